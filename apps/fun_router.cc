@@ -159,7 +159,7 @@ void program_body( const span<char*>& args )
     throw runtime_error( "internal error: #ports != #interfaces" );
   }
 
-  EventLoop event_loop;
+  EventLoop event_loop { EventLoop::Backend::Epoll };
   const auto category_id = event_loop.add_category( "incoming user datagram" );
 
   // configure each interface to receive datagrams from the real world,
@@ -193,18 +193,24 @@ void program_body( const span<char*>& args )
     } );
   }
 
+  EventLoop::print_profiles_on_signal(); // `kill -USR1` prints where the loop's time goes
+
+  // tick the interfaces from a timer, so the loop sleeps until a datagram arrives or the next tick is due
   size_t last_tick = timestamp_ms();
-  while ( event_loop.wait_next_event( 100 ) != EventLoop::Result::Exit ) {
-    const size_t new_tick = timestamp_ms();
-    if ( new_tick > last_tick ) {
-      const size_t ms_since_last_tick = new_tick - last_tick;
+  event_loop.add_timer(
+    event_loop.add_category( "tick" ),
+    100ms,
+    [&] {
+      const size_t new_tick = timestamp_ms();
       for ( auto& iface : interfaces ) {
-        iface->tick( ms_since_last_tick * 5 ); // run at 5x speed to avoid having to wait 30 seconds in real life
-                                               // if router reboots or a new node joins the network
+        iface->tick( ( new_tick - last_tick ) * 5 ); // run at 5x speed to avoid having to wait 30 seconds in
+                                                     // real life if router reboots or a new node joins the network
       }
-    }
-    last_tick = new_tick;
+      last_tick = new_tick;
+    },
+    100ms );
 
+  while ( event_loop.wait_next_event( -1 ) != EventLoop::Result::Exit ) {
     router.route();
   }
 }
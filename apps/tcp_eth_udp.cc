@@ -1,5 +1,6 @@
 #include "address.hh"
 #include "bidirectional_stream_copy.hh"
+#include "eventloop.hh"
 #include "helpers.hh"
 #include "network_interface.hh"
 #include "socket.hh"
@@ -10,6 +11,7 @@
 #include <chrono>
 #include <cstdlib>
 #include <iostream>
+#include <span>
 #include <utility>
 
 using namespace std;
@@ -109,9 +111,20 @@ public:
     interface_.send_datagram( wrap_tcp_in_ip( msg ), next_hop_ );
   }
 
+  // Encapsulate every TCPMessage of a batch; the resulting Ethernet frames leave in one sendmmsg() call.
+  void write_batch( span<TCPMessage> msgs )
+  {
+    tick_network_interface();
+    output_->begin_batch();
+    for ( const auto& msg : msgs ) {
+      interface_.send_datagram( wrap_tcp_in_ip( msg ), next_hop_ );
+    }
+    output_->flush_batch();
+  }
+
   // Pass through connect and tick.
   void connect( const Address& physical_dest ) { output_->connect( physical_dest ); }
-  void tick( const size_t ms_since_last_tick ) { interface_.tick( ms_since_last_tick ); }
+  void tick( const std::chrono::microseconds since_last_tick ) { interface_.tick( since_last_tick ); }
 
   FileDescriptor& fd() { return output_->socket_; }
 
@@ -122,6 +135,8 @@ private:
   {
     UDPSocket socket_ {};
     optional<Address> physical_dest_ {};
+    bool batching_ {};
+    vector<vector<Ref<string>>> pending_frames_ {};
 
     bool is_connected() const { return physical_dest_.has_value(); }
     void connect( const Address& physical_dest )
@@ -136,7 +151,22 @@ private:
         throw runtime_error( "attempt to transmit on unconnected Ethernet-over-UDP port" );
       }
 
-      socket_.send( serialize( x ), physical_dest_ );
+      if ( batching_ ) {
+        pending_frames_.push_back( serialize( x ) );
+      } else {
+        socket_.send( serialize( x ), physical_dest_ );
+      }
+    }
+
+    // Hold transmitted frames until flush_batch() sends them together.
+    void begin_batch() { batching_ = true; }
+    void flush_batch()
+    {
+      batching_ = false;
+      if ( not pending_frames_.empty() ) {
+        socket_.send_batch( pending_frames_, physical_dest_ );
+        pending_frames_.clear();
+      }
     }
   };
 
@@ -291,6 +321,7 @@ int main( int argc, char* argv[] )
     }
 
     auto args = span( argv, argc );
+    EventLoop::print_profiles_on_signal(); // `kill -USR1` prints where the event loops' time goes
 
     if ( args.size() == 7 and args[1] == "client"sv ) {
       be_client( args[2], args[3], args[4], args[5], args[6] );
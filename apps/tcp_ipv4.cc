@@ -1,4 +1,5 @@
 #include "bidirectional_stream_copy.hh"
+#include "eventloop.hh"
 #include "tcp_config.hh"
 #include "tcp_minnow_socket.hh"
 #include "tun.hh"
@@ -151,6 +152,7 @@ int main( int argc, char** argv )
     }
 
     auto args = span( argv, argc );
+    EventLoop::print_profiles_on_signal(); // `kill -USR1` prints where the event loops' time goes
 
     if ( argc < 3 ) {
       show_usage( args.front(), "ERROR: required arguments are missing." );
@@ -23,6 +23,7 @@ ttest(byte_stream_one_write)
 ttest(byte_stream_two_writes)
 ttest(byte_stream_many_writes)
 ttest(byte_stream_stress_test)
+ttest(byte_stream_resize)
 
 ttest(reassembler_single)
 ttest(reassembler_cap)
@@ -58,6 +59,19 @@ ttest(net_interface)
 
 ttest(router)
 
+ttest(tcp_coalescer)
+ttest(tcp_segmentation)
+ttest(tcp_ecn)
+ttest(tcp_fastopen)
+ttest(tcp_metrics_cache)
+ttest(tcp_autotune)
+ttest(tcp_demux)
+ttest(tcp_engine)
+ttest(tcp_embedded)
+ttest(tcp_coroutine)
+ttest(tcp_shards)
+ttest(eventloop)
+
 ttest(no_skip)
 
 add_custom_target (check0 COMMAND ${CMAKE_CTEST_COMMAND} --output-on-failure --stop-on-failure --timeout 15 -R 'webget|^byte_stream_|^no_skip')
@@ -94,3 +108,5 @@ set_tests_properties(${compile_name_opt} PROPERTIES FIXTURES_SETUP compile_opt)
 
 stest(byte_stream_speed_test)
 stest(reassembler_speed_test)
+stest(tcp_peer_speed_test)
+stest(tcp_ping_pong_speed_test)
@@ -1,4 +1,5 @@
 #include "byte_stream.hh"
+#include <algorithm>
 #include <cassert>
 
 using namespace std;
@@ -8,6 +9,24 @@ ByteStream::ByteStream( uint64_t capacity ) : capacity_( capacity )
   buffer_.resize( capacity );
 }
 
+void ByteStream::set_capacity( uint64_t capacity )
+{
+  const uint64_t buffered = bytes_pushed_ - bytes_popped_;
+  capacity = max( { capacity, buffered, uint64_t { 1 } } );
+  if ( capacity == capacity_ ) {
+    return;
+  }
+
+  // 数据在环形缓冲区中的位置取决于容量，需要搬到新位置
+  string resized( capacity, 0 );
+  for ( uint64_t index = bytes_popped_; index < bytes_pushed_; ++index ) {
+    resized[index % capacity] = buffer_[index % capacity_];
+  }
+
+  buffer_ = move( resized );
+  capacity_ = capacity;
+}
+
 void Writer::push( string data )
 {
   if ( closed_ ) {
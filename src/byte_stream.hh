@@ -21,6 +21,9 @@ public:
   void set_error() { error_ = true; };       // Signal that the stream suffered an error.
   bool has_error() const { return error_; }; // Has the stream had an error?
 
+  uint64_t capacity() const { return capacity_; } // Current capacity of the stream
+  void set_capacity( uint64_t capacity );          // Resize (never below the bytes currently buffered)
+
 protected:
   // Please add any additional state to the ByteStream here, and not to the Writer and Reader interfaces.
   uint64_t capacity_;
@@ -8,8 +8,8 @@
 #include "network_interface.hh"
 
 namespace {
-constexpr size_t ARP_ENTRY_TTL_MS = 30'000;       // cache lifetime
-constexpr size_t ARP_REQUEST_INTERVAL_MS = 5'000; // resend throttle
+constexpr std::chrono::milliseconds ARP_ENTRY_TTL { 30'000 };       // cache lifetime
+constexpr std::chrono::milliseconds ARP_REQUEST_INTERVAL { 5'000 }; // resend throttle
 } // namespace
 
 //! \param[in] ethernet_address Ethernet (what ARP calls "hardware") address of the interface
@@ -37,7 +37,7 @@ void NetworkInterface::send_datagram( const InternetDatagram& dgram, const Addre
 
   const auto cache_it = arp_cache_.find( target_ip );
   if ( cache_it != arp_cache_.end() /*已经缓存*/
-       && time_ms_ - cache_it->second.time_ms < ARP_ENTRY_TTL_MS /*且没有过期*/ ) {
+       && time_ - cache_it->second.time < ARP_ENTRY_TTL /*且没有过期*/ ) {
     EthernetFrame frame;
     frame.header.dst = cache_it->second.ethernet_address;
     frame.header.src = ethernet_address_;
@@ -52,8 +52,8 @@ void NetworkInterface::send_datagram( const InternetDatagram& dgram, const Addre
   const auto req_it = arp_request_time_.find( target_ip );
   const bool is_new_request = req_it == arp_request_time_.end(); // 没有请求过
   const bool request_expired
-    = !is_new_request && time_ms_ - req_it->second >= ARP_REQUEST_INTERVAL_MS; // 上一次的ARP请求超时了
-  const bool need_request = is_new_request || request_expired;                 // 一定需要新的ARP请求
+    = !is_new_request && time_ - req_it->second >= ARP_REQUEST_INTERVAL; // 上一次的ARP请求超时了
+  const bool need_request = is_new_request || request_expired;           // 一定需要新的ARP请求
 
   if ( request_expired ) {
     waiting_dgrams_.erase( target_ip );
@@ -80,7 +80,7 @@ void NetworkInterface::send_datagram( const InternetDatagram& dgram, const Addre
     };
     transmit( frame );
 
-    arp_request_time_[target_ip] = time_ms_;
+    arp_request_time_[target_ip] = time_;
   }
 }
 
@@ -107,7 +107,7 @@ void NetworkInterface::recv_frame( EthernetFrame frame )
     }
 
     // 更新ARP缓存
-    arp_cache_[arp.sender_ip_address] = { .ethernet_address = arp.sender_ethernet_address, .time_ms = time_ms_ };
+    arp_cache_[arp.sender_ip_address] = { .ethernet_address = arp.sender_ethernet_address, .time = time_ };
 
     // 是对端发来的ARP请求，先回ARP reply（这样符合测试的首选顺序）
     if ( arp.opcode == ARPMessage::OPCODE_REQUEST && arp.target_ip_address == ip_address_.ipv4_numeric() ) {
@@ -152,12 +152,18 @@ void NetworkInterface::recv_frame( EthernetFrame frame )
 //! \param[in] ms_since_last_tick the number of milliseconds since the last call to this method
 void NetworkInterface::tick( const size_t ms_since_last_tick )
 {
-  time_ms_ += ms_since_last_tick;
+  tick( std::chrono::milliseconds { ms_since_last_tick } );
+}
+
+//! \param[in] since_last_tick the time elapsed since the last call to this method
+void NetworkInterface::tick( const std::chrono::microseconds since_last_tick )
+{
+  time_ += since_last_tick;
 
   // Drop expired pending ARP requests and their queued datagrams.
   auto req_it = arp_request_time_.begin();
   while ( req_it != arp_request_time_.end() ) {
-    if ( time_ms_ - req_it->second >= ARP_REQUEST_INTERVAL_MS ) {
+    if ( time_ - req_it->second >= ARP_REQUEST_INTERVAL ) {
       waiting_dgrams_.erase( req_it->first );
       req_it = arp_request_time_.erase( req_it );
     } else {
@@ -168,7 +174,7 @@ void NetworkInterface::tick( const size_t ms_since_last_tick )
   // Expire ARP cache entries.
   auto it = arp_cache_.begin();
   while ( it != arp_cache_.end() ) {
-    if ( time_ms_ - it->second.time_ms >= ARP_ENTRY_TTL_MS ) {
+    if ( time_ - it->second.time >= ARP_ENTRY_TTL ) {
       it = arp_cache_.erase( it );
     } else {
       ++it;
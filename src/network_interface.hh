@@ -4,6 +4,7 @@
 #include "ethernet_frame.hh"
 #include "ipv4_datagram.hh"
 
+#include <chrono>
 #include <memory>
 #include <queue>
 #include <unordered_map>
@@ -60,7 +61,8 @@ public:
   void recv_frame( EthernetFrame frame );
 
   // Called periodically when time elapses
-  void tick( size_t ms_since_last_tick );
+  void tick( std::chrono::microseconds since_last_tick );
+  void tick( size_t ms_since_last_tick ); // millisecond-granular convenience
 
   // Accessors
   const std::string& name() const { return name_; }
@@ -89,14 +91,14 @@ private:
   struct ARPCacheEntry
   {
     EthernetAddress ethernet_address;
-    size_t time_ms; // 进入列表时的时间戳
+    std::chrono::microseconds time; // 进入列表时的时间戳
   };
 
-  size_t time_ms_ { 0 }; // 时间戳
+  std::chrono::microseconds time_ { 0 }; // 时间戳
   std::unordered_map<uint32_t, ARPCacheEntry> arp_cache_ {};
 
   // 防止出现 ARP 请求风暴，短时间内不会重复请求同一个 ARP
-  std::unordered_map<uint32_t, size_t> arp_request_time_ {};
+  std::unordered_map<uint32_t, std::chrono::microseconds> arp_request_time_ {};
 
   // <IP, 等待发送的 datagram 列表>
   std::unordered_map<uint32_t, std::vector<InternetDatagram>> waiting_dgrams_ {};
@@ -65,6 +65,20 @@ void Reassembler::insert( uint64_t first_index, std::string data, bool is_last_s
   }
 }
 
+void Reassembler::set_capacity( uint64_t capacity )
+{
+  output_.set_capacity( capacity );
+
+  // 容量缩小后，丢弃落在新窗口之外的暂存数据
+  const uint64_t first_unacceptable = next_index() + output_.writer().available_capacity();
+  while ( !segments_.empty() && segments_.back().start >= first_unacceptable ) {
+    segments_.pop_back();
+  }
+  if ( !segments_.empty() && segments_.back().end() > first_unacceptable ) {
+    segments_.back().data.resize( first_unacceptable - segments_.back().start );
+  }
+}
+
 // How many bytes are stored in the Reassembler itself?
 // This function is for testing only; don't add extra state to support it.
 uint64_t Reassembler::count_bytes_pending() const
@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <list>
 #include <optional>
+#include <string>
 #include <sys/types.h>
 
 class Reassembler
@@ -39,6 +40,19 @@ public:
   // This function is for testing only; don't add extra state to support it.
   uint64_t count_bytes_pending() const;
 
+  // Fast path: can `len` bytes that start at the next index be written straight to the output?
+  // (True when nothing is stored, the end of the stream is unknown, and they fit the available capacity.)
+  bool can_append( uint64_t len ) const
+  {
+    return segments_.empty() && !eof_index_.has_value() && len <= output_.writer().available_capacity();
+  }
+
+  // Write bytes that can_append() accepted
+  void append( std::string data ) { output_.writer().push( std::move( data ) ); }
+
+  // Resize the output stream, discarding stored bytes that no longer fit in its available capacity
+  void set_capacity( uint64_t capacity );
+
   // Access output stream reader
   Reader& reader() { return output_.reader(); }
   const Reader& reader() const { return output_.reader(); }
@@ -61,6 +61,12 @@ void Router::route()
         continue;
       }
 
+      // 排队过长：对支持 ECN 的报文打 CE 标记，代替丢包来通知拥塞
+      if ( ecn_threshold_.has_value() && queue.size() >= *ecn_threshold_
+           && dgram.header.ecn() != IPv4Header::ECN_NOT_ECT ) {
+        dgram.header.set_ecn( IPv4Header::ECN_CE );
+      }
+
       // update TTL and checksum
       dgram.header.ttl -= 1;
       dgram.header.compute_checksum();
@@ -32,6 +32,10 @@ public:
   // Route packets between the interfaces
   void route();
 
+  // Mark an ECN-capable datagram "congestion experienced" if at least `threshold` more datagrams are waiting
+  // behind it on the interface it arrived on (RFC 3168); no marking if empty (the default)
+  void set_ecn_threshold( std::optional<size_t> threshold ) { ecn_threshold_ = threshold; }
+
 private:
   // The router's collection of network interfaces
   std::vector<std::shared_ptr<NetworkInterface>> interfaces_ {};
@@ -47,4 +51,7 @@ private:
 
   // 路由表
   std::list<RouteEntry> route_table_ {};
+
+  // 输入队列超过该长度时给支持 ECN 的报文打 CE 标记
+  std::optional<size_t> ecn_threshold_ {};
 };
@@ -20,6 +20,8 @@ void TCPReceiver::receive( TCPSenderMessage message )
     return; // 已经建立了 isn，再次收到 SYN 直接忽略
   }
 
+  note_congestion( message );
+
   const Writer& writer = reassembler_.writer();
   const uint64_t checkpoint = writer.bytes_pushed() + 1 /*SYN*/ + ( writer.is_closed() ? 1 /*FIN*/ : 0 );
   const uint64_t abs_seqno = message.seqno.unwrap( *isn_, checkpoint );
@@ -29,6 +31,18 @@ void TCPReceiver::receive( TCPSenderMessage message )
   reassembler_.insert( stream_index, std::move( message.payload ), message.FIN );
 }
 
+bool TCPReceiver::is_in_order( const TCPSenderMessage& message ) const
+{
+  if ( !isn_.has_value() || message.SYN || message.FIN || message.RST || message.payload.empty() ) {
+    return false;
+  }
+
+  // 下一个期望的序号（SYN 占一个序号；FIN 未到，否则 can_append 不成立）
+  const uint64_t next_abs_seqno = reassembler_.writer().bytes_pushed() + 1;
+  return message.seqno == *isn_ + static_cast<uint32_t>( next_abs_seqno )
+         && reassembler_.can_append( message.payload.size() );
+}
+
 TCPReceiverMessage TCPReceiver::send() const
 {
 
@@ -37,6 +51,7 @@ TCPReceiverMessage TCPReceiver::send() const
   TCPReceiverMessage msg {
     .window_size = static_cast<uint16_t>( min<uint64_t>( UINT16_MAX, writer.available_capacity() ) ),
     .RST = reassembler_.reader().has_error(),
+    .ECE = ece_pending_,
   };
 
   if ( !isn_.has_value() ) {
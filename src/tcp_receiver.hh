@@ -17,9 +17,24 @@ public:
    */
   void receive( TCPSenderMessage message );
 
+  /*
+   * Header prediction: is `message` the next in-order data segment (no flags) of an established
+   * connection, fitting the window and leaving nothing to reassemble? If so, it can be given to
+   * receive_in_order(), which skips the unwrapping and the Reassembler's bookkeeping.
+   */
+  bool is_in_order( const TCPSenderMessage& message ) const;
+  void receive_in_order( TCPSenderMessage message )
+  {
+    note_congestion( message );
+    reassembler_.append( std::move( message.payload ) );
+  }
+
   // The TCPReceiver sends TCPReceiverMessages to the peer's TCPSender.
   TCPReceiverMessage send() const;
 
+  // Resize the receive buffer (and so the advertised window)
+  void set_capacity( uint64_t capacity ) { reassembler_.set_capacity( capacity ); }
+
   // Access the output
   const Reassembler& reassembler() const { return reassembler_; }
   Reader& reader() { return reassembler_.reader(); }
@@ -27,6 +42,13 @@ public:
   const Writer& writer() const { return reassembler_.writer(); }
 
 private:
+  // ECN (RFC 3168): echo a congestion mark with ECE until the sender says it has reduced its window (CWR)
+  void note_congestion( const TCPSenderMessage& message )
+  {
+    ece_pending_ = ( ece_pending_ && !message.CWR ) || message.CE;
+  }
+
   Reassembler reassembler_;
   std::optional<Wrap32> isn_ {};
+  bool ece_pending_ { false }; // 收到 CE 标记后，在每个 ACK 上回显 ECE
 };
@@ -2,75 +2,72 @@
 #include "byte_stream.hh"
 #include "tcp_config.hh"
 #include <algorithm>
+#include <utility>
 
-void TCPSender::fill_window( const TransmitFunction& transmit )
+const TCPSenderMessage* TCPSender::next_segment()
 {
-  // 如果流已经出错，直接发送带 RST 的空段
-  if ( writer().has_error() || reader().has_error() ) {
-    auto msg = make_empty_message();
-    msg.RST = true;
-    transmit( msg );
-    return;
+  uint64_t effective_window = window_size_ == 0 ? 1 : window_size_; // 对端如果提示0窗口，发送零窗口探测
+  if ( cwnd_.has_value() ) {
+    effective_window = std::min( effective_window, *cwnd_ );
+  }
+  if ( !syn_sent_ && data_on_syn_ ) { // Fast Open: SYN 最多携带一个 MSS 的数据
+    effective_window = 1 + TCPConfig::MAX_PAYLOAD_SIZE;
   }
 
-  const uint64_t effective_window = window_size_ == 0 ? 1 : window_size_; // 对端如果提示0窗口，发送零窗口探测
-
-  // 窗口没有满，还能发送数据
-  while ( bytes_in_flight_ < effective_window ) {
-    TCPSenderMessage msg {
-      .seqno = Wrap32::wrap( next_seqno_abs_, isn_ ),
-    };
+  // 窗口已满
+  if ( bytes_in_flight_ >= effective_window ) {
+    return nullptr;
+  }
 
-    uint64_t remaining = effective_window - bytes_in_flight_; // 剩余窗口大小(包含SYN, FIN)
+  TCPSenderMessage msg {
+    .seqno = Wrap32::wrap( next_seqno_abs_, isn_ ),
+  };
 
-    if ( !syn_sent_ ) { // 第一次发送数据
-      if ( remaining == 0 ) {
-        break;
-      }
-      msg.SYN = true;
-      syn_sent_ = true;
-      remaining -= 1;
-    }
+  uint64_t remaining = effective_window - bytes_in_flight_; // 剩余窗口大小(包含SYN, FIN)
 
-    // 确定发送 Segment 的长度
-    const size_t payload_len = std::min( { remaining, TCPConfig::MAX_PAYLOAD_SIZE, reader().bytes_buffered() } );
+  if ( !syn_sent_ ) { // 第一次发送数据
+    msg.SYN = true;
+    syn_sent_ = true;
+    remaining -= 1;
+  }
 
-    if ( payload_len > 0 ) { // 装填 Segment
-      read( reader(), payload_len, msg.payload );
-      remaining -= payload_len;
-    }
+  // 确定发送 Segment 的长度
+  const size_t payload_len = std::min( { remaining, max_payload_size_, reader().bytes_buffered() } );
 
-    if ( !fin_sent_ && reader().is_finished() /*stream结束了*/ && remaining > 0 /*窗口还有空间*/ ) {
-      msg.FIN = true;
-      fin_sent_ = true;
-      remaining -= 1;
-    }
+  if ( payload_len > 0 ) { // 装填 Segment
+    read( reader(), payload_len, msg.payload );
+    remaining -= payload_len;
+  }
 
-    (void)remaining; // FIXME: suppress unused warning
+  if ( !fin_sent_ && reader().is_finished() /*stream结束了*/ && remaining > 0 /*窗口还有空间*/ ) {
+    msg.FIN = true;
+    fin_sent_ = true;
+  }
 
-    const auto seg_len = msg.sequence_length();
+  const auto seg_len = msg.sequence_length();
 
-    if ( seg_len == 0 ) {
-      break; // nothing to send
-    }
+  if ( seg_len == 0 ) {
+    return nullptr; // nothing to send
+  }
 
-    transmit( msg );
-    // outstanding_ 里面的元素一定是按顺序的, 因为就是这么添加进去的
-    outstanding_.push_back( { msg, next_seqno_abs_ /*当前segment的abs_seqno*/ } );
+  if ( ecn_ && !msg.SYN ) { // SYN 不能标记 ECT (RFC 3168 6.1.1)
+    msg.ECT = true;
+    msg.CWR = std::exchange( cwr_pending_, false );
+  }
 
-    // update state
-    next_seqno_abs_ += seg_len;
-    bytes_in_flight_ += seg_len;
+  // outstanding_ 里面的元素一定是按顺序的, 因为就是这么添加进去的
+  outstanding_.push_back( { std::move( msg ), next_seqno_abs_ /*当前segment的abs_seqno*/, time_ } );
 
-    if ( !timer_running_ ) { // 重传计时器
-      timer_running_ = true;
-      time_since_last_tx_ms_ = 0;
-    }
+  // update state
+  next_seqno_abs_ += seg_len;
+  bytes_in_flight_ += seg_len;
 
-    if ( fin_sent_ || ( reader().bytes_buffered() == 0 && !reader().is_finished() ) ) {
-      break; // 已经发了 FIN，或当前没有更多数据可发
-    }
+  if ( !timer_running_ ) { // 重传计时器
+    timer_running_ = true;
+    time_since_last_tx_ = {};
   }
+
+  return &outstanding_.back().msg;
 }
 
 // This function is for testing only; don't add extra state to support it.
@@ -90,6 +87,22 @@ void TCPSender::push( const TransmitFunction& transmit )
   fill_window( transmit );
 }
 
+void TCPSender::tick( std::chrono::microseconds since_last_tick, const TransmitFunction& transmit )
+{
+  if ( const TCPSenderMessage* msg = expire_timer( since_last_tick ) ) {
+    transmit( *msg );
+  }
+}
+
+std::optional<std::chrono::microseconds> TCPSender::next_deadline() const
+{
+  if ( !timer_running_ || bytes_in_flight_ == 0 || outstanding_.empty() ) {
+    return {};
+  }
+
+  return time_ + RTO_ - std::min( time_since_last_tx_, RTO_ );
+}
+
 TCPSenderMessage TCPSender::make_empty_message() const
 {
   TCPSenderMessage msg = {
@@ -119,55 +132,137 @@ void TCPSender::receive( const TCPReceiverMessage& msg )
     return;                          // impossible ack, ignore
   }
 
+  if ( ecn_ && msg.ECE ) {
+    reduce_congestion_window( ack_abs );
+  }
+
   if ( ack_abs <= last_ack_abs_ ) { // 重复确认(TCP是累计确认)
     return;                         // duplicate or old ack
   }
 
+  grow_congestion_window( ack_abs - last_ack_abs_ );
   last_ack_abs_ = ack_abs;                            // 更新已确认的最后一个序号（开区间）
   bytes_in_flight_ = next_seqno_abs_ - last_ack_abs_; // outstanding
 
+  std::optional<std::chrono::microseconds> rtt_sample {};
   while ( !outstanding_.empty() ) {
     const auto& front = outstanding_.front();
     const uint64_t seg_end = front.abs_seqno + front.msg.sequence_length();
     if ( seg_end <= last_ack_abs_ ) {
+      if ( !front.retransmitted ) {
+        rtt_sample = time_ - front.sent_at;
+      }
       outstanding_.pop_front(); // 已经确认了, 删除
     } else {
       break;
     }
   }
 
+  // 只确认了 SYN 而没有确认 SYN 上的数据 (对端拒绝了 Fast Open)：去掉 SYN，剩下的数据立即重发
+  if ( !outstanding_.empty() && outstanding_.front().msg.SYN && last_ack_abs_ > outstanding_.front().abs_seqno ) {
+    Outstanding& front = outstanding_.front();
+    front.msg.SYN = false;
+    front.msg.seqno = front.msg.seqno + 1;
+    front.abs_seqno += 1;
+    front.retransmitted = true;
+    resend_front_ = true;
+  }
+
+  // RFC 6298: RTTVAR = 3/4 * RTTVAR + 1/4 * |SRTT - R|, SRTT = 7/8 * SRTT + 1/8 * R
+  if ( rtt_sample.has_value() ) {
+    if ( srtt_.has_value() ) {
+      rttvar_ = ( rttvar_ * 3 + ( *srtt_ > *rtt_sample ? *srtt_ - *rtt_sample : *rtt_sample - *srtt_ ) ) / 4;
+      srtt_ = ( *srtt_ * 7 + *rtt_sample ) / 8;
+    } else {
+      rttvar_ = *rtt_sample / 2;
+      srtt_ = *rtt_sample;
+    }
+  }
+
   // reset
   consecutive_retx_ = 0;
-  RTO_ms_ = initial_RTO_ms_;
-  time_since_last_tx_ms_ = 0;
+  RTO_ = initial_RTO_;
+  time_since_last_tx_ = {};
   timer_running_ = bytes_in_flight_ > 0;
 }
 
-void TCPSender::tick( uint64_t ms_since_last_tick, const TransmitFunction& transmit )
+const TCPSenderMessage* TCPSender::expire_timer( std::chrono::microseconds since_last_tick )
 {
+  time_ += since_last_tick;
+
   if ( !timer_running_ || bytes_in_flight_ == 0 ) {
-    return;
+    return nullptr;
   }
 
-  time_since_last_tx_ms_ += ms_since_last_tick;
+  time_since_last_tx_ += since_last_tick;
 
-  if ( time_since_last_tx_ms_ < RTO_ms_ /*还没到重传的时间*/ || outstanding_.empty() ) {
-    return;
+  if ( time_since_last_tx_ < RTO_ /*还没到重传的时间*/ || outstanding_.empty() ) {
+    return nullptr;
   }
 
   // 重传第一个outstanding的segment
   // TODO: 改成选择重传，目前只是重传第一个outstanding的segment(能通过测试)
 
-  transmit( outstanding_.front().msg );
-  time_since_last_tx_ms_ = 0;
+  outstanding_.front().retransmitted = true;
+  outstanding_.front().msg.ECT = false; // 重传的段不标记 ECT (RFC 3168 6.1.5)
+  time_since_last_tx_ = {};
 
   consecutive_retx_ += 1;
   if ( window_size_ > 0 ) {
-    RTO_ms_ <<= 1;
+    RTO_ *= 2;
   }
 
   if ( consecutive_retx_ > TCPConfig::MAX_RETX_ATTEMPTS ) {
     reader().set_error();
     writer().set_error();
   }
+
+  return &outstanding_.front().msg;
+}
+
+void TCPSender::seed( std::chrono::microseconds srtt,
+                      std::chrono::microseconds rttvar,
+                      std::optional<uint64_t> congestion_window )
+{
+  srtt_ = srtt;
+  rttvar_ = rttvar;
+  // 下限取 MIN_RTO_MS 与配置的初始 RTO 中较小者，不会抬高一个配置得更短的 RTO
+  const std::chrono::microseconds floor
+    = std::min<std::chrono::microseconds>( initial_RTO_, std::chrono::milliseconds { TCPConfig::MIN_RTO_MS } );
+  initial_RTO_ = std::max( srtt + 4 * rttvar, floor );
+  RTO_ = initial_RTO_;
+
+  if ( congestion_window.has_value() ) {
+    cwnd_ = std::max<uint64_t>( *congestion_window, 2 * TCPConfig::MAX_PAYLOAD_SIZE );
+  }
+}
+
+void TCPSender::skip_rtt_sample()
+{
+  for ( auto& segment : outstanding_ ) {
+    segment.retransmitted = true; // 和重传的段一样，确认时不采样 RTT
+  }
+}
+
+void TCPSender::reduce_congestion_window( uint64_t ack_abs )
+{
+  if ( ack_abs < recover_abs_ ) {
+    return; // 这个窗口里已经减过一次（ECE 会一直回显，直到对端收到带 CWR 的段）
+  }
+
+  // 窗口减半，但至少保留两个 MSS
+  const uint64_t flight = std::max( bytes_in_flight_, cwnd_.value_or( 0 ) );
+  cwnd_ = std::max<uint64_t>( flight / 2, 2 * TCPConfig::MAX_PAYLOAD_SIZE );
+  recover_abs_ = next_seqno_abs_ + 1; // 确认到 CWR 段之后才允许再次减窗
+  cwr_pending_ = true;
+}
+
+void TCPSender::grow_congestion_window( uint64_t bytes_acked )
+{
+  if ( !cwnd_.has_value() ) {
+    return;
+  }
+
+  // 拥塞避免：每确认一个窗口的数据，窗口增加一个 MSS
+  *cwnd_ += std::max<uint64_t>( 1, TCPConfig::MAX_PAYLOAD_SIZE * bytes_acked / *cwnd_ );
 }
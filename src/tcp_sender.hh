@@ -1,18 +1,28 @@
 #pragma once
 
 #include "byte_stream.hh"
+#include "tcp_config.hh"
 #include "tcp_receiver_message.hh"
 #include "tcp_sender_message.hh"
 
+#include <chrono>
+#include <concepts>
 #include <functional>
 #include <list>
+#include <optional>
+#include <utility>
 
 class TCPSender
 {
 public:
   /* Construct TCP sender with given default Retransmission Timeout and possible ISN */
+  TCPSender( ByteStream&& input, Wrap32 isn, std::chrono::microseconds initial_RTO )
+    : input_( std::move( input ) ), isn_( isn ), initial_RTO_( initial_RTO ), RTO_( initial_RTO )
+  {}
+
+  /* The same, with the Retransmission Timeout given in milliseconds */
   TCPSender( ByteStream&& input, Wrap32 isn, uint64_t initial_RTO_ms )
-    : input_( std::move( input ) ), isn_( isn ), initial_RTO_ms_( initial_RTO_ms ), RTO_ms_( initial_RTO_ms )
+    : TCPSender( std::move( input ), isn, std::chrono::milliseconds { initial_RTO_ms } )
   {}
 
   /* Generate an empty TCPSenderMessage */
@@ -27,8 +37,84 @@ public:
   /* Push bytes from the outbound stream */
   void push( const TransmitFunction& transmit );
 
-  /* Time has passed by the given # of milliseconds since the last time the tick() method was called */
-  void tick( uint64_t ms_since_last_tick, const TransmitFunction& transmit );
+  /* Time has passed by the given duration since the last time the tick() method was called */
+  void tick( std::chrono::microseconds since_last_tick, const TransmitFunction& transmit );
+
+  /* The same, with the time given in milliseconds */
+  void tick( uint64_t ms_since_last_tick, const TransmitFunction& transmit )
+  {
+    tick( std::chrono::milliseconds { ms_since_last_tick }, transmit );
+  }
+
+  /* The same, specialized at compile time for any callable (no type erasure, fully inlinable) */
+  template<std::invocable<const TCPSenderMessage&> T>
+  void push( const T& transmit )
+  {
+    fill_window( transmit );
+  }
+
+  template<std::invocable<const TCPSenderMessage&> T>
+  void tick( std::chrono::microseconds since_last_tick, const T& transmit )
+  {
+    if ( const TCPSenderMessage* msg = expire_timer( since_last_tick ) ) {
+      transmit( *msg );
+    }
+  }
+
+  template<std::invocable<const TCPSenderMessage&> T>
+  void tick( uint64_t ms_since_last_tick, const T& transmit )
+  {
+    tick( std::chrono::milliseconds { ms_since_last_tick }, transmit );
+  }
+
+  /* Absolute time (the sum of all ticks so far) at which tick() next has work to do, if the timer is running */
+  std::optional<std::chrono::microseconds> next_deadline() const;
+
+  /* Smoothed round-trip time, once at least one segment has been acknowledged without being retransmitted */
+  std::optional<std::chrono::microseconds> smoothed_rtt() const { return srtt_; }
+
+  /* Round-trip time variation (RFC 6298 RTTVAR), alongside smoothed_rtt() */
+  std::chrono::microseconds rtt_variance() const { return rttvar_; }
+
+  /*
+   * Warm start from an earlier connection to the same peer: start from its RTT estimate, with an initial
+   * RTO of SRTT + 4 * RTTVAR (at least TCPConfig::MIN_RTO_MS, or the configured initial RTO if that is
+   * smaller), and from its congestion window if it had one. Call before the first push.
+   */
+  void seed( std::chrono::microseconds srtt,
+             std::chrono::microseconds rttvar,
+             std::optional<uint64_t> congestion_window );
+
+  /* Take no RTT sample from the segments now in flight (their send times are not known to be real) */
+  void skip_rtt_sample();
+
+  /* Most recent window advertised by the peer */
+  uint16_t peer_window() const { return window_size_; }
+
+  /*
+   * Largest payload to put in one segment (TCPConfig::MAX_PAYLOAD_SIZE by default). A larger value makes
+   * the sender emit "super-segments" that the datagram adapter splits (software segmentation offload).
+   */
+  void set_max_payload_size( size_t max_payload_size ) { max_payload_size_ = max_payload_size; }
+
+  /*
+   * Use Explicit Congestion Notification (RFC 3168), once negotiated: new data goes out marked ECN-capable, and
+   * an ECE from the receiver halves the congestion window (at most once per window of data) and is answered
+   * with CWR. Until the first such signal, the congestion window is unlimited and only the peer's window counts.
+   */
+  void set_ecn( bool enabled ) { ecn_ = enabled; }
+
+  /*
+   * TCP Fast Open (RFC 7413): let the SYN carry up to one segment of data before the peer's window is known.
+   * If the peer acknowledges only the SYN, the data is sent again (without the SYN) on the next push.
+   */
+  void set_data_on_syn( bool enabled ) { data_on_syn_ = enabled; }
+
+  /* Congestion window, once a congestion signal has set one */
+  std::optional<uint64_t> congestion_window() const { return cwnd_; }
+
+  /* Resize the outbound buffer (never below the bytes it currently holds) */
+  void set_capacity( uint64_t capacity ) { input_.set_capacity( capacity ); }
 
   // Accessors
   uint64_t sequence_numbers_in_flight() const;  // For testing: how many sequence numbers are outstanding?
@@ -39,19 +125,57 @@ public:
 
 private:
   Reader& reader() { return input_.reader(); }
-  void fill_window( const TransmitFunction& transmit );
+
+  template<class T>
+  void fill_window( const T& transmit )
+  {
+    // 如果流已经出错，直接发送带 RST 的空段
+    if ( writer().has_error() || reader().has_error() ) {
+      transmit( make_empty_message() );
+      return;
+    }
+
+    // SYN 上的数据没有被确认 (Fast Open 被拒绝)：立即重发这些数据
+    if ( std::exchange( resend_front_, false ) && !outstanding_.empty() ) {
+      transmit( outstanding_.front().msg );
+    }
+
+    while ( const TCPSenderMessage* msg = next_segment() ) {
+      transmit( *msg );
+    }
+  }
+
+  // 生成窗口内的下一个 segment 并记录到 outstanding_，没有可发送的内容时返回 nullptr
+  const TCPSenderMessage* next_segment();
+
+  // 推进重传计时器，超时则返回需要重传的 segment
+  const TCPSenderMessage* expire_timer( std::chrono::microseconds since_last_tick );
+
+  // 拥塞窗口：收到 ECE 时减半，之后每个 RTT 增加约一个 MSS
+  void reduce_congestion_window( uint64_t ack_abs );
+  void grow_congestion_window( uint64_t bytes_acked );
 
   ByteStream input_;
   Wrap32 isn_;
-  uint64_t initial_RTO_ms_;
-
-  uint64_t next_seqno_abs_ { 0 };        // 下一次发送的绝对序号
-  uint64_t last_ack_abs_ { 0 };          // 已确认的最后一个序号（开区间）
-  uint64_t bytes_in_flight_ { 0 };       // 未被确认的序号数量
-  uint64_t RTO_ms_;                      // 当前 RTO
-  uint64_t time_since_last_tx_ms_ { 0 }; // 距离上次（重）传的时间
-  uint64_t consecutive_retx_ { 0 };      // 连续重传次数
-  uint16_t window_size_ { 1 };           // 最近一次通告窗口，0 按 1 处理
+  std::chrono::microseconds initial_RTO_;
+
+  uint64_t next_seqno_abs_ { 0 };                      // 下一次发送的绝对序号
+  uint64_t last_ack_abs_ { 0 };                        // 已确认的最后一个序号（开区间）
+  uint64_t bytes_in_flight_ { 0 };                     // 未被确认的序号数量
+  std::chrono::microseconds RTO_;                      // 当前 RTO
+  std::chrono::microseconds time_since_last_tx_ { 0 }; // 距离上次（重）传的时间
+  std::chrono::microseconds time_ { 0 };               // 累计经过的时间（所有 tick 之和）
+  uint64_t consecutive_retx_ { 0 };                    // 连续重传次数
+  uint16_t window_size_ { 1 };                         // 最近一次通告窗口，0 按 1 处理
+  size_t max_payload_size_ { TCPConfig::MAX_PAYLOAD_SIZE }; // 单个 segment 的最大负载
+  std::optional<std::chrono::microseconds> srtt_ {};   // 平滑 RTT（只用未重传过的 segment 采样）
+  std::chrono::microseconds rttvar_ { 0 };             // RTT 偏差
+  bool ecn_ { false };                                 // 已协商 ECN
+  std::optional<uint64_t> cwnd_ {};                    // 拥塞窗口（收到拥塞信号前不限制）
+  uint64_t recover_abs_ { 0 };                         // 确认越过它之前不再减窗
+  bool cwr_pending_ { false };                         // 下一个新数据段需要带 CWR
+  bool data_on_syn_ { false };                         // SYN 可以携带数据 (Fast Open)
+  bool resend_front_ { false };                        // 下次 push 时立即重发 outstanding_ 的第一个段
   bool timer_running_ { false };
   bool syn_sent_ { false };
   bool fin_sent_ { false };
@@ -60,6 +184,8 @@ private:
   {
     TCPSenderMessage msg;
     uint64_t abs_seqno {};
+    std::chrono::microseconds sent_at {}; // 首次发送的时间
+    bool retransmitted {};                // 重传过的 segment 不参与 RTT 采样 (Karn 算法)
   };
 
   std::list<Outstanding> outstanding_ {};
@@ -0,0 +1,62 @@
+#include "byte_stream_test_harness.hh"
+
+#include <exception>
+#include <iostream>
+
+using namespace std;
+
+int main()
+{
+  try {
+    {
+      ByteStreamTestHarness test { "grow-empty", 2 };
+
+      test.execute( SetCapacity { 5 } );
+      test.execute( AvailableCapacity { 5 } );
+      test.execute( Push { "hello!" } );
+      test.execute( BytesPushed { 5 } );
+      test.execute( BytesBuffered { 5 } );
+      test.execute( Peek { "hello" } );
+    }
+
+    {
+      ByteStreamTestHarness test { "grow-wrapped", 4 };
+
+      test.execute( Push { "abcd" } );
+      test.execute( Pop { 3 } );
+      test.execute( Push { "efg" } );
+      test.execute( BytesBuffered { 4 } );
+      test.execute( SetCapacity { 7 } );
+      test.execute( AvailableCapacity { 3 } );
+      test.execute( Peek { "defg" } );
+      test.execute( Push { "hij" } );
+      test.execute( Peek { "defghij" } );
+      test.execute( Pop { 7 } );
+      test.execute( BufferEmpty { true } );
+      test.execute( BytesPopped { 10 } );
+    }
+
+    {
+      ByteStreamTestHarness test { "shrink-keeps-buffered", 8 };
+
+      test.execute( Push { "abcdef" } );
+      test.execute( Pop { 2 } );
+      test.execute( SetCapacity { 2 } );
+      test.execute( AvailableCapacity { 0 } );
+      test.execute( Peek { "cdef" } );
+      test.execute( Pop { 3 } );
+      test.execute( SetCapacity { 2 } );
+      test.execute( AvailableCapacity { 1 } );
+      test.execute( Push { "gh" } );
+      test.execute( Peek { "fg" } );
+      test.execute( Close {} );
+      test.execute( Pop { 2 } );
+      test.execute( IsFinished { true } );
+    }
+  } catch ( const exception& e ) {
+    cerr << "Exception: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
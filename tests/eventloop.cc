@@ -0,0 +1,527 @@
+#include "eventloop.hh"
+#include "exception.hh"
+#include "expect.hh"
+
+#include <array>
+#include <bit>
+#include <csignal>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+using Direction = EventLoop::Direction;
+using Result = EventLoop::Result;
+
+pair<FileDescriptor, FileDescriptor> make_pair_of_sockets()
+{
+  array<int, 2> fds {};
+  CheckSystemCall( "socketpair", ::socketpair( AF_UNIX, SOCK_STREAM, 0, fds.data() ) );
+  return { FileDescriptor { fds[0] }, FileDescriptor { fds[1] } };
+}
+
+string name( EventLoop::Backend backend )
+{
+  switch ( backend ) {
+    case EventLoop::Backend::Epoll:
+      return "epoll: ";
+    case EventLoop::Backend::IoUring:
+      return "io_uring: ";
+    default:
+      return "poll: ";
+  }
+}
+
+pair<FileDescriptor, FileDescriptor> make_pair_of_datagram_sockets()
+{
+  array<int, 2> fds {};
+  CheckSystemCall( "socketpair", ::socketpair( AF_UNIX, SOCK_DGRAM, 0, fds.data() ) );
+  return { FileDescriptor { fds[0] }, FileDescriptor { fds[1] } };
+}
+
+// Many idle connections and one busy one: only the busy one's rule runs
+void test_one_ready( EventLoop::Backend backend )
+{
+  EventLoop loop { backend };
+  const size_t category = loop.add_category( "read" );
+
+  vector<pair<FileDescriptor, FileDescriptor>> sockets;
+  vector<size_t> served( 200 );
+  sockets.reserve( served.size() ); // the rules refer to the sockets
+  for ( size_t i = 0; i < served.size(); ++i ) {
+    sockets.push_back( make_pair_of_sockets() );
+    FileDescriptor& fd = sockets.back().first;
+    loop.add_rule( category, fd, Direction::In, [&fd, &served, i] {
+      string buffer;
+      fd.read( buffer );
+      ++served[i];
+    } );
+  }
+
+  expect( loop.wait_next_event( 1ms ) == Result::Timeout, name( backend ) + "nothing ready times out" );
+
+  sockets[123].second.write( "x" );
+  expect( loop.wait_next_event( -1ms ) == Result::Success, name( backend ) + "a ready rule is served" );
+  expect( served[123] == 1, name( backend ) + "the rule for the ready fd ran" );
+  for ( size_t i = 0; i < served.size(); ++i ) {
+    expect( i == 123 or served[i] == 0, name( backend ) + "no other rule ran" );
+  }
+  expect( loop.wait_next_event( 0ms ) == Result::Timeout, name( backend ) + "the data was consumed" );
+}
+
+// Rules are cancelled by their handle, at EOF, on hangup, and when their fd is closed
+void test_cancellation( EventLoop::Backend backend )
+{
+  EventLoop loop { backend };
+  const size_t category = loop.add_category( "rule" );
+  const auto ignore = [] {};
+
+  auto [cancelled_a, cancelled_b] = make_pair_of_sockets();
+  auto handle = loop.add_rule( category, cancelled_a, Direction::In, [] {
+    throw runtime_error( "a cancelled rule ran" );
+  } );
+  handle.cancel();
+  cancelled_b.write( "x" );
+
+  auto [eof_a, eof_b] = make_pair_of_sockets();
+  bool eof_cancelled = false;
+  loop.add_rule(
+    category,
+    eof_a,
+    Direction::In,
+    [&] {
+      string buffer;
+      eof_a.read( buffer );
+    },
+    [] { return true; },
+    [&] { eof_cancelled = true; } );
+  eof_b.close();
+
+  auto [hup_a, hup_b] = make_pair_of_sockets();
+  bool hup_cancelled = false;
+  loop.add_rule(
+    category, hup_a, Direction::Out, ignore, [] { return true; }, [&] { hup_cancelled = true; } );
+  hup_b.close();
+
+  auto [closed_a, closed_b] = make_pair_of_sockets();
+  bool closed_cancelled = false;
+  loop.add_rule(
+    category, closed_a, Direction::In, ignore, [] { return true; }, [&] { closed_cancelled = true; } );
+
+  closed_a.close();
+  size_t waits = 0;
+  while ( loop.wait_next_event( 0ms ) != Result::Exit ) {
+    expect( ++waits < 5, name( backend ) + "every rule is cancelled" );
+  }
+  expect( eof_cancelled, name( backend ) + "a rule is cancelled at EOF" );
+  expect( hup_cancelled, name( backend ) + "an output rule is cancelled on hangup" );
+  expect( closed_cancelled, name( backend ) + "a rule is cancelled when its fd is closed" );
+
+  // a new fd (which probably reuses a closed fd's number) can be watched
+  auto [reused_a, reused_b] = make_pair_of_sockets();
+  bool reused_served = false;
+  loop.add_rule( category, reused_a, Direction::In, [&] {
+    string buffer;
+    reused_a.read( buffer );
+    reused_served = true;
+  } );
+  reused_b.write( "x" );
+  expect( loop.wait_next_event( 0ms ) == Result::Success, name( backend ) + "a new fd is watched" );
+  expect( reused_served, name( backend ) + "a new fd is served" );
+}
+
+// A handle can outlive its loop (it then does nothing)
+void test_handle_outlives_loop( EventLoop::Backend backend )
+{
+  auto [a, b] = make_pair_of_sockets();
+  const auto read_a = [&] {
+    string buffer;
+    a.read( buffer );
+  };
+
+  optional<EventLoop::RuleHandle> handle;
+  {
+    EventLoop loop { backend };
+    handle = loop.add_rule( loop.add_category( "rule" ), a, Direction::In, read_a );
+  }
+  handle->cancel();
+  handle->cache_interest();
+  handle->interest_changed();
+
+  // a moved loop keeps its rules, but not the handles made before the move
+  EventLoop moved { backend };
+  handle = moved.add_rule( moved.add_category( "rule" ), a, Direction::In, read_a );
+  EventLoop loop { std::move( moved ) };
+  handle->cancel();
+  b.write( "x" );
+  expect( loop.wait_next_event( 0ms ) == Result::Success, name( backend ) + "a moved loop keeps its rules" );
+}
+
+// A rule's interest changes from one wait to the next
+void test_interest( EventLoop::Backend backend )
+{
+  EventLoop loop { backend };
+  const size_t category = loop.add_category( "rule" );
+
+  auto [a, b] = make_pair_of_sockets();
+  bool reading = false;
+  bool writing = true;
+  size_t reads = 0;
+  size_t writes = 0;
+  loop.add_rule(
+    category,
+    a,
+    Direction::In,
+    [&] {
+      string buffer;
+      a.read( buffer );
+      ++reads;
+    },
+    [&] { return reading; } );
+  loop.add_rule(
+    category,
+    a,
+    Direction::Out,
+    [&] {
+      a.write( "y" );
+      ++writes;
+      writing = false;
+    },
+    [&] { return writing; } );
+
+  b.write( "x" );
+  expect( loop.wait_next_event( 0ms ) == Result::Success and writes == 1, name( backend ) + "the fd is writable" );
+  expect( loop.wait_next_event( 0ms ) == Result::Exit and reads == 0, name( backend ) + "neither rule interested" );
+  reading = true;
+  expect( loop.wait_next_event( 0ms ) == Result::Success and reads == 1, name( backend ) + "now it reads" );
+  expect( loop.wait_next_event( 0ms ) == Result::Timeout, name( backend ) + "and waits for more" );
+  writing = true;
+  expect( loop.wait_next_event( 0ms ) == Result::Success and writes == 2, name( backend ) + "and writes again" );
+}
+
+// Rules that cache their interest are checked only when they run or are told it changed
+void test_cached_interest( EventLoop::Backend backend )
+{
+  EventLoop loop { backend };
+  const size_t idle = loop.add_category( "idle" );
+  const size_t busy = loop.add_category( "busy" );
+
+  vector<pair<FileDescriptor, FileDescriptor>> sockets;
+  sockets.reserve( 100 ); // the rules refer to the sockets
+  for ( size_t i = 0; i < 100; ++i ) {
+    sockets.push_back( make_pair_of_sockets() );
+    loop.add_rule( idle, sockets.back().first, Direction::In, [] {}, [] { return true; } ).cache_interest();
+  }
+
+  auto [a, b] = make_pair_of_sockets();
+  bool reading = false;
+  size_t reads = 0;
+  auto rule = loop.add_rule(
+    busy,
+    a,
+    Direction::In,
+    [&] {
+      string buffer;
+      a.read( buffer );
+      ++reads;
+    },
+    [&] { return reading; } );
+  rule.cache_interest();
+
+  b.write( "x" );
+  expect( loop.wait_next_event( 0ms ) == Result::Timeout, name( backend ) + "nothing ready that is wanted" );
+  const uint64_t idle_checks = loop.profile( idle ).interest_checks;
+  expect( idle_checks == 100, name( backend ) + "each cached interest checked once" );
+
+  reading = true;
+  expect( loop.wait_next_event( 0ms ) == Result::Timeout and reads == 0, name( backend ) + "the cache is used" );
+  rule.interest_changed();
+  expect( loop.wait_next_event( 0ms ) == Result::Success and reads == 1, name( backend ) + "until it changes" );
+  for ( int i = 0; i < 10; ++i ) {
+    b.write( "x" );
+    expect( loop.wait_next_event( 0ms ) == Result::Success, name( backend ) + "and it keeps reading" );
+  }
+  expect( reads == 11, name( backend ) + "every write read" );
+  expect( loop.profile( idle ).interest_checks == idle_checks, name( backend ) + "idle rules are left alone" );
+
+  rule.cancel();
+  b.write( "x" );
+  expect( loop.wait_next_event( 0ms ) == Result::Timeout and reads == 11, name( backend ) + "cancelling drops it" );
+}
+
+// Reads, writes and receives that complete in later waits
+void test_async_io( EventLoop::Backend backend )
+{
+  EventLoop loop { backend };
+  expect( loop.backend() == backend or not IoUring::supported(), name( backend ) + "the backend is as asked" );
+  const auto run = [&] {
+    size_t waits = 0;
+    while ( loop.wait_next_event( 1s ) != Result::Exit ) {
+      expect( ++waits < 100, name( backend ) + "the I/O finishes" );
+    }
+  };
+
+  auto [a, b] = make_pair_of_sockets();
+  size_t written = 0;
+  string read;
+  a.async_write( loop, "hello", [&]( size_t bytes ) { written += bytes; } );
+  a.async_write( loop, string( 3 * IoUring::FIXED_BUFFER_SIZE, 'x' ), [&]( size_t bytes ) { written += bytes; } );
+  b.async_read( loop, [&]( string& buffer ) { read = buffer; } );
+  run();
+  expect( written == 5 + 3 * IoUring::FIXED_BUFFER_SIZE, name( backend ) + "small and large writes complete" );
+  expect( read.starts_with( "hello" ), name( backend ) + "the read completes with what was written" );
+  expect( a.write_count() == 2 and b.read_count() == 1, name( backend ) + "async I/O is counted" );
+
+  a.close();
+  string after_eof = "not empty";
+  b.async_read( loop, [&]( string& buffer ) { after_eof = buffer; } );
+  run();
+  expect( after_eof.empty() and b.eof(), name( backend ) + "a read at EOF is empty" );
+
+  auto [c, d] = make_pair_of_datagram_sockets();
+  vector<string> datagrams;
+  c.async_receive( loop, [&]( string_view datagram ) {
+    datagrams.emplace_back( datagram );
+    return datagrams.size() < 3;
+  } );
+  for ( const auto* datagram : { "one", "two", "three" } ) {
+    d.write( datagram );
+  }
+  run();
+  expect( datagrams == vector<string> { "one", "two", "three" }, name( backend ) + "receive until told to stop" );
+  d.write( "four" );
+  string left;
+  c.read( left );
+  expect( left == "four", name( backend ) + "the rest stay in the socket" );
+
+  // datagrams already queued when the callback stops are not lost (nor are the buffers they arrive in): the
+  // next receive gets them
+  for ( size_t round = 0; round < 20; ++round ) {
+    for ( size_t i = 0; i < 10; ++i ) {
+      d.write( to_string( i ) );
+    }
+    vector<string> first;
+    c.async_receive( loop, [&]( string_view datagram ) {
+      first.emplace_back( datagram );
+      return false;
+    } );
+    run();
+    vector<string> rest;
+    c.async_receive( loop, [&]( string_view datagram ) {
+      rest.emplace_back( datagram );
+      return rest.size() < 9;
+    } );
+    run();
+    expect( first == vector<string> { "0" } and rest.size() == 9 and rest.front() == "1" and rest.back() == "9",
+            name( backend ) + "datagrams queued past a stop go to the next receive, in order" );
+  }
+
+  // a pipe (like a TUN device) is not a socket, so each datagram is one read
+  array<int, 2> pipe_fds {};
+  CheckSystemCall( "pipe", ::pipe( pipe_fds.data() ) );
+  FileDescriptor pipe_out { pipe_fds[0] };
+  FileDescriptor pipe_in { pipe_fds[1] };
+  string from_pipe;
+  pipe_out.async_receive( loop, [&]( string_view datagram ) {
+    from_pipe = datagram;
+    return false;
+  } );
+  pipe_in.write( "through a pipe" );
+  run();
+  expect( from_pipe == "through a pipe", name( backend ) + "receive from a pipe" );
+}
+
+// Callbacks are counted and timed per category, and the waits are counted
+void test_profile( EventLoop::Backend backend )
+{
+  EventLoop loop { backend };
+  const size_t slow = loop.add_category( "slow reader" );
+  const size_t idle = loop.add_category( "idle" );
+
+  auto [a, b] = make_pair_of_sockets();
+  loop.add_rule( slow, a, Direction::In, [&] {
+    string buffer;
+    a.read( buffer );
+    this_thread::sleep_for( 2ms );
+  } );
+  auto [hung_up, peer] = make_pair_of_sockets();
+  loop.add_rule( idle, hung_up, Direction::In, [] {}, [] { return false; } );
+  peer.close();
+
+  // the uninterested rule's fd still reports the hangup, which runs no callback
+  expect( loop.wait_next_event( 0ms ) == Result::Success, name( backend ) + "the hangup wakes the loop" );
+  expect( loop.wakeup_profile().empty_wakeups == 1, name( backend ) + "a wakeup with nothing to do" );
+  b.write( "x" );
+  while ( loop.profile( slow ).callbacks == 0 ) {
+    loop.wait_next_event( 0ms );
+  }
+
+  const auto& profile = loop.profile( slow );
+  expect( profile.max_time >= 2ms and profile.total_time == profile.max_time, name( backend ) + "callback timed" );
+  const auto micros = static_cast<uint64_t>( duration_cast<microseconds>( profile.max_time ).count() );
+  expect( bit_width( micros ) >= 11 and profile.histogram.at( bit_width( micros ) ) == 1,
+          name( backend ) + "the histogram has the 2 ms callback" );
+  expect( profile.interest_checks >= 2, name( backend ) + "interest checks counted" );
+  expect( loop.profile( idle ).callbacks == 0 and loop.profile( idle ).interest_checks >= 2,
+          name( backend ) + "an uninterested rule is only checked" );
+
+  // ask for a profile as the signal handler would
+  EventLoop::print_profiles_on_signal( SIGUSR1 );
+  stringstream printed;
+  auto* const original = cerr.rdbuf( printed.rdbuf() );
+  ::raise( SIGUSR1 );
+  loop.wait_next_event( 0ms );
+  cerr.rdbuf( original );
+  expect( printed.str().find( "\"slow reader\": 1 callbacks" ) != string::npos,
+          name( backend ) + "the profile is printed on request" );
+}
+
+// One-shot and periodic timers fire when due, and the loop sleeps until then
+void test_timers( EventLoop::Backend backend )
+{
+  EventLoop loop { backend };
+  const size_t category = loop.add_category( "timer" );
+
+  const auto start = steady_clock::now();
+  size_t once = 0;
+  size_t periodic = 0;
+  loop.add_timer( category, 100ms, [&] { ++once; } );
+  auto handle = loop.add_timer( category, 10ms, [&] { ++periodic; }, 10ms );
+
+  expect( loop.wait_next_event( 0ms ) == Result::Timeout, name( backend ) + "no timer is due yet" );
+  expect( loop.wait_next_event( -1ms ) == Result::Success and periodic == 1,
+          name( backend ) + "with only timers, the loop sleeps until one is due" );
+  expect( steady_clock::now() - start >= 10ms, name( backend ) + "the timer did not fire early" );
+
+  while ( once == 0 ) {
+    expect( loop.wait_next_event( -1ms ) == Result::Success, name( backend ) + "each wait runs a timer" );
+  }
+  expect( steady_clock::now() - start >= 100ms and periodic >= 3, name( backend ) + "the periodic timer repeats" );
+
+  // a timer that comes due during a wait for an fd ends the wait early
+  auto [a, b] = make_pair_of_sockets();
+  loop.add_rule( category, a, Direction::In, [] {} );
+  const auto before = periodic;
+  expect( loop.wait_next_event( 1s ) == Result::Success and periodic == before + 1,
+          name( backend ) + "a timer cuts short the wait for an fd" );
+
+  handle.cancel();
+  a.close();
+  size_t waits = 0;
+  while ( loop.wait_next_event( 10ms ) != Result::Exit ) {
+    expect( ++waits < 5, name( backend ) + "with every rule and timer gone, the loop exits" );
+  }
+  expect( periodic == before + 1, name( backend ) + "a cancelled timer does not fire" );
+}
+
+// A handle to a removed rule does not reach the rule that reuses its slot, and rules added by a callback (even
+// many, as the table grows) leave the running rule in place
+void test_rule_slots( EventLoop::Backend backend )
+{
+  EventLoop loop { backend };
+  const size_t category = loop.add_category( "rule" );
+
+  size_t first_runs = 0;
+  auto first = loop.add_rule( category, [&] { ++first_runs; }, [&] { return first_runs == 0; } );
+  expect( loop.wait_next_event( 0ms ) == Result::Success and first_runs == 1, name( backend ) + "rule runs" );
+  first.cancel();
+  expect( loop.wait_next_event( 0ms ) == Result::Exit, name( backend ) + "the cancelled rule is removed" );
+
+  bool second_ran = false;
+  bool second_wanted = true;
+  auto second = loop.add_rule(
+    category, [&] { second_ran = true; }, [&] { return second_wanted and not second_ran; } );
+  first.cancel(); // stale: the second rule probably has the first one's slot
+  expect( loop.wait_next_event( 0ms ) == Result::Success and second_ran, name( backend ) + "a stale handle" );
+
+  vector<pair<FileDescriptor, FileDescriptor>> sockets;
+  sockets.reserve( 200 ); // the rules refer to the sockets
+  size_t added_runs = 0;
+  auto [a, b] = make_pair_of_sockets();
+  string received;
+  loop.add_rule( category, a, Direction::In, [&] {
+    for ( size_t i = 0; i < 200; ++i ) {
+      sockets.push_back( make_pair_of_sockets() );
+      FileDescriptor& fd = sockets.back().first;
+      loop.add_rule( category, fd, Direction::In, [&fd, &added_runs] {
+        string buffer;
+        fd.read( buffer );
+        ++added_runs;
+      } );
+    }
+    a.read( received ); // after adding the rules, so the rule must still be where it was
+  } );
+  b.write( "x" );
+  expect( loop.wait_next_event( 0ms ) == Result::Success and received == "x", name( backend ) + "rules added" );
+  sockets[199].second.write( "y" );
+  expect( loop.wait_next_event( 0ms ) == Result::Success and added_runs == 1, name( backend ) + "and served" );
+  second_wanted = false;
+  second.cancel();
+}
+
+// With more rules ready than the budget, higher priorities go first, but no ready rule waits forever
+void test_priorities( EventLoop::Backend backend )
+{
+  EventLoop loop { backend };
+  const size_t bulk = loop.add_category( "bulk", EventLoop::Priority::Low );
+  const size_t urgent = loop.add_category( "urgent", EventLoop::Priority::High );
+
+  vector<pair<FileDescriptor, FileDescriptor>> sockets;
+  sockets.reserve( 4 ); // the rules refer to the sockets
+  vector<size_t> served( 4 );
+  for ( size_t i = 0; i < served.size(); ++i ) {
+    sockets.push_back( make_pair_of_sockets() );
+    FileDescriptor& fd = sockets.back().first;
+    // an empty write leaves the fd writable (always ready), but counts as progress
+    loop.add_rule( i == 3 ? urgent : bulk, fd, Direction::Out, [&fd, &served, i] {
+      ++served[i];
+      fd.write( "" );
+    } );
+  }
+
+  // budget 1: the urgent rule first, then the bulk rules take turns once each is starved
+  expect( loop.wait_next_event( 0ms ) == Result::Success and served[3] == 1, name( backend ) + "urgent first" );
+  for ( size_t i = 0; i < 4 * EventLoop::STARVATION_WAITS; ++i ) {
+    loop.wait_next_event( 0ms );
+  }
+  for ( size_t i = 0; i < 3; ++i ) {
+    expect( served[i] > 0, name( backend ) + "every bulk rule is served eventually" );
+  }
+  expect( served[3] > served[0] and served[3] > served[1] and served[3] > served[2],
+          name( backend ) + "the urgent rule is served most" );
+
+  // a larger budget serves every ready rule in one wait
+  loop.set_callback_budget( 8 );
+  const auto before = served;
+  expect( loop.wait_next_event( 0ms ) == Result::Success, name( backend ) + "one wait" );
+  for ( size_t i = 0; i < served.size(); ++i ) {
+    expect( served[i] == before[i] + 1, name( backend ) + "serves each ready rule once" );
+  }
+}
+} // namespace
+
+int main()
+{
+  return run_tests( [] {
+    using enum EventLoop::Backend;
+    for ( const auto backend : { Poll, Epoll, IoUring } ) {
+      test_one_ready( backend );
+      test_cancellation( backend );
+      test_handle_outlives_loop( backend );
+      test_interest( backend );
+      test_cached_interest( backend );
+      test_async_io( backend );
+      test_profile( backend );
+      test_timers( backend );
+      test_rule_slots( backend );
+      test_priorities( backend );
+    }
+  } );
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+// Checks for the tests that drive a component directly, rather than step by step through a TestHarness
+
+inline void expect( bool condition, const std::string& what )
+{
+  if ( not condition ) {
+    throw std::runtime_error( "expectation failed: " + what );
+  }
+}
+
+// Run a test program's tests, reporting the first failure; returns the program's exit status
+inline int run_tests( const std::function<void()>& tests )
+{
+  try {
+    tests();
+  } catch ( const std::exception& e ) {
+    std::cerr << "Exception: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
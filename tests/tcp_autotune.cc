@@ -0,0 +1,191 @@
+#include "buffer_budget.hh"
+#include "expect.hh"
+#include "tcp_config.hh"
+#include "tcp_peer.hh"
+
+#include <algorithm>
+#include <queue>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+// Two TCPPeers connected by in-memory queues, recording the right edge of every window the server advertises
+struct Loopback
+{
+  TCPPeer client;
+  TCPPeer server;
+  queue<TCPMessage> to_server {};
+  queue<TCPMessage> to_client {};
+
+  uint64_t window_end {}; // furthest right edge (as a stream index) the server has advertised
+  bool window_retracted {};
+
+  void to_server_transmit( TCPMessage x )
+  {
+    to_server.push( { .sender = x.sender.release(), .receiver = x.receiver.release() } );
+  }
+
+  void to_client_transmit( TCPMessage x )
+  {
+    TCPMessage m { .sender = x.sender.release(), .receiver = x.receiver.release() };
+    const TCPReceiverMessage& ack = m.receiver;
+    if ( ack.ackno.has_value() ) {
+      const uint64_t end = server.receiver().writer().bytes_pushed() + ack.window_size;
+      window_retracted |= end < window_end;
+      window_end = max( window_end, end );
+    }
+    to_client.push( move( m ) );
+  }
+
+  void exchange()
+  {
+    const auto to_server_f = [&]( TCPMessage x ) { to_server_transmit( move( x ) ); };
+    const auto to_client_f = [&]( TCPMessage x ) { to_client_transmit( move( x ) ); };
+
+    client.push( to_server_f );
+    server.push( to_client_f );
+    while ( not to_server.empty() or not to_client.empty() ) {
+      while ( not to_server.empty() ) {
+        server.receive( move( to_server.front() ), to_client_f );
+        to_server.pop();
+      }
+      while ( not to_client.empty() ) {
+        client.receive( move( to_client.front() ), to_server_f );
+        to_client.pop();
+      }
+    }
+  }
+
+  void tick( microseconds t )
+  {
+    client.tick( t, [&]( TCPMessage x ) { to_server_transmit( move( x ) ); } );
+    server.tick( t, [&]( TCPMessage x ) { to_client_transmit( move( x ) ); } );
+    exchange();
+  }
+};
+
+TCPConfig autotuned()
+{
+  TCPConfig cfg;
+  cfg.autotune_buffers = true;
+  cfg.recv_capacity = 1 << 20;
+  cfg.send_capacity = 1 << 20;
+  cfg.rt_timeout = 100;
+  return cfg;
+}
+
+void test_budget()
+{
+  BufferBudget budget { 100 };
+  expect( budget.reserve( 60 ) == 60, "a reservation within the limit is granted" );
+  expect( budget.reserve( 60 ) == 40, "a reservation beyond the limit is granted in part" );
+  expect( budget.reserve( 1 ) == 0 and budget.in_use() == 100, "nothing is granted at the limit" );
+  budget.release( 50 );
+  expect( budget.in_use() == 50, "released bytes can be reserved again" );
+
+  {
+    BufferReservation reservation { budget };
+    expect( reservation.grow( 30 ) == 30 and reservation.grow( 30 ) == 20, "a reservation grows up to the limit" );
+    expect( reservation.bytes() == 50 and budget.in_use() == 100, "the reservation holds what it was granted" );
+    reservation.shrink( 10 );
+    expect( reservation.bytes() == 40 and budget.in_use() == 90, "shrinking gives bytes back" );
+    reservation.shrink( 1000 );
+    expect( reservation.bytes() == 0 and budget.in_use() == 50, "a reservation gives back no more than it holds" );
+
+    reservation.grow( 25 );
+    const BufferReservation moved { std::move( reservation ) };
+    // NOLINTNEXTLINE(*-use-after-move)
+    expect( moved.bytes() == 25 and reservation.bytes() == 0, "moving transfers the bytes" );
+    expect( budget.in_use() == 75, "moving neither reserves nor releases" );
+  }
+  expect( budget.in_use() == 50, "a destroyed reservation releases its bytes" );
+
+  budget.set_limit( 40 );
+  expect( budget.reserve( 10 ) == 0, "nothing is granted above a lowered limit" );
+}
+
+void test_grow_then_shrink_when_idle()
+{
+  const size_t in_use_before = BufferBudget::global().in_use();
+
+  {
+    Loopback links { .client = TCPPeer { autotuned() }, .server = TCPPeer { autotuned() } };
+    links.exchange(); // handshake
+    expect( links.server.receiver().writer().capacity() == TCPConfig::MIN_AUTOTUNE_CAPACITY,
+            "an autotuned buffer starts small" );
+
+    for ( int round = 0; round < 16; ++round ) {
+      Writer& outbound = links.client.outbound_writer();
+      outbound.push( string( outbound.available_capacity(), 'x' ) );
+      links.exchange();
+      if ( round == 0 ) {
+        // The server sends nothing, so without autotuning a tickless caller would never tick it.
+        const auto deadline = links.server.next_deadline();
+        expect( deadline.has_value(), "a receiving connection reports when it next measures its delivery rate" );
+      }
+      links.server.inbound_reader().pop( links.server.inbound_reader().bytes_buffered() );
+      links.tick( milliseconds { 10 } );
+    }
+
+    const uint64_t grown = links.server.receiver().writer().capacity();
+    expect( grown > UINT16_MAX, "the receive buffer grows with the delivery rate" );
+    expect( BufferBudget::global().in_use() > in_use_before, "growth is reserved from the budget" );
+
+    // Now idle: the deadline comes from autotuning alone, and reaching it gives the growth back.
+    const auto deadline = links.server.next_deadline();
+    expect( deadline.has_value() and *deadline > links.server.current_time(), "an idle shrink is scheduled" );
+    links.tick( *deadline - links.server.current_time() );
+
+    const uint64_t shrunk = links.server.receiver().writer().capacity();
+    expect( shrunk < grown, "an idle connection shrinks its receive buffer" );
+    expect( shrunk >= links.window_end - links.server.inbound_reader().bytes_popped(),
+            "the buffer keeps room for the window already advertised" );
+    expect( not links.window_retracted, "the advertised window never retracts" );
+    expect( not links.server.next_deadline().has_value(), "nothing more to do until the next event" );
+  }
+
+  expect( BufferBudget::global().in_use() == in_use_before, "closed connections give their growth back" );
+}
+
+void test_no_shrink_into_advertised_window()
+{
+  TCPConfig cfg = autotuned();
+  cfg.recv_capacity = 16000; // small enough that the whole buffer is advertised
+  Loopback links { .client = TCPPeer { autotuned() }, .server = TCPPeer { cfg } };
+  links.exchange();
+
+  for ( int round = 0; round < 8; ++round ) {
+    Writer& outbound = links.client.outbound_writer();
+    outbound.push( string( outbound.available_capacity(), 'x' ) );
+    links.exchange();
+    links.server.inbound_reader().pop( links.server.inbound_reader().bytes_buffered() );
+    links.tick( milliseconds { 10 } );
+  }
+  expect( links.server.receiver().writer().capacity() == cfg.recv_capacity, "the buffer grows to its limit" );
+
+  // A reply from the server advertises the whole (now empty) buffer.
+  links.server.outbound_writer().push( "y" );
+  links.exchange();
+  links.client.inbound_reader().pop( 1 );
+  expect( links.window_end - links.server.inbound_reader().bytes_popped() == cfg.recv_capacity,
+          "the whole buffer is advertised" );
+
+  for ( int round = 0; round < 4; ++round ) {
+    links.tick( cfg.initial_RTO() );
+  }
+  expect( links.server.receiver().writer().capacity() == cfg.recv_capacity,
+          "an idle connection keeps the window it advertised" );
+  expect( not links.window_retracted, "the advertised window never retracts" );
+  expect( not links.server.next_deadline().has_value(), "no deadline for a shrink that cannot happen" );
+}
+} // namespace
+
+int main()
+{
+  return run_tests( [] {
+    test_budget();
+    test_grow_then_shrink_when_idle();
+    test_no_shrink_into_advertised_window();
+  } );
+}
@@ -0,0 +1,64 @@
+#include "expect.hh"
+#include "tcp_coalescer.hh"
+
+#include <vector>
+
+using namespace std;
+
+namespace {
+TCPMessage data_segment( uint32_t seqno, string payload, uint32_t ackno, uint16_t window, bool fin = false )
+{
+  return { .sender = TCPSenderMessage { .seqno = Wrap32 { seqno }, .payload = move( payload ), .FIN = fin },
+           .receiver = TCPReceiverMessage { .ackno = Wrap32 { ackno }, .window_size = window } };
+}
+
+void test_in_order_run()
+{
+  vector<TCPMessage> msgs;
+  msgs.push_back( data_segment( 100, "abc", 7, 1000 ) );
+  msgs.push_back( data_segment( 103, "de", 9, 900 ) );
+  msgs.push_back( data_segment( 105, "f", 8, 800, true ) );
+  TCPCoalescer::coalesce( msgs );
+
+  expect( msgs.size() == 1, "three in-order segments merge into one" );
+  const TCPSenderMessage& merged = msgs[0].sender;
+  expect( merged.seqno == Wrap32 { 100 } and merged.payload == "abcdef" and merged.FIN, "merged payload and FIN" );
+  const TCPReceiverMessage& ack = msgs[0].receiver;
+  expect( ack.ackno == Wrap32 { 9 } and ack.window_size == 900, "a reordered older ACK does not win" );
+}
+
+void test_gaps_and_flags()
+{
+  vector<TCPMessage> msgs;
+  msgs.push_back( data_segment( 100, "abc", 7, 1000 ) );
+  msgs.push_back( data_segment( 200, "xyz", 7, 1000 ) ); // gap
+  msgs.push_back( data_segment( 203, "!", 7, 1000, true ) );
+  msgs.push_back( data_segment( 204, "?", 7, 1000 ) ); // after a FIN
+  TCPCoalescer::coalesce( msgs );
+
+  expect( msgs.size() == 3, "a gap and a FIN end runs" );
+  expect( msgs[0].sender->payload == "abc", "first run" );
+  expect( msgs[1].sender->payload == "xyz!" and msgs[1].sender->FIN, "second run" );
+  expect( msgs[2].sender->payload == "?", "third run" );
+}
+
+void test_wraparound()
+{
+  vector<TCPMessage> msgs;
+  msgs.push_back( data_segment( UINT32_MAX - 1, "ab", UINT32_MAX, 10 ) );
+  msgs.push_back( data_segment( 0, "cd", 1, 20 ) );
+  TCPCoalescer::coalesce( msgs );
+
+  expect( msgs.size() == 1 and msgs[0].sender->payload == "abcd", "merge across the seqno wraparound" );
+  expect( msgs[0].receiver->ackno == Wrap32 { 1 }, "newer ACK across the wraparound" );
+}
+} // namespace
+
+int main()
+{
+  return run_tests( [] {
+    test_in_order_run();
+    test_gaps_and_flags();
+    test_wraparound();
+  } );
+}
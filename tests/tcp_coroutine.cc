@@ -0,0 +1,180 @@
+#include "coroutine_loop.hh"
+#include "exception.hh"
+#include "expect.hh"
+#include "helpers.hh"
+#include "tcp_config.hh"
+#include "tcp_minnow_co_socket.hh"
+#include "tcp_over_ip.hh"
+
+#include <array>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <vector>
+
+using namespace std;
+
+namespace {
+// TCP-in-IPv4 datagrams over one end of a Unix-domain datagram socket pair (a "wire" between two sockets)
+class WireAdapter : public TCPOverIPv4Adapter
+{
+  FileDescriptor fd_;
+
+public:
+  explicit WireAdapter( FileDescriptor&& fd ) : fd_( move( fd ) ) { fd_.set_blocking( false ); }
+
+  optional<TCPMessage> read()
+  {
+    string datagram;
+    fd_.read( datagram );
+    InternetDatagram ip_dgram;
+    if ( datagram.empty() or not parse( ip_dgram, vector<string> { move( datagram ) } ) ) {
+      return {};
+    }
+    return unwrap_tcp_in_ip( move( ip_dgram ) );
+  }
+
+  void write( const TCPMessage& msg ) { fd_.write( serialize( wrap_tcp_in_ip( msg ) ) ); }
+
+  FileDescriptor& fd() { return fd_; }
+};
+
+using CoSocket = TCPMinnowCoSocket<WireAdapter>;
+
+pair<WireAdapter, WireAdapter> make_wire()
+{
+  array<int, 2> fds {};
+  CheckSystemCall( "socketpair", ::socketpair( AF_UNIX, SOCK_DGRAM, 0, fds.data() ) );
+  return { WireAdapter { FileDescriptor { fds[0] } }, WireAdapter { FileDescriptor { fds[1] } } };
+}
+
+size_t thread_count()
+{
+  ifstream status { "/proc/self/status" };
+  string line;
+  while ( getline( status, line ) ) {
+    if ( line.starts_with( "Threads:" ) ) {
+      return stoul( line.substr( 8 ) );
+    }
+  }
+  throw runtime_error( "no thread count in /proc/self/status" );
+}
+
+TCPConfig tcp_config()
+{
+  TCPConfig cfg;
+  cfg.rt_timeout = 100; // keep the lingering short
+  return cfg;
+}
+
+FdAdapterConfig server_config()
+{
+  FdAdapterConfig cfg;
+  cfg.source = Address { "10.0.0.2", 80 };
+  return cfg;
+}
+
+FdAdapterConfig client_config( uint16_t port )
+{
+  FdAdapterConfig cfg;
+  cfg.source = Address { "10.0.0.1", port };
+  cfg.destination = server_config().source;
+  return cfg;
+}
+
+// Echo everything back, upper-cased
+Task serve( CoSocket& socket )
+{
+  co_await socket.accept( tcp_config(), server_config() );
+  string buffer;
+  while ( true ) {
+    co_await socket.read( buffer );
+    if ( buffer.empty() ) {
+      break;
+    }
+    for ( auto& c : buffer ) {
+      c = static_cast<char>( toupper( c ) );
+    }
+    co_await socket.write( buffer );
+  }
+  socket.shutdown_write();
+  co_await socket.closed();
+}
+
+Task request( CoSocket& socket, uint16_t port, string message, string& reply )
+{
+  co_await socket.connect( tcp_config(), client_config( port ) );
+  co_await socket.write( message );
+  socket.shutdown_write();
+
+  string buffer;
+  do {
+    co_await socket.read( buffer );
+    reply += buffer;
+  } while ( not buffer.empty() );
+  co_await socket.closed();
+}
+
+void test_many_connections_one_thread()
+{
+  constexpr size_t connections = 100;
+  CoroutineLoop loop;
+  vector<unique_ptr<CoSocket>> sockets;
+  vector<string> messages( connections );
+  vector<string> replies( connections );
+  vector<Task> tasks;
+
+  for ( size_t i = 0; i < connections; ++i ) {
+    auto [client_wire, server_wire] = make_wire();
+    sockets.push_back( make_unique<CoSocket>( loop, move( server_wire ) ) );
+    tasks.push_back( serve( *sockets.back() ) );
+
+    messages[i] = "message " + to_string( i ) + " " + string( i * 100, 'x' );
+    sockets.push_back( make_unique<CoSocket>( loop, move( client_wire ) ) );
+    tasks.push_back( request( *sockets.back(), static_cast<uint16_t>( 1000 + i ), messages[i], replies[i] ) );
+  }
+
+  loop.run( tasks );
+
+  for ( size_t i = 0; i < connections; ++i ) {
+    string expected = messages[i];
+    for ( auto& c : expected ) {
+      c = static_cast<char>( toupper( c ) );
+    }
+    expect( replies[i] == expected, "each connection gets its own reply" );
+  }
+  expect( thread_count() == 1, "all on the loop's thread" );
+}
+
+Task connect_nowhere( CoSocket& socket, bool& failed )
+{
+  TCPConfig cfg;
+  cfg.rt_timeout_us = 500; // give up quickly
+  try {
+    co_await socket.connect( cfg, client_config( 1 ) );
+  } catch ( const runtime_error& ) {
+    failed = true;
+  }
+}
+
+void test_failed_connect()
+{
+  CoroutineLoop loop;
+  auto [client_wire, server_wire] = make_wire();
+  CoSocket client { loop, move( client_wire ) };
+  bool failed = false;
+  vector<Task> tasks;
+  tasks.push_back( connect_nowhere( client, failed ) );
+  loop.run( tasks );
+  expect( failed, "a connection that nobody answers fails" );
+}
+} // namespace
+
+int main()
+{
+  return run_tests( [] {
+    test_many_connections_one_thread();
+    test_failed_connect();
+  } );
+}
@@ -0,0 +1,361 @@
+#include "connection_table.hh"
+#include "expect.hh"
+#include "helpers.hh"
+#include "tcp_config.hh"
+#include "tcp_demux.hh"
+#include "tcp_over_ip.hh"
+
+#include <queue>
+#include <random>
+#include <unordered_map>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+void test_connection_table()
+{
+  ConnectionTable table;
+  unordered_map<uint32_t, uint32_t> reference; // remote address -> id
+  default_random_engine rng { 144 };
+
+  const auto tuple = []( uint32_t remote ) {
+    return FourTuple { .local_address = 1, .remote_address = remote, .local_port = 80, .remote_port = 5000 };
+  };
+
+  for ( uint32_t i = 0; i < 20000; ++i ) {
+    const uint32_t remote = rng() % 500;
+    if ( rng() % 3 == 0 ) {
+      expect( table.erase( tuple( remote ) ) == reference.contains( remote ), "erase finds what was inserted" );
+      reference.erase( remote );
+    } else {
+      table.insert( tuple( remote ), i );
+      reference.insert_or_assign( remote, i );
+    }
+    expect( table.size() == reference.size(), "size" );
+  }
+
+  for ( uint32_t remote = 0; remote < 500; ++remote ) {
+    const auto id = table.find( tuple( remote ) );
+    const auto it = reference.find( remote );
+    expect( id.has_value() == ( it != reference.end() ), "membership survives erases and rehashes" );
+    expect( not id.has_value() or *id == it->second, "the latest id is found" );
+  }
+  expect( table.capacity() >= 2 * table.size(), "the table stays at most half full" );
+  expect( not table.find( { .local_address = 1, .remote_address = 7, .local_port = 80, .remote_port = 5001 } ),
+          "every field of the tuple counts" );
+}
+
+// A client host and a server host, each with one demux, connected by in-memory queues of raw datagrams
+struct Hosts
+{
+  queue<string> to_server {};
+  queue<string> to_client {};
+  TCPDemux client { [&]( const InternetDatagram& dgram ) { to_server.push( concat( serialize( dgram ) ) ); } };
+  TCPDemux server { [&]( const InternetDatagram& dgram ) { to_client.push( concat( serialize( dgram ) ) ); } };
+
+  void deliver()
+  {
+    while ( not to_server.empty() or not to_client.empty() ) {
+      while ( not to_server.empty() ) {
+        server.receive_datagram( move( to_server.front() ) );
+        to_server.pop();
+      }
+      while ( not to_client.empty() ) {
+        client.receive_datagram( move( to_client.front() ) );
+        to_client.pop();
+      }
+    }
+  }
+
+  TCPDemux::ConnectionId connect( uint16_t port, const TCPConfig& tcp_cfg = {} )
+  {
+    FdAdapterConfig cfg;
+    cfg.source = Address { "10.0.0.1", port };
+    cfg.destination = Address { "10.0.0.2", 80 };
+    return client.connect( tcp_cfg, cfg );
+  }
+};
+
+string read_all( TCPPeer& peer )
+{
+  string ret;
+  Reader& reader = peer.inbound_reader();
+  while ( reader.bytes_buffered() ) {
+    ret += reader.peek();
+    reader.pop( reader.peek().size() );
+  }
+  return ret;
+}
+
+void test_listen_and_accept()
+{
+  Hosts hosts;
+  hosts.server.listen( Address { "0", 80 }, 2 );
+
+  vector<TCPDemux::ConnectionId> clients;
+  for ( uint16_t port = 1001; port <= 1003; ++port ) {
+    clients.push_back( hosts.connect( port ) );
+  }
+  hosts.deliver();
+  expect( hosts.server.stats().backlog_full == 1, "the third SYN finds the backlog full" );
+  expect( hosts.server.connection_count() == 2 and hosts.server.backlog() == 2, "two connections wait" );
+  expect( hosts.client.established( clients[0] ) and not hosts.client.established( clients[2] ), "handshakes" );
+
+  vector<TCPDemux::ConnectionId> accepted;
+  for ( auto id = hosts.server.accept(); id.has_value(); id = hosts.server.accept() ) {
+    accepted.push_back( *id );
+  }
+  expect( accepted.size() == 2 and hosts.server.backlog() == 0, "both waiting connections are accepted" );
+
+  // The third client retransmits its SYN, which now fits in the backlog.
+  hosts.client.tick( milliseconds { TCPConfig::TIMEOUT_DFLT } );
+  hosts.deliver();
+  const auto third = hosts.server.accept();
+  expect( third.has_value(), "the retransmitted SYN is accepted" );
+  accepted.push_back( *third );
+
+  // Each connection's data reaches its own peer.
+  for ( size_t i = 0; i < clients.size(); ++i ) {
+    hosts.client.peer( clients[i] ).outbound_writer().push( "from client " + to_string( i ) );
+    hosts.client.push( clients[i] );
+  }
+  hosts.deliver();
+  for ( size_t i = 0; i < accepted.size(); ++i ) {
+    expect( read_all( hosts.server.peer( accepted[i] ) ) == "from client " + to_string( i ), "data is demuxed" );
+  }
+
+  // Closing both ends of one connection frees it once the server's peer is done.
+  hosts.client.close( clients[0] );
+  hosts.deliver();
+  hosts.server.close( accepted[0] );
+  hosts.deliver();
+  hosts.server.tick( milliseconds { 1 } );
+  expect( hosts.server.connection_count() == 2, "a closed connection is forgotten" );
+  expect( hosts.client.connection_count() == 3, "the client lingers" );
+  hosts.client.tick( 10 * milliseconds { TCPConfig::TIMEOUT_DFLT } );
+  expect( hosts.client.connection_count() == 2, "until the linger time passes" );
+}
+
+void test_unrelated_traffic()
+{
+  Hosts hosts;
+  hosts.server.listen( Address { "10.0.0.2", 80 }, 4 );
+
+  TCPOverIPv4Adapter adapter;
+  adapter.config_mut().source = Address { "10.0.0.1", 1234 };
+  adapter.config_mut().destination = Address { "10.0.0.2", 80 };
+  const auto datagram = [&]( bool syn ) {
+    return concat( serialize( adapter.wrap_tcp_in_ip(
+      { .sender = TCPSenderMessage { .seqno = Wrap32 { 1 }, .SYN = syn, .payload = "data" },
+        .receiver = TCPReceiverMessage { .window_size = 100 } } ) ) );
+  };
+
+  hosts.server.receive_datagram( "not a datagram" );
+  hosts.server.receive_datagram( datagram( false ) );
+  expect( hosts.server.stats().unrelated == 2, "garbage and non-SYNs to the listener are unrelated" );
+
+  adapter.config_mut().destination = Address { "10.0.0.2", 81 };
+  hosts.server.receive_datagram( datagram( true ) );
+  expect( hosts.server.stats().unrelated == 3, "a SYN to another port is unrelated" );
+
+  adapter.config_mut().destination = Address { "10.0.0.2", 80 };
+  string corrupted = datagram( true );
+  corrupted.back() ^= 1;
+  hosts.server.receive_datagram( corrupted );
+  expect( hosts.server.stats().bad_datagram == 1, "a bad checksum is caught" );
+  expect( hosts.server.connection_count() == 0, "and opens no connection" );
+
+  hosts.server.receive_datagram( datagram( true ) );
+  expect( hosts.server.connection_count() == 1 and hosts.to_client.size() == 1, "a good SYN is answered" );
+}
+
+void test_syn_cookies()
+{
+  Hosts hosts;
+  hosts.server.listen( Address { "0", 80 }, 2 );
+  hosts.server.set_syn_cookies( true );
+
+  // A burst of SYNs is answered without creating any connection.
+  TCPOverIPv4Adapter adapter;
+  adapter.config_mut().destination = Address { "10.0.0.2", 80 };
+  for ( uint16_t port = 2000; port < 2100; ++port ) {
+    adapter.config_mut().source = Address { "10.0.0.9", port };
+    hosts.server.receive_datagram( concat( serialize( adapter.wrap_tcp_in_ip(
+      { .sender = TCPSenderMessage { .seqno = Wrap32 { port }, .SYN = true },
+        .receiver = TCPReceiverMessage { .window_size = 100 } } ) ) ) );
+  }
+  expect( hosts.to_client.size() == 100, "every SYN gets a SYN-ACK" );
+  expect( hosts.server.connection_count() == 0, "but no connection state" );
+  hosts.to_client = {};
+
+  // An ACK that does not match a cookie opens nothing.
+  adapter.config_mut().source = Address { "10.0.0.9", 2000 };
+  const TCPMessage forged { .sender = TCPSenderMessage { .seqno = Wrap32 { 2001 } },
+                            .receiver = TCPReceiverMessage { .ackno = Wrap32 { 12345 }, .window_size = 100 } };
+  hosts.server.receive_datagram( concat( serialize( adapter.wrap_tcp_in_ip( forged ) ) ) );
+  expect( hosts.server.stats().bad_syn_cookie == 1 and hosts.server.connection_count() == 0, "forged ACK" );
+
+  // Real clients: the connection is created by the ACK, up to the backlog.
+  vector<TCPDemux::ConnectionId> clients;
+  for ( uint16_t port = 1001; port <= 1003; ++port ) {
+    clients.push_back( hosts.connect( port ) );
+  }
+  hosts.deliver();
+  expect( hosts.server.connection_count() == 2 and hosts.server.stats().backlog_full == 1, "backlog" );
+  vector<TCPDemux::ConnectionId> accepted;
+  for ( auto id = hosts.server.accept(); id.has_value(); id = hosts.server.accept() ) {
+    accepted.push_back( *id );
+  }
+
+  // The third client's first data segment also acknowledges the cookie, so it opens the connection.
+  for ( size_t i = 0; i < clients.size(); ++i ) {
+    hosts.client.peer( clients[i] ).outbound_writer().push( "from client " + to_string( i ) );
+    hosts.client.push( clients[i] );
+  }
+  hosts.deliver();
+  const auto third = hosts.server.accept();
+  expect( third.has_value(), "the third connection is opened by its data" );
+  accepted.push_back( *third );
+  for ( size_t i = 0; i < accepted.size(); ++i ) {
+    expect( read_all( hosts.server.peer( accepted[i] ) ) == "from client " + to_string( i ), "data arrives" );
+  }
+  expect( not hosts.server.peer( accepted[0] ).sender().smoothed_rtt().has_value(), "no RTT from a cookie" );
+
+  // A cookie expires after one to two periods.
+  const auto client = hosts.connect( 1004 );
+  hosts.server.receive_datagram( move( hosts.to_server.front() ) );
+  hosts.to_server.pop();
+  hosts.server.tick( 2 * TCPDemux::SYN_COOKIE_PERIOD );
+  hosts.deliver();
+  expect( hosts.client.established( client ) and hosts.server.stats().bad_syn_cookie == 2, "stale cookie" );
+}
+
+void test_time_wait()
+{
+  Hosts hosts;
+  hosts.server.listen( Address { "0", 80 }, 4 );
+  const auto client = hosts.connect( 1001 );
+  hosts.deliver();
+  const auto server = hosts.server.accept().value();
+
+  // The client closes first, so it is the one that lingers.
+  hosts.client.close( client );
+  hosts.deliver();
+  hosts.server.close( server );
+  const string fin = hosts.to_client.front();
+  hosts.deliver();
+  expect( hosts.client.peer( client ).lingering(), "both streams are finished" );
+
+  hosts.client.tick( milliseconds { 1 } );
+  expect( hosts.client.connection_count() == 0 and hosts.client.time_wait_count() == 1, "collapsed" );
+
+  // The server's FIN, retransmitted, is acknowledged again.
+  hosts.client.receive_datagram( fin );
+  expect( hosts.to_server.size() == 1, "the record answers a retransmitted FIN" );
+  TCPOverIPv4Adapter server_side;
+  server_side.config_mut().source = Address { "10.0.0.2", 80 };
+  server_side.config_mut().destination = Address { "10.0.0.1", 1001 };
+  TCPOverIPv4Adapter client_side;
+  client_side.config_mut().source = server_side.config().destination;
+  client_side.config_mut().destination = server_side.config().source;
+  InternetDatagram fin_dgram;
+  InternetDatagram ack_dgram;
+  expect( parse( fin_dgram, vector<string> { fin } ), "FIN parses" );
+  expect( parse( ack_dgram, vector<string> { hosts.to_server.front() } ), "ACK parses" );
+  const auto fin_msg = client_side.unwrap_tcp_in_ip( move( fin_dgram ) );
+  const auto ack_msg = server_side.unwrap_tcp_in_ip( move( ack_dgram ) );
+  expect( fin_msg.has_value() and ack_msg.has_value(), "segments unwrap" );
+  expect( ack_msg->receiver->ackno == fin_msg->sender->seqno + 1, "the ACK covers the FIN" );
+  expect( ack_msg->sender->sequence_length() == 0, "and carries nothing else" );
+  hosts.deliver();
+  expect( hosts.to_client.empty(), "the server does not answer it" );
+
+  // The linger time restarts with each retransmitted FIN, then the record is forgotten.
+  hosts.client.tick( TCPConfig {}.linger_time() - milliseconds { 1 } );
+  expect( hosts.client.time_wait_count() == 1, "still lingering" );
+  hosts.client.tick( milliseconds { 1 } );
+  expect( hosts.client.time_wait_count() == 0, "the record expires" );
+  hosts.client.receive_datagram( fin );
+  expect( hosts.to_server.empty() and hosts.client.stats().unrelated == 1, "then the tuple is unknown" );
+}
+
+void test_time_wait_autotuned()
+{
+  TCPConfig cfg;
+  cfg.autotune_buffers = true;
+  Hosts hosts;
+  hosts.server.listen( Address { "0", 80 }, 4, cfg );
+  const auto client = hosts.connect( 1001, cfg );
+  hosts.deliver();
+  const auto server = hosts.server.accept().value();
+
+  // The client's receive buffer grows, so once idle, autotuning has a deadline (to shrink it) of its own.
+  for ( int round = 0; round < 8; ++round ) {
+    Writer& outbound = hosts.server.peer( server ).outbound_writer();
+    outbound.push( string( outbound.available_capacity(), 'x' ) );
+    hosts.server.push( server );
+    hosts.deliver();
+    read_all( hosts.client.peer( client ) );
+    hosts.client.tick( milliseconds { 10 } );
+    hosts.server.tick( milliseconds { 10 } );
+    hosts.deliver();
+  }
+
+  hosts.client.close( client );
+  hosts.deliver();
+  hosts.server.close( server );
+  hosts.deliver();
+  const TCPPeer& peer = hosts.client.peer( client );
+  expect( peer.lingering(), "both streams are finished" );
+  expect( *peer.next_deadline() - peer.current_time() < cfg.linger_time(), "autotuning is due before the linger" );
+
+  hosts.client.tick( milliseconds { 1 } );
+  expect( hosts.client.time_wait_count() == 1, "collapsed" );
+  hosts.client.tick( cfg.linger_time() - milliseconds { 2 } );
+  expect( hosts.client.time_wait_count() == 1, "the record lingers for the whole linger time" );
+  hosts.client.tick( milliseconds { 1 } );
+  expect( hosts.client.time_wait_count() == 0, "then expires" );
+}
+
+void test_peek()
+{
+  TCPOverIPv4Adapter adapter;
+  adapter.config_mut().source = Address { "10.0.0.1", 1234 };
+  adapter.config_mut().destination = Address { "10.0.0.2", 80 };
+  const string datagram = concat( serialize( adapter.wrap_tcp_in_ip(
+    { .sender = TCPSenderMessage { .seqno = Wrap32 { 1 }, .SYN = true },
+      .receiver = TCPReceiverMessage { .ackno = Wrap32 { 9 }, .window_size = 100 } } ) ) );
+
+  const auto peek = TCPOverIPv4Adapter::peek_tcp_in_ip( datagram );
+  expect( peek.has_value(), "peek" );
+  expect( peek->tuple
+            == FourTuple { .local_address = 0x0a000002,
+                           .remote_address = 0x0a000001,
+                           .local_port = 80,
+                           .remote_port = 1234 },
+          "the tuple is seen from the receiver" );
+  expect( peek->SYN and peek->ACK and not peek->RST, "flags" );
+
+  TCPOverIPv4Adapter receiver;
+  receiver.config_mut().source = adapter.config().destination;
+  receiver.config_mut().destination = Address { "10.0.0.3", 1234 };
+  expect( not receiver.is_related( *peek ), "a datagram from another host is unrelated" );
+  receiver.config_mut().destination = adapter.config().source;
+  expect( receiver.is_related( *peek ), "one from the peer is related" );
+  expect( not TCPOverIPv4Adapter::peek_tcp_in_ip( datagram.substr( 0, 30 ) ), "a truncated datagram is not" );
+}
+} // namespace
+
+int main()
+{
+  return run_tests( [] {
+    test_connection_table();
+    test_peek();
+    test_listen_and_accept();
+    test_unrelated_traffic();
+    test_syn_cookies();
+    test_time_wait();
+    test_time_wait_autotuned();
+  } );
+}
@@ -0,0 +1,126 @@
+#include "expect.hh"
+#include "tcp_config.hh"
+#include "tcp_over_ip.hh"
+#include "tcp_peer.hh"
+
+#include <queue>
+
+using namespace std;
+
+namespace {
+// Two TCPPeers connected by in-memory queues, with a hook to inspect (and mark) each client->server message
+struct Loopback
+{
+  TCPPeer client;
+  TCPPeer server;
+  queue<TCPMessage> to_server {};
+  queue<TCPMessage> to_client {};
+  bool mark_congestion {}; // set CE on client data, as a congested router would
+
+  size_t ect_segments {};
+  size_t cwr_segments {};
+  size_t ece_acks {};
+
+  void run()
+  {
+    const auto to_server_transmit = [&]( TCPMessage x ) {
+      TCPMessage m { .sender = x.sender.release(), .receiver = x.receiver.release() };
+      TCPSenderMessage& s = m.sender;
+      ect_segments += s.ECT;
+      cwr_segments += s.CWR and not s.SYN;
+      s.CE = s.ECT and mark_congestion;
+      to_server.push( move( m ) );
+    };
+    const auto to_client_transmit = [&]( TCPMessage x ) {
+      TCPMessage m { .sender = x.sender.release(), .receiver = x.receiver.release() };
+      ece_acks += as_const( m.receiver ).get().ECE and not as_const( m.sender ).get().SYN;
+      to_client.push( move( m ) );
+    };
+
+    client.push( to_server_transmit );
+    while ( not to_server.empty() or not to_client.empty() ) {
+      while ( not to_server.empty() ) {
+        server.receive( move( to_server.front() ), to_client_transmit );
+        to_server.pop();
+      }
+      while ( not to_client.empty() ) {
+        client.receive( move( to_client.front() ), to_server_transmit );
+        to_client.pop();
+      }
+    }
+  }
+};
+
+TCPConfig config( bool ecn )
+{
+  TCPConfig cfg;
+  cfg.ecn = ecn;
+  return cfg;
+}
+
+void test_segment_flags()
+{
+  TCPOverIPv4Adapter a;
+  a.config_mut().source = Address { "10.0.0.1", 1234 };
+  a.config_mut().destination = Address { "10.0.0.2", 80 };
+  TCPOverIPv4Adapter b;
+  b.config_mut().source = a.config().destination;
+  b.config_mut().destination = a.config().source;
+
+  const TCPMessage msg {
+    .sender = TCPSenderMessage { .seqno = Wrap32 { 5 }, .payload = "x", .CWR = true, .ECT = true },
+    .receiver = TCPReceiverMessage { .ackno = Wrap32 { 9 }, .window_size = 100, .ECE = true } };
+  InternetDatagram dgram = a.wrap_tcp_in_ip( msg );
+  expect( dgram.header.ecn() == IPv4Header::ECN_ECT0, "ECT segments are sent as ECT(0)" );
+
+  dgram.header.set_ecn( IPv4Header::ECN_CE );
+  dgram.header.compute_checksum();
+  const auto parsed = b.unwrap_tcp_in_ip( dgram );
+  expect( parsed.has_value(), "datagram parses" );
+  expect( parsed->sender->CWR and parsed->receiver->ECE, "CWR and ECE survive serialization" );
+  expect( parsed->sender->CE, "a CE mark is reported to the receiver" );
+}
+
+void test_negotiation( bool client_ecn, bool server_ecn, bool expect_ect )
+{
+  Loopback links { .client = TCPPeer { config( client_ecn ) }, .server = TCPPeer { config( server_ecn ) } };
+  links.client.outbound_writer().push( "hello" );
+  links.run();
+
+  expect( links.server.inbound_reader().peek() == "hello", "data arrives" );
+  expect( ( links.ect_segments > 0 ) == expect_ect, "data is ECN-capable only if both sides agreed" );
+}
+
+void test_congestion_response()
+{
+  Loopback links { .client = TCPPeer { config( true ) }, .server = TCPPeer { config( true ) } };
+  links.run(); // handshake
+  expect( not links.client.sender().congestion_window().has_value(), "no congestion window before a signal" );
+
+  links.mark_congestion = true;
+  links.client.outbound_writer().push( string( 8 * TCPConfig::MAX_PAYLOAD_SIZE, 'x' ) );
+  links.run();
+  expect( links.ece_acks > 0, "the receiver echoes CE with ECE" );
+  const auto cwnd = links.client.sender().congestion_window();
+  expect( cwnd.has_value() and *cwnd >= 2 * TCPConfig::MAX_PAYLOAD_SIZE, "ECE sets the congestion window" );
+
+  links.mark_congestion = false;
+  links.ece_acks = 0;
+  links.client.outbound_writer().push( "more" );
+  links.run();
+  expect( links.cwr_segments == 1, "the next new data carries CWR" );
+  expect( links.ece_acks == 0, "CWR stops the echo" );
+  expect( links.server.inbound_reader().bytes_buffered() == 8 * TCPConfig::MAX_PAYLOAD_SIZE + 4, "no data lost" );
+}
+} // namespace
+
+int main()
+{
+  return run_tests( [] {
+    test_segment_flags();
+    test_negotiation( true, true, true );
+    test_negotiation( true, false, false );
+    test_negotiation( false, true, false );
+    test_congestion_response();
+  } );
+}
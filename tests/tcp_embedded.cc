@@ -0,0 +1,141 @@
+#include "exception.hh"
+#include "expect.hh"
+#include "helpers.hh"
+#include "tcp_config.hh"
+#include "tcp_minnow_socket_impl.hh"
+#include "tcp_over_ip.hh"
+
+#include <array>
+#include <fstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+// TCP-in-IPv4 datagrams over one end of a Unix-domain datagram socket pair (a "wire" between two sockets)
+class WireAdapter : public TCPOverIPv4Adapter
+{
+  FileDescriptor fd_;
+
+public:
+  explicit WireAdapter( FileDescriptor&& fd ) : fd_( move( fd ) ) { fd_.set_blocking( false ); }
+
+  optional<TCPMessage> read()
+  {
+    string datagram;
+    fd_.read( datagram );
+    InternetDatagram ip_dgram;
+    if ( datagram.empty() or not parse( ip_dgram, vector<string> { move( datagram ) } ) ) {
+      return {};
+    }
+    return unwrap_tcp_in_ip( move( ip_dgram ) );
+  }
+
+  void write( const TCPMessage& msg ) { fd_.write( serialize( wrap_tcp_in_ip( msg ) ) ); }
+
+  FileDescriptor& fd() { return fd_; }
+};
+
+using EmbeddedSocket = TCPMinnowEmbeddedSocket<WireAdapter>;
+
+pair<WireAdapter, WireAdapter> make_wire()
+{
+  array<int, 2> fds {};
+  CheckSystemCall( "socketpair", ::socketpair( AF_UNIX, SOCK_DGRAM, 0, fds.data() ) );
+  return { WireAdapter { FileDescriptor { fds[0] } }, WireAdapter { FileDescriptor { fds[1] } } };
+}
+
+size_t thread_count()
+{
+  ifstream status { "/proc/self/status" };
+  string line;
+  while ( getline( status, line ) ) {
+    if ( line.starts_with( "Threads:" ) ) {
+      return stoul( line.substr( 8 ) );
+    }
+  }
+  throw runtime_error( "no thread count in /proc/self/status" );
+}
+
+microseconds earliest( microseconds a, microseconds b )
+{
+  if ( a.count() < 0 ) {
+    return b;
+  }
+  return b.count() < 0 ? a : min( a, b );
+}
+
+// A client sends a request and a server answers it, both on one event loop on the main thread
+void test_request_reply()
+{
+  EventLoop loop;
+  auto [client_wire, server_wire] = make_wire();
+  EmbeddedSocket client { loop, move( client_wire ) };
+  EmbeddedSocket server { loop, move( server_wire ) };
+
+  TCPConfig tcp_config;
+  tcp_config.rt_timeout = 10; // keep the lingering short
+  FdAdapterConfig server_config;
+  server_config.source = Address { "10.0.0.2", 80 };
+  FdAdapterConfig client_config;
+  client_config.source = Address { "10.0.0.1", 1234 };
+  client_config.destination = server_config.source;
+
+  const string request = "GET / " + string( 3 * TCPConfig::MAX_PAYLOAD_SIZE, 'x' );
+  size_t request_written = 0;
+  client.on_writable( [&]( Writer& outbound ) {
+    const string_view rest = string_view { request }.substr( request_written );
+    const size_t len = min( rest.size(), outbound.available_capacity() );
+    outbound.push( string { rest.substr( 0, len ) } );
+    request_written += len;
+    if ( request_written == request.size() ) {
+      outbound.close();
+    }
+  } );
+
+  string reply;
+  client.on_readable( [&]( Reader& inbound ) {
+    reply += inbound.peek();
+    inbound.pop( inbound.peek().size() );
+  } );
+
+  string received;
+  size_t server_reads = 0;
+  server.on_readable( [&]( Reader& inbound ) {
+    ++server_reads;
+    received += inbound.peek(); // straight out of the TCPPeer's buffer
+    inbound.pop( inbound.peek().size() );
+    if ( inbound.is_finished() ) {
+      server.outbound_writer().push( "got " + to_string( received.size() ) );
+      server.outbound_writer().close();
+    }
+  } );
+
+  server.listen( tcp_config, server_config );
+  client.connect( tcp_config, client_config );
+  expect( not client.established(), "connect() does not wait for the handshake" );
+
+  for ( size_t events = 0; client.active() or server.active(); ++events ) {
+    expect( events < 10000, "the exchange finishes" );
+    loop.wait_next_event( earliest( client.wait_timeout(), server.wait_timeout() ) );
+    client.tick();
+    server.tick();
+  }
+
+  expect( client.established() and server.established(), "both sides saw the handshake complete" );
+  expect( received == request, "the request arrives" );
+  expect( server_reads > 1, "the server reads the request as it arrives" );
+  expect( reply == "got " + to_string( request.size() ), "the reply arrives" );
+  expect( thread_count() == 1, "no threads besides the application's" );
+}
+} // namespace
+
+int main()
+{
+  return run_tests( [] {
+    test_request_reply();
+  } );
+}
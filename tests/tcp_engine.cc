@@ -0,0 +1,133 @@
+#include "exception.hh"
+#include "expect.hh"
+#include "helpers.hh"
+#include "tcp_config.hh"
+#include "tcp_engine.hh"
+#include "tcp_minnow_socket_impl.hh"
+#include "tcp_over_ip.hh"
+
+#include <array>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+// TCP-in-IPv4 datagrams over one end of a Unix-domain datagram socket pair (a "wire" between two sockets)
+class WireAdapter : public TCPOverIPv4Adapter
+{
+  FileDescriptor fd_;
+
+public:
+  explicit WireAdapter( FileDescriptor&& fd ) : fd_( move( fd ) ) { fd_.set_blocking( false ); }
+
+  optional<TCPMessage> read()
+  {
+    string datagram;
+    fd_.read( datagram );
+    InternetDatagram ip_dgram;
+    if ( datagram.empty() or not parse( ip_dgram, vector<string> { move( datagram ) } ) ) {
+      return {};
+    }
+    return unwrap_tcp_in_ip( move( ip_dgram ) );
+  }
+
+  void write( const TCPMessage& msg ) { fd_.write( serialize( wrap_tcp_in_ip( msg ) ) ); }
+
+  FileDescriptor& fd() { return fd_; }
+};
+
+using WireSocket = TCPMinnowSocket<WireAdapter>;
+
+pair<WireAdapter, WireAdapter> make_wire()
+{
+  array<int, 2> fds {};
+  CheckSystemCall( "socketpair", ::socketpair( AF_UNIX, SOCK_DGRAM, 0, fds.data() ) );
+  return { WireAdapter { FileDescriptor { fds[0] } }, WireAdapter { FileDescriptor { fds[1] } } };
+}
+
+size_t thread_count()
+{
+  ifstream status { "/proc/self/status" };
+  string line;
+  while ( getline( status, line ) ) {
+    if ( line.starts_with( "Threads:" ) ) {
+      return stoul( line.substr( 8 ) );
+    }
+  }
+  throw runtime_error( "no thread count in /proc/self/status" );
+}
+
+string read_to_eof( Socket& socket )
+{
+  string ret;
+  while ( not socket.eof() ) {
+    string buffer;
+    socket.read( buffer );
+    ret += buffer;
+  }
+  return ret;
+}
+
+void test_many_connections_few_threads()
+{
+  constexpr size_t connections = 20;
+  TCPEngine engine { 2 };
+  expect( engine.thread_count() == 2, "thread count" );
+
+  TCPConfig tcp_config;
+  tcp_config.rt_timeout = 10; // keep the lingering short
+
+  vector<unique_ptr<WireSocket>> clients;
+  vector<unique_ptr<WireSocket>> servers;
+  const size_t threads_before = thread_count();
+  for ( size_t i = 0; i < connections; ++i ) {
+    auto [client_wire, server_wire] = make_wire();
+    clients.push_back( make_unique<WireSocket>( move( client_wire ), engine ) );
+    servers.push_back( make_unique<WireSocket>( move( server_wire ), engine ) );
+
+    FdAdapterConfig server_config;
+    server_config.source = Address { "10.0.0.2", 80 };
+    FdAdapterConfig client_config;
+    client_config.source = Address { "10.0.0.1", static_cast<uint16_t>( 1000 + i ) };
+    client_config.destination = server_config.source;
+
+    thread accept_thread { [&] { servers.back()->listen_and_accept( tcp_config, server_config ); } };
+    clients.back()->connect( tcp_config, client_config );
+    accept_thread.join();
+  }
+  expect( engine.connection_count() == 2 * connections, "every connection is served by the engine" );
+  expect( thread_count() == threads_before, "without a thread of its own" );
+
+  for ( size_t i = 0; i < connections; ++i ) {
+    clients[i]->write( "request " + to_string( i ) );
+    clients[i]->shutdown( SHUT_WR );
+  }
+  for ( size_t i = 0; i < connections; ++i ) {
+    const string request = read_to_eof( *servers[i] );
+    expect( request == "request " + to_string( i ), "each connection carries its own data" );
+    servers[i]->write( "reply to " + request );
+    servers[i]->shutdown( SHUT_WR );
+  }
+  for ( size_t i = 0; i < connections; ++i ) {
+    expect( read_to_eof( *clients[i] ) == "reply to request " + to_string( i ), "replies" );
+  }
+
+  for ( size_t i = 0; i < connections; ++i ) {
+    clients[i]->wait_until_closed();
+    servers[i]->wait_until_closed();
+  }
+  expect( engine.connection_count() == 0, "finished connections leave the engine" );
+}
+} // namespace
+
+int main()
+{
+  return run_tests( [] {
+    test_many_connections_few_threads();
+  } );
+}
@@ -0,0 +1,145 @@
+#include "expect.hh"
+#include "tcp_config.hh"
+#include "tcp_fastopen.hh"
+#include "tcp_over_ip.hh"
+#include "tcp_peer.hh"
+
+#include <queue>
+
+using namespace std;
+
+namespace {
+constexpr uint32_t CLIENT_ADDRESS = 0x0a000001;
+constexpr uint32_t SERVER_ADDRESS = 0x0a000002;
+
+void test_cookie_option()
+{
+  TCPOverIPv4Adapter a;
+  a.config_mut().source = Address { "10.0.0.1", 1234 };
+  a.config_mut().destination = Address { "10.0.0.2", 80 };
+  TCPOverIPv4Adapter b;
+  b.config_mut().source = a.config().destination;
+  b.config_mut().destination = a.config().source;
+
+  for ( const string& cookie : { string {}, string { "0123456789ab" } } ) {
+    const TCPMessage msg { .sender = TCPSenderMessage { .seqno = Wrap32 { 5 },
+                                                        .SYN = true,
+                                                        .payload = "request",
+                                                        .fastopen_cookie = cookie },
+                           .receiver = TCPReceiverMessage { .window_size = 100 } };
+    const auto parsed = b.unwrap_tcp_in_ip( a.wrap_tcp_in_ip( msg ) );
+    expect( parsed.has_value(), "a SYN with a Fast Open option parses" );
+    expect( parsed->sender->fastopen_cookie == cookie, "the cookie survives serialization" );
+    expect( parsed->sender->payload == "request", "the payload follows the options" );
+  }
+}
+
+void test_cookie_cache()
+{
+  TCPFastOpen fastopen { 12345 };
+  const string cookie = fastopen.server_cookie( CLIENT_ADDRESS );
+  expect( cookie.size() == TCPFastOpen::COOKIE_LENGTH, "cookie length" );
+  expect( cookie == TCPFastOpen { 12345 }.server_cookie( CLIENT_ADDRESS ), "cookies depend only on key and address" );
+  expect( cookie != fastopen.server_cookie( SERVER_ADDRESS ), "each address gets its own cookie" );
+
+  expect( not fastopen.cached_cookie( SERVER_ADDRESS ).has_value(), "nothing cached at first" );
+  fastopen.cache_cookie( SERVER_ADDRESS, "abc" );
+  expect( not fastopen.cached_cookie( SERVER_ADDRESS ).has_value(), "a too-short cookie is ignored" );
+  fastopen.cache_cookie( SERVER_ADDRESS, cookie );
+  expect( fastopen.cached_cookie( SERVER_ADDRESS ) == cookie, "the cookie is cached by server address" );
+}
+
+// One connection between two TCPPeers over in-memory queues, with Fast Open on both sides
+struct Connection
+{
+  TCPPeer client;
+  TCPPeer server;
+  queue<TCPMessage> to_server {};
+  queue<TCPMessage> to_client {};
+
+  Connection( optional<string> client_cookie, const string& server_cookie )
+    : client( config() ), server( config() )
+  {
+    client.use_fastopen_cookie( move( client_cookie ) );
+    server.expect_fastopen_cookie( server_cookie );
+  }
+
+  static TCPConfig config()
+  {
+    TCPConfig cfg;
+    cfg.fastopen = true;
+    return cfg;
+  }
+
+  void to_server_transmit( TCPMessage x )
+  {
+    to_server.push( { .sender = x.sender.release(), .receiver = x.receiver.release() } );
+  }
+  void to_client_transmit( TCPMessage x )
+  {
+    to_client.push( { .sender = x.sender.release(), .receiver = x.receiver.release() } );
+  }
+
+  // Deliver what the client sent to the server, and the server's replies back to the client
+  void round_trip()
+  {
+    while ( not to_server.empty() ) {
+      server.receive( move( to_server.front() ), [&]( TCPMessage x ) { to_client_transmit( move( x ) ); } );
+      to_server.pop();
+    }
+    while ( not to_client.empty() ) {
+      client.receive( move( to_client.front() ), [&]( TCPMessage x ) { to_server_transmit( move( x ) ); } );
+      to_client.pop();
+    }
+  }
+
+  void connect( const string& data )
+  {
+    client.outbound_writer().push( data );
+    client.push( [&]( TCPMessage x ) { to_server_transmit( move( x ) ); } );
+  }
+};
+
+void test_fastopen()
+{
+  TCPFastOpen fastopen { 777 };
+  const string cookie = fastopen.server_cookie( CLIENT_ADDRESS );
+
+  // First connection: the client has no cookie, so it asks for one, and its data waits for the handshake.
+  Connection first { {}, cookie };
+  first.connect( "GET /" );
+  expect( first.client.sender().sequence_numbers_in_flight() == 1, "without a cookie, the SYN carries no data" );
+  first.round_trip();
+  expect( first.client.issued_fastopen_cookie() == cookie, "the server issues a cookie on its SYN-ACK" );
+  first.round_trip();
+  expect( first.server.inbound_reader().peek() == "GET /", "data follows the handshake" );
+  fastopen.cache_cookie( SERVER_ADDRESS, *first.client.issued_fastopen_cookie() );
+
+  // Second connection: the data rides on the SYN and reaches the server's application at once.
+  Connection second { fastopen.cached_cookie( SERVER_ADDRESS ), cookie };
+  second.connect( "GET /" );
+  expect( second.client.sender().sequence_numbers_in_flight() == 6, "with a cookie, the SYN carries the data" );
+  second.round_trip();
+  expect( second.server.inbound_reader().peek() == "GET /", "SYN data is accepted with a valid cookie" );
+  expect( second.client.sender().sequence_numbers_in_flight() == 0, "SYN and data acknowledged together" );
+  expect( not second.client.issued_fastopen_cookie().has_value(), "no new cookie needed" );
+
+  // A wrong cookie: the server drops the SYN data and issues the right cookie; the client resends the data.
+  Connection third { "wrongcookie!", cookie };
+  third.connect( "GET /" );
+  third.round_trip();
+  expect( third.server.inbound_reader().bytes_buffered() == 0, "SYN data with a wrong cookie is dropped" );
+  expect( third.client.issued_fastopen_cookie() == cookie, "the right cookie is issued" );
+  third.round_trip();
+  expect( third.server.inbound_reader().peek() == "GET /", "the data is resent after the SYN-ACK" );
+}
+} // namespace
+
+int main()
+{
+  return run_tests( [] {
+    test_cookie_option();
+    test_cookie_cache();
+    test_fastopen();
+  } );
+}
@@ -0,0 +1,94 @@
+#include "expect.hh"
+#include "tcp_config.hh"
+#include "tcp_metrics_cache.hh"
+#include "tcp_peer.hh"
+
+#include <queue>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+void test_cache()
+{
+  TCPMetricsCache cache;
+  expect( not cache.lookup( 1 ).has_value(), "empty at first" );
+
+  cache.update( 1, { .srtt = 40ms, .rttvar = 5ms } );
+  cache.update( 1, { .srtt = 50ms, .rttvar = 6ms, .congestion_window = 8000 } );
+  const auto metrics = cache.lookup( 1 );
+  expect( metrics.has_value() and metrics->srtt == 50ms and metrics->congestion_window == 8000, "latest wins" );
+  expect( not cache.lookup( 2 ).has_value(), "entries are per address" );
+
+  for ( uint32_t address = 2; address < 2 + TCPMetricsCache::MAX_ENTRIES; ++address ) {
+    cache.update( address, { .srtt = 1ms } );
+  }
+  expect( cache.size() == TCPMetricsCache::MAX_ENTRIES, "the cache is bounded" );
+  expect( not cache.lookup( 1 ).has_value(), "the oldest entry is evicted" );
+}
+
+// Connect a client to a server with a fixed round-trip time, then transfer a little data
+optional<TCPMetrics> measure( TCPPeer& client, microseconds rtt )
+{
+  TCPPeer server { TCPConfig {} };
+  queue<TCPMessage> to_server;
+  queue<TCPMessage> to_client;
+  const auto to_server_transmit = [&]( TCPMessage x ) {
+    to_server.push( { .sender = x.sender.release(), .receiver = x.receiver.release() } );
+  };
+  const auto to_client_transmit = [&]( TCPMessage x ) {
+    to_client.push( { .sender = x.sender.release(), .receiver = x.receiver.release() } );
+  };
+
+  client.outbound_writer().push( "hello" );
+  client.push( to_server_transmit );
+  for ( int i = 0; i < 3; ++i ) {
+    client.tick( rtt / 2, to_server_transmit );
+    while ( not to_server.empty() ) {
+      server.receive( move( to_server.front() ), to_client_transmit );
+      to_server.pop();
+    }
+    client.tick( rtt / 2, to_server_transmit );
+    while ( not to_client.empty() ) {
+      client.receive( move( to_client.front() ), to_server_transmit );
+      to_client.pop();
+    }
+  }
+  return client.metrics();
+}
+
+void test_warm_start()
+{
+  TCPPeer cold { TCPConfig {} };
+  expect( not cold.metrics().has_value(), "nothing measured before a round trip" );
+  const auto metrics = measure( cold, 300ms );
+  expect( metrics.has_value() and metrics->srtt == 300ms, "SRTT measured" );
+  expect( metrics->rttvar == microseconds { 150ms } * 3 / 4, "RTTVAR starts at half the first sample" );
+
+  TCPPeer warm { TCPConfig {} };
+  warm.seed_metrics( *metrics );
+  warm.push( []( const TCPMessage& /*unused*/ ) {} );
+  expect( warm.next_deadline() == metrics->srtt + 4 * metrics->rttvar, "the SYN's RTO comes from the metrics" );
+
+  TCPPeer fast_path { TCPConfig {} };
+  fast_path.seed_metrics( { .srtt = 1ms, .rttvar = 0ms, .congestion_window = 1 } );
+  fast_path.push( []( const TCPMessage& /*unused*/ ) {} );
+  expect( fast_path.next_deadline() == milliseconds { TCPConfig::MIN_RTO_MS }, "the seeded RTO has a floor" );
+  expect( fast_path.sender().congestion_window() == 2 * TCPConfig::MAX_PAYLOAD_SIZE, "so does the window" );
+
+  TCPConfig short_rto;
+  short_rto.rt_timeout_us = 50'000;
+  TCPPeer configured { short_rto };
+  configured.seed_metrics( { .srtt = 1ms, .rttvar = 0ms, .congestion_window = {} } );
+  configured.push( []( const TCPMessage& /*unused*/ ) {} );
+  expect( configured.next_deadline() == 50ms, "the floor never exceeds the configured initial RTO" );
+}
+} // namespace
+
+int main()
+{
+  return run_tests( [] {
+    test_cache();
+    test_warm_start();
+  } );
+}
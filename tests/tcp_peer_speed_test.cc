@@ -0,0 +1,152 @@
+#include "tcp_config.hh"
+#include "tcp_peer.hh"
+
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <queue>
+#include <random>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+// Two TCPPeers connected by in-memory queues (a lossless loopback "link")
+struct Loopback
+{
+  TCPPeer client;
+  TCPPeer server;
+  queue<TCPMessage> to_server {};
+  queue<TCPMessage> to_client {};
+};
+
+// Transfer `data` from the client to the server, transmitting with the given callables.
+string transfer( Loopback& links,
+                 const string& data,
+                 const auto& to_server_transmit,
+                 const auto& to_client_transmit )
+{
+  auto& [client, server, to_server, to_client] = links;
+  string output_data;
+  output_data.reserve( data.size() );
+
+  size_t bytes_written = 0;
+  client.push( to_server_transmit );
+  while ( not server.inbound_reader().is_finished() ) {
+    Writer& outbound = client.outbound_writer();
+    if ( bytes_written < data.size() ) {
+      const size_t len = min( outbound.available_capacity(), data.size() - bytes_written );
+      outbound.push( data.substr( bytes_written, len ) );
+      bytes_written += len;
+    } else if ( not outbound.is_closed() ) {
+      outbound.close();
+    }
+    client.push( to_server_transmit );
+
+    if ( to_server.empty() and to_client.empty() and server.inbound_reader().bytes_buffered() == 0 ) {
+      throw runtime_error( "TCPPeer loopback transfer stalled" );
+    }
+
+    while ( not to_server.empty() ) {
+      server.receive( move( to_server.front() ), to_client_transmit );
+      to_server.pop();
+    }
+    while ( not to_client.empty() ) {
+      client.receive( move( to_client.front() ), to_server_transmit );
+      to_client.pop();
+    }
+
+    Reader& inbound = server.inbound_reader();
+    while ( inbound.bytes_buffered() ) {
+      output_data += inbound.peek();
+      inbound.pop( inbound.peek().size() );
+    }
+  }
+
+  return output_data;
+}
+
+double speed_test( fstream& debug_output,
+                   const size_t input_len,   // NOLINT(bugprone-easily-swappable-parameters)
+                   const size_t random_seed, // NOLINT(bugprone-easily-swappable-parameters)
+                   const bool type_erased )
+{
+  // Generate the data to be written
+  const string data = [&random_seed, &input_len] {
+    default_random_engine rd { random_seed };
+    uniform_int_distribution<char> ud;
+    string ret;
+    for ( size_t i = 0; i < input_len; ++i ) {
+      ret += ud( rd );
+    }
+    return ret;
+  }();
+
+  TCPConfig client_config;
+  TCPConfig server_config;
+  server_config.isn = Wrap32 { static_cast<uint32_t>( random_seed ) };
+
+  Loopback links { .client = TCPPeer { client_config }, .server = TCPPeer { server_config } };
+
+  // The sender's messages are borrowed, so each one is copied into the queue that models the link.
+  const auto to_server = [&]( TCPMessage x ) {
+    links.to_server.push( { .sender = x.sender.release(), .receiver = x.receiver.release() } );
+  };
+  const auto to_client = [&]( TCPMessage x ) {
+    links.to_client.push( { .sender = x.sender.release(), .receiver = x.receiver.release() } );
+  };
+
+  const auto start_time = steady_clock::now();
+  const string output_data
+    = type_erased
+        ? transfer( links, data, TCPPeer::TransmitFunction { to_server }, TCPPeer::TransmitFunction { to_client } )
+        : transfer( links, data, to_server, to_client );
+  const auto stop_time = steady_clock::now();
+
+  if ( data != output_data ) {
+    throw runtime_error( "Mismatch between data written and read" );
+  }
+
+  auto test_duration = duration_cast<duration<double>>( stop_time - start_time );
+  auto bytes_per_second = static_cast<double>( input_len ) / test_duration.count();
+  auto bits_per_second = 8 * bytes_per_second;
+  auto gigabits_per_second = bits_per_second / 1e9;
+
+  const string kind = type_erased ? "std::function" : "template";
+  cout << "TCPPeer loopback with " << kind << " transmit reached " << fixed << setprecision( 2 )
+       << gigabits_per_second << " Gbit/s.\n";
+
+  const string fill( 13 - kind.size(), ' ' );
+  debug_output << "        TCPPeer loopback throughput (" << kind << "):" << fill << fixed << setprecision( 2 )
+               << setw( 5 ) << gigabits_per_second << " Gbit/s\n";
+
+  if ( gigabits_per_second < 0.1 ) {
+    throw runtime_error( "TCPPeer loopback did not meet minimum speed of 0.1 Gbit/s" );
+  }
+
+  return gigabits_per_second;
+}
+
+void program_body()
+{
+  fstream debug_output;
+  debug_output.open( "/dev/tty" );
+
+  speed_test( debug_output, 1e7, 789, true );
+  speed_test( debug_output, 1e7, 789, false );
+}
+} // namespace
+
+int main()
+{
+  try {
+    program_body();
+  } catch ( const exception& e ) {
+    cerr << "Exception: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
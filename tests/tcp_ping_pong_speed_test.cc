@@ -0,0 +1,129 @@
+#include "exception.hh"
+#include "helpers.hh"
+#include "tcp_config.hh"
+#include "tcp_engine.hh"
+#include "tcp_minnow_socket_impl.hh"
+#include "tcp_over_ip.hh"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sys/socket.h>
+#include <thread>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+// TCP-in-IPv4 datagrams over one end of a Unix-domain datagram socket pair (a "wire" between two sockets)
+class WireAdapter : public TCPOverIPv4Adapter
+{
+  FileDescriptor fd_;
+
+public:
+  explicit WireAdapter( FileDescriptor&& fd ) : fd_( move( fd ) ) { fd_.set_blocking( false ); }
+
+  optional<TCPMessage> read()
+  {
+    string datagram;
+    fd_.read( datagram );
+    InternetDatagram ip_dgram;
+    if ( datagram.empty() or not parse( ip_dgram, vector<string> { move( datagram ) } ) ) {
+      return {};
+    }
+    return unwrap_tcp_in_ip( move( ip_dgram ) );
+  }
+
+  void write( const TCPMessage& msg ) { fd_.write( serialize( wrap_tcp_in_ip( msg ) ) ); }
+
+  FileDescriptor& fd() { return fd_; }
+};
+
+using WireSocket = TCPMinnowSocket<WireAdapter>;
+
+// Bounce one byte back and forth between two sockets; returns the mean round-trip time
+duration<double, micro> ping_pong( fstream& debug_output, microseconds busy_poll, size_t rounds )
+{
+  TCPEngine engine { 1, busy_poll };
+  array<int, 2> fds {};
+  CheckSystemCall( "socketpair", ::socketpair( AF_UNIX, SOCK_DGRAM, 0, fds.data() ) );
+  WireSocket client { WireAdapter { FileDescriptor { fds[0] } }, engine };
+  WireSocket server { WireAdapter { FileDescriptor { fds[1] } }, engine };
+
+  TCPConfig tcp_config;
+  tcp_config.rt_timeout = 10; // keep the lingering short
+  FdAdapterConfig server_config;
+  server_config.source = Address { "10.0.0.2", 80 };
+  FdAdapterConfig client_config;
+  client_config.source = Address { "10.0.0.1", 1234 };
+  client_config.destination = server_config.source;
+
+  thread accept_thread { [&] { server.listen_and_accept( tcp_config, server_config ); } };
+  client.connect( tcp_config, client_config );
+  accept_thread.join();
+
+  string buffer;
+  const auto start_time = steady_clock::now();
+  for ( size_t i = 0; i < rounds; ++i ) {
+    client.write( "p" );
+    server.read( buffer );
+    server.write( buffer );
+    client.read( buffer );
+    if ( buffer != "p" ) {
+      throw runtime_error( "ping-pong lost its ball" );
+    }
+  }
+  const duration<double, micro> round_trip = ( steady_clock::now() - start_time ) / rounds;
+
+  client.shutdown( SHUT_WR );
+  while ( not server.eof() ) {
+    server.read( buffer );
+  }
+  server.shutdown( SHUT_WR );
+  while ( not client.eof() ) {
+    client.read( buffer );
+  }
+  client.wait_until_closed();
+  server.wait_until_closed();
+
+  const auto stats = engine.busy_poll_stats();
+  if ( busy_poll.count() > 0 and stats.spin_events == 0 ) {
+    throw runtime_error( "busy polling never found an event" );
+  }
+
+  const string kind = busy_poll.count() > 0 ? "busy poll " + to_string( busy_poll.count() ) + " us" : "poll";
+  cout << "TCPEngine ping-pong with " << kind << ": " << fixed << setprecision( 1 ) << round_trip.count()
+       << " us per round trip (" << stats.spin_events << " events found spinning, " << stats.sleeps
+       << " sleeps).\n";
+
+  const string fill( 20 - kind.size(), ' ' );
+  debug_output << "        TCPEngine ping-pong round trip (" << kind << "):" << fill << fixed << setprecision( 1 )
+               << setw( 7 ) << round_trip.count() << " us\n";
+
+  return round_trip;
+}
+
+void program_body()
+{
+  fstream debug_output;
+  debug_output.open( "/dev/tty" );
+
+  ping_pong( debug_output, microseconds { 0 }, 2000 );
+  ping_pong( debug_output, microseconds { 50 }, 2000 );
+}
+} // namespace
+
+int main()
+{
+  try {
+    program_body();
+  } catch ( const exception& e ) {
+    cerr << "Exception: " << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
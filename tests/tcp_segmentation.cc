@@ -0,0 +1,94 @@
+#include "expect.hh"
+#include "helpers.hh"
+#include "tcp_config.hh"
+#include "tcp_over_ip.hh"
+
+#include <vector>
+
+using namespace std;
+
+namespace {
+// An adapter that sends from 10.0.0.1:1234 to 10.0.0.2:80, and one that receives those datagrams
+struct AdapterPair
+{
+  TCPOverIPv4Adapter sender {};
+  TCPOverIPv4Adapter receiver {};
+
+  AdapterPair()
+  {
+    sender.config_mut().source = Address { "10.0.0.1", 1234 };
+    sender.config_mut().destination = Address { "10.0.0.2", 80 };
+    receiver.config_mut().source = sender.config().destination;
+    receiver.config_mut().destination = sender.config().source;
+  }
+};
+
+// Segment `msg`, then parse every datagram back (checking both checksums) into a TCPMessage
+vector<TCPSenderMessage> segment_and_parse( AdapterPair& adapters, const TCPMessage& msg )
+{
+  vector<TCPOverIPv4Adapter::SegmentedDatagram> datagrams;
+  adapters.sender.segment_tcp_in_ip( msg, datagrams );
+
+  vector<TCPSenderMessage> ret;
+  for ( const auto& dgram : datagrams ) {
+    expect( dgram.payload.size() <= TCPConfig::MAX_PAYLOAD_SIZE, "each datagram fits in one packet" );
+    InternetDatagram ip_dgram;
+    expect( parse( ip_dgram, vector<string> { dgram.headers + string { dgram.payload } } ), "IPv4 header parses" );
+    auto parsed = adapters.receiver.unwrap_tcp_in_ip( move( ip_dgram ) );
+    expect( parsed.has_value(), "TCP segment parses with a valid checksum" );
+    expect( parsed->receiver->ackno == msg.receiver->ackno, "ackno is copied to every datagram" );
+    ret.push_back( parsed->sender.release() );
+  }
+  return ret;
+}
+
+void test_small_segment_matches_wrap()
+{
+  AdapterPair adapters;
+  const TCPMessage msg { .sender = TCPSenderMessage { .seqno = Wrap32 { 77 }, .SYN = true, .payload = "hello" },
+                         .receiver = TCPReceiverMessage { .ackno = Wrap32 { 5 }, .window_size = 1000 } };
+
+  vector<TCPOverIPv4Adapter::SegmentedDatagram> datagrams;
+  adapters.sender.segment_tcp_in_ip( msg, datagrams );
+  expect( datagrams.size() == 1, "a small message is one datagram" );
+  const string wrapped = concat( serialize( adapters.sender.wrap_tcp_in_ip( msg ) ) );
+  expect( datagrams[0].headers + string { datagrams[0].payload } == wrapped, "same bytes as wrap_tcp_in_ip" );
+}
+
+void test_super_segment()
+{
+  AdapterPair adapters;
+  string payload;
+  for ( size_t i = 0; i < 3 * TCPConfig::MAX_PAYLOAD_SIZE + 17; ++i ) {
+    payload += static_cast<char>( 'a' + i % 26 );
+  }
+  const uint32_t isn = UINT32_MAX - 1000; // the seqnos wrap inside the super-segment
+  const TCPMessage msg {
+    .sender = TCPSenderMessage { .seqno = Wrap32 { isn }, .SYN = true, .payload = payload, .FIN = true },
+    .receiver = TCPReceiverMessage { .ackno = Wrap32 { 42 }, .window_size = 65535 } };
+
+  const auto parsed = segment_and_parse( adapters, msg );
+  expect( parsed.size() == 4, "split into four datagrams" );
+
+  string reassembled;
+  Wrap32 next_seqno { isn };
+  for ( size_t i = 0; i < parsed.size(); ++i ) {
+    expect( parsed[i].seqno == next_seqno, "seqnos are contiguous" );
+    expect( parsed[i].SYN == ( i == 0 ), "SYN only on the first datagram" );
+    expect( parsed[i].FIN == ( i == parsed.size() - 1 ), "FIN only on the last datagram" );
+    reassembled += parsed[i].payload;
+    next_seqno = next_seqno + static_cast<uint32_t>( parsed[i].sequence_length() );
+  }
+  expect( reassembled == payload, "payload survives segmentation" );
+  expect( next_seqno == Wrap32 { isn } + static_cast<uint32_t>( msg.sender->sequence_length() ),
+          "total sequence length" );
+}
+} // namespace
+
+int main()
+{
+  return run_tests( [] {
+    test_small_segment_matches_wrap();
+    test_super_segment();
+  } );
+}
@@ -0,0 +1,158 @@
+#include "exception.hh"
+#include "expect.hh"
+#include "helpers.hh"
+#include "tcp_config.hh"
+#include "tcp_demux.hh"
+#include "tcp_shards.hh"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <sys/socket.h>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+string read_all( TCPPeer& peer )
+{
+  string ret;
+  Reader& reader = peer.inbound_reader();
+  while ( reader.bytes_buffered() ) {
+    ret += reader.peek();
+    reader.pop( reader.peek().size() );
+  }
+  return ret;
+}
+
+// What one shard's application has done (touched only by that shard's thread until the shards stop)
+struct ShardState
+{
+  vector<TCPDemux::ConnectionId> connections {};
+  size_t accepted {};
+};
+
+// The server's application: echo each connection's data back, and close it when the client does
+void echo( ShardState& state, TCPDemux& demux, atomic_size_t& finished )
+{
+  for ( auto id = demux.accept(); id.has_value(); id = demux.accept() ) {
+    state.connections.push_back( *id );
+    ++state.accepted;
+  }
+  erase_if( state.connections, [&]( TCPDemux::ConnectionId id ) {
+    TCPPeer& peer = demux.peer( id );
+    if ( const string data = read_all( peer ); not data.empty() ) {
+      peer.outbound_writer().push( "echo: " + data );
+      demux.push( id );
+    }
+    if ( peer.inbound_reader().is_finished() ) {
+      demux.close( id );
+      ++finished;
+      return true;
+    }
+    return false;
+  } );
+}
+
+void test_sharded_echo()
+{
+  constexpr size_t shard_count = 4;
+  constexpr uint16_t connections = 40;
+
+  // Each shard's queue is one end of a datagram socket pair; the client holds the other ends.
+  vector<FileDescriptor> shard_queues;
+  vector<FileDescriptor> client_queues;
+  for ( size_t i = 0; i < shard_count; ++i ) {
+    array<int, 2> fds {};
+    CheckSystemCall( "socketpair", ::socketpair( AF_UNIX, SOCK_DGRAM, 0, fds.data() ) );
+    shard_queues.emplace_back( fds[0] );
+    client_queues.emplace_back( fds[1] );
+    client_queues.back().set_blocking( false );
+  }
+
+  vector<ShardState> states( shard_count );
+  atomic_size_t finished {};
+  TCPConfig tcp_config;
+  tcp_config.rt_timeout = 100;
+
+  const auto handler = [&]( size_t shard, TCPDemux& demux ) { echo( states[shard], demux, finished ); };
+  auto shards
+    = make_unique<TCPShards>( move( shard_queues ), Address { "10.0.0.2", 80 }, connections, tcp_config, handler );
+  expect( shards->shard_count() == shard_count, "one shard per queue" );
+
+  // Like a NIC whose hash disagrees with ours, the client puts each connection on a queue by its port.
+  TCPDemux client { [&]( const InternetDatagram& dgram ) {
+    const auto peek = TCPOverIPv4Adapter::peek_tcp_in_ip( concat( serialize( dgram ) ) );
+    client_queues.at( peek->tuple.remote_port % shard_count ).write( serialize( dgram ) );
+  } };
+
+  vector<TCPDemux::ConnectionId> ids;
+  for ( uint16_t i = 0; i < connections; ++i ) {
+    FdAdapterConfig cfg;
+    cfg.source = Address { "10.0.0.1", static_cast<uint16_t>( 5000 + i ) };
+    cfg.destination = Address { "10.0.0.2", 80 };
+    ids.push_back( client.connect( tcp_config, cfg ) );
+    client.peer( ids.back() ).outbound_writer().push( "hello " + to_string( i ) );
+    client.peer( ids.back() ).outbound_writer().close();
+  }
+
+  EventLoop loop;
+  for ( auto& fd : client_queues ) {
+    loop.add_rule( "client queue", fd, Direction::In, [&] {
+      string datagram;
+      fd.read( datagram );
+      if ( not datagram.empty() ) {
+        client.receive_datagram( move( datagram ) );
+      }
+    } );
+  }
+
+  vector<string> replies( connections );
+  const auto start = steady_clock::now();
+  auto last_tick = start;
+  while ( finished < connections ) {
+    expect( steady_clock::now() - start < seconds { 10 }, "every connection finishes" );
+    loop.wait_next_event( milliseconds { 10 } );
+    const auto now = steady_clock::now();
+    client.tick( duration_cast<microseconds>( now - last_tick ) );
+    last_tick = now;
+    for ( uint16_t i = 0; i < connections; ++i ) {
+      client.push( ids[i] );
+      replies[i] += read_all( client.peer( ids[i] ) );
+    }
+  }
+  while ( any_of( replies.begin(), replies.end(), []( const string& r ) { return r.empty(); } ) ) {
+    expect( steady_clock::now() - start < seconds { 10 }, "every reply arrives" );
+    loop.wait_next_event( milliseconds { 10 } );
+    for ( uint16_t i = 0; i < connections; ++i ) {
+      replies[i] += read_all( client.peer( ids[i] ) );
+    }
+  }
+
+  for ( uint16_t i = 0; i < connections; ++i ) {
+    expect( replies[i] == "echo: hello " + to_string( i ), "each connection is echoed by its shard" );
+  }
+
+  const auto stats = shards->stats();
+  shards.reset(); // stop the shards, so that their states can be read
+  expect( stats.steered > 0 and stats.forwarded > 0, "datagrams on the wrong queue are forwarded" );
+  expect( stats.dropped == 0, "none are lost" );
+  size_t accepted = 0;
+  size_t busy_shards = 0;
+  for ( const auto& state : states ) {
+    accepted += state.accepted;
+    busy_shards += state.accepted > 0;
+  }
+  expect( accepted == connections, "every connection is accepted by exactly one shard" );
+  expect( busy_shards == shard_count, "the connections are spread over the shards" );
+}
+} // namespace
+
+int main()
+{
+  return run_tests( [] {
+    test_sharded_echo();
+  } );
+}
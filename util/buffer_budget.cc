@@ -0,0 +1,50 @@
+#include "buffer_budget.hh"
+
+#include <algorithm>
+
+using namespace std;
+
+BufferBudget& BufferBudget::global()
+{
+  static BufferBudget budget;
+  return budget;
+}
+
+size_t BufferBudget::reserve( const size_t bytes )
+{
+  size_t used = in_use_.load();
+  size_t granted = 0;
+  do {
+    const size_t limit = limit_.load();
+    granted = used < limit ? min( bytes, limit - used ) : 0;
+    if ( granted == 0 ) {
+      return 0;
+    }
+  } while ( not in_use_.compare_exchange_weak( used, used + granted ) );
+
+  return granted;
+}
+
+BufferReservation& BufferReservation::operator=( BufferReservation&& other ) noexcept
+{
+  if ( this != &other ) {
+    budget_->release( bytes_ );
+    budget_ = other.budget_;
+    bytes_ = exchange( other.bytes_, 0 );
+  }
+  return *this;
+}
+
+size_t BufferReservation::grow( const size_t bytes )
+{
+  const size_t granted = budget_->reserve( bytes );
+  bytes_ += granted;
+  return granted;
+}
+
+void BufferReservation::shrink( size_t bytes )
+{
+  bytes = min( bytes, bytes_ );
+  budget_->release( bytes );
+  bytes_ -= bytes;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+//! \brief A process-wide limit on the memory that autotuned TCP buffers may grow into
+//! \details Every connection starts with TCPConfig::MIN_AUTOTUNE_CAPACITY per direction for free;
+//! growth beyond that is reserved from the budget, and returned when the buffers shrink or the
+//! connection goes away.
+class BufferBudget
+{
+  std::atomic<size_t> limit_;
+  std::atomic<size_t> in_use_ { 0 };
+
+public:
+  static constexpr size_t DEFAULT_LIMIT = 64 * 1024 * 1024; //!< Default limit, in bytes
+
+  explicit BufferBudget( size_t limit = DEFAULT_LIMIT ) : limit_( limit ) {}
+
+  //! The budget shared by every TCPPeer in the process
+  static BufferBudget& global();
+
+  void set_limit( size_t limit ) { limit_.store( limit ); }
+  size_t limit() const { return limit_.load(); }
+  size_t in_use() const { return in_use_.load(); }
+
+  //! \returns how many of the requested bytes were granted (fewer, or none, once the limit is near)
+  size_t reserve( size_t bytes );
+  void release( size_t bytes ) { in_use_.fetch_sub( bytes ); }
+};
+
+//! Bytes that one owner holds from a BufferBudget, given back when the owner is destroyed
+class BufferReservation
+{
+  BufferBudget* budget_;
+  size_t bytes_ {};
+
+public:
+  explicit BufferReservation( BufferBudget& budget ) : budget_( &budget ) {}
+  ~BufferReservation() { budget_->release( bytes_ ); }
+
+  BufferReservation( const BufferReservation& other ) = delete;
+  BufferReservation& operator=( const BufferReservation& other ) = delete;
+
+  BufferReservation( BufferReservation&& other ) noexcept
+    : budget_( other.budget_ ), bytes_( std::exchange( other.bytes_, 0 ) )
+  {}
+  BufferReservation& operator=( BufferReservation&& other ) noexcept;
+
+  //! \returns how many bytes were granted
+  size_t grow( size_t bytes );
+  void shrink( size_t bytes );
+
+  size_t bytes() const { return bytes_; }
+};
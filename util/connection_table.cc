@@ -0,0 +1,89 @@
+#include "connection_table.hh"
+
+#include <algorithm>
+#include <bit>
+
+using namespace std;
+
+uint64_t FourTuple::hash() const
+{
+  // splitmix64 finalizer over the packed tuple
+  uint64_t x = ( static_cast<uint64_t>( local_address ) << 32 | remote_address )
+               ^ ( static_cast<uint64_t>( local_port ) << 16 | remote_port ) * 0x9e3779b97f4a7c15;
+  x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9;
+  x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111eb;
+  return x ^ ( x >> 31 );
+}
+
+size_t ConnectionTable::probe( const FourTuple& key ) const
+{
+  const size_t mask = slots_.size() - 1;
+  optional<size_t> first_tombstone;
+  for ( size_t i = key.hash() & mask;; i = ( i + 1 ) & mask ) {
+    const Slot& slot = slots_[i];
+    if ( slot.state == SlotState::Empty ) {
+      return first_tombstone.value_or( i );
+    }
+    if ( slot.state == SlotState::Tombstone ) {
+      if ( not first_tombstone.has_value() ) {
+        first_tombstone = i;
+      }
+    } else if ( slot.key == key ) {
+      return i;
+    }
+  }
+}
+
+optional<uint32_t> ConnectionTable::find( const FourTuple& key ) const
+{
+  const Slot& slot = slots_[probe( key )];
+  if ( slot.state == SlotState::Full and slot.key == key ) {
+    return slot.id;
+  }
+  return {};
+}
+
+void ConnectionTable::insert( const FourTuple& key, uint32_t id )
+{
+  // Keep at least half the slots empty, so every probe sequence ends quickly.
+  if ( 2 * ( size_ + tombstones_ + 1 ) > slots_.size() ) {
+    rehash( max( MIN_CAPACITY, bit_ceil( 4 * ( size_ + 1 ) ) ) );
+  }
+
+  Slot& slot = slots_[probe( key )];
+  if ( slot.state == SlotState::Full and slot.key == key ) {
+    slot.id = id;
+    return;
+  }
+  if ( slot.state == SlotState::Tombstone ) {
+    --tombstones_;
+  }
+  slot = { .key = key, .id = id, .state = SlotState::Full };
+  ++size_;
+}
+
+bool ConnectionTable::erase( const FourTuple& key )
+{
+  Slot& slot = slots_[probe( key )];
+  if ( slot.state != SlotState::Full or not( slot.key == key ) ) {
+    return false;
+  }
+  slot.state = SlotState::Tombstone;
+  --size_;
+  ++tombstones_;
+  return true;
+}
+
+void ConnectionTable::rehash( size_t capacity )
+{
+  vector<Slot> old( capacity );
+  swap( old, slots_ );
+  size_ = 0;
+  tombstones_ = 0;
+  for ( const Slot& slot : old ) {
+    if ( slot.state == SlotState::Full ) {
+      slots_[probe( slot.key )] = slot;
+      ++size_;
+    }
+  }
+}
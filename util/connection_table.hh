@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+//! The addresses and ports that identify one TCP connection, from this host's point of view
+struct FourTuple
+{
+  uint32_t local_address {};
+  uint32_t remote_address {};
+  uint16_t local_port {};
+  uint16_t remote_port {};
+
+  bool operator==( const FourTuple& other ) const = default;
+
+  //! A well-mixed hash of all four fields
+  uint64_t hash() const;
+};
+
+//! \brief A map from FourTuple to connection id (an open-addressing hash table with linear probing)
+//! \details Slots live in one flat array whose size is a power of two, kept at most half full, so a lookup
+//! usually touches a single cache line. Erased slots become tombstones, which lookups probe past and inserts
+//! reuse; a rehash (on growth, or when tombstones pile up) clears them.
+class ConnectionTable
+{
+  enum class SlotState : uint8_t
+  {
+    Empty,
+    Full,
+    Tombstone
+  };
+
+  struct Slot
+  {
+    FourTuple key {};
+    uint32_t id {};
+    SlotState state { SlotState::Empty };
+  };
+
+  std::vector<Slot> slots_ = std::vector<Slot>( MIN_CAPACITY );
+  size_t size_ {};
+  size_t tombstones_ {};
+
+  //! Index of the slot holding `key`, or of the slot where it would be inserted
+  size_t probe( const FourTuple& key ) const;
+  void rehash( size_t capacity );
+
+public:
+  static constexpr size_t MIN_CAPACITY = 16; //!< Initial number of slots (a power of two)
+
+  //! The id stored for `key`, if any
+  std::optional<uint32_t> find( const FourTuple& key ) const;
+
+  //! Store `id` for `key`, replacing any id already there
+  void insert( const FourTuple& key, uint32_t id );
+
+  //! Forget `key`; returns whether it was present
+  bool erase( const FourTuple& key );
+
+  size_t size() const { return size_; }
+  size_t capacity() const { return slots_.size(); }
+};
@@ -0,0 +1,104 @@
+#include "coroutine_loop.hh"
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+// ready callbacks (e.g. many connections' segments) served by one wait
+constexpr size_t CALLBACK_BUDGET = 64;
+} // namespace
+
+CoroutineLoop::CoroutineLoop()
+{
+  loop_.set_callback_budget( CALLBACK_BUDGET );
+}
+
+void CoroutineLoop::remove_timer( Timer& timer )
+{
+  // (outdated deadlines too, which still point to it)
+  if ( erase_if( deadlines_, [&]( const Deadline& deadline ) { return deadline.timer == &timer; } ) ) {
+    ranges::make_heap( deadlines_, greater {} );
+  }
+  erase( touched_, &timer );
+}
+
+void CoroutineLoop::touch( Timer& timer )
+{
+  if ( not timer.touched_ ) {
+    timer.touched_ = true;
+    touched_.push_back( &timer );
+  }
+}
+
+void CoroutineLoop::tick_timers()
+{
+  const auto now = steady_clock::now();
+  while ( not deadlines_.empty() and deadlines_.front().when <= now ) {
+    ranges::pop_heap( deadlines_, greater {} );
+    const Deadline due = deadlines_.back();
+    deadlines_.pop_back();
+    if ( due.timer->deadline_ == due.when ) {
+      due.timer->deadline_.reset();
+      touch( *due.timer );
+    }
+  }
+
+  swap( touched_, ticking_ );
+  for ( auto* timer : ticking_ ) {
+    timer->touched_ = false;
+    timer->tick();
+
+    const auto timeout = timer->wait_timeout();
+    if ( timeout.count() < 0 ) {
+      timer->deadline_.reset();
+    } else if ( timer->deadline_ != now + timeout ) {
+      timer->deadline_ = now + timeout;
+      deadlines_.push_back( { now + timeout, timer } );
+      ranges::push_heap( deadlines_, greater {} );
+    }
+  }
+  ticking_.clear();
+}
+
+void CoroutineLoop::run( const vector<Task>& tasks )
+{
+  while ( true ) {
+    tick_timers();
+    while ( not ready_.empty() ) {
+      swap( ready_, resuming_ );
+      for ( const auto handle : resuming_ ) {
+        handle.resume();
+      }
+      resuming_.clear();
+      tick_timers(); // the coroutines may have touched them
+    }
+
+    bool all_done = true;
+    for ( const auto& task : tasks ) {
+      task.result();
+      all_done = all_done and task.done();
+    }
+    if ( all_done ) {
+      return;
+    }
+
+    microseconds timeout { -1 };
+    if ( not deadlines_.empty() ) {
+      timeout = max( ceil<microseconds>( deadlines_.front().when - steady_clock::now() ), microseconds { 0 } );
+    }
+
+    const auto result = loop_.wait_next_event( timeout );
+
+    if ( result == EventLoop::Result::Exit and ready_.empty() ) {
+      // No rule is interested in anything, so only time can make progress.
+      if ( timeout.count() < 0 ) {
+        throw runtime_error( "CoroutineLoop: tasks are waiting, but nothing can wake them" );
+      }
+      this_thread::sleep_for( timeout );
+    }
+  }
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "eventloop.hh"
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <vector>
+
+//! \brief A coroutine that starts running as soon as it is called, and is resumed by a CoroutineLoop
+//! \details The Task owns the coroutine's frame; an exception that escapes the coroutine is rethrown by
+//! result().
+class Task
+{
+public:
+  struct promise_type
+  {
+    std::exception_ptr exception {};
+
+    Task get_return_object() { return Task { std::coroutine_handle<promise_type>::from_promise( *this ) }; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { exception = std::current_exception(); }
+  };
+
+  //! Has the coroutine returned (or thrown)?
+  bool done() const { return handle_.done(); }
+
+  //! Rethrow the exception that ended the coroutine, if any
+  void result() const
+  {
+    if ( handle_.done() and handle_.promise().exception ) {
+      std::rethrow_exception( handle_.promise().exception );
+    }
+  }
+
+  Task( Task&& other ) noexcept : handle_( std::exchange( other.handle_, {} ) ) {}
+  Task& operator=( Task&& other ) noexcept
+  {
+    std::swap( handle_, other.handle_ );
+    return *this;
+  }
+  Task( const Task& other ) = delete;
+  Task& operator=( const Task& other ) = delete;
+
+  ~Task()
+  {
+    if ( handle_ ) {
+      handle_.destroy();
+    }
+  }
+
+private:
+  explicit Task( std::coroutine_handle<promise_type> handle ) : handle_( handle ) {}
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+//! An awaitable built from three callables, for the awaiter's await_ready, await_suspend and await_resume
+template<class Ready, class Suspend, class Resume>
+struct Awaitable
+{
+  Ready ready;
+  Suspend suspend;
+  Resume resume;
+
+  bool await_ready() { return ready(); }
+  void await_suspend( std::coroutine_handle<> handle ) { suspend( handle ); }
+  decltype( auto ) await_resume() { return resume(); }
+};
+
+//! \brief An EventLoop that runs coroutines (Tasks) on one thread
+//! \details Objects that coroutines wait on (e.g. TCPMinnowCoSocket) add rules to event_loop() and register
+//! a Timer, which they touch() when an event or the coroutine may have changed its deadline; when an event or
+//! a tick makes a waiting coroutine runnable, they schedule() it. Coroutines are
+//! only ever resumed from run(), between calls to EventLoop::wait_next_event, so a rule's callback never
+//! finds its object destroyed underneath it.
+class CoroutineLoop
+{
+public:
+  //! Something that needs to be ticked as time passes
+  class Timer
+  {
+  public:
+    //! Let time pass
+    virtual void tick() = 0;
+
+    //! How long the loop may sleep before the next tick (negative if only an event needs handling)
+    virtual std::chrono::microseconds wait_timeout() const = 0;
+
+    Timer() = default;
+    Timer( const Timer& other ) = default;
+    Timer( Timer&& other ) = default;
+    Timer& operator=( const Timer& other ) = default;
+    Timer& operator=( Timer&& other ) = default;
+    virtual ~Timer() = default;
+
+  private:
+    friend class CoroutineLoop;
+    std::optional<std::chrono::steady_clock::time_point> deadline_ {}; //!< when the loop next ticks it
+    bool touched_ {};                                                  //!< whether it is in touched_
+  };
+
+  CoroutineLoop();
+
+  EventLoop& event_loop() { return loop_; }
+
+  //! \name
+  //! A timer is ticked when its wait_timeout() has passed, or after it is touched
+
+  //!@{
+  void add_timer( Timer& timer ) { touch( timer ); }
+  void remove_timer( Timer& timer );
+  //!@}
+
+  //! Tick `timer` before the next wait, and ask it for its wait_timeout() again (call after anything that may
+  //! have changed it, such as I/O)
+  void touch( Timer& timer );
+
+  //! Resume `handle` from the next iteration of run()
+  void schedule( std::coroutine_handle<> handle ) { ready_.push_back( handle ); }
+
+  //! Run until every one of `tasks` is done, rethrowing the first exception to escape any of them
+  void run( const std::vector<Task>& tasks );
+
+private:
+  //! A Timer's deadline, in deadlines_ (outdated if the Timer's deadline_ has since changed)
+  struct Deadline
+  {
+    std::chrono::steady_clock::time_point when;
+    Timer* timer;
+
+    bool operator>( const Deadline& other ) const { return when > other.when; }
+  };
+
+  EventLoop loop_ { EventLoop::Backend::Epoll };
+  std::vector<Deadline> deadlines_ {}; //!< min-heap
+  std::vector<Timer*> touched_ {};
+  std::vector<Timer*> ticking_ {};
+  std::vector<std::coroutine_handle<>> ready_ {};
+  std::vector<std::coroutine_handle<>> resuming_ {};
+
+  //! Tick the timers that were touched or whose deadline has passed, and schedule their next deadlines
+  void tick_timers();
+};
@@ -1,27 +1,68 @@
 #include "eventloop.hh"
 #include "exception.hh"
 
+#include <algorithm>
+#include <bit>
 #include <cstring>
 #include <iostream>
+#include <limits>
 #include <sys/socket.h>
+#include <thread>
+#include <tuple>
 
 using namespace std;
 
+// Backend::Epoll and Backend::IoUring share the poll(2) event bits
+static_assert( EPOLLIN == POLLIN and EPOLLOUT == POLLOUT and EPOLLERR == POLLERR and EPOLLHUP == POLLHUP );
+
+EventLoop::EventLoop( const Backend backend ) : _backend( backend )
+{
+  _rule_categories.reserve( 64 );
+  if ( _backend == Backend::IoUring and not IoUring::supported() ) {
+    _backend = Backend::Epoll;
+  }
+
+  if ( _backend == Backend::Epoll ) {
+    _epoll.emplace( CheckSystemCall( "epoll_create1", ::epoll_create1( EPOLL_CLOEXEC ) ) );
+    _epoll_events.resize( 64 );
+  } else if ( _backend == Backend::IoUring ) {
+    _io_uring = make_unique<IoUring>();
+  }
+}
+
 unsigned int EventLoop::FDRule::service_count() const
 {
   return direction == Direction::In ? fd.read_count() : fd.write_count();
 }
 
-size_t EventLoop::add_category( const string& name )
+size_t EventLoop::add_category( const string& name, const Priority priority )
 {
   if ( _rule_categories.size() >= _rule_categories.capacity() ) {
     throw runtime_error( "maximum categories reached" );
   }
 
-  _rule_categories.push_back( { name } );
+  _rule_categories.push_back( { name, priority } );
   return _rule_categories.size() - 1;
 }
 
+size_t EventLoop::category( const string& name, const Priority priority )
+{
+  for ( size_t i = 0; i < _rule_categories.size(); ++i ) {
+    if ( _rule_categories[i].name == name ) {
+      return i;
+    }
+  }
+  return add_category( name, priority );
+}
+
+void EventLoop::set_callback_budget( const size_t budget )
+{
+  if ( budget == 0 ) {
+    throw invalid_argument( "EventLoop: the callback budget must be at least 1" );
+  }
+  _callback_budget = budget;
+}
+
 EventLoop::BasicRule::BasicRule( size_t s_category_id, InterestT s_interest, CallbackT s_callback )
   : category_id( s_category_id ), interest( move( s_interest ) ), callback( move( s_callback ) )
 {}
@@ -38,62 +79,339 @@ EventLoop::FDRule::FDRule( BasicRule&& base,
   , error( move( s_error ) )
 {}
 
+void EventLoop::CategoryProfile::record( const chrono::nanoseconds duration )
+{
+  ++callbacks;
+  total_time += duration;
+  max_time = max( max_time, duration );
+  const auto micros = static_cast<uint64_t>( chrono::duration_cast<chrono::microseconds>( duration ).count() );
+  ++histogram.at( min( static_cast<size_t>( bit_width( micros ) ), HISTOGRAM_BUCKETS - 1 ) );
+}
+
+bool EventLoop::_interested( const BasicRule& rule )
+{
+  ++_rule_categories[rule.category_id].profile.interest_checks;
+  return rule.interest();
+}
+
+void EventLoop::_check_interest( FDRule& rule )
+{
+  if ( rule.interest_cached and not rule.interest_stale ) {
+    return;
+  }
+  rule.interest_stale = false;
+  rule.polled_events = _interested( rule ) ? ( rule.direction == Direction::In ? POLLIN : POLLOUT ) : 0;
+}
+
+void EventLoop::_mark_stale( const uint32_t slot )
+{
+  FDRule& rule = *_fd_rules.find( slot );
+  if ( rule.interest_cached and not rule.interest_stale ) {
+    rule.interest_stale = true;
+    if ( _backend != Backend::Poll ) {
+      _stale_rules.push_back( slot );
+    }
+  }
+}
+
+void EventLoop::_mark_changed( const int fd_num )
+{
+  Registration& registration = _registrations[fd_num];
+  if ( not registration.changed ) {
+    registration.changed = true;
+    _changed_registrations.push_back( fd_num );
+  }
+}
+
+void EventLoop::_run( const BasicRule& rule )
+{
+  const auto start = chrono::steady_clock::now();
+  rule.callback();
+  _rule_categories[rule.category_id].profile.record( chrono::steady_clock::now() - start );
+}
+
+atomic<unsigned>& EventLoop::profile_requests()
+{
+  static atomic<unsigned> requests;
+  return requests;
+}
+
+void EventLoop::print_profiles_on_signal( const int signal )
+{
+  static_assert( atomic<unsigned>::is_always_lock_free ); // so the handler is async-signal-safe
+  profile_requests(); // construct it outside the handler
+  if ( ::signal( signal, []( int /*unused*/ ) { ++profile_requests(); } ) == SIG_ERR ) {
+    throw unix_error( "signal" );
+  }
+}
+
+void EventLoop::print_profile( ostream& out ) const
+{
+  out << "EventLoop profile: " << _wakeups.wakeups << " wakeups (" << _wakeups.empty_wakeups
+      << " with nothing to do), " << _wakeups.timeouts << " timeouts\n";
+  for ( const auto& [name, priority, profile] : _rule_categories ) {
+    out << "  \"" << name << "\""
+        << ( priority == Priority::High ? " (high priority)" : priority == Priority::Low ? " (low priority)" : "" )
+        << ": " << profile.callbacks << " callbacks, "
+        << chrono::duration_cast<chrono::microseconds>( profile.total_time ).count() << " us total, "
+        << chrono::duration_cast<chrono::microseconds>( profile.max_time ).count() << " us max, "
+        << profile.interest_checks << " interest checks\n";
+    if ( profile.callbacks == 0 ) {
+      continue;
+    }
+    out << "    callback durations:";
+    for ( size_t i = 0; i < CategoryProfile::HISTOGRAM_BUCKETS; ++i ) {
+      if ( profile.histogram.at( i ) == 0 ) {
+        continue;
+      }
+      if ( i < CategoryProfile::HISTOGRAM_BUCKETS - 1 ) {
+        out << " <" << ( 1ULL << i ) << "us:" << profile.histogram.at( i );
+      } else {
+        out << " >=" << ( 1ULL << ( i - 1 ) ) << "us:" << profile.histogram.at( i );
+      }
+    }
+    out << "\n";
+  }
+}
+
+EventLoop::TimerRule::TimerRule( BasicRule&& base, chrono::microseconds s_period )
+  : BasicRule( move( base ) ), period( s_period )
+{}
+
+namespace {
+// The order of the timer heap: the earliest deadline on top
+constexpr auto later = []( const auto& a, const auto& b ) { return a.deadline > b.deadline; };
+} // namespace
+
+EventLoop::RuleHandle EventLoop::add_timer( const size_t category_id,
+                                            const chrono::microseconds delay,
+                                            CallbackT callback,
+                                            const chrono::microseconds period )
+{
+  if ( category_id >= _rule_categories.size() ) {
+    throw out_of_range( "bad category_id" );
+  }
+
+  const uint32_t slot = _timers.add( BasicRule { category_id, [] { return true; }, move( callback ) }, period );
+  _timer_deadlines.push_back( { chrono::steady_clock::now() + delay, slot } );
+  ranges::push_heap( _timer_deadlines, later );
+
+  return { this, RuleHandle::Kind::Timer, slot, _timers.generation( slot ) };
+}
+
+bool EventLoop::_run_timers()
+{
+  const auto now = chrono::steady_clock::now();
+  bool ran = false;
+  while ( not _timer_deadlines.empty() and _timer_deadlines.front().deadline <= now ) {
+    ranges::pop_heap( _timer_deadlines, later );
+    TimerDeadline next = _timer_deadlines.back();
+    _timer_deadlines.pop_back();
+    TimerRule& timer = *_timers.find( next.slot );
+    if ( timer.cancel_requested ) {
+      _timers.remove( next.slot );
+      continue;
+    }
+
+    _run( timer );
+    ran = true;
+
+    if ( timer.period.count() == 0 or timer.cancel_requested ) {
+      _timers.remove( next.slot );
+      continue;
+    }
+
+    // the next period, or (if the loop fell a whole period behind) a period from now, so missed periods don't
+    // pile up
+    next.deadline += timer.period;
+    if ( next.deadline <= now ) {
+      next.deadline = now + timer.period;
+    }
+    _timer_deadlines.push_back( next );
+    ranges::push_heap( _timer_deadlines, later );
+  }
+  return ran;
+}
+
+chrono::microseconds EventLoop::_timer_timeout()
+{
+  while ( not _timer_deadlines.empty() and _timers.find( _timer_deadlines.front().slot )->cancel_requested ) {
+    _timers.remove( _timer_deadlines.front().slot );
+    ranges::pop_heap( _timer_deadlines, later );
+    _timer_deadlines.pop_back();
+  }
+  if ( _timer_deadlines.empty() ) {
+    return chrono::microseconds { -1 };
+  }
+
+  // rounded up, so the wait doesn't end just before the deadline
+  const auto until
+    = chrono::ceil<chrono::microseconds>( _timer_deadlines.front().deadline - chrono::steady_clock::now() );
+  return max( until, chrono::microseconds { 0 } );
+}
+
 EventLoop::RuleHandle EventLoop::add_rule( size_t category_id,
                                            FileDescriptor& fd,
                                            Direction direction,
-                                           const CallbackT& callback,
-                                           const InterestT& interest,
-                                           const CallbackT& cancel, // NOLINT(*-easily-swappable-*)
-                                           const CallbackT& error )
+                                           CallbackT callback,
+                                           InterestT interest,
+                                           CallbackT cancel, // NOLINT(*-easily-swappable-*)
+                                           CallbackT error )
 {
   if ( category_id >= _rule_categories.size() ) {
     throw out_of_range( "bad category_id" );
   }
 
-  _fd_rules.emplace_back( make_shared<FDRule>(
-    BasicRule { category_id, interest, callback }, fd.duplicate(), direction, cancel, error ) );
+  const uint32_t slot = _fd_rules.add( BasicRule { category_id, move( interest ), move( callback ) },
+                                       fd.duplicate(),
+                                       direction,
+                                       move( cancel ),
+                                       move( error ) );
 
-  return RuleHandle { _fd_rules.back() };
+  if ( _backend != Backend::Poll ) {
+    const auto fd_num = static_cast<size_t>( fd.fd_num() );
+    if ( fd_num >= _registrations.size() ) {
+      _registrations.resize( fd_num + 1 );
+    }
+    _registrations[fd_num].rules.push_back( slot );
+    _mark_changed( fd.fd_num() );
+    _uncached_rules.push_back( { slot, _fd_rules.generation( slot ) } );
+  }
+
+  return { this, RuleHandle::Kind::FD, slot, _fd_rules.generation( slot ) };
 }
 
-EventLoop::RuleHandle EventLoop::add_rule( const size_t category_id,
-                                           const CallbackT& callback,
-                                           const InterestT& interest )
+EventLoop::RuleHandle EventLoop::add_rule( const size_t category_id, CallbackT callback, InterestT interest )
 {
   if ( category_id >= _rule_categories.size() ) {
     throw out_of_range( "bad category_id" );
   }
 
-  _non_fd_rules.emplace_back( make_shared<BasicRule>( category_id, interest, callback ) );
+  const uint32_t slot = _non_fd_rules.add( category_id, move( interest ), move( callback ) );
 
-  return RuleHandle { _non_fd_rules.back() };
+  return { this, RuleHandle::Kind::NonFD, slot, _non_fd_rules.generation( slot ) };
+}
+
+EventLoop::BasicRule* EventLoop::_find( const RuleHandle& handle )
+{
+  switch ( handle.kind_ ) {
+    case RuleHandle::Kind::FD:
+      return _fd_rules.find( handle.slot_, handle.generation_ );
+    case RuleHandle::Kind::NonFD:
+      return _non_fd_rules.find( handle.slot_, handle.generation_ );
+    default:
+      return _timers.find( handle.slot_, handle.generation_ );
+  }
 }
 
 void EventLoop::RuleHandle::cancel()
 {
-  const shared_ptr<BasicRule> rule_shared_ptr = rule_weak_ptr_.lock();
-  if ( rule_shared_ptr ) {
-    rule_shared_ptr->cancel_requested = true;
+  EventLoop* const loop = _loop();
+  BasicRule* const rule = loop ? loop->_find( *this ) : nullptr;
+  if ( rule ) {
+    rule->cancel_requested = true;
+    if ( kind_ == Kind::FD ) {
+      loop->_mark_stale( slot_ );
+    }
+  }
+}
+
+void EventLoop::RuleHandle::cache_interest()
+{
+  EventLoop* const loop = _loop();
+  FDRule* const rule = loop and kind_ == Kind::FD ? loop->_fd_rules.find( slot_, generation_ ) : nullptr;
+  if ( rule and not rule->interest_cached ) {
+    rule->interest_cached = true;
+    rule->interest_stale = false;
+    loop->_mark_stale( slot_ ); // checked once more, as a cached interest, and no longer at every wait
+  }
+}
+
+void EventLoop::RuleHandle::interest_changed()
+{
+  EventLoop* const loop = _loop();
+  if ( loop and kind_ == Kind::FD and loop->_fd_rules.find( slot_, generation_ ) ) {
+    loop->_mark_stale( slot_ );
   }
 }
 
 // NOLINTBEGIN(*-cognitive-complexity)
 // NOLINTBEGIN(*-signed-bitwise)
-EventLoop::Result EventLoop::wait_next_event( const int timeout_ms )
+EventLoop::Result EventLoop::wait_next_event( const chrono::microseconds timeout )
 {
+  if ( profile_requests() != _profile_requests_seen ) {
+    _profile_requests_seen = profile_requests();
+    print_profile( cerr );
+  }
+
+  // timers that are due come first
+  if ( _run_timers() ) {
+    return Result::Success;
+  }
+
   // first, handle the non-file-descriptor-related rules
-  {
-    for ( auto it = _non_fd_rules.begin(); it != _non_fd_rules.end(); ) {
-      auto& this_rule = **it;
-      bool rule_fired = false;
+  const size_t served = _serve_non_fd_rules();
+  if ( served >= _callback_budget ) {
+    return Result::Success;
+  }
+
+  // wait no longer than the earliest timer
+  const auto timer_timeout = _timer_timeout();
+  const bool timer_first = timer_timeout.count() >= 0 and ( timeout.count() < 0 or timer_timeout < timeout );
+  const auto wait_timeout = timer_first ? timer_timeout : timeout;
+
+  // rules kept ready from an earlier wait are served without waiting
+  const bool no_wait = served or _any_pending();
+  const auto backend_timeout = no_wait ? chrono::microseconds { 0 } : wait_timeout;
+
+  Result result {};
+  const size_t budget = _callback_budget - served;
+  ++_waits;
+  switch ( _backend ) {
+    case Backend::Epoll:
+      result = _wait_epoll( backend_timeout, budget );
+      break;
+    case Backend::IoUring:
+      result = _wait_io_uring( backend_timeout, budget );
+      break;
+    default:
+      result = _wait_poll( backend_timeout, budget );
+  }
+  if ( served ) {
+    return Result::Success; // without waiting: the fds were only checked for what else is ready
+  }
+
+  if ( result == Result::Exit and timer_timeout.count() >= 0 ) {
+    // no fd to wait for, but a timer is pending
+    this_thread::sleep_for( wait_timeout );
+    result = Result::Timeout;
+  }
+
+  if ( result == Result::Timeout and timer_first ) {
+    return _run_timers() ? Result::Success : Result::Timeout;
+  }
+  return result;
+}
+
+size_t EventLoop::_serve_non_fd_rules()
+{
+  size_t served = 0;
+  for ( const auto priority : { Priority::High, Priority::Normal, Priority::Low } ) {
+    for ( uint32_t slot = 0; slot < _non_fd_rules.size() and served < _callback_budget; ++slot ) {
+      BasicRule* const rule = _non_fd_rules.find( slot );
+      if ( not rule or _rule_categories[rule->category_id].priority != priority ) {
+        continue;
+      }
+      auto& this_rule = *rule;
 
       if ( this_rule.cancel_requested ) {
-        it = _non_fd_rules.erase( it );
+        _non_fd_rules.remove( slot );
         continue;
       }
 
+      bool rule_fired = false;
       uint8_t iterations = 0;
-      while ( this_rule.interest() ) {
+      while ( _interested( this_rule ) ) {
         if ( iterations++ >= 128 ) {
           throw runtime_error( "EventLoop: busy wait detected: rule \""
                                + _rule_categories.at( this_rule.category_id ).name + "\" is still interested after "
@@ -101,56 +419,197 @@ EventLoop::Result EventLoop::wait_next_event( const int timeout_ms )
         }
 
         rule_fired = true;
-        this_rule.callback();
+        _run( this_rule );
       }
 
-      if ( rule_fired ) {
-        return Result::Success; /* only serve one rule on each iteration */
+      served += rule_fired ? 1 : 0;
+    }
+  }
+  return served;
+}
+
+void EventLoop::_add_pending( const uint32_t slot )
+{
+  FDRule& rule = *_fd_rules.find( slot );
+  if ( rule.pending ) {
+    return;
+  }
+  rule.pending = true;
+  rule.ready_since = _waits;
+  const auto priority = static_cast<size_t>( _rule_categories[rule.category_id].priority );
+  _pending_rules.at( priority ).push_back( { slot, _fd_rules.generation( slot ) } );
+  if ( _backend != Backend::Poll ) {
+    _mark_changed( rule.fd.fd_num() ); // no longer polled until served
+  }
+}
+
+bool EventLoop::_any_pending() const
+{
+  return ranges::any_of( _pending_rules, []( const auto& rules ) { return not rules.empty(); } );
+}
+
+optional<uint32_t> EventLoop::_take_pending()
+{
+  // drop the rules removed (or no longer interested) since they were kept
+  for ( auto& rules : _pending_rules ) {
+    while ( not rules.empty() ) {
+      const FDRule* const rule = _fd_rules.find( rules.front().slot, rules.front().generation );
+      if ( rule and rule->pending ) {
+        break;
       }
+      rules.pop_front();
+    }
+  }
+
+  const auto starved = [&]( const deque<RuleRef>& rules ) {
+    return not rules.empty() and _waits - _fd_rules.find( rules.front().slot )->ready_since >= STARVATION_WAITS;
+  };
+  auto chosen = ranges::find_if( _pending_rules, starved );
+  if ( chosen == _pending_rules.end() ) {
+    chosen = ranges::find_if( _pending_rules, []( const deque<RuleRef>& rules ) { return not rules.empty(); } );
+  }
+  if ( chosen == _pending_rules.end() ) {
+    return {};
+  }
+
+  const uint32_t slot = chosen->front().slot;
+  chosen->pop_front();
+  FDRule& rule = *_fd_rules.find( slot );
+  rule.pending = false;
+  if ( _backend != Backend::Poll ) {
+    _mark_changed( rule.fd.fd_num() ); // polled again
+  }
+  return slot;
+}
 
-      ++it;
+namespace {
+// whether an fd is ready for `events` now, without waiting
+bool ready_now( const int fd_num, const int16_t events )
+{
+  pollfd fd { fd_num, events, 0 };
+  CheckSystemCall( "poll", ::poll( &fd, 1, 0 ) );
+  return ( fd.revents & events ) != 0;
+}
+} // namespace
+
+size_t EventLoop::_serve_ready_rules( const size_t budget )
+{
+  _served_rules.clear();
+  while ( _served_rules.size() < budget ) {
+    const auto next = _take_pending();
+    if ( not next.has_value() ) {
+      break;
+    }
+    const uint32_t slot = *next;
+    auto& this_rule = *_fd_rules.find( slot );
+
+    // an earlier callback (in this wait, or since the rule was kept) may have taken what this rule was ready
+    // for (or cancelled it)
+    const bool kept = this_rule.ready_since != _waits;
+    const auto same_fd = [&]( const uint32_t served_slot ) {
+      const FDRule& served_rule = *_fd_rules.find( served_slot );
+      return served_rule.fd.fd_num() == this_rule.fd.fd_num() and served_rule.direction == this_rule.direction;
+    };
+    if ( ( kept or not _served_rules.empty() )
+         and ( this_rule.cancel_requested or this_rule.fd.closed() or ranges::any_of( _served_rules, same_fd )
+               or not _interested( this_rule )
+               or ( kept
+                    and not ready_now( this_rule.fd.fd_num(),
+                                       this_rule.direction == Direction::In ? POLLIN : POLLOUT ) ) ) ) {
+      _mark_stale( slot );
+      continue;
+    }
+
+    const auto count_before = this_rule.service_count();
+    _run( this_rule );
+    _served_rules.push_back( slot );
+    _mark_stale( slot );
+
+    const bool serviced = count_before != this_rule.service_count();
+    if ( not serviced and ( not this_rule.fd.closed() ) and _interested( this_rule ) ) {
+      throw runtime_error( "EventLoop: busy wait detected: rule \""
+                           + _rule_categories.at( this_rule.category_id ).name
+                           + "\" did not read/write fd and is still interested" );
     }
   }
 
-  // now the file-descriptor-related rules. poll any "interested" file descriptors
-  vector<pollfd> pollfds {};
-  pollfds.reserve( _fd_rules.size() );
+  return _served_rules.size();
+}
+
+void EventLoop::_report_fd_error( const FDRule& rule ) const
+{
+  /* see if fd is a socket */
+  int socket_error = 0;
+  socklen_t optlen = sizeof( socket_error );
+  const int ret = getsockopt( rule.fd.fd_num(), SOL_SOCKET, SO_ERROR, &socket_error, &optlen );
+  if ( ret == -1 and errno == ENOTSOCK ) {
+    cerr << "error on polled file descriptor for rule \"" << _rule_categories.at( rule.category_id ).name << "\"\n";
+  } else if ( ret == -1 ) {
+    throw unix_error( "getsockopt" );
+  } else if ( optlen != sizeof( socket_error ) ) {
+    throw runtime_error( "unexpected length from getsockopt: " + to_string( optlen ) );
+  } else if ( socket_error ) {
+    cerr << "error on polled socket for rule \"" << _rule_categories.at( rule.category_id ).name
+         << "\": " << strerror( socket_error ) << "\n";
+  }
+}
+
+namespace {
+timespec to_timespec( const chrono::microseconds timeout )
+{
+  const auto timeout_s = chrono::duration_cast<chrono::seconds>( timeout );
+  const auto timeout_ns = chrono::duration_cast<chrono::nanoseconds>( timeout - timeout_s );
+  return { .tv_sec = timeout_s.count(), .tv_nsec = timeout_ns.count() };
+}
+} // namespace
+
+EventLoop::Result EventLoop::_wait_poll( const chrono::microseconds timeout, const size_t budget )
+{
+  // poll any "interested" file descriptors
+  _pollfds.clear();
+  _polled_rules.clear();
   bool something_to_poll = false;
 
   // set up the pollfd for each rule
-  for ( auto it = _fd_rules.begin(); it != _fd_rules.end(); ) { // NOTE: it gets erased or incremented in loop body
-    auto& this_rule = **it;
+  for ( uint32_t slot = 0; slot < _fd_rules.size(); ++slot ) {
+    FDRule* const rule = _fd_rules.find( slot );
+    if ( not rule ) {
+      continue;
+    }
+    auto& this_rule = *rule;
 
     if ( this_rule.cancel_requested ) {
       //      this_rule.cancel();
       //      if rule is cancelled externally, no need to call the cancellation callback
       //      this makes it easier to cancel rules and delete captured objects right away
-      it = _fd_rules.erase( it );
+      _fd_rules.remove( slot );
       continue;
     }
 
     if ( this_rule.direction == Direction::In && this_rule.fd.eof() ) {
       // no more reading on this rule, it's reached eof
       this_rule.cancel();
-      it = _fd_rules.erase( it );
+      _fd_rules.remove( slot );
       continue;
     }
 
     if ( this_rule.fd.closed() ) {
       this_rule.cancel();
-      it = _fd_rules.erase( it );
+      _fd_rules.remove( slot );
       continue;
     }
 
-    if ( this_rule.interest() ) {
-      pollfds.push_back( { this_rule.fd.fd_num(),
-                           static_cast<int16_t>( this_rule.direction == Direction::In ? POLLIN : POLLOUT ),
-                           0 } );
-      something_to_poll = true;
+    _check_interest( this_rule );
+    this_rule.pending = this_rule.pending and this_rule.polled_events != 0;
+    something_to_poll |= this_rule.polled_events != 0;
+    if ( this_rule.polled_events and not this_rule.pending ) {
+      _pollfds.push_back( { this_rule.fd.fd_num(),
+                            static_cast<int16_t>( this_rule.direction == Direction::In ? POLLIN : POLLOUT ),
+                            0 } );
     } else {
-      pollfds.push_back( { this_rule.fd.fd_num(), 0, 0 } ); // placeholder --- we still want errors
+      _pollfds.push_back( { this_rule.fd.fd_num(), 0, 0 } ); // placeholder --- we still want errors
     }
-    ++it;
+    _polled_rules.push_back( slot );
   }
 
   // quit if there is nothing left to poll
@@ -158,37 +617,28 @@ EventLoop::Result EventLoop::wait_next_event( const int timeout_ms )
     return Result::Exit;
   }
 
-  // call poll -- wait until one of the fds satisfies one of the rules (writeable/readable)
-  if ( 0 == CheckSystemCall( "poll", ::poll( pollfds.data(), pollfds.size(), timeout_ms ) ) ) {
+  // call ppoll -- wait until one of the fds satisfies one of the rules (writeable/readable)
+  const timespec timeout_ts = to_timespec( timeout );
+  const timespec* const timeout_ptr = timeout.count() < 0 ? nullptr : &timeout_ts;
+  if ( 0 == CheckSystemCall( "ppoll", ::ppoll( _pollfds.data(), _pollfds.size(), timeout_ptr, nullptr ) )
+       and not _any_pending() ) {
+    ++_wakeups.timeouts;
     return Result::Timeout;
   }
+  ++_wakeups.wakeups;
 
   // go through the poll results
-  for ( auto [it, idx] = make_pair( _fd_rules.begin(), static_cast<size_t>( 0 ) ); it != _fd_rules.end(); ++idx ) {
-    const auto& this_pollfd = pollfds.at( idx );
-    auto& this_rule = **it;
+  for ( size_t idx = 0; idx < _pollfds.size(); ++idx ) {
+    const auto& this_pollfd = _pollfds[idx];
+    const uint32_t slot = _polled_rules[idx];
+    auto& this_rule = *_fd_rules.find( slot );
 
     const auto poll_error = static_cast<bool>( this_pollfd.revents & ( POLLERR | POLLNVAL ) );
     if ( poll_error ) {
-      /* see if fd is a socket */
-      int socket_error = 0;
-      socklen_t optlen = sizeof( socket_error );
-      const int ret = getsockopt( this_rule.fd.fd_num(), SOL_SOCKET, SO_ERROR, &socket_error, &optlen );
-      if ( ret == -1 and errno == ENOTSOCK ) {
-        cerr << "error on polled file descriptor for rule \"" << _rule_categories.at( this_rule.category_id ).name
-             << "\"\n";
-      } else if ( ret == -1 ) {
-        throw unix_error( "getsockopt" );
-      } else if ( optlen != sizeof( socket_error ) ) {
-        throw runtime_error( "unexpected length from getsockopt: " + to_string( optlen ) );
-      } else if ( socket_error ) {
-        cerr << "error on polled socket for rule \"" << _rule_categories.at( this_rule.category_id ).name
-             << "\": " << strerror( socket_error ) << "\n";
-      }
-
+      _report_fd_error( this_rule );
       this_rule.error();
       this_rule.cancel();
-      it = _fd_rules.erase( it );
+      _fd_rules.remove( slot );
       continue;
     }
 
@@ -200,27 +650,250 @@ EventLoop::Result EventLoop::wait_next_event( const int timeout_ms )
       //   - if it was POLLOUT, it will not be writable again
       // additionally, consider FD defunct if rule will only query for Direction::Out
       this_rule.cancel();
-      it = _fd_rules.erase( it );
+      _fd_rules.remove( slot );
       continue;
     }
 
     if ( poll_ready ) {
       // we only want to call callback if revents includes the event we asked for
-      const auto count_before = this_rule.service_count();
-      this_rule.callback();
+      _add_pending( slot );
+    }
+  }
 
-      if ( count_before == this_rule.service_count() and ( not this_rule.fd.closed() ) and this_rule.interest() ) {
-        throw runtime_error( "EventLoop: busy wait detected: rule \""
-                             + _rule_categories.at( this_rule.category_id ).name
-                             + "\" did not read/write fd and is still interested" );
-      }
+  if ( _serve_ready_rules( budget ) == 0 ) {
+    ++_wakeups.empty_wakeups;
+  }
+  return Result::Success;
+}
 
-      return Result::Success; /* only serve one rule on each iteration */
+void EventLoop::_remove_fd_rule( const uint32_t slot )
+{
+  const FDRule& rule = *_fd_rules.find( slot );
+  const auto fd_num = static_cast<size_t>( rule.fd.fd_num() );
+  _interested_rules -= rule.polled_events ? 1 : 0;
+  _fd_rules.remove( slot );
+  if ( fd_num >= _registrations.size() ) {
+    return;
+  }
+
+  Registration& registration = _registrations[fd_num];
+  erase( registration.rules, slot );
+  _mark_changed( static_cast<int>( fd_num ) );
+  if ( registration.rules.empty() ) {
+    if ( registration.added and _backend == Backend::Epoll ) {
+      // fails harmlessly if the fd was already closed (which removes it from the set)
+      ::epoll_ctl( _epoll->fd_num(), EPOLL_CTL_DEL, static_cast<int>( fd_num ), nullptr );
+    } else if ( registration.added ) {
+      _io_uring->cancel_poll( registration.poll_tag );
     }
+    registration.added = false;
+  }
+}
+
+void EventLoop::_update_rule( const uint32_t slot )
+{
+  FDRule* const rule = _fd_rules.find( slot );
+  if ( not rule ) {
+    return;
+  }
+  auto& this_rule = *rule;
+
+  // drop rules that are finished (as _wait_poll does)
+  if ( this_rule.cancel_requested ) {
+    _remove_fd_rule( slot );
+    return;
+  }
 
-    ++it; // if we got here, it means we didn't call _fd_rules.erase()
+  if ( ( this_rule.direction == Direction::In && this_rule.fd.eof() ) or this_rule.fd.closed() ) {
+    this_rule.cancel();
+    _remove_fd_rule( slot );
+    return;
   }
 
+  const bool was_interested = this_rule.polled_events != 0;
+  _check_interest( this_rule );
+  if ( was_interested != ( this_rule.polled_events != 0 ) ) {
+    if ( was_interested ) {
+      --_interested_rules;
+      this_rule.pending = false; // not to be served
+    } else {
+      ++_interested_rules;
+    }
+    _mark_changed( this_rule.fd.fd_num() );
+  }
+}
+
+bool EventLoop::_update_interest()
+{
+  // the rules checked at every wait (indexed, as a cancel callback may add rules)
+  erase_if( _uncached_rules, [&]( const RuleRef& ref ) {
+    const FDRule* const rule = _fd_rules.find( ref.slot, ref.generation );
+    return rule == nullptr or rule->interest_cached;
+  } );
+  for ( size_t i = 0; i < _uncached_rules.size(); ++i ) {
+    const RuleRef ref = _uncached_rules[i];
+    if ( _fd_rules.find( ref.slot, ref.generation ) ) {
+      _update_rule( ref.slot );
+    }
+  }
+
+  // the cached ones that may have changed (some perhaps since removed, or their slots reused)
+  for ( size_t i = 0; i < _stale_rules.size(); ++i ) {
+    _update_rule( _stale_rules[i] );
+  }
+  _stale_rules.clear();
+
+  // what each changed fd's rules are now interested in
+  for ( const int fd_num : _changed_registrations ) {
+    Registration& registration = _registrations[fd_num];
+    registration.wanted = 0;
+    for ( const uint32_t slot : registration.rules ) {
+      const FDRule& rule = *_fd_rules.find( slot );
+      registration.wanted |= rule.pending ? 0 : rule.polled_events;
+    }
+  }
+
+  return _interested_rules > 0;
+}
+
+void EventLoop::_collect_ready_fd( const int fd_num, const uint32_t events )
+{
+  if ( static_cast<size_t>( fd_num ) >= _registrations.size() ) {
+    return;
+  }
+
+  _fd_rules_seen = _registrations[fd_num].rules; // copied: the loop below may remove rules
+  for ( const uint32_t slot : _fd_rules_seen ) {
+    auto& this_rule = *_fd_rules.find( slot );
+
+    if ( events & ( POLLERR | POLLNVAL ) ) {
+      _report_fd_error( this_rule );
+      this_rule.error();
+      this_rule.cancel();
+      _remove_fd_rule( slot );
+      continue;
+    }
+
+    const auto polled_events = this_rule.pending ? 0 : this_rule.polled_events; // as in the registration
+    const auto poll_ready = static_cast<bool>( events & polled_events );
+    const auto poll_hup = static_cast<bool>( events & POLLHUP );
+    const auto polled = polled_events != 0;
+    if ( poll_hup && ( ( polled && !poll_ready ) or ( this_rule.direction == Direction::Out ) ) ) {
+      // defunct, as in _wait_poll
+      this_rule.cancel();
+      _remove_fd_rule( slot );
+      continue;
+    }
+
+    if ( poll_ready ) {
+      _add_pending( slot );
+    }
+  }
+}
+
+EventLoop::Result EventLoop::_wait_epoll( const chrono::microseconds timeout, const size_t budget )
+{
+  // quit if there is nothing left to poll
+  if ( not _update_interest() ) {
+    return Result::Exit;
+  }
+
+  // tell the kernel only about the fds whose interest changed (an uninterested fd stays registered for errors)
+  for ( const int fd_num : _changed_registrations ) {
+    auto& registration = _registrations[fd_num];
+    registration.changed = false;
+    if ( registration.rules.empty() or ( registration.added and registration.events == registration.wanted ) ) {
+      continue;
+    }
+    epoll_event event { .events = registration.wanted, .data = { .fd = fd_num } };
+    if ( not registration.added
+         or ( ::epoll_ctl( _epoll->fd_num(), EPOLL_CTL_MOD, fd_num, &event ) == -1 and errno == ENOENT ) ) {
+      // new, or the fd number was closed and reused since it was added
+      CheckSystemCall( "epoll_ctl", ::epoll_ctl( _epoll->fd_num(), EPOLL_CTL_ADD, fd_num, &event ) );
+      registration.added = true;
+    }
+    registration.events = registration.wanted;
+  }
+  _changed_registrations.clear();
+
+  // wait until one of the fds satisfies one of the rules (writeable/readable)
+  const timespec timeout_ts = to_timespec( timeout );
+  const int ready_count = CheckSystemCall(
+    "epoll_pwait2",
+    ::epoll_pwait2( _epoll->fd_num(),
+                    _epoll_events.data(),
+                    static_cast<int>( _epoll_events.size() ),
+                    timeout.count() < 0 ? nullptr : &timeout_ts,
+                    nullptr ) );
+  if ( ready_count == 0 and not _any_pending() ) {
+    ++_wakeups.timeouts;
+    return Result::Timeout;
+  }
+  ++_wakeups.wakeups;
+
+  // go through the rules of the ready fds only
+  if ( static_cast<size_t>( ready_count ) == _epoll_events.size() ) {
+    _epoll_events.resize( 2 * _epoll_events.size() ); // any others are reported next time (level-triggered)
+  }
+  for ( size_t i = 0; i < static_cast<size_t>( ready_count ); ++i ) {
+    _collect_ready_fd( _epoll_events[i].data.fd, _epoll_events[i].events );
+  }
+
+  if ( _serve_ready_rules( budget ) == 0 ) {
+    ++_wakeups.empty_wakeups;
+  }
+  return Result::Success;
+}
+
+EventLoop::Result EventLoop::_wait_io_uring( const chrono::microseconds timeout, const size_t budget )
+{
+  // quit if there is nothing left to poll and no I/O in flight
+  if ( not _update_interest() and not _io_uring->busy() ) {
+    return Result::Exit;
+  }
+
+  // a poll is one-shot, so (re)arm one for each fd whose last poll completed or whose interest changed
+  for ( const int fd_num : _changed_registrations ) {
+    auto& registration = _registrations[fd_num];
+    registration.changed = false;
+    if ( registration.rules.empty() or ( registration.added and registration.events == registration.wanted ) ) {
+      continue;
+    }
+    if ( registration.added ) {
+      _io_uring->cancel_poll( registration.poll_tag );
+    }
+    registration.poll_tag = _io_uring->poll( fd_num, registration.wanted );
+    registration.added = true;
+    registration.events = registration.wanted;
+  }
+  _changed_registrations.clear();
+
+  // submit them (and any reads and writes queued since the last wait) and wait for completions, whose
+  // callbacks run now
+  const size_t completed = _io_uring->wait( timeout );
+  if ( completed == 0 and not _any_pending() ) {
+    ++_wakeups.timeouts;
+    return Result::Timeout;
+  }
+  ++_wakeups.wakeups;
+
+  // go through the rules of the ready fds only
+  _ready_polls.swap( _io_uring->ready_polls() );
+  _io_uring->ready_polls().clear();
+  for ( const auto& ready : _ready_polls ) {
+    const auto fd_num = static_cast<size_t>( ready.fd );
+    if ( fd_num < _registrations.size() and _registrations[fd_num].poll_tag == ready.tag ) {
+      _registrations[fd_num].added = false;
+      _mark_changed( ready.fd );
+    }
+  }
+  for ( const auto& [tag, fd_num, events] : _ready_polls ) {
+    _collect_ready_fd( fd_num, events < 0 ? POLLERR : static_cast<uint32_t>( events ) );
+  }
+
+  if ( _serve_ready_rules( budget ) == 0 and completed == _ready_polls.size() ) { // no I/O completed either
+    ++_wakeups.empty_wakeups;
+  }
   return Result::Success;
 }
 // NOLINTEND(*-signed-bitwise)
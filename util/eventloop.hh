@@ -1,11 +1,21 @@
 #pragma once
 
-#include <functional>
-#include <list>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <deque>
 #include <memory>
+#include <optional>
+#include <ostream>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <vector>
 
 #include "file_descriptor.hh"
+#include "inplace_function.hh"
+#include "io_uring.hh"
 
 //! Waits for events on file descriptors and executes corresponding callbacks.
 class EventLoop
@@ -18,13 +28,55 @@ public:
     Out // Callback will be triggered when Rule::fd is writable.
   };
 
+  //! \brief How urgently the rules of a category are served
+  //! \details When more rules are ready than the callback budget allows (see set_callback_budget()), the rules
+  //! with higher priority are served first; the others are kept for a later call to wait_next_event (in order
+  //! of readiness within each priority), but a rule kept STARVATION_WAITS waits is served ahead of every
+  //! priority, so each class has bounded latency.
+  enum class Priority : uint8_t
+  {
+    High,
+    Normal,
+    Low
+  };
+
+  //! Waits a ready rule can be kept for before it is served ahead of every priority
+  static constexpr uint32_t STARVATION_WAITS = 4;
+
+  //! What the loop has measured about the rules of one category
+  struct CategoryProfile
+  {
+    static constexpr size_t HISTOGRAM_BUCKETS = 24;
+
+    uint64_t callbacks {};                  //!< number of callbacks run
+    uint64_t interest_checks {};            //!< number of calls to the rules' interest functions
+    std::chrono::nanoseconds total_time {}; //!< time spent in the callbacks
+    std::chrono::nanoseconds max_time {};   //!< time spent in the longest callback
+    //! Callback durations: bucket 0 counts those under 1 us, and bucket i those from 2^(i-1) us to under 2^i us
+    //! (the last bucket also counts everything longer)
+    std::array<uint64_t, HISTOGRAM_BUCKETS> histogram {};
+
+    void record( std::chrono::nanoseconds duration );
+  };
+
+  //! What the loop has measured about its waits
+  struct WakeupProfile
+  {
+    uint64_t wakeups {};       //!< waits that returned with an fd or completion ready
+    uint64_t empty_wakeups {}; //!< wakeups that ran no callback (e.g. only a hangup or a stale readiness)
+    uint64_t timeouts {};      //!< waits that timed out
+  };
+
 private:
-  using CallbackT = std::function<void( void )>;
-  using InterestT = std::function<bool( void )>;
+  //! Held in place in their rules, so adding a rule or serving an event doesn't allocate
+  using CallbackT = InplaceFunction<void( void )>;
+  using InterestT = InplaceFunction<bool( void )>;
 
   struct RuleCategory
   {
     std::string name;
+    Priority priority;
+    CategoryProfile profile {};
   };
 
   struct BasicRule
@@ -43,6 +95,11 @@ private:
     Direction direction; //!< Direction::In for reading from fd, Direction::Out for writing to fd.
     CallbackT cancel;    //!< A callback that is called when the rule is cancelled (e.g. on EOF or hangup)
     CallbackT error;     //!< A callback that is called when the fd has an error before cancellation
+    uint32_t polled_events {}; //!< The events the rule is interested in (0 if none), as last checked
+    bool interest_cached {};   //!< see RuleHandle::cache_interest()
+    bool interest_stale { true }; //!< whether a cached interest needs checking before the next wait
+    bool pending {};              //!< whether the rule was found ready and is kept in _pending_rules
+    uint64_t ready_since {};      //!< the wait in which a pending rule was found ready
 
     FDRule( BasicRule&& base, FileDescriptor&& s_fd, Direction s_direction, CallbackT s_cancel, CallbackT s_error );
 
@@ -51,12 +108,156 @@ private:
     unsigned int service_count() const;
   };
 
+  struct TimerRule : public BasicRule
+  {
+    std::chrono::microseconds period; //!< zero for a one-shot timer
+
+    TimerRule( BasicRule&& base, std::chrono::microseconds s_period );
+  };
+
+  //! \brief Rules of one kind, in slots numbered from 0
+  //! \details The slots are kept in blocks that never move, so a rule stays put while its callback runs,
+  //! even if the callback adds rules. Each slot has a generation that changes when its rule is removed, so
+  //! a RuleHandle to a removed rule cannot reach the next rule in the same slot.
+  template<class RuleT>
+  class RuleTable
+  {
+    static constexpr uint32_t SLOTS_PER_BLOCK = 64;
+
+    struct Slot
+    {
+      uint32_t generation {};
+      std::optional<RuleT> rule {};
+    };
+
+    std::vector<std::unique_ptr<std::array<Slot, SLOTS_PER_BLOCK>>> _blocks {};
+    std::vector<uint32_t> _free {}; //!< empty slots below size()
+    uint32_t _size {};
+
+    Slot& _slot( uint32_t index ) { return ( *_blocks[index / SLOTS_PER_BLOCK] )[index % SLOTS_PER_BLOCK]; }
+
+  public:
+    //! One more than the highest slot that has held a rule
+    uint32_t size() const { return _size; }
+
+    bool empty() const { return _free.size() == _size; }
+
+    //! Put a new rule in an empty slot
+    //! \returns the slot
+    template<typename... Targs>
+    uint32_t add( Targs&&... Fargs )
+    {
+      uint32_t index = _size;
+      if ( not _free.empty() ) {
+        index = _free.back();
+        _free.pop_back();
+      } else {
+        if ( _size % SLOTS_PER_BLOCK == 0 ) {
+          _blocks.push_back( std::make_unique<std::array<Slot, SLOTS_PER_BLOCK>>() );
+        }
+        ++_size;
+      }
+      _slot( index ).rule.emplace( std::forward<Targs>( Fargs )... );
+      return index;
+    }
+
+    //! Empty a slot that holds a rule
+    void remove( uint32_t index )
+    {
+      Slot& slot = _slot( index );
+      slot.rule.reset();
+      ++slot.generation;
+      _free.push_back( index );
+    }
+
+    uint32_t generation( uint32_t index ) { return _slot( index ).generation; }
+
+    //! The rule in a slot (nullptr if the slot is empty)
+    RuleT* find( uint32_t index )
+    {
+      auto& rule = _slot( index ).rule;
+      return rule.has_value() ? &rule.value() : nullptr;
+    }
+
+    //! The rule in a slot, if the slot has the given generation
+    RuleT* find( uint32_t index, uint32_t generation )
+    {
+      return index < _size and _slot( index ).generation == generation ? find( index ) : nullptr;
+    }
+  };
+
+  //! \brief Shared with the loop's RuleHandles, which do nothing once it is gone
+  //! \details Renewed when the loop is moved (on both sides), as the rules no longer live where the handles
+  //! made before the move refer to them.
+  class Liveness
+  {
+    std::shared_ptr<bool> token_ { std::make_shared<bool>() };
+
+  public:
+    std::weak_ptr<const bool> watch() const { return token_; }
+
+    Liveness() = default;
+    Liveness( Liveness&& other ) { other.token_ = std::make_shared<bool>(); }
+    Liveness& operator=( Liveness&& other )
+    {
+      token_ = std::make_shared<bool>();
+      other.token_ = std::make_shared<bool>();
+      return *this;
+    }
+    Liveness( const Liveness& other ) = delete;
+    Liveness& operator=( const Liveness& other ) = delete;
+    ~Liveness() = default;
+  };
+
+  //! When a timer is next due
+  struct TimerDeadline
+  {
+    std::chrono::steady_clock::time_point deadline;
+    uint32_t slot; //!< in _timers (which keeps the rule until its deadline leaves the heap)
+  };
+
   std::vector<RuleCategory> _rule_categories {};
-  std::list<std::shared_ptr<FDRule>> _fd_rules {};
-  std::list<std::shared_ptr<BasicRule>> _non_fd_rules {};
+  RuleTable<FDRule> _fd_rules {};
+  RuleTable<BasicRule> _non_fd_rules {};
+  RuleTable<TimerRule> _timers {};
+  Liveness _liveness {};
+
+  //! The timers' deadlines, as a min-heap (a cancelled timer is removed when its deadline reaches the top)
+  std::vector<TimerDeadline> _timer_deadlines {};
 
 public:
-  EventLoop() { _rule_categories.reserve( 64 ); }
+  //! How wait_next_event waits for the file descriptors
+  enum class Backend : uint8_t
+  {
+    Poll,   //!< [ppoll(2)](\ref man2::poll) on every interested fd, rebuilt on each call
+    Epoll,  //!< one [epoll(7)](\ref man7::epoll) set, changed only when a rule's interest changes; the kernel's
+            //!< work and the scan of the results are then proportional to the number of ready fds
+    IoUring //!< an [io_uring(7)](\ref man7::io_uring) (see ::IoUring): one-shot polls for the fds, submitted
+            //!< in the same system call that waits, along with the fds' asynchronous reads and writes (see
+            //!< FileDescriptor::async_read); becomes Epoll if the kernel cannot run an io_uring
+  };
+
+  explicit EventLoop( Backend backend = Backend::Poll );
+
+  //! The backend in use (which may differ from the one requested; see Backend::IoUring)
+  Backend backend() const { return _backend; }
+
+  //! The io_uring of an EventLoop with Backend::IoUring (otherwise nullptr)
+  ::IoUring* io_uring() { return _io_uring.get(); }
+
+  //! \name
+  //! Profiling: the loop counts every callback and interest check, and times every callback
+
+  //!@{
+  const CategoryProfile& profile( size_t category_id ) const { return _rule_categories.at( category_id ).profile; }
+  const WakeupProfile& wakeup_profile() const { return _wakeups; }
+
+  //! Write the profile of each category, and of the waits, to `out`
+  void print_profile( std::ostream& out ) const;
+
+  //! Make `signal` ask every EventLoop in the process to print its profile to stderr at its next wait
+  static void print_profiles_on_signal( int signal = SIGUSR1 );
+  //!@}
 
   //! Returned by each call to EventLoop::wait_next_event.
   enum class Result : uint8_t
@@ -67,34 +268,95 @@ public:
              //!< EventLoop::wait_next_event.
   };
 
-  size_t add_category( const std::string& name );
+  size_t add_category( const std::string& name, Priority priority = Priority::Normal );
 
+  //! The id of the category with this name, adding it (with `priority`) if there is none yet (so that the
+  //! rules of many objects served by one loop can share a handful of categories)
+  size_t category( const std::string& name, Priority priority = Priority::Normal );
+
+  //! Let each call to wait_next_event run up to `budget` rules' callbacks (by default one): the non-fd rules
+  //! that are interested, then the fd rules that are ready, each at most once, in order of priority
+  void set_callback_budget( size_t budget );
+
+  //! \brief Refers to a rule (by its slot and the slot's generation), to cancel it
+  //! \details A handle may outlive its rule and its EventLoop: once the rule is removed, or the loop is
+  //! destroyed or moved, its methods do nothing. So an object whose rules run on a loop it does not own can
+  //! cancel them when it is destroyed, whichever goes first.
   class RuleHandle
   {
-    std::weak_ptr<BasicRule> rule_weak_ptr_;
+    friend class EventLoop;
 
-  public:
-    template<class RuleType>
-    explicit RuleHandle( const std::shared_ptr<RuleType>& x ) : rule_weak_ptr_( x )
+    enum class Kind : uint8_t
+    {
+      FD,
+      NonFD,
+      Timer
+    };
+
+    EventLoop* loop_;
+    std::weak_ptr<const bool> loop_alive_; //!< expired once loop_ is destroyed or moved
+    Kind kind_;
+    uint32_t slot_;
+    uint32_t generation_;
+
+    RuleHandle( EventLoop* loop, Kind kind, uint32_t slot, uint32_t generation )
+      : loop_( loop )
+      , loop_alive_( loop->_liveness.watch() )
+      , kind_( kind )
+      , slot_( slot )
+      , generation_( generation )
     {}
 
+    //! The loop, if it is still there
+    EventLoop* _loop() const { return loop_alive_.expired() ? nullptr : loop_; }
+
+  public:
+    //! Remove the rule before the next wait (without calling its cancel callback)
     void cancel();
+
+    //! \brief Check the rule's interest only when it may have changed, rather than before every wait
+    //! \details For an fd rule whose interest depends only on what its own callback does, or on state whose
+    //! changes are reported with interest_changed(). The loop then calls the interest function (and notices
+    //! that the fd reached EOF or was closed) only after the rule's callback runs, after interest_changed() and
+    //! after cancel(), so a wakeup costs nothing for the rules that neither changed nor became ready. No effect
+    //! on other kinds of rule.
+    void cache_interest();
+
+    //! Something the rule's (cached) interest depends on has changed: check it before the next wait
+    void interest_changed();
+
+    RuleHandle( const RuleHandle& other ) = default;
+    RuleHandle( RuleHandle&& other ) = default;
+    RuleHandle& operator=( const RuleHandle& other ) = default;
+    RuleHandle& operator=( RuleHandle&& other ) = default;
+    ~RuleHandle() = default;
   };
 
   RuleHandle add_rule(
     size_t category_id,
     FileDescriptor& fd,
     Direction direction,
-    const CallbackT& callback,
-    const InterestT& interest = [] { return true; },
-    const CallbackT& cancel = [] {},
-    const CallbackT& error = [] {} );
+    CallbackT callback,
+    InterestT interest = [] { return true; },
+    CallbackT cancel = [] {},
+    CallbackT error = [] {} );
+
+  RuleHandle add_rule( size_t category_id, CallbackT callback, InterestT interest = [] { return true; } );
+
+  //! Add a timer: its callback runs once `delay` has passed, and then (with a nonzero `period`) every `period`
+  //! until it is cancelled. The loop sleeps no longer than the earliest timer, and a pending timer keeps
+  //! wait_next_event from returning Exit.
+  RuleHandle add_timer( size_t category_id,
+                        std::chrono::microseconds delay,
+                        CallbackT callback,
+                        std::chrono::microseconds period = std::chrono::microseconds { 0 } );
 
-  RuleHandle
-  add_rule( size_t category_id, const CallbackT& callback, const InterestT& interest = [] { return true; } );
+  //! Calls [ppoll(2)](\ref man2::poll) (or waits on the epoll set) and then executes callback for each ready fd.
+  //! A negative timeout waits indefinitely.
+  Result wait_next_event( std::chrono::microseconds timeout );
 
-  //! Calls [poll(2)](\ref man2::poll) and then executes callback for each ready fd.
-  Result wait_next_event( int timeout_ms );
+  //! The same, with the timeout in milliseconds (as for [poll(2)](\ref man2::poll)).
+  Result wait_next_event( int timeout_ms ) { return wait_next_event( std::chrono::milliseconds { timeout_ms } ); }
 
   // convenience function to add category and rule at the same time
   template<typename... Targs>
@@ -102,6 +364,137 @@ public:
   {
     return add_rule( add_category( name ), std::forward<Targs>( Fargs )... );
   }
+
+private:
+  //! One fd watched by the epoll set or the io_uring, and the rules that watch it
+  struct Registration
+  {
+    bool added {};        //!< whether the fd is in the epoll set, or has a poll in the io_uring
+    uint32_t events {};   //!< as added
+    uint32_t wanted {};   //!< as the rules' interest requires in the current wait
+    uint64_t poll_tag {}; //!< the io_uring poll, if added
+    bool changed {};      //!< whether the fd is in _changed_registrations
+    std::vector<uint32_t> rules {}; //!< slots in _fd_rules (none if the fd is not watched)
+  };
+
+  //! A rule, by slot and generation (so a rule that has been removed is recognized)
+  struct RuleRef
+  {
+    uint32_t slot;
+    uint32_t generation;
+  };
+
+  Backend _backend;
+  std::optional<FileDescriptor> _epoll {};
+  std::unique_ptr<::IoUring> _io_uring {};
+  std::vector<Registration> _registrations {}; //!< by fd number, with Backend::Epoll or Backend::IoUring
+  std::vector<epoll_event> _epoll_events {};
+
+  //! \name
+  //! What needs checking before the next wait, with Backend::Epoll or Backend::IoUring
+
+  //!@{
+  std::vector<RuleRef> _uncached_rules {}; //!< the fd rules whose interest is checked before every wait
+  std::vector<uint32_t> _stale_rules {};   //!< the fd rules whose cached interest is stale
+  std::vector<int> _changed_registrations {}; //!< the fds whose rules or rules' interest changed
+  size_t _interested_rules {};                //!< the fd rules with nonzero polled_events
+  //!@}
+
+  //! \name
+  //! Reused from one wait to the next, so a wait doesn't allocate
+
+  //!@{
+  std::vector<pollfd> _pollfds {};                 //!< with Backend::Poll
+  std::vector<uint32_t> _polled_rules {};          //!< the slot of each pollfd's rule, with Backend::Poll
+  std::vector<uint32_t> _fd_rules_seen {};         //!< the rules of the fd being looked at
+  std::vector<uint32_t> _served_rules {};          //!< the fd rules served in this wait
+  std::vector<IoUring::PollResult> _ready_polls {}; //!< with Backend::IoUring
+  //!@}
+
+  //! The fd rules found ready but not yet served, by priority and in order of readiness; they are left out of
+  //! the polled events until served, so a wait reports only the fds that became ready since
+  std::array<std::deque<RuleRef>, 3> _pending_rules {};
+  uint64_t _waits {}; //!< backend waits so far, to tell how long a pending rule has been kept
+
+  size_t _callback_budget { 1 };
+
+  WakeupProfile _wakeups {};
+  unsigned _profile_requests_seen { profile_requests() }; //!< the value of profile_requests() at the last print
+
+  //! Incremented by the signal handler of print_profiles_on_signal()
+  static std::atomic<unsigned>& profile_requests();
+
+  //! Run the timers that are due
+  //! \returns whether any ran
+  bool _run_timers();
+
+  //! Time until the earliest timer is due (negative if there is no timer)
+  std::chrono::microseconds _timer_timeout();
+
+  //! Call a rule's interest function, counting the call
+  bool _interested( const BasicRule& rule );
+
+  //! Bring an fd rule's polled_events up to date (calling its interest function unless the cached answer is
+  //! current)
+  void _check_interest( FDRule& rule );
+
+  //! Have an fd rule's cached interest checked before the next wait
+  void _mark_stale( uint32_t slot );
+
+  //! Have an fd's registration brought up to date before the next wait
+  void _mark_changed( int fd_num );
+
+  //! Call a rule's callback, timing it
+  void _run( const BasicRule& rule );
+
+  //! \name
+  //! The second half of wait_next_event, for each backend
+
+  //!@{
+  Result _wait_poll( std::chrono::microseconds timeout, size_t budget );
+  Result _wait_epoll( std::chrono::microseconds timeout, size_t budget );
+  Result _wait_io_uring( std::chrono::microseconds timeout, size_t budget );
+  //!@}
+
+  //! Run the callbacks of the interested non-fd rules, in order of priority
+  //! \returns how many rules ran
+  size_t _serve_non_fd_rules();
+
+  //! Check the rules whose interest is uncached or stale, removing finished rules, and bring the `wanted` of
+  //! the registrations that changed up to date
+  //! \returns whether any rule is interested
+  bool _update_interest();
+
+  //! Check one rule for _update_interest
+  void _update_rule( uint32_t slot );
+
+  //! Cancel the rules of an fd that has an error or has hung up, and add those that are ready with `events`
+  //! (as for poll(2)) to _pending_rules
+  void _collect_ready_fd( int fd_num, uint32_t events );
+
+  //! Keep a ready fd rule in _pending_rules until it is served
+  void _add_pending( uint32_t slot );
+
+  //! Take the next rule to serve from _pending_rules: the first kept STARVATION_WAITS waits, by priority, or
+  //! else the first of the highest priority
+  std::optional<uint32_t> _take_pending();
+
+  //! Whether any rule is kept in _pending_rules (perhaps one since removed)
+  bool _any_pending() const;
+
+  //! Run the callbacks of up to `budget` of _pending_rules, in the order of _take_pending; a rule kept from an
+  //! earlier wait is first checked to be still ready
+  //! \returns how many ran
+  size_t _serve_ready_rules( size_t budget );
+
+  //! The rule a handle refers to (nullptr if it has been removed)
+  BasicRule* _find( const RuleHandle& handle );
+
+  //! Remove an fd rule, and remove it from its fd's registration
+  void _remove_fd_rule( uint32_t slot );
+
+  //! Log the error behind POLLERR or EPOLLERR on a rule's fd
+  void _report_fd_error( const FDRule& rule ) const;
 };
 
 using Direction = EventLoop::Direction;
@@ -2,6 +2,8 @@
 
 #include "tcp_config.hh"
 
+#include <chrono>
+
 //! \brief Basic functionality for file descriptor adaptors
 //! \details See TCPOverIPv4OverTunFdAdapter for more information.
 class FdAdapterBase
@@ -31,5 +33,5 @@ public:
   FdAdapterConfig& config_mut() { return _cfg; }
 
   //! Called periodically when time elapses
-  void tick( const size_t unused [[maybe_unused]] ) {}
+  void tick( const std::chrono::microseconds unused [[maybe_unused]] ) {}
 };
@@ -1,5 +1,6 @@
 #include "file_descriptor.hh"
 
+#include "eventloop.hh"
 #include "exception.hh"
 
 #include <fcntl.h>
@@ -8,6 +9,7 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
+#include <utility>
 
 using namespace std;
 
@@ -202,3 +204,118 @@ void FileDescriptor::set_blocking( bool blocking )
 
   internal_fd_->non_blocking_ = not blocking;
 }
+
+namespace {
+// An io_uring result (bytes, or -errno) as the system call would have returned it
+ssize_t as_system_call( int32_t result )
+{
+  if ( result < 0 ) {
+    errno = -result;
+    return -1;
+  }
+  return result;
+}
+} // namespace
+
+void FileDescriptor::async_read( EventLoop& loop, function<void( string& )> done )
+{
+  if ( IoUring* const ring = loop.io_uring() ) {
+    ring->read( fd_num(), kReadBufferSize, [wrapper = internal_fd_, done]( int32_t result, string_view data ) {
+      wrapper->CheckRead( "read", as_system_call( result ) );
+      ++wrapper->read_count_;
+      string buffer { data };
+      done( buffer );
+    } );
+    return;
+  }
+
+  const auto fd = make_shared<FileDescriptor>( duplicate() );
+  const auto finish = make_shared<function<void( string& )>>( move( done ) ); // emptied once called
+  const auto rule = make_shared<optional<EventLoop::RuleHandle>>();
+  *rule = loop.add_rule(
+    loop.category( "asynchronous read" ),
+    *this,
+    EventLoop::Direction::In,
+    [fd, finish, rule] {
+      string buffer;
+      fd->read( buffer );
+      rule->value().cancel();
+      exchange( *finish, {} )( buffer );
+    },
+    [] { return true; },
+    [finish] {
+      if ( *finish ) {
+        string buffer;
+        exchange( *finish, {} )( buffer );
+      }
+    } );
+  rule->value().cache_interest(); // only its own callback changes what it waits for
+}
+
+void FileDescriptor::async_write( EventLoop& loop, string buffer, function<void( size_t )> done )
+{
+  if ( IoUring* const ring = loop.io_uring() ) {
+    ring->write(
+      fd_num(), move( buffer ), [wrapper = internal_fd_, done]( int32_t result, string_view /*unused*/ ) {
+        const size_t bytes_written = wrapper->CheckFDSystemCall( "write", as_system_call( result ) );
+        ++wrapper->write_count_;
+        done( bytes_written );
+      } );
+    return;
+  }
+
+  const auto fd = make_shared<FileDescriptor>( duplicate() );
+  const auto finish = make_shared<function<void( size_t )>>( move( done ) ); // emptied once called
+  const auto rule = make_shared<optional<EventLoop::RuleHandle>>();
+  *rule = loop.add_rule(
+    loop.category( "asynchronous write" ),
+    *this,
+    EventLoop::Direction::Out,
+    [fd, finish, rule, buffer = move( buffer )] {
+      const size_t bytes_written = buffer.empty() ? 0 : fd->write( buffer );
+      rule->value().cancel();
+      exchange( *finish, {} )( bytes_written );
+    },
+    [] { return true; },
+    [finish] {
+      if ( *finish ) {
+        exchange( *finish, {} )( 0 );
+      }
+    } );
+  rule->value().cache_interest();
+}
+
+void FileDescriptor::async_receive( EventLoop& loop, function<bool( string_view )> on_datagram )
+{
+  if ( IoUring* const ring = loop.io_uring() ) {
+    ring->receive( fd_num(), [wrapper = internal_fd_, on_datagram]( int32_t result, string_view data ) {
+      wrapper->CheckRead( "recv", as_system_call( result ) );
+      ++wrapper->read_count_;
+      return on_datagram( data );
+    } );
+    return;
+  }
+
+  const auto fd = make_shared<FileDescriptor>( duplicate() );
+  const auto receive = make_shared<function<bool( string_view )>>( move( on_datagram ) ); // emptied once done
+  const auto rule = make_shared<optional<EventLoop::RuleHandle>>();
+  *rule = loop.add_rule(
+    loop.category( "asynchronous receive" ),
+    *this,
+    EventLoop::Direction::In,
+    [fd, receive, rule] {
+      string buffer;
+      fd->read( buffer );
+      if ( not( *receive )( buffer ) or buffer.empty() ) {
+        *receive = {};
+        rule->value().cancel();
+      }
+    },
+    [receive] { return static_cast<bool>( *receive ); },
+    [receive] {
+      if ( *receive ) {
+        exchange( *receive, {} )( {} );
+      }
+    } );
+  rule->value().cache_interest();
+}
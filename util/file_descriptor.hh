@@ -4,9 +4,14 @@
 
 #include <bits/types/struct_iovec.h>
 #include <cstddef>
+#include <functional>
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
+class EventLoop;
+
 // A reference-counted handle to a file descriptor
 class FileDescriptor
 {
@@ -30,6 +35,16 @@ public:
     return write( iovecs, total_size );
   }
 
+  // Asynchronous counterparts of read() and write(): each starts now and completes (calling `done`) in a later
+  // EventLoop::wait_next_event of `loop`: through its io_uring with EventLoop::Backend::IoUring, and otherwise
+  // from a rule that does the I/O once the fd is ready. An empty buffer means EOF (or that the fd closed first).
+  void async_read( EventLoop& loop, std::function<void( std::string& )> done );
+  void async_write( EventLoop& loop, std::string buffer, std::function<void( size_t )> done );
+
+  // Read datagrams, one per read, until `on_datagram` returns false or the fd reaches EOF (reported as an empty
+  // datagram). With an io_uring this is a single multishot receive into buffers provided to the kernel.
+  void async_receive( EventLoop& loop, std::function<bool( std::string_view )> on_datagram );
+
   // Close the underlying file descriptor
   void close() { internal_fd_->close(); }
 
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template<typename Signature, size_t Capacity = 48>
+class InplaceFunction;
+
+//! \brief A move-only std::function that keeps its callable inside itself
+//! \details A callable of up to `Capacity` bytes (e.g. a lambda capturing a few references, pointers or
+//! shared_ptrs, or a std::function) is stored in place, so wrapping, moving and calling it never allocate,
+//! and a call is one indirect jump. A larger callable is moved to the heap, as std::function would.
+template<typename R, typename... Args, size_t Capacity>
+class InplaceFunction<R( Args... ), Capacity>
+{
+public:
+  InplaceFunction() = default;
+
+  template<typename F>
+    requires( not std::is_same_v<std::remove_cvref_t<F>, InplaceFunction> )
+            and std::is_invocable_r_v<R, std::decay_t<F>&, Args...>
+  InplaceFunction( F&& f ) // NOLINT(*-explicit-*)
+  {
+    using T = std::decay_t<F>;
+    if constexpr ( fits_in_place<T> ) {
+      new ( storage_.data() ) T( std::forward<F>( f ) );
+      invoke_ = []( void* callable, Args&&... args ) -> R {
+        return std::invoke( *static_cast<T*>( callable ), std::forward<Args>( args )... );
+      };
+      manage_ = []( void* destination, void* source ) {
+        if ( destination ) {
+          new ( destination ) T( std::move( *static_cast<T*>( source ) ) );
+        }
+        static_cast<T*>( source )->~T();
+      };
+    } else {
+      new ( storage_.data() ) T*( new T( std::forward<F>( f ) ) );
+      invoke_ = []( void* callable, Args&&... args ) -> R {
+        return std::invoke( **static_cast<T**>( callable ), std::forward<Args>( args )... );
+      };
+      manage_ = []( void* destination, void* source ) {
+        if ( destination ) {
+          new ( destination ) T*( *static_cast<T**>( source ) );
+        } else {
+          delete *static_cast<T**>( source ); // NOLINT(*-owning-memory)
+        }
+      };
+    }
+  }
+
+  InplaceFunction( InplaceFunction&& other ) noexcept { take( other ); }
+
+  InplaceFunction& operator=( InplaceFunction&& other ) noexcept
+  {
+    if ( this != &other ) {
+      reset();
+      take( other );
+    }
+    return *this;
+  }
+
+  InplaceFunction( const InplaceFunction& other ) = delete;
+  InplaceFunction& operator=( const InplaceFunction& other ) = delete;
+
+  ~InplaceFunction() { reset(); }
+
+  R operator()( Args... args ) const
+  {
+    if ( not invoke_ ) {
+      throw std::bad_function_call();
+    }
+    return invoke_( const_cast<std::byte*>( storage_.data() ), std::forward<Args>( args )... ); // NOLINT
+  }
+
+  explicit operator bool() const { return invoke_ != nullptr; }
+
+private:
+  template<typename T>
+  static constexpr bool fits_in_place = sizeof( T ) <= Capacity and alignof( T ) <= alignof( std::max_align_t )
+                                        and std::is_nothrow_move_constructible_v<T>;
+
+  alignas( std::max_align_t ) std::array<std::byte, Capacity> storage_ {};
+  R ( *invoke_ )( void* callable, Args&&... args ) = nullptr;
+  void ( *manage_ )( void* destination, void* source ) = nullptr; //!< move (if destination), then destroy source
+
+  void reset()
+  {
+    if ( manage_ ) {
+      manage_( nullptr, storage_.data() );
+    }
+    invoke_ = nullptr;
+    manage_ = nullptr;
+  }
+
+  void take( InplaceFunction& other )
+  {
+    if ( other.manage_ ) {
+      other.manage_( storage_.data(), other.storage_.data() );
+    }
+    invoke_ = std::exchange( other.invoke_, nullptr );
+    manage_ = std::exchange( other.manage_, nullptr );
+  }
+};
@@ -0,0 +1,432 @@
+#include "io_uring.hh"
+#include "exception.hh"
+
+#include <atomic>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+constexpr uint16_t BUFFER_GROUP = 0;      // the group of the buffers provided for receives
+constexpr uint64_t CURRENT_POSITION = -1; // offset for reads and writes at the file's position (or a stream's)
+
+int setup( unsigned entries, io_uring_params& params )
+{
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = 4 * entries; // room for the bursts of completions that multishot receives produce
+  return static_cast<int>( ::syscall( __NR_io_uring_setup, entries, &params ) );
+}
+
+uint64_t address( const void* pointer )
+{
+  return reinterpret_cast<uint64_t>( pointer ); // NOLINT(*-reinterpret-cast)
+}
+
+uint32_t load_acquire( uint32_t* x )
+{
+  return atomic_ref { *x }.load( memory_order_acquire );
+}
+
+void store_release( uint32_t* x, uint32_t value )
+{
+  atomic_ref { *x }.store( value, memory_order_release );
+}
+} // namespace
+
+bool IoUring::supported()
+{
+  static const bool ret = [] {
+    io_uring_params params {};
+    const int fd = setup( 1, params );
+    if ( fd < 0 ) {
+      return false; // e.g. ENOSYS, or EPERM where io_uring is disabled
+    }
+    ::close( fd );
+    return ( params.features & IORING_FEAT_EXT_ARG ) and ( params.features & IORING_FEAT_NODROP );
+  }();
+  return ret;
+}
+
+IoUring::Mapping::Mapping( const FileDescriptor& fd, size_t length, uint64_t offset )
+  : address_( ::mmap( nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd.fd_num(), offset ) )
+  , length_( length )
+{
+  if ( address_ == MAP_FAILED ) {
+    throw unix_error( "mmap" );
+  }
+}
+
+IoUring::Mapping::~Mapping()
+{
+  ::munmap( address_, length_ );
+}
+
+IoUring::IoUring( unsigned entries )
+  : fd_( CheckSystemCall( "io_uring_setup", setup( entries, params_ ) ) )
+  , sq_ring_( fd_, params_.sq_off.array + params_.sq_entries * sizeof( uint32_t ), IORING_OFF_SQ_RING )
+  , cq_ring_( fd_, params_.cq_off.cqes + params_.cq_entries * sizeof( io_uring_cqe ), IORING_OFF_CQ_RING )
+  , sqes_( fd_, params_.sq_entries * sizeof( io_uring_sqe ), IORING_OFF_SQES )
+  , fixed_buffers_( FIXED_BUFFER_SIZE * FIXED_BUFFER_COUNT )
+  , provided_buffers_( PROVIDED_BUFFER_SIZE * PROVIDED_BUFFER_COUNT )
+{
+  // each submission entry is always in the same slot of the array
+  uint32_t* const array = sq_ring_.at<uint32_t>( params_.sq_off.array );
+  for ( uint32_t i = 0; i < params_.sq_entries; ++i ) {
+    array[i] = i; // NOLINT(*-pointer-arithmetic)
+  }
+  sq_tail_ = *sq_ring_.at<uint32_t>( params_.sq_off.tail );
+
+  // without the registration (e.g. over RLIMIT_MEMLOCK), every write goes from its own buffer
+  const iovec region { fixed_buffers_.data(), fixed_buffers_.size() };
+  if ( ::syscall( __NR_io_uring_register, fd_.fd_num(), IORING_REGISTER_BUFFERS, &region, 1 ) == 0 ) {
+    for ( size_t i = FIXED_BUFFER_COUNT; i > 0; --i ) {
+      free_fixed_buffers_.push_back( static_cast<int>( i - 1 ) );
+    }
+  }
+
+  provide_buffers( 0, PROVIDED_BUFFER_COUNT );
+}
+
+IoUring::~IoUring()
+{
+  // The kernel may still write into the buffers of unfinished reads and receives, so cancel them and wait
+  // (briefly) for their last completions before the buffers go away.
+  try {
+    for ( const auto& [tag, op] : operations_ ) {
+      cancel( tag );
+    }
+    for ( unsigned attempts = 0; not operations_.empty() and attempts < 100; ++attempts ) {
+      completions_.clear();
+      enter( 1, 10ms );
+      reap();
+      for ( const auto& completion : completions_ ) {
+        if ( not( completion.flags & IORING_CQE_F_MORE ) ) {
+          operations_.erase( completion.tag );
+        }
+      }
+    }
+  } catch ( const exception& e ) {
+    // don't throw an exception from the destructor
+    cerr << "Exception destructing IoUring: " << e.what() << "\n";
+  }
+}
+
+io_uring_sqe& IoUring::next_sqe()
+{
+  if ( sq_tail_ - load_acquire( sq_ring_.at<uint32_t>( params_.sq_off.head ) ) == params_.sq_entries ) {
+    enter( 0, 0us );
+  }
+
+  const uint32_t mask = *sq_ring_.at<uint32_t>( params_.sq_off.ring_mask );
+  io_uring_sqe& sqe = sqes_.at<io_uring_sqe>( 0 )[sq_tail_ & mask]; // NOLINT(*-pointer-arithmetic)
+  sqe = {};
+  ++sq_tail_;
+  return sqe;
+}
+
+void IoUring::enter( uint32_t wait_for, microseconds timeout )
+{
+  store_release( sq_ring_.at<uint32_t>( params_.sq_off.tail ), sq_tail_ );
+  const uint32_t to_submit = sq_tail_ - load_acquire( sq_ring_.at<uint32_t>( params_.sq_off.head ) );
+
+  const auto timeout_s = duration_cast<seconds>( timeout );
+  const __kernel_timespec timeout_ts { .tv_sec = timeout_s.count(),
+                                       .tv_nsec = duration_cast<nanoseconds>( timeout - timeout_s ).count() };
+  io_uring_getevents_arg arg { .sigmask = 0,
+                               .sigmask_sz = _NSIG / 8,
+                               .pad = 0,
+                               .ts = timeout.count() < 0 ? 0 : address( &timeout_ts ) };
+  const uint32_t flags = IORING_ENTER_EXT_ARG | ( wait_for > 0 ? IORING_ENTER_GETEVENTS : 0 );
+
+  if ( ::syscall( __NR_io_uring_enter, fd_.fd_num(), to_submit, wait_for, flags, &arg, sizeof( arg ) ) < 0 ) {
+    if ( errno == ETIME or errno == EINTR or errno == EBUSY ) {
+      return; // timed out, interrupted, or completions are waiting to be reaped first
+    }
+    throw unix_error( "io_uring_enter" );
+  }
+}
+
+void IoUring::reap()
+{
+  uint32_t* const head = cq_ring_.at<uint32_t>( params_.cq_off.head );
+  const uint32_t tail = load_acquire( cq_ring_.at<uint32_t>( params_.cq_off.tail ) );
+  const io_uring_cqe* const cqes = cq_ring_.at<io_uring_cqe>( params_.cq_off.cqes );
+  const uint32_t mask = *cq_ring_.at<uint32_t>( params_.cq_off.ring_mask );
+
+  for ( uint32_t i = *head; i != tail; ++i ) {
+    const io_uring_cqe& cqe = cqes[i & mask]; // NOLINT(*-pointer-arithmetic)
+    completions_.push_back( { .tag = cqe.user_data, .result = cqe.res, .flags = cqe.flags } );
+  }
+  store_release( head, tail );
+}
+
+size_t IoUring::wait( microseconds timeout )
+{
+  // receives that start with unclaimed datagrams have completions already, so don't block for more
+  const size_t delivered = deliver_unclaimed();
+  if ( delivered > 0 ) {
+    timeout = microseconds { 0 };
+  }
+
+  const auto deadline = steady_clock::now() + timeout;
+  microseconds remaining = timeout;
+  while ( true ) {
+    completions_.clear();
+    reap();
+    enter( completions_.empty() and remaining.count() != 0 ? 1 : 0, remaining );
+    reap();
+
+    size_t completed = 0;
+    for ( const auto& completion : completions_ ) {
+      completed += complete( completion );
+    }
+
+    // keep waiting if only entries whose result is ignored (cancellations, provided buffers) completed
+    if ( completed > 0 or timeout.count() == 0 ) {
+      return delivered + completed;
+    }
+    if ( timeout.count() > 0 ) {
+      remaining = duration_cast<microseconds>( deadline - steady_clock::now() );
+      if ( remaining.count() <= 0 ) {
+        return 0;
+      }
+    }
+  }
+}
+
+bool IoUring::complete( const Completion& completion )
+{
+  if ( completion.tag == 0 ) {
+    return false;
+  }
+
+  if ( const auto poll = polls_.find( completion.tag ); poll != polls_.end() ) {
+    ready_polls_.push_back( { .tag = completion.tag, .fd = poll->second, .events = completion.result } );
+    polls_.erase( poll );
+    return true;
+  }
+
+  const auto it = operations_.find( completion.tag );
+  if ( it == operations_.end() ) {
+    return false; // a poll that was cancelled
+  }
+
+  if ( it->second.kind == Operation::Kind::Receive ) {
+    complete_receive( completion.tag, it->second, completion );
+    return true;
+  }
+
+  Operation op = std::move( it->second );
+  operations_.erase( it );
+  if ( op.fixed_buffer >= 0 ) {
+    free_fixed_buffers_.push_back( op.fixed_buffer );
+  }
+  string_view data;
+  if ( op.kind == Operation::Kind::Read and completion.result > 0 ) {
+    data = string_view { op.buffer }.substr( 0, completion.result );
+  }
+  op.done( completion.result, data );
+  return true;
+}
+
+void IoUring::complete_receive( const uint64_t tag, Operation& op, const Completion& completion )
+{
+  const bool more = completion.flags & IORING_CQE_F_MORE;
+
+  if ( op.multishot and ( completion.result == -ENOTSOCK or completion.result == -EINVAL ) ) {
+    // not a socket (e.g. a TUN device), or no multishot recv in this kernel: read one datagram at a time
+    op.multishot = false;
+    arm_receive( tag, op );
+    return;
+  }
+
+  const bool has_buffer = completion.flags & IORING_CQE_F_BUFFER;
+  const uint16_t buffer_id = completion.flags >> IORING_CQE_BUFFER_SHIFT;
+  string_view data;
+  if ( has_buffer ) {
+    data = { provided_buffers_.data() + buffer_id * PROVIDED_BUFFER_SIZE,
+             static_cast<size_t>( max( completion.result, 0 ) ) };
+  }
+
+  bool keep_going = not op.stopping;
+  if ( completion.result == -ENOBUFS or completion.result == -ECANCELED ) {
+    // ENOBUFS: every provided buffer was in use; they are provided again (ahead of the new receive) as they
+    // are consumed
+  } else if ( keep_going ) {
+    keep_going = op.on_datagram( completion.result, data ) and completion.result > 0;
+  } else if ( completion.result > 0 ) {
+    // taken from the socket after the callback asked to stop, so it can't be left there for a later read
+    unclaimed_[op.fd].emplace_back( data );
+  }
+
+  if ( has_buffer ) {
+    provide_buffers( buffer_id, 1 );
+  }
+
+  if ( not keep_going and not op.stopping ) {
+    op.stopping = true;
+    if ( more ) {
+      cancel( tag );
+    }
+  }
+
+  if ( not more ) {
+    if ( op.stopping ) {
+      operations_.erase( tag );
+    } else {
+      arm_receive( tag, op );
+    }
+  }
+}
+
+void IoUring::read( int fd, size_t size, CompletionT done )
+{
+  const uint64_t tag = next_tag_++;
+  Operation& op = operations_
+                    .emplace( tag,
+                              Operation { .kind = Operation::Kind::Read,
+                                          .fd = fd,
+                                          .buffer = string( size, 0 ),
+                                          .done = std::move( done ) } )
+                    .first->second;
+
+  io_uring_sqe& sqe = next_sqe();
+  sqe.opcode = IORING_OP_READ;
+  sqe.fd = fd;
+  sqe.addr = address( op.buffer.data() );
+  sqe.len = op.buffer.size();
+  sqe.off = CURRENT_POSITION;
+  sqe.user_data = tag;
+}
+
+void IoUring::write( int fd, string buffer, CompletionT done )
+{
+  const uint64_t tag = next_tag_++;
+  Operation& op
+    = operations_.emplace( tag, Operation { .kind = Operation::Kind::Write, .fd = fd, .done = std::move( done ) } )
+        .first->second;
+
+  io_uring_sqe& sqe = next_sqe();
+  sqe.fd = fd;
+  sqe.len = buffer.size();
+  sqe.off = CURRENT_POSITION;
+  sqe.user_data = tag;
+  if ( buffer.size() <= FIXED_BUFFER_SIZE and not free_fixed_buffers_.empty() ) {
+    op.fixed_buffer = free_fixed_buffers_.back();
+    free_fixed_buffers_.pop_back();
+    char* const fixed = fixed_buffers_.data() + op.fixed_buffer * FIXED_BUFFER_SIZE;
+    memcpy( fixed, buffer.data(), buffer.size() );
+    sqe.opcode = IORING_OP_WRITE_FIXED;
+    sqe.addr = address( fixed );
+    sqe.buf_index = 0; // the one registered region
+  } else {
+    op.buffer = std::move( buffer );
+    sqe.opcode = IORING_OP_WRITE;
+    sqe.addr = address( op.buffer.data() );
+  }
+}
+
+void IoUring::receive( int fd, ReceiveT on_datagram )
+{
+  const uint64_t tag = next_tag_++;
+  Operation op { .kind = Operation::Kind::Receive, .fd = fd, .on_datagram = std::move( on_datagram ) };
+  Operation& receive = operations_.emplace( tag, std::move( op ) ).first->second;
+  if ( unclaimed_.contains( fd ) ) {
+    redeliveries_.push_back( tag ); // armed once the unclaimed datagrams are delivered
+  } else {
+    arm_receive( tag, receive );
+  }
+}
+
+size_t IoUring::deliver_unclaimed()
+{
+  size_t delivered = 0;
+  for ( const uint64_t tag : exchange( redeliveries_, {} ) ) {
+    Operation& op = operations_.at( tag );
+    const int fd = op.fd;
+    bool keep_going = true;
+    while ( keep_going and unclaimed_.contains( fd ) ) {
+      auto& datagrams = unclaimed_.at( fd );
+      const string datagram = std::move( datagrams.front() );
+      datagrams.pop_front();
+      if ( datagrams.empty() ) {
+        unclaimed_.erase( fd );
+      }
+      keep_going = op.on_datagram( static_cast<int32_t>( datagram.size() ), datagram );
+      ++delivered;
+    }
+
+    if ( keep_going ) {
+      arm_receive( tag, op );
+    } else {
+      operations_.erase( tag );
+    }
+  }
+  return delivered;
+}
+
+void IoUring::arm_receive( const uint64_t tag, const Operation& op )
+{
+  io_uring_sqe& sqe = next_sqe();
+  if ( op.multishot ) {
+    sqe.opcode = IORING_OP_RECV;
+    sqe.ioprio = IORING_RECV_MULTISHOT;
+  } else {
+    sqe.opcode = IORING_OP_READ;
+    sqe.len = PROVIDED_BUFFER_SIZE;
+    sqe.off = CURRENT_POSITION;
+  }
+  sqe.fd = op.fd;
+  sqe.flags = IOSQE_BUFFER_SELECT;
+  sqe.buf_group = BUFFER_GROUP;
+  sqe.user_data = tag;
+}
+
+void IoUring::provide_buffers( uint16_t first, uint16_t count )
+{
+  io_uring_sqe& sqe = next_sqe();
+  sqe.opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe.fd = count;
+  sqe.addr = address( provided_buffers_.data() + first * PROVIDED_BUFFER_SIZE );
+  sqe.len = PROVIDED_BUFFER_SIZE;
+  sqe.off = first;
+  sqe.buf_group = BUFFER_GROUP;
+}
+
+void IoUring::cancel( const uint64_t tag )
+{
+  io_uring_sqe& sqe = next_sqe();
+  sqe.opcode = IORING_OP_ASYNC_CANCEL;
+  sqe.addr = tag;
+}
+
+uint64_t IoUring::poll( int fd, uint32_t events )
+{
+  const uint64_t tag = next_tag_++;
+  polls_.emplace( tag, fd );
+
+  io_uring_sqe& sqe = next_sqe();
+  sqe.opcode = IORING_OP_POLL_ADD;
+  sqe.fd = fd;
+  sqe.poll32_events = events;
+  sqe.user_data = tag;
+  return tag;
+}
+
+void IoUring::cancel_poll( const uint64_t tag )
+{
+  if ( polls_.erase( tag ) == 0 ) {
+    return;
+  }
+
+  io_uring_sqe& sqe = next_sqe();
+  sqe.opcode = IORING_OP_POLL_REMOVE;
+  sqe.addr = tag;
+}
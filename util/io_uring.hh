@@ -0,0 +1,176 @@
+#pragma once
+
+#include "file_descriptor.hh"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <linux/io_uring.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+//! \brief A minimal [io_uring(7)](\ref man7::io_uring) (used by EventLoop::Backend::IoUring)
+//! \details Operations are queued in the submission ring and handed to the kernel together, in the same
+//! [io_uring_enter(2)](\ref man2::io_uring_enter) that waits for completions, so one system call carries a
+//! whole batch. Writes of up to FIXED_BUFFER_SIZE bytes are copied into registered (fixed) buffers, and
+//! receives are multishot, into buffers provided to the kernel once.
+class IoUring
+{
+public:
+  //! Called with the result of a read or write (bytes transferred, or -errno) and the bytes read, if any
+  using CompletionT = std::function<void( int32_t result, std::string_view data )>;
+
+  //! Called with each datagram received (or 0 at EOF, or -errno); returning false stops the receive. Datagrams
+  //! that a multishot receive takes after that (before the kernel sees the stop) are kept for the fd's next
+  //! receive(), which gets them first.
+  using ReceiveT = std::function<bool( int32_t result, std::string_view data )>;
+
+  //! A poll that completed: its tag (from poll()), its fd, and the events (as for poll(2)) or -errno
+  struct PollResult
+  {
+    uint64_t tag;
+    int fd;
+    int32_t events;
+  };
+
+  static constexpr size_t FIXED_BUFFER_SIZE = 2048;    //!< size of each registered buffer for writes
+  static constexpr size_t FIXED_BUFFER_COUNT = 64;     //!< number of registered buffers for writes
+  static constexpr size_t PROVIDED_BUFFER_SIZE = 2048; //!< largest datagram a receive delivers in one piece
+  static constexpr size_t PROVIDED_BUFFER_COUNT = 64;  //!< number of buffers provided for receives
+
+  //! Whether the kernel can run an IoUring (checked once per process)
+  static bool supported();
+
+  explicit IoUring( unsigned entries = 256 );
+  ~IoUring();
+
+  //! \name
+  //! Operations; each completes (and calls its callback) in a later wait()
+
+  //!@{
+  void read( int fd, size_t size, CompletionT done );
+  void write( int fd, std::string buffer, CompletionT done );
+  void receive( int fd, ReceiveT on_datagram );
+  //!@}
+
+  //! Watch `fd` once for `events` (plus errors and hangups); the result appears in ready_polls()
+  //! \returns a tag for cancel_poll()
+  uint64_t poll( int fd, uint32_t events );
+
+  //! Cancel a poll that has not completed
+  void cancel_poll( uint64_t tag );
+
+  //! Whether a read, write or receive is unfinished
+  bool busy() const { return not operations_.empty(); }
+
+  //! Submit what is queued and wait up to `timeout` (negative: indefinitely) for a completion, then run the
+  //! callbacks of every completion
+  //! \returns the number of polls and operations that completed
+  size_t wait( std::chrono::microseconds timeout );
+
+  //! The polls that completed in the last wait() (for the caller to consume)
+  std::vector<PollResult>& ready_polls() { return ready_polls_; }
+
+  //! \name
+  //! The kernel refers to the rings and buffers, so an IoUring cannot be moved or copied
+
+  //!@{
+  IoUring( const IoUring& other ) = delete;
+  IoUring( IoUring&& other ) = delete;
+  IoUring& operator=( const IoUring& other ) = delete;
+  IoUring& operator=( IoUring&& other ) = delete;
+  //!@}
+
+private:
+  struct Operation
+  {
+    enum class Kind : uint8_t
+    {
+      Read,
+      Write,
+      Receive
+    };
+
+    Kind kind;
+    int fd;
+    std::string buffer {};   //!< where a read lands, or what a write sends if not in a fixed buffer
+    int fixed_buffer = -1;   //!< index of the fixed buffer a write sends from, if any
+    CompletionT done {};     //!< for Read and Write
+    ReceiveT on_datagram {}; //!< for Receive
+    bool multishot = true;   //!< whether a Receive uses multishot recv (false if the fd is not a socket)
+    bool stopping = false;   //!< whether a Receive has been asked to stop
+  };
+
+  //! The parts of a completion entry that are used
+  struct Completion
+  {
+    uint64_t tag;
+    int32_t result;
+    uint32_t flags;
+  };
+
+  //! A memory mapping of the rings, unmapped on destruction
+  class Mapping
+  {
+    void* address_;
+    size_t length_;
+
+  public:
+    Mapping( const FileDescriptor& fd, size_t length, uint64_t offset );
+    ~Mapping();
+    template<typename T>
+    T* at( uint32_t offset ) const
+    {
+      return reinterpret_cast<T*>( static_cast<char*>( address_ ) + offset ); // NOLINT(*-reinterpret-cast)
+    }
+    Mapping( const Mapping& other ) = delete;
+    Mapping( Mapping&& other ) = delete;
+    Mapping& operator=( const Mapping& other ) = delete;
+    Mapping& operator=( Mapping&& other ) = delete;
+  };
+
+  io_uring_params params_ {};
+  FileDescriptor fd_;
+  Mapping sq_ring_;
+  Mapping cq_ring_;
+  Mapping sqes_;
+
+  uint32_t sq_tail_ {};   //!< tail of the submission ring, published to the kernel by enter()
+  uint64_t next_tag_ = 1; //!< user_data of the next poll or operation (0 marks entries whose result is ignored)
+
+  std::vector<char> fixed_buffers_;
+  std::vector<int> free_fixed_buffers_ {};
+  std::vector<char> provided_buffers_;
+
+  std::unordered_map<uint64_t, Operation> operations_ {};
+  std::unordered_map<uint64_t, int> polls_ {}; //!< fds of the polls that have not completed, by tag
+  std::vector<Completion> completions_ {};
+  std::vector<PollResult> ready_polls_ {};
+
+  std::unordered_map<int, std::deque<std::string>> unclaimed_ {}; //!< datagrams taken after a stop, by fd
+  std::vector<uint64_t> redeliveries_ {}; //!< receives that start with unclaimed datagrams in the next wait()
+
+  //! A zeroed submission entry, queued for the next submission (submitting first if the ring is full)
+  io_uring_sqe& next_sqe();
+
+  //! Submit the queued entries and wait for `wait_for` completions, for up to `timeout`
+  void enter( uint32_t wait_for, std::chrono::microseconds timeout );
+
+  //! Move the completions from the completion ring to completions_
+  void reap();
+
+  //! Run the callback of a completion; returns false for entries whose result is ignored
+  bool complete( const Completion& completion );
+  void complete_receive( uint64_t tag, Operation& op, const Completion& completion );
+
+  //! Give the receives in redeliveries_ their fds' unclaimed datagrams, then arm them (unless they stop)
+  //! \returns the number of datagrams delivered
+  size_t deliver_unclaimed();
+  void arm_receive( uint64_t tag, const Operation& op );
+  void provide_buffers( uint16_t first, uint16_t count );
+  void cancel( uint64_t tag );
+};
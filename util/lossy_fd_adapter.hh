@@ -5,9 +5,14 @@
 #include "tcp_config.hh"
 #include "tcp_segment.hh"
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <optional>
 #include <random>
+#include <span>
 #include <utility>
+#include <vector>
 
 //! An adapter class that adds random dropping behavior to an FD adapter
 template<typename AdapterT>
@@ -20,6 +25,9 @@ private:
   //! The underlying FD adapter
   AdapterT _adapter;
 
+  //! Scratch space for the messages of a batch that were not dropped
+  std::vector<TCPMessage> _kept {};
+
   //! \brief Determine whether or not to drop a given read or write
   //! \param[in] uplink is `true` to use the uplink loss probability, else use the downlink loss probability
   //! \returns `true` if the segment should be dropped
@@ -49,6 +57,17 @@ public:
     return ret;
   }
 
+  //! \brief Read a batch from the underlying AdapterT instance, potentially dropping each datagram
+  //! \param[out] msgs gets the datagrams that were not dropped appended to it
+  void read_batch( std::vector<TCPMessage>& msgs )
+    requires requires( AdapterT a, std::vector<TCPMessage>& m ) { a.read_batch( m ); }
+  {
+    const auto first = static_cast<std::ptrdiff_t>( msgs.size() );
+    _adapter.read_batch( msgs );
+    msgs.erase( std::remove_if( msgs.begin() + first, msgs.end(), [&]( auto& ) { return _should_drop( false ); } ),
+                msgs.end() );
+  }
+
   //! \brief Write to the underlying AdapterT instance, potentially dropping the datagram to be written
   //! \param[in] seg is the packet to either write or drop
   void write( const TCPMessage& seg )
@@ -59,11 +78,27 @@ public:
     return _adapter.write( seg );
   }
 
+  //! \brief Write a batch to the underlying AdapterT instance, potentially dropping each datagram
+  //! \param[in] msgs are the packets to either write or drop
+  void write_batch( std::span<TCPMessage> msgs )
+    requires requires( AdapterT a, std::span<TCPMessage> m ) { a.write_batch( m ); }
+  {
+    _kept.clear();
+    for ( auto& msg : msgs ) {
+      if ( not _should_drop( true ) ) {
+        _kept.push_back( std::move( msg ) );
+      }
+    }
+    if ( not _kept.empty() ) {
+      _adapter.write_batch( _kept );
+    }
+  }
+
   //! \name
   //! Passthrough functions to the underlying AdapterT instance
 
   void set_listening( const bool l ) { _adapter.set_listening( l ); } //!< FdAdapterBase::set_listening passthrough
   const FdAdapterConfig& config() const { return _adapter.config(); } //!< FdAdapterBase::config passthrough
   FdAdapterConfig& config_mut() { return _adapter.config_mut(); }     //!< FdAdapterBase::config_mut passthrough
-  void tick( const size_t ms_since_last_tick ) { _adapter.tick( ms_since_last_tick ); }
+  void tick( const std::chrono::microseconds since_last_tick ) { _adapter.tick( since_last_tick ); }
 };
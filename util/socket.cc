@@ -214,6 +214,56 @@ void DatagramSocket::send( vector<iovec>& iovecs, size_t total_size, const optio
   }
 }
 
+void DatagramSocket::send_batch( const vector<vector<Ref<string>>>& datagrams,
+                                 const optional<Address>& destination )
+{
+  static thread_local vector<iovec> iovecs;
+  static thread_local vector<mmsghdr> messages;
+
+  // reserve every iovec up front, since each mmsghdr points into the vector
+  size_t buffer_count = 0;
+  for ( const auto& dgram : datagrams ) {
+    buffer_count += dgram.size();
+  }
+  iovecs.clear();
+  iovecs.reserve( buffer_count );
+  messages.clear();
+
+  void* const name = destination.has_value() // NOLINTNEXTLINE(*-const-cast)
+                       ? static_cast<void*>( const_cast<sockaddr*>( destination->raw() ) )
+                       : nullptr;
+  const socklen_t namelen = destination.has_value() ? destination->size() : 0;
+
+  for ( const auto& dgram : datagrams ) {
+    const size_t first_iovec = iovecs.size();
+    for ( const auto& buf : dgram ) {
+      const string_view x { buf };
+      if ( not x.empty() ) {
+        iovecs.push_back( { const_cast<char*>( x.data() ), x.size() } ); // NOLINT(*-const-cast)
+      }
+    }
+    messages.push_back( { .msg_hdr = { .msg_name = name,
+                                       .msg_namelen = namelen,
+                                       .msg_iov = iovecs.data() + first_iovec,
+                                       .msg_iovlen = iovecs.size() - first_iovec,
+                                       .msg_control = nullptr,
+                                       .msg_controllen {},
+                                       .msg_flags {} },
+                          .msg_len {} } );
+  }
+
+  size_t datagrams_sent = 0;
+  while ( datagrams_sent < messages.size() ) {
+    const size_t sent = CheckFDSystemCall(
+      "sendmmsg", ::sendmmsg( fd_num(), messages.data() + datagrams_sent, messages.size() - datagrams_sent, 0 ) );
+    register_write();
+    if ( sent == 0 ) {
+      throw runtime_error( "sendmmsg sent no datagrams" );
+    }
+    datagrams_sent += sent;
+  }
+}
+
 // mark the socket as listening for incoming connections
 //! \param[in] backlog is the number of waiting connections to queue (see [listen(2)](\ref man2::listen))
 void TCPSocket::listen( const int backlog )
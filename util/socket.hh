@@ -2,6 +2,7 @@
 
 #include "address.hh"
 #include "file_descriptor.hh"
+#include "ref.hh"
 
 #include <functional>
 #include <sys/socket.h>
@@ -73,6 +74,11 @@ public:
     send( iovecs, total_size, destination );
   }
 
+  //! Send several datagrams (each a collection of buffers) with as few [sendmmsg(2)](\ref man2::sendmmsg) calls as
+  //! the kernel allows
+  void send_batch( const std::vector<std::vector<Ref<std::string>>>& datagrams,
+                   const std::optional<Address>& destination = {} );
+
 private:
   void send( std::vector<iovec>& iovecs, size_t total_size, const std::optional<Address>& destination = {} );
 
@@ -0,0 +1,74 @@
+#include "tcp_coalescer.hh"
+
+#include <cstdint>
+#include <utility>
+
+using namespace std;
+
+namespace {
+class Wrap32Comparable : public Wrap32
+{
+public:
+  uint32_t raw_value() const { return raw_value_; }
+};
+
+// Is `b` at or after `a` in sequence-number space?
+bool not_before( Wrap32 a, Wrap32 b )
+{
+  return static_cast<int32_t>( Wrap32Comparable { b }.raw_value() - Wrap32Comparable { a }.raw_value() ) >= 0;
+}
+} // namespace
+
+bool TCPCoalescer::mergeable( const TCPMessage& prev, const TCPMessage& next )
+{
+  const TCPSenderMessage& ps = prev.sender;
+  const TCPSenderMessage& ns = next.sender;
+  const TCPReceiverMessage& pr = prev.receiver;
+  const TCPReceiverMessage& nr = next.receiver;
+
+  return prev.sender.is_owned() and not ps.SYN and not ps.FIN and not ps.RST and not ps.payload.empty()
+         and not ns.SYN and not ns.RST and not ns.CWR and not ns.payload.empty()
+         and ns.seqno == ps.seqno + static_cast<uint32_t>( ps.payload.size() )
+         and ps.payload.size() + ns.payload.size() <= MAX_PAYLOAD and not pr.RST and not nr.RST
+         and pr.ackno.has_value() == nr.ackno.has_value();
+}
+
+void TCPCoalescer::coalesce( vector<TCPMessage>& msgs )
+{
+  if ( msgs.size() < 2 ) {
+    return;
+  }
+
+  size_t last = 0; // the message that later ones are merged into
+  for ( size_t i = 1; i < msgs.size(); ++i ) {
+    TCPMessage& prev = msgs[last];
+    TCPMessage& next = msgs[i];
+
+    if ( not mergeable( prev, next ) ) {
+      if ( ++last != i ) {
+        msgs[last] = move( next );
+      }
+      continue;
+    }
+
+    TCPSenderMessage& merged = prev.sender;
+    merged.payload += as_const( next.sender ).get().payload;
+    merged.FIN = as_const( next.sender ).get().FIN;
+    merged.CE |= as_const( next.sender ).get().CE; // a congestion mark on any part marks the whole
+
+    // Keep the newest acknowledgment (a reordered older one must not move the ackno back).
+    const TCPReceiverMessage& prev_ack = prev.receiver;
+    const TCPReceiverMessage& next_ack = next.receiver;
+    const bool ece = prev_ack.ECE or next_ack.ECE;
+    if ( not next_ack.ackno.has_value() or not_before( *prev_ack.ackno, *next_ack.ackno ) ) {
+      prev.receiver = move( next.receiver );
+    }
+    if ( ece ) { // an ECN echo on any part is kept
+      TCPReceiverMessage merged_ack = prev.receiver.release();
+      merged_ack.ECE = true;
+      prev.receiver = move( merged_ack );
+    }
+  }
+
+  msgs.resize( last + 1 );
+}
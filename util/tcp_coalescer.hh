@@ -0,0 +1,24 @@
+#pragma once
+
+#include "tcp_segment.hh"
+
+#include <cstddef>
+#include <vector>
+
+//! \brief Software receive offload: merge runs of consecutive in-order data segments (like Linux's GRO)
+//! \details Messages read in one batch for one connection are merged when each one's payload starts where
+//! the previous one's ended and neither carries SYN or RST (a FIN may only end a run, a CWR only start one).
+//! The merged message keeps the newest acknowledgment and window, and any ECN marks, so TCPPeer::receive,
+//! the Reassembler and the ACK it triggers run once per run instead of once per segment.
+class TCPCoalescer
+{
+public:
+  static constexpr size_t MAX_PAYLOAD = 65535; //!< Largest merged payload (as for GRO)
+
+  //! Merge, in place, whatever runs of mergeable messages `msgs` contains
+  static void coalesce( std::vector<TCPMessage>& msgs );
+
+private:
+  //! Can `next` be appended to `prev`?
+  static bool mergeable( const TCPMessage& prev, const TCPMessage& next );
+};
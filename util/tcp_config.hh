@@ -3,6 +3,7 @@
 #include "address.hh"
 #include "wrapping_integers.hh"
 
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 
@@ -10,15 +11,38 @@
 class TCPConfig
 {
 public:
-  static constexpr size_t DEFAULT_CAPACITY = 64000; //!< Default capacity
-  static constexpr size_t MAX_PAYLOAD_SIZE = 1000;  //!< Conservative max payload size for real Internet
-  static constexpr uint16_t TIMEOUT_DFLT = 1000;    //!< Default re-transmit timeout is 1 second
-  static constexpr unsigned MAX_RETX_ATTEMPTS = 8;  //!< Maximum re-transmit attempts before giving up
+  static constexpr size_t DEFAULT_CAPACITY = 64000;     //!< Default capacity
+  static constexpr size_t MIN_AUTOTUNE_CAPACITY = 4096; //!< Size autotuned buffers start at and shrink back to
+  static constexpr size_t MAX_PAYLOAD_SIZE = 1000;      //!< Conservative max payload size for real Internet
+  static constexpr uint16_t TIMEOUT_DFLT = 1000;        //!< Default re-transmit timeout is 1 second
+  static constexpr unsigned MAX_RETX_ATTEMPTS = 8;      //!< Maximum re-transmit attempts before giving up
+  static constexpr uint16_t MIN_RTO_MS = 200;           //!< Least RTO estimated from measured round trips
 
   uint16_t rt_timeout = TIMEOUT_DFLT;      //!< Initial value of the retransmission timeout, in milliseconds
+  uint32_t rt_timeout_us = 0;              //!< If nonzero, overrides rt_timeout with a value in microseconds
   size_t recv_capacity = DEFAULT_CAPACITY; //!< Receive capacity, in bytes
   size_t send_capacity = DEFAULT_CAPACITY; //!< Sender capacity, in bytes
   Wrap32 isn { 137 };                      //!< Default initial sequence number
+  bool autotune_buffers = false;           //!< Size buffers to the connection's needs, up to the capacities above
+  bool ecn = false;                        //!< Offer (and accept) Explicit Congestion Notification (RFC 3168)
+  bool fastopen = false;                   //!< Use TCP Fast Open (RFC 7413) cookies and data on the SYN
+  bool cache_metrics = false;              //!< Warm-start from, and update, the per-destination TCPMetricsCache
+
+  //! Largest payload TCPSender puts in one segment. Above MAX_PAYLOAD_SIZE, the datagram adapter splits each
+  //! segment into MAX_PAYLOAD_SIZE packets (software segmentation offload; see TCPOverIPv4Adapter)
+  size_t max_segment_payload = MAX_PAYLOAD_SIZE;
+
+  //! Initial value of the retransmission timeout, at full (microsecond) resolution
+  std::chrono::microseconds initial_RTO() const
+  {
+    if ( rt_timeout_us != 0 ) {
+      return std::chrono::microseconds { rt_timeout_us };
+    }
+    return std::chrono::milliseconds { rt_timeout };
+  }
+
+  //! How long a peer lingers after both streams finish (to acknowledge a retransmitted FIN)
+  std::chrono::microseconds linger_time() const { return 10 * initial_RTO(); }
 };
 
 //! Config for classes derived from FdAdapter
@@ -0,0 +1,372 @@
+#include "tcp_demux.hh"
+
+#include "helpers.hh"
+#include "random.hh"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <stdexcept>
+#include <utility>
+
+using namespace std;
+
+namespace {
+Address make_address( uint32_t ip_address, uint16_t port )
+{
+  return Address { inet_ntoa( { htobe32( ip_address ) } ), port };
+}
+
+// The splitmix64 finalizer: a keyed mix that makes SYN cookies unpredictable without the key (not a MAC)
+uint64_t mix( uint64_t x )
+{
+  x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+  x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebULL;
+  return x ^ ( x >> 31 );
+}
+
+uint64_t random_key()
+{
+  auto rng = get_random_engine();
+  return uniform_int_distribution<uint64_t> {}( rng );
+}
+
+// The TCP message in a datagram, if it has valid checksums
+optional<TCPMessage> parse_segment( string datagram )
+{
+  InternetDatagram ip_dgram;
+  TCPSegment seg;
+  if ( parse( ip_dgram, vector<string> { move( datagram ) } )
+       and parse( seg, move( ip_dgram.payload ), ip_dgram.header.pseudo_checksum() ) ) {
+    return move( seg.message );
+  }
+  return {};
+}
+} // namespace
+
+TCPDemux::TCPDemux( TransmitFunction transmit ) : transmit_( move( transmit ) ), syn_cookie_key_( random_key() ) {}
+
+TCPDemux::Connection::Connection( const TCPConfig& cfg, const FourTuple& t ) : tuple( t ), adapter(), peer( cfg )
+{
+  adapter.config_mut().source = make_address( tuple.local_address, tuple.local_port );
+  adapter.config_mut().destination = make_address( tuple.remote_address, tuple.remote_port );
+}
+
+TCPDemux::Connection& TCPDemux::connection( ConnectionId id )
+{
+  if ( id >= connections_.size() or not connections_[id] ) {
+    throw runtime_error( "TCPDemux: no such connection" );
+  }
+  return *connections_[id];
+}
+
+const TCPDemux::Connection& TCPDemux::connection( ConnectionId id ) const
+{
+  if ( id >= connections_.size() or not connections_[id] ) {
+    throw runtime_error( "TCPDemux: no such connection" );
+  }
+  return *connections_[id];
+}
+
+TCPDemux::ConnectionId TCPDemux::add( unique_ptr<Connection> conn )
+{
+  ConnectionId id {};
+  if ( free_ids_.empty() ) {
+    id = static_cast<ConnectionId>( connections_.size() );
+    connections_.emplace_back();
+  } else {
+    id = free_ids_.back();
+    free_ids_.pop_back();
+  }
+  table_.insert( conn->tuple, id );
+  connections_[id] = move( conn );
+  return id;
+}
+
+void TCPDemux::remove( ConnectionId id )
+{
+  table_.erase( connections_[id]->tuple );
+  connections_[id].reset();
+  free_ids_.push_back( id );
+  erase( unaccepted_, id );
+}
+
+void TCPDemux::listen( const Address& local, size_t backlog, const TCPConfig& cfg )
+{
+  listener_.emplace( local, backlog, cfg );
+}
+
+optional<TCPDemux::ConnectionId> TCPDemux::accept()
+{
+  const auto it = ranges::find_if( unaccepted_, [&]( ConnectionId id ) { return established( id ); } );
+  if ( it == unaccepted_.end() ) {
+    return {};
+  }
+  const ConnectionId id = *it;
+  unaccepted_.erase( it );
+  connection( id ).accepted = true;
+  return id;
+}
+
+TCPDemux::ConnectionId TCPDemux::connect( const TCPConfig& cfg, const FdAdapterConfig& adapter_cfg )
+{
+  const FourTuple tuple { .local_address = adapter_cfg.source.ipv4_numeric(),
+                          .remote_address = adapter_cfg.destination.ipv4_numeric(),
+                          .local_port = adapter_cfg.source.port(),
+                          .remote_port = adapter_cfg.destination.port() };
+  if ( table_.find( tuple ).has_value() ) {
+    throw runtime_error( "TCPDemux: connection already exists" );
+  }
+
+  auto conn = make_unique<Connection>( cfg, tuple );
+  conn->accepted = true;
+  const ConnectionId id = add( move( conn ) );
+  push( id );
+  return id;
+}
+
+void TCPDemux::push( ConnectionId id )
+{
+  Connection& conn = connection( id );
+  conn.peer.push( make_transmit( conn ) );
+}
+
+bool TCPDemux::established( ConnectionId id ) const
+{
+  const TCPPeer& peer = connection( id ).peer;
+  return peer.has_ackno() and peer.sender().sequence_numbers_in_flight() == 0;
+}
+
+void TCPDemux::close( ConnectionId id )
+{
+  Connection& conn = connection( id );
+  conn.closed = true;
+  if ( not conn.peer.outbound_writer().is_closed() ) {
+    conn.peer.outbound_writer().close();
+    push( id );
+  }
+}
+
+void TCPDemux::receive_datagram( string datagram )
+{
+  const auto peek = TCPOverIPv4Adapter::peek_tcp_in_ip( datagram );
+  if ( not peek.has_value() ) {
+    ++stats_.unrelated;
+    return;
+  }
+
+  // An existing connection?
+  Connection* conn {};
+  unique_ptr<Connection> opening;
+  bool from_syn_cookie {};
+  if ( const auto id = table_.find( peek->tuple ); id.has_value() ) {
+    if ( *id & TIME_WAIT_ID ) {
+      receive_in_time_wait( *id & ~TIME_WAIT_ID, move( datagram ) );
+      return;
+    }
+    conn = connections_[*id].get();
+  } else {
+    // A new connection to the listener? (A SYN that is not a SYN-ACK, or with SYN cookies, the ACK of one.)
+    const bool to_listener = listener_.has_value() and peek->tuple.local_port == listener_->local.port()
+                             and ( listener_->local.ipv4_numeric() == 0
+                                   or listener_->local.ipv4_numeric() == peek->tuple.local_address );
+    const bool syn = peek->SYN and not peek->ACK;
+    from_syn_cookie = syn_cookies_ and not peek->SYN and peek->ACK;
+    if ( not to_listener or peek->RST or not( syn or from_syn_cookie ) ) {
+      ++stats_.unrelated;
+      return;
+    }
+    if ( syn and syn_cookies_ ) {
+      answer_with_syn_cookie( *peek, move( datagram ) );
+      return;
+    }
+    if ( from_syn_cookie and not valid_syn_cookie( *peek ) ) {
+      ++stats_.bad_syn_cookie;
+      return;
+    }
+    if ( unaccepted_.size() >= listener_->backlog ) {
+      ++stats_.backlog_full; // like Linux, drop it: the client will retransmit
+      return;
+    }
+
+    TCPConfig cfg = listener_->cfg;
+    if ( from_syn_cookie ) {
+      cfg.isn = Wrap32 { peek->ackno - 1 };
+    }
+    opening = make_unique<Connection>( cfg, peek->tuple );
+    conn = opening.get();
+  }
+
+  // Only now verify the checksums.
+  InternetDatagram ip_dgram;
+  optional<TCPMessage> msg;
+  if ( parse( ip_dgram, vector<string> { move( datagram ) } ) ) {
+    msg = conn->adapter.unwrap_tcp_in_ip( move( ip_dgram ) );
+  }
+  if ( not msg.has_value() ) {
+    ++stats_.bad_datagram;
+    return;
+  }
+
+  if ( opening ) {
+    unaccepted_.push_back( add( move( opening ) ) );
+  }
+  if ( from_syn_cookie ) {
+    conn->peer.restore_syn_cookie_handshake( Wrap32 { peek->seqno - 1 }, msg->receiver->window_size );
+  }
+  conn->peer.receive( move( *msg ), make_transmit( *conn ) );
+}
+
+//! \details The cookie is the top 32 bits of a keyed hash of the 4-tuple, the client's ISN and the number of
+//! SYN_COOKIE_PERIODs elapsed. Unlike Linux's, it encodes no MSS (the MSS is fixed; see TCPConfig).
+uint32_t TCPDemux::syn_cookie( const FourTuple& tuple, uint32_t client_isn, uint64_t period ) const
+{
+  return static_cast<uint32_t>( mix( syn_cookie_key_ ^ tuple.hash() ^ mix( period << 32 | client_isn ) ) >> 32 );
+}
+
+bool TCPDemux::valid_syn_cookie( const TCPOverIPv4Adapter::Peek& ack ) const
+{
+  const uint32_t client_isn = ack.seqno - 1;
+  const uint32_t cookie = ack.ackno - 1;
+  const uint64_t period = current_time_ / SYN_COOKIE_PERIOD;
+  return cookie == syn_cookie( ack.tuple, client_isn, period )
+         or ( period > 0 and cookie == syn_cookie( ack.tuple, client_isn, period - 1 ) );
+}
+
+void TCPDemux::answer_with_syn_cookie( const TCPOverIPv4Adapter::Peek& syn, string datagram )
+{
+  if ( not parse_segment( move( datagram ) ).has_value() ) {
+    ++stats_.bad_datagram;
+    return;
+  }
+
+  // Advertise no more than the connection's receive buffer will start with.
+  const TCPConfig& cfg = listener_->cfg;
+  const uint64_t capacity = cfg.autotune_buffers ? min( cfg.recv_capacity, TCPConfig::MIN_AUTOTUNE_CAPACITY )
+                                                 : cfg.recv_capacity;
+  const auto window_size = static_cast<uint16_t>( min<uint64_t>( capacity, UINT16_MAX ) );
+  const uint32_t cookie = syn_cookie( syn.tuple, syn.seqno, current_time_ / SYN_COOKIE_PERIOD );
+  transmit_( TCPOverIPv4Adapter::wrap_tcp_in_ip(
+    { .sender = TCPSenderMessage { .seqno = Wrap32 { cookie }, .SYN = true },
+      .receiver = TCPReceiverMessage { .ackno = Wrap32 { syn.seqno } + 1, .window_size = window_size } },
+    syn.tuple ) );
+}
+
+void TCPDemux::tick( chrono::microseconds t )
+{
+  current_time_ += t;
+  for ( ConnectionId id = 0; id < connections_.size(); ++id ) {
+    Connection* conn = connections_[id].get();
+    if ( conn == nullptr ) {
+      continue;
+    }
+    conn->peer.tick( t, make_transmit( *conn ) );
+
+    // Forget finished connections the application no longer holds (or never accepted).
+    if ( conn->closed or not conn->accepted ) {
+      if ( not conn->peer.active() ) {
+        remove( id );
+      } else if ( conn->peer.lingering() ) {
+        enter_time_wait( id );
+      }
+    }
+  }
+
+  for ( size_t i = 0; i < time_wait_.size(); ) {
+    if ( time_wait_[i].deadline <= current_time_ ) {
+      remove_time_wait( i ); // moves the last record to `i`
+    } else {
+      ++i;
+    }
+  }
+}
+
+void TCPDemux::enter_time_wait( ConnectionId id )
+{
+  const TCPPeer& peer = connections_[id]->peer;
+  const TCPReceiverMessage ack = peer.receiver().send();
+  if ( not ack.ackno.has_value() ) {
+    return;
+  }
+
+  // The linger time runs from the last receipt (next_deadline() may be earlier, e.g. for autotuning).
+  const auto linger_left = peer.time_of_last_receipt() + peer.config().linger_time() - peer.current_time();
+
+  TimeWait record { .tuple = connections_[id]->tuple,
+                    .seqno = peer.sender().make_empty_message().seqno,
+                    .ackno = *ack.ackno,
+                    .window_size = ack.window_size,
+                    .deadline = current_time_ + linger_left,
+                    .linger = peer.config().linger_time() };
+  remove( id );
+  table_.insert( record.tuple, TIME_WAIT_ID | static_cast<uint32_t>( time_wait_.size() ) );
+  time_wait_.push_back( record );
+}
+
+void TCPDemux::remove_time_wait( size_t index )
+{
+  table_.erase( time_wait_[index].tuple );
+  if ( index != time_wait_.size() - 1 ) {
+    time_wait_[index] = time_wait_.back();
+    table_.insert( time_wait_[index].tuple, TIME_WAIT_ID | static_cast<uint32_t>( index ) );
+  }
+  time_wait_.pop_back();
+}
+
+//! \details Like a lingering TCPPeer, a TimeWait record acknowledges any segment that occupies sequence
+//! numbers (the peer's FIN, retransmitted because our ACK of it was lost) and restarts its linger time.
+void TCPDemux::receive_in_time_wait( size_t index, string datagram )
+{
+  const auto msg = parse_segment( move( datagram ) );
+  if ( not msg.has_value() ) {
+    ++stats_.bad_datagram;
+    return;
+  }
+  if ( msg->sender->sequence_length() == 0 or msg->sender->RST ) {
+    return;
+  }
+
+  TimeWait& record = time_wait_[index];
+  record.deadline = current_time_ + record.linger;
+  transmit_( TCPOverIPv4Adapter::wrap_tcp_in_ip(
+    { .sender = TCPSenderMessage { .seqno = record.seqno },
+      .receiver = TCPReceiverMessage { .ackno = record.ackno, .window_size = record.window_size } },
+    record.tuple ) );
+}
+
+optional<chrono::microseconds> TCPDemux::next_deadline() const
+{
+  optional<chrono::microseconds> ret;
+  for ( const auto& record : time_wait_ ) {
+    const auto remaining = max( record.deadline - current_time_, chrono::microseconds { 0 } );
+    ret = ret.has_value() ? min( *ret, remaining ) : remaining;
+  }
+  for ( const auto& conn : connections_ ) {
+    if ( not conn ) {
+      continue;
+    }
+    const auto deadline = conn->peer.next_deadline();
+    if ( deadline.has_value() ) {
+      const auto remaining = max( *deadline - conn->peer.current_time(), chrono::microseconds { 0 } );
+      ret = ret.has_value() ? min( *ret, remaining ) : remaining;
+    }
+  }
+  return ret;
+}
+
+TunTCPDemux::TunTCPDemux( TunFD&& tun )
+  : TCPDemux( [this]( const InternetDatagram& dgram ) { tun_.write( serialize( dgram ) ); } ), tun_( move( tun ) )
+{
+  tun_.set_blocking( false );
+}
+
+void TunTCPDemux::read()
+{
+  for ( size_t i = 0; i < MAX_READ_BATCH; ++i ) {
+    string datagram;
+    tun_.read( datagram );
+    if ( datagram.empty() ) {
+      return;
+    }
+    receive_datagram( move( datagram ) );
+  }
+}
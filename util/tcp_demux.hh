@@ -0,0 +1,185 @@
+#pragma once
+
+#include "connection_table.hh"
+#include "ipv4_datagram.hh"
+#include "tcp_config.hh"
+#include "tcp_over_ip.hh"
+#include "tcp_peer.hh"
+#include "tun.hh"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+//! \brief Many TCP connections sharing one source of IPv4 datagrams (e.g. one TUN device)
+//! \details Each incoming datagram is routed by a cheap peek at its headers (TCPOverIPv4Adapter::peek_tcp_in_ip)
+//! to the connection with its FourTuple, found in a ConnectionTable; only then are its checksums verified.
+//! A SYN that matches no connection opens one if it is addressed to the listening port and the listener's
+//! backlog (connections not yet accepted) has room; anything else is counted in stats() and dropped.
+//!
+//! With SYN cookies (see set_syn_cookies()), the listener keeps no state for a SYN: it answers with a SYN-ACK
+//! whose seqno is a keyed hash of the 4-tuple, the client's ISN and the time, and creates the connection (and
+//! its buffers) only when an ACK of that seqno arrives.
+//!
+//! A connection that the application has closed and that lingers after both streams finished (see
+//! TCPPeer::lingering()) is collapsed into a TimeWait record, freeing its TCPPeer and buffers. The record still
+//! acknowledges a retransmitted FIN until the linger time passes.
+//!
+//! The demux does no I/O of its own: datagrams are handed to it with receive_datagram(), and the datagrams
+//! its connections send are given to the TransmitFunction. TunTCPDemux binds it to a TUN device.
+class TCPDemux
+{
+public:
+  using ConnectionId = uint32_t;
+  using TransmitFunction = std::function<void( const InternetDatagram& )>;
+
+  //! Datagrams that were dropped without reaching a connection
+  struct Stats
+  {
+    uint64_t unrelated {};      //!< not TCP, or for no connection and not a SYN to the listener
+    uint64_t bad_datagram {};   //!< addressed to a connection, but failed to parse (e.g. a bad checksum)
+    uint64_t backlog_full {};   //!< a SYN (or, with SYN cookies, its final ACK) when the backlog was full
+    uint64_t bad_syn_cookie {}; //!< an ACK to the listener that did not acknowledge a valid SYN cookie
+  };
+
+  static constexpr std::chrono::seconds SYN_COOKIE_PERIOD { 64 }; //!< A SYN cookie is valid for one to two periods
+
+  explicit TCPDemux( TransmitFunction transmit );
+
+  //! Accept connections to `local` (whose address may be "0", for any), keeping at most `backlog`
+  //! connections that have not yet been accepted. Each one uses `cfg`.
+  void listen( const Address& local, size_t backlog, const TCPConfig& cfg = {} );
+
+  //! Answer SYNs to the listener statelessly, with SYN cookies (off by default)
+  void set_syn_cookies( bool enabled ) { syn_cookies_ = enabled; }
+
+  //! The oldest established connection that has not been accepted yet, if any
+  std::optional<ConnectionId> accept();
+
+  //! Open a connection from `adapter_cfg.source` to `adapter_cfg.destination` (sends the SYN)
+  ConnectionId connect( const TCPConfig& cfg, const FdAdapterConfig& adapter_cfg );
+
+  //! The peer of an accepted (or connected) connection, for the application to read and write
+  TCPPeer& peer( ConnectionId id ) { return connection( id ).peer; }
+
+  //! Send what the application wrote to a connection's outbound stream
+  void push( ConnectionId id );
+
+  //! Has the handshake finished?
+  bool established( ConnectionId id ) const;
+
+  //! The application is done with a connection: its outbound stream is closed, and it is forgotten
+  //! (and its id reused) once the peer is no longer active
+  void close( ConnectionId id );
+
+  //! Route one serialized IPv4 datagram to its connection
+  void receive_datagram( std::string datagram );
+
+  //! Advance every connection's clock, and forget connections that are finished
+  void tick( std::chrono::microseconds t );
+
+  //! Earliest time (relative to now) at which tick() has work to do, if any
+  std::optional<std::chrono::microseconds> next_deadline() const;
+
+  size_t connection_count() const { return table_.size() - time_wait_.size(); }
+  size_t time_wait_count() const { return time_wait_.size(); }
+  size_t backlog() const { return unaccepted_.size(); }
+  const Stats& stats() const { return stats_; }
+
+private:
+  struct Connection
+  {
+    FourTuple tuple {};
+    TCPOverIPv4Adapter adapter {};
+    TCPPeer peer;
+    bool accepted {}; //!< handed to the application (by accept() or connect())
+    bool closed {};   //!< released by the application
+
+    Connection( const TCPConfig& cfg, const FourTuple& t );
+  };
+
+  //! What is left of a connection that lingers after both streams finished
+  struct TimeWait
+  {
+    FourTuple tuple {};
+    Wrap32 seqno { 0 }; //!< our next seqno (just past our FIN)
+    Wrap32 ackno { 0 }; //!< just past the peer's FIN
+    uint16_t window_size {};
+    std::chrono::microseconds deadline {}; //!< on the demux's clock
+    std::chrono::microseconds linger {};   //!< how long after each received segment
+  };
+
+  //! Ids in the ConnectionTable with this bit set index time_wait_ instead of connections_
+  static constexpr uint32_t TIME_WAIT_ID = 1U << 31;
+
+  struct Listener
+  {
+    Address local;
+    size_t backlog;
+    TCPConfig cfg;
+  };
+
+  TransmitFunction transmit_;
+  std::optional<Listener> listener_ {};
+
+  bool syn_cookies_ {};
+  uint64_t syn_cookie_key_;
+  std::chrono::microseconds current_time_ {}; //!< the sum of all ticks so far
+
+  uint32_t syn_cookie( const FourTuple& tuple, uint32_t client_isn, uint64_t period ) const;
+  bool valid_syn_cookie( const TCPOverIPv4Adapter::Peek& ack ) const;
+  void answer_with_syn_cookie( const TCPOverIPv4Adapter::Peek& syn, std::string datagram );
+
+  ConnectionTable table_ {};
+  std::vector<std::unique_ptr<Connection>> connections_ {};
+  std::vector<ConnectionId> free_ids_ {};
+  std::deque<ConnectionId> unaccepted_ {}; //!< opened by the listener, in order of arrival
+  std::vector<TimeWait> time_wait_ {};
+
+  Stats stats_ {};
+
+  Connection& connection( ConnectionId id );
+  const Connection& connection( ConnectionId id ) const;
+
+  ConnectionId add( std::unique_ptr<Connection> conn );
+  void remove( ConnectionId id );
+  void enter_time_wait( ConnectionId id );
+  void remove_time_wait( size_t index );
+  void receive_in_time_wait( size_t index, std::string datagram );
+
+  auto make_transmit( Connection& conn )
+  {
+    return [this, &conn]( const TCPMessage& msg ) { transmit_( conn.adapter.wrap_tcp_in_ip( msg ) ); };
+  }
+};
+
+//! A TCPDemux that reads and writes one TUN device
+class TunTCPDemux : public TCPDemux
+{
+  TunFD tun_;
+
+public:
+  //! Construct from a TunFD (made non-blocking)
+  explicit TunTCPDemux( TunFD&& tun );
+
+  static constexpr size_t MAX_READ_BATCH = 64; //!< Most datagrams that read() takes in one call
+
+  //! Reads the datagrams waiting on the TUN device (up to MAX_READ_BATCH) and routes each to its connection
+  void read();
+
+  //! Access underlying file descriptor
+  FileDescriptor& fd() { return tun_; }
+
+  // The transmit function refers to the TUN device, so the demux stays where it was constructed.
+  TunTCPDemux( const TunTCPDemux& other ) = delete;
+  TunTCPDemux& operator=( const TunTCPDemux& other ) = delete;
+  TunTCPDemux( TunTCPDemux&& other ) = delete;
+  TunTCPDemux& operator=( TunTCPDemux&& other ) = delete;
+  ~TunTCPDemux() = default;
+};
@@ -0,0 +1,214 @@
+#include "tcp_engine.hh"
+
+#include "exception.hh"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+// Most rules served per wait, so one wakeup serves many connections before the worker ticks them
+constexpr size_t CALLBACK_BUDGET = 64;
+} // namespace
+
+const size_t TCPEngine::DEFAULT_THREADS = clamp<size_t>( thread::hardware_concurrency(), 1, 4 );
+
+TCPEngine::TCPEngine( size_t threads, chrono::microseconds busy_poll )
+{
+  for ( size_t i = 0; i < max<size_t>( threads, 1 ); ++i ) {
+    workers_.push_back( make_unique<Worker>( busy_poll ) );
+  }
+}
+
+TCPEngine& TCPEngine::global()
+{
+  static TCPEngine engine { DEFAULT_THREADS };
+  return engine;
+}
+
+void TCPEngine::add( Connection& connection, const FourTuple& tuple )
+{
+  workers_[tuple.hash() % workers_.size()]->add( connection );
+}
+
+void TCPEngine::Connection::touch()
+{
+  if ( worker_ ) {
+    worker_->touch( *this );
+  }
+}
+
+size_t TCPEngine::connection_count() const
+{
+  size_t ret = 0;
+  for ( const auto& worker : workers_ ) {
+    ret += worker->count();
+  }
+  return ret;
+}
+
+TCPEngine::BusyPollStats TCPEngine::busy_poll_stats() const
+{
+  BusyPollStats ret;
+  for ( const auto& worker : workers_ ) {
+    worker->add_stats( ret );
+  }
+  return ret;
+}
+
+TCPEngine::~TCPEngine()
+{
+  for ( const auto& worker : workers_ ) {
+    worker->stop();
+  }
+}
+
+TCPEngine::Worker::Worker( chrono::microseconds busy_poll )
+  : wakeup_( CheckSystemCall( "eventfd", ::eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) ), busy_poll_( busy_poll )
+{
+  loop_.set_callback_budget( CALLBACK_BUDGET );
+  loop_.add_rule( loop_.add_category( "wake up TCP engine worker", EventLoop::Priority::High ),
+                  wakeup_,
+                  Direction::In,
+                  [&] {
+                    string counter( sizeof( uint64_t ), 0 );
+                    wakeup_.read( counter );
+                  } );
+  thread_ = thread( &Worker::main, this );
+}
+
+void TCPEngine::Worker::wake()
+{
+  const uint64_t one = 1;
+  CheckSystemCall( "write", ::write( wakeup_.fd_num(), &one, sizeof( one ) ) );
+}
+
+void TCPEngine::Worker::add( Connection& connection )
+{
+  connection.worker_ = this;
+  {
+    const lock_guard lock { mutex_ };
+    incoming_.push_back( &connection );
+  }
+  ++count_;
+  wake();
+}
+
+void TCPEngine::Worker::touch( Connection& connection )
+{
+  if ( not connection.touched_ ) {
+    connection.touched_ = true;
+    touched_.push_back( &connection );
+  }
+}
+
+void TCPEngine::Worker::add_stats( BusyPollStats& stats ) const
+{
+  stats.spin_events += spin_events_.load( memory_order_relaxed );
+  stats.idle_spins += idle_spins_.load( memory_order_relaxed );
+  stats.sleeps += sleeps_.load( memory_order_relaxed );
+}
+
+void TCPEngine::Worker::stop()
+{
+  stop_ = true;
+  wake();
+  thread_.join();
+}
+
+void TCPEngine::Worker::main()
+{
+  try {
+    while ( not stop_ ) {
+      {
+        const lock_guard lock { mutex_ };
+        for ( Connection* connection : incoming_ ) {
+          connection->install( loop_ );
+          touch( *connection );
+        }
+        incoming_.clear();
+      }
+
+      tick_connections();
+
+      // Sleep until the earliest deadline of any connection.
+      chrono::microseconds timeout { -1 };
+      if ( not deadlines_.empty() ) {
+        timeout = max( chrono::ceil<chrono::microseconds>( deadlines_.front().when - chrono::steady_clock::now() ),
+                       chrono::microseconds { 0 } );
+      }
+      if ( not spin( timeout ) ) {
+        loop_.wait_next_event( timeout );
+      }
+    }
+  } catch ( const exception& e ) {
+    cerr << "Exception in TCP engine worker: " << e.what() << "\n";
+    throw;
+  }
+}
+
+void TCPEngine::Worker::tick_connections()
+{
+  const auto now = chrono::steady_clock::now();
+  while ( not deadlines_.empty() and deadlines_.front().when <= now ) {
+    ranges::pop_heap( deadlines_, greater {} );
+    const Deadline due = deadlines_.back();
+    deadlines_.pop_back();
+    if ( due.connection->deadline_ == due.when ) {
+      due.connection->deadline_.reset();
+      touch( *due.connection );
+    }
+  }
+
+  swap( touched_, ticking_ );
+  for ( Connection* connection : ticking_ ) {
+    connection->touched_ = false;
+    if ( not connection->tick() ) {
+      // forget it (outdated deadlines too, which still point to it) before the owner can destroy it
+      if ( erase_if( deadlines_, [&]( const Deadline& deadline ) { return deadline.connection == connection; } ) ) {
+        ranges::make_heap( deadlines_, greater {} );
+      }
+      connection->finish();
+      --count_;
+      continue;
+    }
+
+    const auto timeout = connection->wait_timeout();
+    if ( timeout.count() < 0 ) {
+      connection->deadline_.reset();
+    } else if ( connection->deadline_ != now + timeout ) {
+      connection->deadline_ = now + timeout;
+      deadlines_.push_back( { now + timeout, connection } );
+      ranges::push_heap( deadlines_, greater {} );
+    }
+  }
+  ticking_.clear();
+}
+
+//! \param[in] timeout is when the earliest connection needs a tick (negative if none does)
+bool TCPEngine::Worker::spin( chrono::microseconds timeout )
+{
+  if ( busy_poll_.count() <= 0 or timeout.count() == 0 ) {
+    return false;
+  }
+
+  const auto budget = timeout.count() < 0 ? busy_poll_ : min( busy_poll_, timeout );
+  const auto give_up = chrono::steady_clock::now() + budget;
+  do {
+    if ( loop_.wait_next_event( chrono::microseconds { 0 } ) == EventLoop::Result::Success ) {
+      spin_events_.fetch_add( 1, memory_order_relaxed );
+      return true;
+    }
+    idle_spins_.fetch_add( 1, memory_order_relaxed );
+  } while ( chrono::steady_clock::now() < give_up );
+
+  if ( budget == timeout ) {
+    return true; // a connection is due for a tick, so there is no time left to block
+  }
+  sleeps_.fetch_add( 1, memory_order_relaxed );
+  return false;
+}
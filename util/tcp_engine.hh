@@ -0,0 +1,149 @@
+#pragma once
+
+#include "connection_table.hh"
+#include "eventloop.hh"
+#include "file_descriptor.hh"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+//! \brief A small pool of worker threads that run many TCP connections (an N:M engine)
+//! \details Each worker runs one EventLoop holding the rules of every connection assigned to it, sleeps until
+//! the earliest of their deadlines (kept in a min-heap), and when it wakes ticks only the connections whose
+//! deadline has passed or whose rules ran. A connection is assigned to a worker by the hash of its FourTuple, so
+//! the same connection always lands on the same worker.
+class TCPEngine
+{
+  class Worker;
+
+public:
+  //! What a worker needs from each connection it serves (implemented by TCPMinnowSocket).
+  //! All of these are called on the worker's thread.
+  class Connection
+  {
+  public:
+    //! Add the connection's rules to the worker's event loop
+    virtual void install( EventLoop& loop ) = 0;
+
+    //! Let time pass; returns false once the connection is finished
+    virtual bool tick() = 0;
+
+    //! How long the worker may sleep before this connection needs a tick (negative if only an event can
+    //! wake it)
+    virtual std::chrono::microseconds wait_timeout() const = 0;
+
+    //! Remove the connection's rules (it is finished); the worker forgets the connection afterwards
+    virtual void finish() = 0;
+
+    Connection() = default;
+    Connection( const Connection& other ) = default;
+    Connection( Connection&& other ) = default;
+    Connection& operator=( const Connection& other ) = default;
+    Connection& operator=( Connection&& other ) = default;
+    virtual ~Connection() = default;
+
+  protected:
+    //! Have the worker tick the connection once the current wait is over (call from each of its rules, as any
+    //! event may change its wait_timeout() or finish it); does nothing until the connection is added
+    void touch();
+
+  private:
+    friend class TCPEngine::Worker;
+    Worker* worker_ {};                                                //!< the worker serving it, once added
+    std::optional<std::chrono::steady_clock::time_point> deadline_ {}; //!< when the worker next ticks it
+    bool touched_ {};                                                  //!< whether it is in touched_
+  };
+
+  //! Start `threads` workers (at least one). With a nonzero `busy_poll`, a worker that runs out of events spins
+  //! on non-blocking polls for up to that long before blocking in poll(), trading CPU for wakeup latency.
+  explicit TCPEngine( size_t threads, std::chrono::microseconds busy_poll = std::chrono::microseconds { 0 } );
+
+  //! The engine shared by every TCPMinnowSocket that is not given one (DEFAULT_THREADS workers)
+  static TCPEngine& global();
+
+  static const size_t DEFAULT_THREADS; //!< min( 4, hardware concurrency )
+
+  //! Hand a connection to the worker chosen by the hash of `tuple`; it stays there until it is finished
+  void add( Connection& connection, const FourTuple& tuple );
+
+  size_t thread_count() const { return workers_.size(); }
+
+  //! Connections being served right now
+  size_t connection_count() const;
+
+  //! What the workers' busy polling has done, summed over the workers
+  struct BusyPollStats
+  {
+    uint64_t spin_events {}; //!< events found by a non-blocking poll while spinning
+    uint64_t idle_spins {};  //!< non-blocking polls that found nothing
+    uint64_t sleeps {};      //!< spins that used up their budget, falling back to a blocking poll
+  };
+  BusyPollStats busy_poll_stats() const;
+
+  //! Stops the workers (every connection must have finished)
+  ~TCPEngine();
+
+  TCPEngine( const TCPEngine& other ) = delete;
+  TCPEngine( TCPEngine&& other ) = delete;
+  TCPEngine& operator=( const TCPEngine& other ) = delete;
+  TCPEngine& operator=( TCPEngine&& other ) = delete;
+
+private:
+  class Worker
+  {
+    //! A connection's deadline, in deadlines_ (outdated if the connection's deadline_ has since changed)
+    struct Deadline
+    {
+      std::chrono::steady_clock::time_point when;
+      Connection* connection;
+
+      bool operator>( const Deadline& other ) const { return when > other.when; }
+    };
+
+    EventLoop loop_ { EventLoop::Backend::Epoll };
+    FileDescriptor wakeup_; //!< an eventfd that interrupts the loop's wait
+
+    std::mutex mutex_ {};
+    std::vector<Connection*> incoming_ {}; //!< added, not yet installed (guarded by mutex_)
+    std::vector<Deadline> deadlines_ {};   //!< min-heap
+    std::vector<Connection*> touched_ {};  //!< to tick once the current wait is over
+    std::vector<Connection*> ticking_ {};
+    std::atomic_size_t count_ {};
+    std::atomic_bool stop_ {};
+
+    std::chrono::microseconds busy_poll_;
+    std::atomic_uint64_t spin_events_ {};
+    std::atomic_uint64_t idle_spins_ {};
+    std::atomic_uint64_t sleeps_ {};
+
+    std::thread thread_ {};
+
+    void main();
+    void wake();
+
+    //! Tick the connections that were touched or whose deadline has passed, finishing those that are done and
+    //! scheduling the next deadlines of the others
+    void tick_connections();
+
+    //! Poll without blocking for up to busy_poll_ (but no longer than `timeout`); false if the worker should
+    //! go on to block in poll()
+    bool spin( std::chrono::microseconds timeout );
+
+  public:
+    explicit Worker( std::chrono::microseconds busy_poll );
+    void add( Connection& connection );
+    void touch( Connection& connection );
+    size_t count() const { return count_; }
+    void add_stats( BusyPollStats& stats ) const;
+    void stop();
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers_ {};
+};
@@ -0,0 +1,61 @@
+#include "tcp_fastopen.hh"
+#include "random.hh"
+
+using namespace std;
+
+namespace {
+// The splitmix64 finalizer: a keyed mix that makes cookies unpredictable without the key (not a MAC)
+uint64_t mix( uint64_t x )
+{
+  x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+  x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebULL;
+  return x ^ ( x >> 31 );
+}
+
+uint64_t random_key()
+{
+  auto rng = get_random_engine();
+  return uniform_int_distribution<uint64_t> {}( rng );
+}
+} // namespace
+
+TCPFastOpen::TCPFastOpen( optional<uint64_t> key )
+  : key_( key.has_value() ? *key : random_key() )
+{}
+
+TCPFastOpen& TCPFastOpen::global()
+{
+  static TCPFastOpen fastopen;
+  return fastopen;
+}
+
+string TCPFastOpen::server_cookie( uint32_t client_address ) const
+{
+  uint64_t value = mix( key_ ^ mix( client_address ) );
+  string cookie( COOKIE_LENGTH, 0 );
+  for ( auto& c : cookie ) {
+    c = static_cast<char>( value );
+    value >>= 8;
+  }
+  return cookie;
+}
+
+optional<string> TCPFastOpen::cached_cookie( uint32_t server_address )
+{
+  const lock_guard lock { mutex_ };
+  const auto it = cookies_.find( server_address );
+  if ( it == cookies_.end() ) {
+    return {};
+  }
+  return it->second;
+}
+
+void TCPFastOpen::cache_cookie( uint32_t server_address, const string& cookie )
+{
+  if ( cookie.size() < MIN_COOKIE_LENGTH or cookie.size() > MAX_COOKIE_LENGTH or cookie.size() % 2 ) {
+    return;
+  }
+
+  const lock_guard lock { mutex_ };
+  cookies_[server_address] = cookie;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+//! \brief TCP Fast Open cookies (RFC 7413), for both ends of a connection
+//! \details A server hands each client a cookie derived from the client's address and a secret key, and
+//! accepts data on a later SYN from that address only if it carries the same cookie. A client remembers
+//! the cookie per server address, so that its next connection to that server can send data on the SYN.
+class TCPFastOpen
+{
+  uint64_t key_;
+
+  std::mutex mutex_ {};
+  std::unordered_map<uint32_t, std::string> cookies_ {}; // client side: cookie by server address
+
+public:
+  static constexpr size_t COOKIE_LENGTH = 8;      //!< Length of the cookies this server issues
+  static constexpr size_t MIN_COOKIE_LENGTH = 4;  //!< Shortest cookie a client accepts (RFC 7413)
+  static constexpr size_t MAX_COOKIE_LENGTH = 16; //!< Longest cookie a client accepts (RFC 7413)
+
+  //! A random key unless one is given (servers sharing an address would share a key)
+  explicit TCPFastOpen( std::optional<uint64_t> key = {} );
+
+  //! The state shared by every connection in the process
+  static TCPFastOpen& global();
+
+  //! The cookie that the client at `client_address` (an IPv4 address in numeric form) is issued and must present
+  std::string server_cookie( uint32_t client_address ) const;
+
+  //! The cookie remembered for the server at `server_address`, if any
+  std::optional<std::string> cached_cookie( uint32_t server_address );
+
+  //! Remember the cookie issued by the server at `server_address` (ignored if its length is invalid)
+  void cache_cookie( uint32_t server_address, const std::string& cookie );
+};
@@ -0,0 +1,40 @@
+#include "tcp_metrics_cache.hh"
+
+#include <algorithm>
+
+using namespace std;
+
+TCPMetricsCache& TCPMetricsCache::global()
+{
+  static TCPMetricsCache cache;
+  return cache;
+}
+
+optional<TCPMetrics> TCPMetricsCache::lookup( uint32_t address )
+{
+  const lock_guard lock { mutex_ };
+  const auto it = entries_.find( address );
+  if ( it == entries_.end() ) {
+    return {};
+  }
+  if ( Clock::now() - it->second.updated > ENTRY_TTL ) {
+    entries_.erase( it );
+    return {};
+  }
+  return it->second.metrics;
+}
+
+void TCPMetricsCache::update( uint32_t address, const TCPMetrics& metrics )
+{
+  const lock_guard lock { mutex_ };
+  if ( entries_.size() >= MAX_ENTRIES and not entries_.contains( address ) ) {
+    entries_.erase( ranges::min_element( entries_, {}, []( const auto& entry ) { return entry.second.updated; } ) );
+  }
+  entries_.insert_or_assign( address, Entry { metrics, Clock::now() } );
+}
+
+size_t TCPMetricsCache::size()
+{
+  const lock_guard lock { mutex_ };
+  return entries_.size();
+}
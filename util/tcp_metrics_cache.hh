@@ -0,0 +1,49 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+//! What one connection learned about the path to its peer, for the next connection to start from
+struct TCPMetrics
+{
+  std::chrono::microseconds srtt {};            //!< Smoothed round-trip time
+  std::chrono::microseconds rttvar {};          //!< Round-trip time variation
+  std::optional<uint64_t> congestion_window {}; //!< Congestion window, if congestion had set one
+};
+
+//! \brief A process-wide cache of TCPMetrics by destination address (like Linux's tcp_metrics)
+//! \details Connections store their metrics when they close, and a new connection to the same address
+//! starts from them instead of from the configured defaults. Entries expire after ENTRY_TTL, and the
+//! cache holds at most MAX_ENTRIES (evicting the oldest entry when full).
+class TCPMetricsCache
+{
+  using Clock = std::chrono::steady_clock;
+
+  struct Entry
+  {
+    TCPMetrics metrics;
+    Clock::time_point updated;
+  };
+
+  std::mutex mutex_ {};
+  std::unordered_map<uint32_t, Entry> entries_ {};
+
+public:
+  static constexpr size_t MAX_ENTRIES = 1024;            //!< Most destinations remembered
+  static constexpr std::chrono::minutes ENTRY_TTL { 10 }; //!< How long metrics stay trustworthy
+
+  //! The cache shared by every connection in the process
+  static TCPMetricsCache& global();
+
+  //! The metrics remembered for `address` (an IPv4 address in numeric form), unless none or expired
+  std::optional<TCPMetrics> lookup( uint32_t address );
+
+  //! Remember the metrics of a connection to `address`
+  void update( uint32_t address, const TCPMetrics& metrics );
+
+  size_t size();
+};
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "coroutine_loop.hh"
+#include "tcp_minnow_socket_impl.hh"
+
+#include <coroutine>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+//! \brief Awaitable wrapper around TCPPeer for coroutines run by a CoroutineLoop
+//! \details Like TCPMinnowEmbeddedSocket (which it is built on), the socket runs on the loop's thread, with no
+//! thread or socketpair of its own, so many connections can share one thread. Instead of callbacks, a
+//! coroutine waits for each step in turn:
+//!
+//!     co_await socket.connect( tcp_config, adapter_config );
+//!     co_await socket.write( "request" );
+//!     socket.shutdown_write();
+//!     std::string reply;
+//!     co_await socket.read( reply );
+//!
+//! At most one coroutine may wait for each kind of operation at a time.
+template<TCPDatagramAdapter AdaptT>
+class TCPMinnowCoSocket : private CoroutineLoop::Timer
+{
+public:
+  //! Construct from the loop to run on and the interface that the TCPPeer will use to read and write datagrams
+  TCPMinnowCoSocket( CoroutineLoop& loop, AdaptT&& datagram_interface )
+    : _loop( loop ), _socket( loop.event_loop(), std::move( datagram_interface ) )
+  {
+    _socket.on_readable( [&]( Reader& /*unused*/ ) { _wake( _reading ); } );
+    _socket.on_received( [&] { _loop.touch( *this ); } );
+    _socket.on_writable( [&]( Writer& /*unused*/ ) {
+      _loop.touch( *this ); // what the rule sends may start the retransmission timer
+      if ( _socket.established() ) {
+        _wake( _opening );
+      }
+      if ( not _unwritten.empty() ) {
+        _fill();
+        if ( _unwritten.empty() ) {
+          _wake( _writing );
+        }
+      }
+    } );
+    _loop.add_timer( *this );
+  }
+
+  //! Connect; completes once the handshake does (and throws if it fails)
+  auto connect( const TCPConfig& c_tcp, const FdAdapterConfig& c_ad )
+  {
+    _socket.connect( c_tcp, c_ad );
+    _loop.touch( *this );
+    return _open();
+  }
+
+  //! Listen for a single connection; completes once the handshake does (and throws if it fails)
+  auto accept( const TCPConfig& c_tcp, const FdAdapterConfig& c_ad )
+  {
+    _socket.listen( c_tcp, c_ad );
+    _loop.touch( *this );
+    return _open();
+  }
+
+  //! Read what has arrived into `buffer`, waiting until something has; an empty buffer means EOF
+  auto read( std::string& buffer )
+  {
+    return Awaitable {
+      [&] {
+        const Reader& inbound = _socket.inbound_reader();
+        return not _socket.active() or inbound.bytes_buffered() or inbound.is_finished() or inbound.has_error();
+      },
+      [&]( std::coroutine_handle<> handle ) { _reading = handle; },
+      [&] {
+        Reader& inbound = _socket.inbound_reader();
+        buffer.clear();
+        while ( inbound.bytes_buffered() ) {
+          buffer += inbound.peek();
+          inbound.pop( inbound.peek().size() );
+        }
+        if ( buffer.empty() and inbound.has_error() ) {
+          throw std::runtime_error( "TCPMinnowCoSocket: inbound stream had an error" );
+        }
+        _socket.push(); // advertise the window the read opened
+        _loop.touch( *this );
+      } };
+  }
+
+  //! Write all of `data` to the outbound stream, waiting for room as needed (`data` must outlive the wait)
+  auto write( std::string_view data )
+  {
+    _unwritten = data;
+    _fill();
+    _socket.push();
+    _loop.touch( *this );
+    return Awaitable { [&] { return _unwritten.empty() or not _socket.active(); },
+                       [&]( std::coroutine_handle<> handle ) { _writing = handle; },
+                       [&] {
+                         if ( not _unwritten.empty() ) {
+                           _unwritten = {};
+                           throw std::runtime_error( "TCPMinnowCoSocket: connection ended during a write" );
+                         }
+                       } };
+  }
+
+  //! Finish the outbound stream
+  void shutdown_write()
+  {
+    _socket.outbound_writer().close();
+    _socket.push();
+    _loop.touch( *this );
+  }
+
+  //! Wait for the connection to end (including the lingering after both streams finish)
+  auto closed()
+  {
+    return Awaitable { [&] { return not _socket.active(); },
+                       [&]( std::coroutine_handle<> handle ) { _closing = handle; },
+                       [] {} };
+  }
+
+  //! Return peer address from underlying datagram adapter
+  const Address& peer_address() const { return _socket.peer_address(); }
+
+  ~TCPMinnowCoSocket() override { _loop.remove_timer( *this ); }
+
+  //! \name
+  //! The loop refers to this object, so it cannot be moved or copied
+
+  //!@{
+  TCPMinnowCoSocket( const TCPMinnowCoSocket& ) = delete;
+  TCPMinnowCoSocket( TCPMinnowCoSocket&& ) = delete;
+  TCPMinnowCoSocket& operator=( const TCPMinnowCoSocket& ) = delete;
+  TCPMinnowCoSocket& operator=( TCPMinnowCoSocket&& ) = delete;
+  //!@}
+
+private:
+  CoroutineLoop& _loop;
+  TCPMinnowEmbeddedSocket<AdaptT> _socket;
+
+  //! \name
+  //! The coroutine waiting for each kind of operation, if any
+
+  //!@{
+  std::coroutine_handle<> _opening {};
+  std::coroutine_handle<> _reading {};
+  std::coroutine_handle<> _writing {};
+  std::coroutine_handle<> _closing {};
+  //!@}
+
+  std::string_view _unwritten {}; //!< what the waiting write() has yet to put in the outbound stream
+
+  //! Schedule the coroutine waiting in `waiting`, if any
+  void _wake( std::coroutine_handle<>& waiting )
+  {
+    if ( waiting ) {
+      _loop.schedule( std::exchange( waiting, {} ) );
+    }
+  }
+
+  //! Move as much of _unwritten to the outbound stream as fits
+  void _fill()
+  {
+    Writer& outbound = _socket.outbound_writer();
+    const size_t len = std::min( _unwritten.size(), outbound.available_capacity() );
+    outbound.push( std::string { _unwritten.substr( 0, len ) } );
+    _unwritten.remove_prefix( len );
+  }
+
+  auto _open()
+  {
+    return Awaitable { [&] { return _socket.established() or not _socket.active(); },
+                       [&]( std::coroutine_handle<> handle ) { _opening = handle; },
+                       [&] {
+                         if ( not _socket.established() ) {
+                           throw std::runtime_error( "TCPMinnowCoSocket: connection failed" );
+                         }
+                       } };
+  }
+
+  void tick() override
+  {
+    _socket.tick();
+    if ( not _socket.active() ) {
+      _wake( _opening );
+      _wake( _reading );
+      _wake( _writing );
+      _wake( _closing );
+    }
+  }
+
+  std::chrono::microseconds wait_timeout() const override { return _socket.wait_timeout(); }
+};
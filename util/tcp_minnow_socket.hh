@@ -4,21 +4,29 @@
 #include "file_descriptor.hh"
 #include "socket.hh"
 #include "tcp_config.hh"
+#include "tcp_engine.hh"
 #include "tcp_peer.hh"
 #include "tuntap_adapter.hh"
 
 #include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <optional>
-#include <thread>
+#include <string_view>
+#include <vector>
 
 //! Multithreaded wrapper around TCPPeer that approximates the Unix sockets API
 template<TCPDatagramAdapter AdaptT>
-class TCPMinnowSocket : public LocalStreamSocket
+class TCPMinnowSocket
+  : public LocalStreamSocket
+  , private TCPEngine::Connection
 {
 public:
-  //! Construct from the interface that the TCPPeer thread will use to read and write datagrams
-  explicit TCPMinnowSocket( AdaptT&& datagram_interface );
+  //! Construct from the interface that the TCPPeer will use to read and write datagrams; once connected,
+  //! the connection is run by one of `engine`'s worker threads
+  explicit TCPMinnowSocket( AdaptT&& datagram_interface, TCPEngine& engine = TCPEngine::global() );
 
   //! Close socket, and wait for TCPPeer to finish
   //! \note Calling this function is only advisable if the socket has reached EOF,
@@ -26,7 +34,12 @@ public:
   void wait_until_closed();
 
   //! Connect using the specified configurations; blocks until connect succeeds or fails
-  void connect( const TCPConfig& c_tcp, const FdAdapterConfig& c_ad );
+  void connect( const TCPConfig& c_tcp, const FdAdapterConfig& c_ad ) { connect( c_tcp, c_ad, {} ); }
+
+  //! Connect, sending the first bytes of `data` with the SYN if TCP Fast Open (TCPConfig::fastopen) has a
+  //! cookie for the destination (or else right after the handshake), like sendto(2) with MSG_FASTOPEN
+  //! \returns how many bytes of `data` were taken (the rest must be written to the socket as usual)
+  size_t connect( const TCPConfig& c_tcp, const FdAdapterConfig& c_ad, std::string_view data );
 
   //! Listen and accept using the specified configurations; blocks until accept succeeds or fails
   void listen_and_accept( const TCPConfig& c_tcp, const FdAdapterConfig& c_ad );
@@ -67,25 +80,76 @@ private:
   //! Set up the TCPPeer and the event loop
   void _initialize_TCP( const TCPConfig& config );
 
+  //! Add the rules that run the TCPPeer to an event loop (the owner's while connecting, then a worker's)
+  void _install_rules( EventLoop& loop );
+
+  //! Handles to the rules added by _install_rules()
+  std::vector<EventLoop::RuleHandle> _rules {};
+
+  //! Set up what depends on the peer's address (TCP Fast Open cookies, cached metrics), once it is known:
+  //! when connecting, or from the SYN when listening
+  void _prepare_for_peer( bool active_open );
+
+  bool _peer_known { false }; //!< Has _prepare_for_peer() run?
+
   //! TCP state machine
   std::optional<TCPPeer> _tcp {};
 
   //! eventloop that handles all the events (new inbound datagram, new outbound bytes, new inbound bytes)
+  //! while the owner thread connects or accepts
   EventLoop _eventloop {};
 
+  //! Messages read from the adapter in one batch (see TCPBatchReadDatagramAdapter)
+  std::vector<TCPMessage> _inbound_batch {};
+
+  //! \name
+  //! Pass calls through to the TCPPeer, using a batched write when the adapter supports one
+
+  //!@{
+  void _tcp_push();
+  void _tcp_tick( std::chrono::microseconds since_last_tick );
+  void _tcp_receive( TCPMessage msg );
+  //!@}
+
   //! Process events while specified condition is true
   void _tcp_loop( const std::function<bool()>& condition );
 
-  //! Main loop of TCPPeer thread
-  void _tcp_main();
+  //! Tick the TCPPeer (and the adapter) with the time since the last tick
+  void _tcp_tick_now();
+
+  //! timestamp_us() at which the TCPPeer was last ticked
+  std::chrono::microseconds _last_tick_time {};
+
+  //! Lets the owner wake the TCPPeer's worker out of an indefinite wait (see the destructor)
+  FileDescriptor _wakeup;
+
+  //! Hand the established connection to the engine
+  void _start();
+
+  //! \name
+  //! TCPEngine::Connection, called on the worker thread
+
+  //!@{
+  void install( EventLoop& loop ) override;
+  bool tick() override;
+  std::chrono::microseconds wait_timeout() const override;
+  void finish() override;
+  //!@}
+
+  //! Runs the connection once it is established
+  TCPEngine& _engine;
 
-  //! Handle to the TCPPeer thread; owner thread calls join() in the destructor
-  std::thread _tcp_thread {};
+  bool _running { false };          //!< Has the connection been handed to the engine?
+  //! Has the engine finished with the connection? (Shared, so that finish() can still notify it after the
+  //! owner, woken by the store, has destroyed the socket.)
+  std::shared_ptr<std::atomic_bool> _done { std::make_shared<std::atomic_bool>( false ) };
 
   //! Construct LocalStreamSocket fds from socket pair, initialize eventloop
-  TCPMinnowSocket( std::pair<FileDescriptor, FileDescriptor> data_socket_pair, AdaptT&& datagram_interface );
+  TCPMinnowSocket( std::pair<FileDescriptor, FileDescriptor> data_socket_pair,
+                   AdaptT&& datagram_interface,
+                   TCPEngine& engine );
 
-  std::atomic_bool _abort { false }; //!< Flag used by the owner to force the TCPPeer thread to shut down
+  std::atomic_bool _abort { false }; //!< Flag used by the owner to force the TCPPeer's worker to drop it
 
   bool _inbound_shutdown { false }; //!< Has TCPMinnowSocket shut down the incoming data to the owner?
 
@@ -105,9 +169,10 @@ using LossyTCPOverIPv4MinnowSocket = TCPMinnowSocket<LossyFdAdapter<TCPOverIPv4O
 //! and reads from a reliable data stream, etc. Only the owner thread calls public
 //! methods of this class.
 //!
-//! The other, the "TCPPeer" thread, takes care of the back-end tasks that the kernel would
-//! perform for a TCPSocket: reading and parsing datagrams from the wire, filtering out
-//! segments unrelated to the connection, etc.
+//! The other, a worker thread of a TCPEngine (shared with many other sockets), takes care of
+//! the back-end tasks that the kernel would perform for a TCPSocket: reading and parsing datagrams
+//! from the wire, filtering out segments unrelated to the connection, etc. Until the connection is
+//! established, the owner thread does this itself.
 //!
 //! There are a few notable differences between the TCPMinnowSocket and TCPSocket interfaces:
 //!
@@ -135,3 +200,132 @@ public:
     TCPOverIPv4MinnowSocket::connect( tcp_config, multiplexer_config );
   }
 };
+
+//! \brief Single-threaded ("embedded") wrapper around TCPPeer that runs on the application's own EventLoop
+//! \details There is no worker thread and no socketpair: the application reads from inbound_reader() and
+//! writes to outbound_writer() directly (typically from the on_readable() and on_writable() callbacks, which
+//! run on the same EventLoop as the rules that feed the TCPPeer), so the stream's bytes are never copied
+//! through the kernel on their way to or from the application.
+//!
+//! The application drives the loop itself:
+//!
+//!     while ( socket.active() ) {
+//!       loop.wait_next_event( socket.wait_timeout() );
+//!       socket.tick();
+//!     }
+template<TCPDatagramAdapter AdaptT>
+class TCPMinnowEmbeddedSocket
+{
+public:
+  using ReadableCallback = std::function<void( Reader& )>;
+  using WritableCallback = std::function<void( Writer& )>;
+  using ReceivedCallback = std::function<void()>;
+
+  //! Construct from the event loop to run on and the interface that the TCPPeer will use to read and write
+  //! datagrams
+  TCPMinnowEmbeddedSocket( EventLoop& loop, AdaptT&& datagram_interface );
+
+  //! Start connecting (sends the SYN and returns)
+  void connect( const TCPConfig& c_tcp, const FdAdapterConfig& c_ad );
+
+  //! Start listening for a single connection (returns at once)
+  void listen( const TCPConfig& c_tcp, const FdAdapterConfig& c_ad );
+
+  //! Called when new bytes arrive in the inbound stream, and once when it finishes (or has an error).
+  //! It is not called again for bytes the callback left unread until more arrive.
+  void on_readable( ReadableCallback callback ) { _on_readable = std::move( callback ); }
+
+  //! Called once the connection is established, then whenever the outbound stream has gained capacity since
+  //! the callback last returned or push() was last called (until the stream is closed)
+  void on_writable( WritableCallback callback ) { _on_writable = std::move( callback ); }
+
+  //! Called after segments from the network reach the TCPPeer, which may have changed wait_timeout() or ended
+  //! the connection (e.g. so an owner of many sockets can tick() only those)
+  void on_received( ReceivedCallback callback ) { _on_received = std::move( callback ); }
+
+  //! Has the handshake completed?
+  bool established() const { return _established; }
+
+  //! Is the connection still going (including the lingering after both streams finish)?
+  bool active() const { return _tcp.has_value() and _tcp->active(); }
+
+  //! \name
+  //! The TCPPeer's streams (call push() after writing or closing outside the callbacks)
+
+  //!@{
+  Reader& inbound_reader() { return _tcp.value().inbound_reader(); }
+  Writer& outbound_writer() { return _tcp.value().outbound_writer(); }
+  //!@}
+
+  //! Send what has been written to the outbound stream (and a window update for what was read)
+  void push();
+
+  //! How long the event loop may wait before the next tick() (negative if only an event needs handling)
+  std::chrono::microseconds wait_timeout() const;
+
+  //! Let time pass for the TCPPeer (call after every EventLoop::wait_next_event)
+  void tick();
+
+  //! Return peer address from underlying datagram adapter
+  const Address& peer_address() const { return _datagram_adapter.config().destination; }
+
+  //! Removes the rules from the event loop; an active connection is simply abandoned
+  ~TCPMinnowEmbeddedSocket();
+
+  //! \name
+  //! The event loop's rules refer to this object, so it cannot be moved or copied
+
+  //!@{
+  TCPMinnowEmbeddedSocket( const TCPMinnowEmbeddedSocket& ) = delete;
+  TCPMinnowEmbeddedSocket( TCPMinnowEmbeddedSocket&& ) = delete;
+  TCPMinnowEmbeddedSocket& operator=( const TCPMinnowEmbeddedSocket& ) = delete;
+  TCPMinnowEmbeddedSocket& operator=( TCPMinnowEmbeddedSocket&& ) = delete;
+  //!@}
+
+protected:
+  //! Adapter to underlying datagram socket (e.g., UDP or IP)
+  AdaptT _datagram_adapter;
+
+private:
+  EventLoop& _eventloop;
+
+  //! Set up the TCPPeer and add the rules that run it to the event loop
+  void _initialize_TCP( const TCPConfig& config );
+
+  //! Handles to the rules added by _initialize_TCP()
+  std::vector<EventLoop::RuleHandle> _rules {};
+
+  //! TCP state machine
+  std::optional<TCPPeer> _tcp {};
+
+  //! Messages read from the adapter in one batch (see TCPBatchReadDatagramAdapter)
+  std::vector<TCPMessage> _inbound_batch {};
+
+  ReadableCallback _on_readable {};
+  WritableCallback _on_writable {};
+  ReceivedCallback _on_received {};
+
+  bool _active_open { false }; //!< Did this side connect (rather than listen)?
+  bool _peer_known { false };  //!< Has the peer's address been used to prepare the TCPPeer?
+  bool _established { false }; //!< Has the handshake completed?
+  bool _finished { false };    //!< Has the end of the connection been handled?
+
+  uint64_t _bytes_seen { 0 };         //!< inbound bytes announced to on_readable()
+  bool _inbound_end_seen { false };   //!< has the end of the inbound stream been announced?
+  uint64_t _capacity_seen { 0 };      //!< outbound capacity left when on_writable() last returned (or less)
+  bool _writable_announced { false }; //!< has on_writable() been called at all?
+
+  //! timestamp_us() at which the TCPPeer was last ticked
+  std::chrono::microseconds _last_tick_time {};
+
+  //! \name
+  //! When the callbacks are due
+
+  //!@{
+  bool _readable() const;
+  bool _writable() const;
+  //!@}
+
+  //! Pass one message to the TCPPeer
+  void _tcp_receive( TCPMessage msg );
+};
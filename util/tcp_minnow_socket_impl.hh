@@ -1,31 +1,180 @@
 #include "tcp_minnow_socket.hh"
 
 #include "exception.hh"
+#include "tcp_coalescer.hh"
+#include "tcp_fastopen.hh"
+#include "tcp_metrics_cache.hh"
 
+#include <algorithm>
 #include <cstddef>
 #include <exception>
 #include <iostream>
 #include <stdexcept>
 #include <string>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <unistd.h>
 #include <utility>
 
-static constexpr size_t TCP_TICK_MS = 10;
+static constexpr std::chrono::milliseconds TCP_TICK { 10 };
 
-inline uint64_t timestamp_ms()
+inline std::chrono::microseconds timestamp_us()
 {
-  static_assert( std::is_same_v<std::chrono::steady_clock::duration, std::chrono::nanoseconds> );
+  using namespace std::chrono;
+  return duration_cast<microseconds>( steady_clock::now().time_since_epoch() );
+}
+
+//! \name
+//! Pass calls through to a TCPPeer, using a batched write when the adapter supports one
+
+//!@{
+template<TCPDatagramAdapter AdaptT>
+void tcp_push( TCPPeer& tcp, AdaptT& adapter )
+{
+  if constexpr ( TCPBatchDatagramAdapter<AdaptT> ) {
+    tcp.push_batch( [&]( std::span<TCPMessage> msgs ) { adapter.write_batch( msgs ); } );
+  } else {
+    tcp.push( [&]( const TCPMessage& x ) { adapter.write( x ); } );
+  }
+}
+
+template<TCPDatagramAdapter AdaptT>
+void tcp_tick( TCPPeer& tcp, AdaptT& adapter, std::chrono::microseconds since_last_tick )
+{
+  if constexpr ( TCPBatchDatagramAdapter<AdaptT> ) {
+    tcp.tick_batch( since_last_tick, [&]( std::span<TCPMessage> msgs ) { adapter.write_batch( msgs ); } );
+  } else {
+    tcp.tick( since_last_tick, [&]( const TCPMessage& x ) { adapter.write( x ); } );
+  }
+}
+
+template<TCPDatagramAdapter AdaptT>
+void tcp_receive( TCPPeer& tcp, AdaptT& adapter, TCPMessage msg )
+{
+  if constexpr ( TCPBatchDatagramAdapter<AdaptT> ) {
+    tcp.receive_batch( std::move( msg ), [&]( std::span<TCPMessage> msgs ) { adapter.write_batch( msgs ); } );
+  } else {
+    tcp.receive( std::move( msg ), [&]( const TCPMessage& x ) { adapter.write( x ); } );
+  }
+}
+//!@}
+
+//! Read every datagram waiting on the adapter's fd and give it to the TCPPeer
+//! \param[in] batch is scratch space for a batch read (see TCPBatchReadDatagramAdapter)
+//! \param[in] receive passes one message to the TCPPeer
+template<TCPDatagramAdapter AdaptT>
+void tcp_read( AdaptT& adapter, std::vector<TCPMessage>& batch, const auto& receive )
+{
+  if constexpr ( TCPBatchReadDatagramAdapter<AdaptT> ) {
+    // Take everything waiting, merging in-order runs so each costs one receive (and one ACK).
+    batch.clear();
+    adapter.read_batch( batch );
+    TCPCoalescer::coalesce( batch );
+    for ( auto& msg : batch ) {
+      receive( std::move( msg ) );
+    }
+  } else if ( auto seg = adapter.read() ) {
+    receive( std::move( seg.value() ) );
+  }
+}
+
+//! Set up what depends on the peer's address (TCP Fast Open cookies, cached metrics)
+inline void tcp_prepare_for_peer( TCPPeer& tcp, uint32_t peer, bool active_open )
+{
+  const TCPConfig& config = tcp.config();
+
+  if ( config.fastopen and active_open ) {
+    tcp.use_fastopen_cookie( TCPFastOpen::global().cached_cookie( peer ) );
+  } else if ( config.fastopen ) {
+    tcp.expect_fastopen_cookie( TCPFastOpen::global().server_cookie( peer ) );
+  }
+
+  if ( config.cache_metrics ) {
+    if ( const auto metrics = TCPMetricsCache::global().lookup( peer ) ) {
+      tcp.seed_metrics( *metrics );
+    }
+  }
+}
+
+//! Remember what the finished connection measured about the peer, for the next connection to it
+inline void tcp_save_metrics( const TCPPeer& tcp, uint32_t peer )
+{
+  if ( tcp.config().cache_metrics ) {
+    if ( const auto metrics = tcp.metrics() ) {
+      TCPMetricsCache::global().update( peer, *metrics );
+    }
+  }
+}
+
+template<TCPDatagramAdapter AdaptT>
+void TCPMinnowSocket<AdaptT>::_tcp_push()
+{
+  tcp_push( _tcp.value(), _datagram_adapter );
+}
 
-  return std::chrono::steady_clock::now().time_since_epoch().count() / 1000000;
+template<TCPDatagramAdapter AdaptT>
+void TCPMinnowSocket<AdaptT>::_tcp_tick( std::chrono::microseconds since_last_tick )
+{
+  tcp_tick( _tcp.value(), _datagram_adapter, since_last_tick );
+}
+
+template<TCPDatagramAdapter AdaptT>
+void TCPMinnowSocket<AdaptT>::_tcp_receive( TCPMessage msg )
+{
+  // Reading the SYN has told a listening adapter who the peer is.
+  if ( not _peer_known ) [[unlikely]] {
+    _prepare_for_peer( false );
+  }
+
+  tcp_receive( _tcp.value(), _datagram_adapter, std::move( msg ) );
+}
+
+template<TCPDatagramAdapter AdaptT>
+void TCPMinnowSocket<AdaptT>::_prepare_for_peer( bool active_open )
+{
+  _peer_known = true;
+  tcp_prepare_for_peer( _tcp.value(), _datagram_adapter.config().destination.ipv4_numeric(), active_open );
+}
+
+//! \returns the poll timeout that wakes the loop no later than the TCPPeer's next deadline (negative if the
+//! TCPPeer has none)
+template<TCPDatagramAdapter AdaptT>
+std::chrono::microseconds TCPMinnowSocket<AdaptT>::wait_timeout() const
+{
+  // Once the connection is over, keep polling periodically while the last inbound bytes are flushed.
+  if ( not _tcp.has_value() or not _tcp->active() ) {
+    return TCP_TICK;
+  }
+
+  const auto deadline = _tcp->next_deadline();
+  if ( not deadline.has_value() ) {
+    // nothing is timed: sleep until a datagram, the application or the owner wakes us
+    return std::chrono::microseconds { -1 };
+  }
+
+  const auto until_deadline = *deadline - _tcp->current_time();
+  const auto elapsed = timestamp_us() - _last_tick_time;
+  return std::max( until_deadline - elapsed, std::chrono::microseconds { 0 } );
+}
+
+template<TCPDatagramAdapter AdaptT>
+void TCPMinnowSocket<AdaptT>::_tcp_tick_now()
+{
+  const auto next_time = timestamp_us();
+  if ( _tcp.value().active() ) {
+    _tcp_tick( next_time - _last_tick_time );
+    _datagram_adapter.tick( next_time - _last_tick_time );
+  }
+  _last_tick_time = next_time;
 }
 
 //! \param[in] condition is a function returning true if loop should continue
 template<TCPDatagramAdapter AdaptT>
 void TCPMinnowSocket<AdaptT>::_tcp_loop( const std::function<bool()>& condition )
 {
-  auto base_time = timestamp_ms();
+  _last_tick_time = timestamp_us();
   while ( condition() ) {
-    auto ret = _eventloop.wait_next_event( TCP_TICK_MS );
+    auto ret = _eventloop.wait_next_event( wait_timeout() );
     if ( ret == EventLoop::Result::Exit or _abort ) {
       break;
     }
@@ -34,23 +183,22 @@ void TCPMinnowSocket<AdaptT>::_tcp_loop( const std::function<bool()>& condition
       throw std::runtime_error( "_tcp_loop entered before TCPPeer initialized" );
     }
 
-    if ( _tcp.value().active() ) {
-      const auto next_time = timestamp_ms();
-      _tcp.value().tick( next_time - base_time, [&]( const auto& x ) { _datagram_adapter.write( x ); } );
-      _datagram_adapter.tick( next_time - base_time );
-      base_time = next_time;
-    }
+    _tcp_tick_now();
   }
 }
 
 //! \param[in] data_socket_pair is a pair of connected AF_UNIX SOCK_STREAM sockets
 //! \param[in] datagram_interface is the interface for reading and writing datagrams
+//! \param[in] engine runs the connection once it is established
 template<TCPDatagramAdapter AdaptT>
 TCPMinnowSocket<AdaptT>::TCPMinnowSocket( std::pair<FileDescriptor, FileDescriptor> data_socket_pair,
-                                          AdaptT&& datagram_interface )
+                                          AdaptT&& datagram_interface,
+                                          TCPEngine& engine )
   : LocalStreamSocket( std::move( data_socket_pair.first ) )
   , _datagram_adapter( std::move( datagram_interface ) )
   , _thread_data( std::move( data_socket_pair.second ) )
+  , _wakeup( CheckSystemCall( "eventfd", ::eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) )
+  , _engine( engine )
 {
   _thread_data.set_blocking( false );
 }
@@ -59,7 +207,13 @@ template<TCPDatagramAdapter AdaptT>
 void TCPMinnowSocket<AdaptT>::_initialize_TCP( const TCPConfig& config )
 {
   _tcp.emplace( config );
+  _install_rules( _eventloop );
+}
 
+//! \param[in] loop is the owner's event loop while connecting, or an engine worker's once connected
+template<TCPDatagramAdapter AdaptT>
+void TCPMinnowSocket<AdaptT>::_install_rules( EventLoop& loop )
+{
   // Set up the event loop
 
   // There are three events to handle:
@@ -73,16 +227,30 @@ void TCPMinnowSocket<AdaptT>::_initialize_TCP( const TCPConfig& config )
   // 3) Incoming bytes reassembled by the Reassembler
   //    (needs to be read from the inbound_stream and written
   //    to the local stream socket back to the application)
+  //
+  // The rules that face the application have Priority::High, so a flood of datagrams from the network
+  // cannot keep the application waiting. Each touch()es the connection, so the engine ticks it after the wait.
+
+  // rule 0: wake-up from the owner (the loop may otherwise sleep until the TCPPeer's next deadline)
+  _rules.push_back( loop.add_rule(
+    loop.category( "wake up TCPPeer", EventLoop::Priority::High ),
+    _wakeup,
+    Direction::In,
+    [&] {
+      touch();
+      std::string counter( sizeof( uint64_t ), 0 );
+      _wakeup.read( counter );
+    },
+    [&] { return _tcp->active(); } ) );
 
   // rule 1: read from filtered packet stream and dump into TCPConnection
-  _eventloop.add_rule(
-    "receive TCP segment from the network",
+  _rules.push_back( loop.add_rule(
+    loop.category( "receive TCP segment from the network" ),
     _datagram_adapter.fd(),
     Direction::In,
     [&] {
-      if ( auto seg = _datagram_adapter.read() ) {
-        _tcp->receive( std::move( seg.value() ), [&]( const auto& x ) { _datagram_adapter.write( x ); } );
-      }
+      touch();
+      tcp_read( _datagram_adapter, _inbound_batch, [&]( TCPMessage msg ) { _tcp_receive( std::move( msg ) ); } );
 
       // debugging output:
       if ( _thread_data.eof() and _tcp.value().sender().sequence_numbers_in_flight() == 0 and not _fully_acked ) {
@@ -91,14 +259,15 @@ void TCPMinnowSocket<AdaptT>::_initialize_TCP( const TCPConfig& config )
         _fully_acked = true;
       }
     },
-    [&] { return _tcp->active(); } );
+    [&] { return _tcp->active(); } ) );
 
   // rule 2: read from pipe into outbound buffer
-  _eventloop.add_rule(
-    "push bytes to TCPPeer",
+  _rules.push_back( loop.add_rule(
+    loop.category( "push bytes to TCPPeer", EventLoop::Priority::High ),
     _thread_data,
     Direction::In,
     [&] {
+      touch();
       std::string data;
       data.resize( _tcp->outbound_writer().available_capacity() );
       _thread_data.read( data );
@@ -115,27 +284,30 @@ void TCPMinnowSocket<AdaptT>::_initialize_TCP( const TCPConfig& config )
                   << " still in flight).\n";
       }
 
-      _tcp->push( [&]( const auto& x ) { _datagram_adapter.write( x ); } );
+      _tcp_push();
     },
     [&] {
       return ( _tcp->active() ) and ( not _outbound_shutdown )
              and ( _tcp->outbound_writer().available_capacity() > 0 );
     },
     [&] {
+      touch();
       _tcp->outbound_writer().close();
       _outbound_shutdown = true;
     },
     [&] {
+      touch();
       std::cerr << "DEBUG: minnow outbound stream had error.\n";
       _tcp->outbound_writer().set_error();
-    } );
+    } ) );
 
   // rule 3: read from inbound buffer into pipe
-  _eventloop.add_rule(
-    "read bytes from inbound stream",
+  _rules.push_back( loop.add_rule(
+    loop.category( "read bytes from inbound stream", EventLoop::Priority::High ),
     _thread_data,
     Direction::Out,
     [&] {
+      touch();
       Reader& inbound = _tcp->inbound_reader();
       // Write from the inbound_stream into
       // the pipe, handling the possibility of a partial
@@ -160,11 +332,15 @@ void TCPMinnowSocket<AdaptT>::_initialize_TCP( const TCPConfig& config )
              or ( ( _tcp->inbound_reader().is_finished() or _tcp->inbound_reader().has_error() )
                   and not _inbound_shutdown );
     },
-    [&] {},
     [&] {
+      touch();
+      _inbound_shutdown = true; // the owner hung up, so there is nowhere left to write
+    },
+    [&] {
+      touch();
       std::cerr << "DEBUG: minnow inbound stream had error.\n";
       _tcp->inbound_reader().set_error();
-    } );
+    } ) );
 }
 
 //! \brief Call [socketpair](\ref man2::socketpair) and return connected Unix-domain sockets of specified type
@@ -179,21 +355,25 @@ inline std::pair<SocketType, SocketType> socket_pair_helper( int domain, int typ
 }
 
 //! \param[in] datagram_interface is the underlying interface (e.g. to UDP, IP, or Ethernet)
+//! \param[in] engine runs the connection once it is established
 template<TCPDatagramAdapter AdaptT>
-TCPMinnowSocket<AdaptT>::TCPMinnowSocket( AdaptT&& datagram_interface )
+TCPMinnowSocket<AdaptT>::TCPMinnowSocket( AdaptT&& datagram_interface, TCPEngine& engine )
   : TCPMinnowSocket( socket_pair_helper<LocalStreamSocket>( AF_UNIX, SOCK_STREAM ),
-                     std::move( datagram_interface ) )
+                     std::move( datagram_interface ),
+                     engine )
 {}
 
 template<TCPDatagramAdapter AdaptT>
 TCPMinnowSocket<AdaptT>::~TCPMinnowSocket()
 {
   try {
-    if ( _tcp_thread.joinable() ) {
+    if ( _running and not *_done ) {
       std::cerr << "Warning: unclean shutdown of TCPMinnowSocket\n";
-      // force the other side to exit
+      // force the worker to drop the connection
       _abort.store( true );
-      _tcp_thread.join();
+      const uint64_t one = 1;
+      CheckSystemCall( "write", ::write( _wakeup.fd_num(), &one, sizeof( one ) ) );
+      _done->wait( false );
     }
   } catch ( const std::exception& e ) {
     std::cerr << "Exception destructing TCPMinnowSocket: " << e.what() << "\n";
@@ -204,17 +384,20 @@ template<TCPDatagramAdapter AdaptT>
 void TCPMinnowSocket<AdaptT>::wait_until_closed()
 {
   shutdown( SHUT_RDWR );
-  if ( _tcp_thread.joinable() ) {
+  if ( _running ) {
     std::cerr << "DEBUG: minnow waiting for clean shutdown... ";
-    _tcp_thread.join();
+    _done->wait( false );
     std::cerr << "done.\n";
   }
 }
 
 //! \param[in] c_tcp is the TCPConfig for the TCPConnection
 //! \param[in] c_ad is the FdAdapterConfig for the FdAdapter
+//! \param[in] data is sent with the SYN (as much as fits in one segment) if a Fast Open cookie is cached
 template<TCPDatagramAdapter AdaptT>
-void TCPMinnowSocket<AdaptT>::connect( const TCPConfig& c_tcp, const FdAdapterConfig& c_ad )
+size_t TCPMinnowSocket<AdaptT>::connect( const TCPConfig& c_tcp,
+                                         const FdAdapterConfig& c_ad,
+                                         std::string_view data )
 {
   if ( _tcp ) {
     throw std::runtime_error( "connect() with TCPConnection already initialized" );
@@ -230,13 +413,19 @@ void TCPMinnowSocket<AdaptT>::connect( const TCPConfig& c_tcp, const FdAdapterCo
     throw std::runtime_error( "TCPPeer not successfully initialized" );
   }
 
-  _tcp->push( [&]( const auto& x ) { _datagram_adapter.write( x ); } );
+  _prepare_for_peer( true );
+  const size_t data_taken = std::min( data.size(), _tcp->outbound_writer().available_capacity() );
+  _tcp->outbound_writer().push( std::string { data.substr( 0, data_taken ) } );
+
+  _tcp_push();
 
-  if ( _tcp->sender().sequence_numbers_in_flight() != 1 ) {
-    throw std::runtime_error( "After TCPConnection::connect(), expected sequence_numbers_in_flight() == 1" );
+  // The SYN, and any data that went with it
+  const uint64_t syn_length = _tcp->sender().sequence_numbers_in_flight();
+  if ( syn_length == 0 ) {
+    throw std::runtime_error( "After TCPConnection::connect(), expected the SYN to be in flight" );
   }
 
-  _tcp_loop( [&] { return _tcp->sender().sequence_numbers_in_flight() == 1; } );
+  _tcp_loop( [&] { return _tcp->sender().sequence_numbers_in_flight() == syn_length; } );
 
   if ( not _tcp.has_value() ) {
     throw std::runtime_error( "TCPPeer destroyed unexpectedly" );
@@ -247,7 +436,12 @@ void TCPMinnowSocket<AdaptT>::connect( const TCPConfig& c_tcp, const FdAdapterCo
     std::cerr << "DEBUG: minnow successfully connected to " << c_ad.destination.to_string() << ".\n";
   }
 
-  _tcp_thread = std::thread( &TCPMinnowSocket::_tcp_main, this );
+  if ( const auto& cookie = _tcp->issued_fastopen_cookie() ) {
+    TCPFastOpen::global().cache_cookie( c_ad.destination.ipv4_numeric(), *cookie );
+  }
+
+  _start();
+  return data_taken;
 }
 
 //! \param[in] c_tcp is the TCPConfig for the TCPConnection
@@ -268,28 +462,241 @@ void TCPMinnowSocket<AdaptT>::listen_and_accept( const TCPConfig& c_tcp, const F
   _tcp_loop( [&] { return ( not _tcp->has_ackno() ) or ( _tcp->sender().sequence_numbers_in_flight() ); } );
   std::cerr << "DEBUG: minnow new connection from " << _datagram_adapter.config().destination.to_string() << ".\n";
 
-  _tcp_thread = std::thread( &TCPMinnowSocket::_tcp_main, this );
+  _start();
+}
+
+template<TCPDatagramAdapter AdaptT>
+void TCPMinnowSocket<AdaptT>::_start()
+{
+  // Move the rules from the owner's event loop to a worker's (dropping the owner's copies of the fds).
+  for ( auto& rule : _rules ) {
+    rule.cancel();
+  }
+  _rules.clear();
+  _eventloop = EventLoop {};
+
+  const FdAdapterConfig& config = _datagram_adapter.config();
+  _running = true;
+  _engine.add( *this,
+               { .local_address = config.source.ipv4_numeric(),
+                 .remote_address = config.destination.ipv4_numeric(),
+                 .local_port = config.source.port(),
+                 .remote_port = config.destination.port() } );
+}
+
+template<TCPDatagramAdapter AdaptT>
+void TCPMinnowSocket<AdaptT>::install( EventLoop& loop )
+{
+  _install_rules( loop );
+}
+
+//! \returns false once the connection is over and its last inbound bytes have been handed to the owner
+//! (or the owner has aborted it)
+template<TCPDatagramAdapter AdaptT>
+bool TCPMinnowSocket<AdaptT>::tick()
+{
+  if ( _abort ) {
+    return false;
+  }
+  _tcp_tick_now();
+  return _tcp->active() or not _inbound_shutdown;
 }
 
 template<TCPDatagramAdapter AdaptT>
-void TCPMinnowSocket<AdaptT>::_tcp_main()
+void TCPMinnowSocket<AdaptT>::finish()
 {
+  for ( auto& rule : _rules ) {
+    rule.cancel();
+  }
+  _rules.clear();
+
   try {
-    if ( not _tcp.has_value() ) {
-      throw std::runtime_error( "no TCP" );
-    }
-    _tcp_loop( [] { return true; } );
     shutdown( SHUT_RDWR );
-    if ( not _tcp.has_value() ) {
-      throw std::runtime_error( "TCP implementation destroyed unexpectedly" );
-    }
     if ( not _tcp.value().active() ) {
       std::cerr << "DEBUG: minnow TCP connection finished "
                 << ( _tcp->inbound_reader().has_error() ? "uncleanly.\n" : "cleanly.\n" );
     }
+    tcp_save_metrics( _tcp.value(), _datagram_adapter.config().destination.ipv4_numeric() );
     _tcp.reset();
   } catch ( const std::exception& e ) {
-    std::cerr << "Exception in TCPConnection runner thread: " << e.what() << "\n";
-    throw e;
+    std::cerr << "Exception finishing TCPMinnowSocket: " << e.what() << "\n";
+  }
+
+  // The owner may destroy the socket as soon as it sees this, so hold on to the flag to notify it.
+  const std::shared_ptr<std::atomic_bool> done = _done;
+  *done = true;
+  done->notify_all();
+}
+
+//! \param[in] loop is the application's event loop, which the socket's rules are added to
+//! \param[in] datagram_interface is the underlying interface (e.g. to UDP, IP, or Ethernet)
+template<TCPDatagramAdapter AdaptT>
+TCPMinnowEmbeddedSocket<AdaptT>::TCPMinnowEmbeddedSocket( EventLoop& loop, AdaptT&& datagram_interface )
+  : _datagram_adapter( std::move( datagram_interface ) ), _eventloop( loop )
+{}
+
+template<TCPDatagramAdapter AdaptT>
+TCPMinnowEmbeddedSocket<AdaptT>::~TCPMinnowEmbeddedSocket()
+{
+  if ( active() ) {
+    std::cerr << "Warning: unclean shutdown of TCPMinnowEmbeddedSocket\n";
+  }
+  for ( auto& rule : _rules ) {
+    rule.cancel();
+  }
+}
+
+template<TCPDatagramAdapter AdaptT>
+void TCPMinnowEmbeddedSocket<AdaptT>::_initialize_TCP( const TCPConfig& config )
+{
+  if ( _tcp ) {
+    throw std::runtime_error( "TCPMinnowEmbeddedSocket already initialized" );
+  }
+  _tcp.emplace( config );
+  _last_tick_time = timestamp_us();
+
+  // rule 1: read from filtered packet stream and dump into TCPPeer
+  _rules.push_back( _eventloop.add_rule(
+    _eventloop.category( "receive TCP segment from the network" ),
+    _datagram_adapter.fd(),
+    Direction::In,
+    [&] {
+      tcp_read( _datagram_adapter, _inbound_batch, [&]( TCPMessage msg ) { _tcp_receive( std::move( msg ) ); } );
+      if ( _on_received ) {
+        _on_received();
+      }
+    },
+    [&] { return _tcp->active(); } ) );
+
+  // rule 2: hand new inbound bytes to the application, then advertise the window they leave
+  _rules.push_back( _eventloop.add_rule(
+    _eventloop.category( "application reads inbound stream", EventLoop::Priority::High ),
+    [&] {
+      Reader& inbound = _tcp->inbound_reader();
+      _bytes_seen = inbound.bytes_popped() + inbound.bytes_buffered();
+      _inbound_end_seen = inbound.is_finished() or inbound.has_error();
+      _on_readable( inbound );
+      push();
+    },
+    [&] { return _readable(); } ) );
+
+  // rule 3: let the application fill the outbound stream, then send what it wrote
+  _rules.push_back( _eventloop.add_rule(
+    _eventloop.category( "application writes outbound stream", EventLoop::Priority::High ),
+    [&] {
+      _writable_announced = true;
+      _on_writable( _tcp->outbound_writer() );
+      _capacity_seen = _tcp->outbound_writer().available_capacity();
+      push();
+    },
+    [&] { return _writable(); } ) );
+}
+
+template<TCPDatagramAdapter AdaptT>
+bool TCPMinnowEmbeddedSocket<AdaptT>::_readable() const
+{
+  if ( not _on_readable ) {
+    return false;
+  }
+  const Reader& inbound = _tcp->receiver().reader();
+  return inbound.bytes_popped() + inbound.bytes_buffered() > _bytes_seen
+         or ( ( inbound.is_finished() or inbound.has_error() ) and not _inbound_end_seen );
+}
+
+template<TCPDatagramAdapter AdaptT>
+bool TCPMinnowEmbeddedSocket<AdaptT>::_writable() const
+{
+  if ( not _on_writable or not _established or not _tcp->active() ) {
+    return false;
+  }
+  const Writer& outbound = _tcp->sender().writer();
+  return not outbound.is_closed() and outbound.available_capacity() > 0
+         and ( not _writable_announced or outbound.available_capacity() > _capacity_seen );
+}
+
+//! \param[in] c_tcp is the TCPConfig for the TCPPeer
+//! \param[in] c_ad is the FdAdapterConfig for the FdAdapter
+template<TCPDatagramAdapter AdaptT>
+void TCPMinnowEmbeddedSocket<AdaptT>::connect( const TCPConfig& c_tcp, const FdAdapterConfig& c_ad )
+{
+  _initialize_TCP( c_tcp );
+  _datagram_adapter.config_mut() = c_ad;
+  _active_open = true;
+  _peer_known = true;
+  tcp_prepare_for_peer( *_tcp, c_ad.destination.ipv4_numeric(), true );
+  push();
+}
+
+//! \param[in] c_tcp is the TCPConfig for the TCPPeer
+//! \param[in] c_ad is the FdAdapterConfig for the FdAdapter
+template<TCPDatagramAdapter AdaptT>
+void TCPMinnowEmbeddedSocket<AdaptT>::listen( const TCPConfig& c_tcp, const FdAdapterConfig& c_ad )
+{
+  _initialize_TCP( c_tcp );
+  _datagram_adapter.config_mut() = c_ad;
+  _datagram_adapter.set_listening( true );
+}
+
+template<TCPDatagramAdapter AdaptT>
+void TCPMinnowEmbeddedSocket<AdaptT>::_tcp_receive( TCPMessage msg )
+{
+  // Reading the SYN has told a listening adapter who the peer is.
+  if ( not _peer_known ) [[unlikely]] {
+    _peer_known = true;
+    tcp_prepare_for_peer( *_tcp, _datagram_adapter.config().destination.ipv4_numeric(), false );
+  }
+
+  tcp_receive( *_tcp, _datagram_adapter, std::move( msg ) );
+
+  // The same conditions that end the blocking connect() and listen_and_accept()
+  if ( not _established and _tcp->has_ackno() ) {
+    _established = _active_open or _tcp->sender().sequence_numbers_in_flight() == 0;
+  }
+}
+
+template<TCPDatagramAdapter AdaptT>
+void TCPMinnowEmbeddedSocket<AdaptT>::push()
+{
+  if ( active() ) {
+    // What the application wrote itself counts against the capacity on_writable() was last called with.
+    _capacity_seen = std::min( _capacity_seen, _tcp->sender().writer().available_capacity() );
+    tcp_push( *_tcp, _datagram_adapter );
+  }
+}
+
+template<TCPDatagramAdapter AdaptT>
+std::chrono::microseconds TCPMinnowEmbeddedSocket<AdaptT>::wait_timeout() const
+{
+  if ( not active() ) {
+    return std::chrono::microseconds { -1 };
+  }
+
+  const auto deadline = _tcp->next_deadline();
+  if ( not deadline.has_value() ) {
+    return std::chrono::microseconds { -1 };
+  }
+
+  const auto until_deadline = *deadline - _tcp->current_time();
+  const auto elapsed = timestamp_us() - _last_tick_time;
+  return std::max( until_deadline - elapsed, std::chrono::microseconds { 0 } );
+}
+
+template<TCPDatagramAdapter AdaptT>
+void TCPMinnowEmbeddedSocket<AdaptT>::tick()
+{
+  if ( not _tcp.has_value() ) {
+    return;
+  }
+
+  const auto next_time = timestamp_us();
+  if ( _tcp->active() ) {
+    tcp_tick( *_tcp, _datagram_adapter, next_time - _last_tick_time );
+    _datagram_adapter.tick( next_time - _last_tick_time );
+  }
+  _last_tick_time = next_time;
+
+  if ( not _tcp->active() and not _finished ) {
+    _finished = true;
+    tcp_save_metrics( *_tcp, _datagram_adapter.config().destination.ipv4_numeric() );
   }
 }
@@ -1,9 +1,11 @@
 #include "tcp_over_ip.hh"
 
+#include "checksum.hh"
 #include "helpers.hh"
 #include "ipv4_datagram.hh"
 #include "ipv4_header.hh"
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <utility>
@@ -68,24 +70,114 @@ optional<TCPMessage> TCPOverIPv4Adapter::unwrap_tcp_in_ip( InternetDatagram ip_d
     return {};
   }
 
+  // did a router on the way signal congestion?
+  tcp_seg.message.sender->CE = ip_dgram.header.ecn() == IPv4Header::ECN_CE;
+
   return move( tcp_seg.message );
 }
 
+namespace {
+uint16_t get16( string_view src, size_t offset )
+{
+  const auto high = static_cast<uint8_t>( src[offset] );
+  const auto low = static_cast<uint8_t>( src[offset + 1] );
+  return static_cast<uint16_t>( high << 8 | low );
+}
+
+uint32_t get32( string_view src, size_t offset )
+{
+  return static_cast<uint32_t>( get16( src, offset ) ) << 16 | get16( src, offset + 2 );
+}
+} // namespace
+
+//! \details Only the fields needed to route the datagram are read: no checksum is computed, so a datagram
+//! that passes this check may still fail to parse.
+//! \param[in] ip_header holds at least the IPv4 header (including any options)
+//! \param[in] tcp_header holds at least the fixed part of the TCP header
+optional<TCPOverIPv4Adapter::Peek> TCPOverIPv4Adapter::peek_tcp_in_ip( string_view ip_header,
+                                                                       string_view tcp_header )
+{
+  if ( ip_header.size() < IPv4Header::LENGTH or tcp_header.size() < TCPSegment::HEADER_LENGTH ) {
+    return {};
+  }
+
+  const auto first_byte = static_cast<uint8_t>( ip_header[0] );
+  const size_t ip_header_length = ( first_byte & 0x0fU ) * 4UL;
+  if ( first_byte >> 4 != 4 or ip_header_length < IPv4Header::LENGTH or ip_header.size() < ip_header_length ) {
+    return {};
+  }
+
+  // a TCP segment, unfragmented, that claims to be long enough to hold a TCP header?
+  if ( static_cast<uint8_t>( ip_header[9] ) != IPv4Header::PROTO_TCP or ( get16( ip_header, 6 ) & 0x3fff ) != 0
+       or get16( ip_header, 2 ) < ip_header_length + TCPSegment::HEADER_LENGTH ) {
+    return {};
+  }
+
+  const auto flags = static_cast<uint8_t>( tcp_header[13] );
+  return Peek { .tuple = { .local_address = get32( ip_header, 16 ),
+                           .remote_address = get32( ip_header, 12 ),
+                           .local_port = get16( tcp_header, 2 ),
+                           .remote_port = get16( tcp_header, 0 ) },
+                .seqno = get32( tcp_header, 4 ),
+                .ackno = get32( tcp_header, 8 ),
+                .SYN = static_cast<bool>( flags & 0x02 ),
+                .ACK = static_cast<bool>( flags & 0x10 ),
+                .RST = static_cast<bool>( flags & 0x04 ) };
+}
+
+optional<TCPOverIPv4Adapter::Peek> TCPOverIPv4Adapter::peek_tcp_in_ip( string_view datagram )
+{
+  if ( datagram.empty() ) {
+    return {};
+  }
+  const size_t ip_header_length = ( static_cast<uint8_t>( datagram[0] ) & 0x0fU ) * 4UL;
+  if ( datagram.size() < ip_header_length ) {
+    return {};
+  }
+  return peek_tcp_in_ip( datagram.substr( 0, ip_header_length ), datagram.substr( ip_header_length ) );
+}
+
+//! \details Applies the same address and port checks as unwrap_tcp_in_ip()
+bool TCPOverIPv4Adapter::is_related( const Peek& peek ) const
+{
+  if ( peek.tuple.local_port != config().source.port() ) {
+    return false;
+  }
+
+  if ( listening() ) {
+    return peek.SYN and not peek.RST;
+  }
+
+  return peek.tuple.local_address == config().source.ipv4_numeric()
+         and peek.tuple.remote_address == config().destination.ipv4_numeric()
+         and peek.tuple.remote_port == config().destination.port();
+}
+
 //! Takes a TCP segment, sets port numbers as necessary, and wraps it in an IPv4 datagram
 //! \param[in] seg is the TCP segment to convert
 InternetDatagram TCPOverIPv4Adapter::wrap_tcp_in_ip( const TCPMessage& msg )
+{
+  return wrap_tcp_in_ip( msg,
+                         { .local_address = config().source.ipv4_numeric(),
+                           .remote_address = config().destination.ipv4_numeric(),
+                           .local_port = config().source.port(),
+                           .remote_port = config().destination.port() } );
+}
+
+InternetDatagram TCPOverIPv4Adapter::wrap_tcp_in_ip( const TCPMessage& msg, const FourTuple& tuple )
 {
   const size_t payload_size = msg.sender->payload.size();
   TCPSegment seg { .message = { .sender = msg.sender.borrow(), .receiver = msg.receiver.borrow() } };
   // set the port numbers in the TCP segment
-  seg.udinfo.src_port = config().source.port();
-  seg.udinfo.dst_port = config().destination.port();
+  seg.udinfo.src_port = tuple.local_port;
+  seg.udinfo.dst_port = tuple.remote_port;
 
   // create an Internet Datagram and set its addresses and length
   InternetDatagram ip_dgram;
-  ip_dgram.header.src = config().source.ipv4_numeric();
-  ip_dgram.header.dst = config().destination.ipv4_numeric();
-  ip_dgram.header.len = ip_dgram.header.hlen * 4 + 20 /* tcp header len */ + payload_size;
+  ip_dgram.header.src = tuple.local_address;
+  ip_dgram.header.dst = tuple.remote_address;
+  ip_dgram.header.len = ip_dgram.header.hlen * 4 + seg.header_length() + payload_size;
+  ip_dgram.header.set_ecn( msg.sender->ECT ? IPv4Header::ECN_ECT0 : IPv4Header::ECN_NOT_ECT );
 
   // set payload, calculating TCP checksum using information from IP header
   seg.compute_checksum( ip_dgram.header.pseudo_checksum() );
@@ -94,3 +186,106 @@ InternetDatagram TCPOverIPv4Adapter::wrap_tcp_in_ip( const TCPMessage& msg )
 
   return ip_dgram;
 }
+
+namespace {
+class Wrap32Serializable : public Wrap32
+{
+public:
+  uint32_t raw_value() const { return raw_value_; }
+};
+
+void put16( string& dst, size_t offset, uint16_t val )
+{
+  dst[offset] = static_cast<char>( val >> 8 );
+  dst[offset + 1] = static_cast<char>( val );
+}
+
+// Internet checksum of a precomputed (folded) sum plus some 16-bit words and some data
+uint16_t finish_checksum( uint16_t folded_sum, initializer_list<uint16_t> words, string_view data = {} )
+{
+  uint32_t sum = folded_sum;
+  for ( const uint16_t word : words ) {
+    sum += word;
+  }
+  InternetChecksum check { sum };
+  check.add( data );
+  return check.value();
+}
+} // namespace
+
+//! \details The IPv4 and TCP headers are built once, as a template whose checksums are summed ahead of time.
+//! Each datagram then copies the template, patches its length, seqno and flags, and folds just those fields
+//! and its payload into the precomputed sums (the ones' complement sum is associative, so the result is the
+//! checksum that serializing the datagram from scratch would give). The SYN and CWR flags go only in the first
+//! datagram and the FIN only in the last.
+void TCPOverIPv4Adapter::segment_tcp_in_ip( const TCPMessage& msg, vector<SegmentedDatagram>& out )
+{
+  static constexpr size_t IP_LEN_OFFSET = 2;
+  static constexpr size_t IP_CKSUM_OFFSET = 10;
+  static constexpr size_t TCP_SEQNO_OFFSET = IPv4Header::LENGTH + 4;
+  static constexpr size_t TCP_FLAGS_OFFSET = IPv4Header::LENGTH + 13;
+  static constexpr size_t TCP_CKSUM_OFFSET = IPv4Header::LENGTH + 16;
+  static constexpr uint8_t CWR_FLAG = 0b1000'0000U;
+  static constexpr uint8_t SYN_FLAG = 0b0000'0010U;
+  static constexpr uint8_t FIN_FLAG = 0b0000'0001U;
+
+  const TCPSenderMessage& sender = msg.sender;
+
+  // The template: no payload, SYN, FIN or CWR, and zero seqno, length and checksums
+  TCPSegment seg { .message
+                   = { .sender = TCPSenderMessage { .RST = sender.RST }, .receiver = msg.receiver.borrow() } };
+  seg.udinfo.src_port = config().source.port();
+  seg.udinfo.dst_port = config().destination.port();
+
+  IPv4Header ip_header;
+  ip_header.src = config().source.ipv4_numeric();
+  ip_header.dst = config().destination.ipv4_numeric();
+  ip_header.len = ip_header.hlen * 4; // so that the pseudo-header sum leaves out the TCP length
+  ip_header.set_ecn( sender.ECT ? IPv4Header::ECN_ECT0 : IPv4Header::ECN_NOT_ECT );
+
+  Serializer serializer;
+  ip_header.serialize( serializer );
+  seg.serialize( serializer );
+  string headers;
+  for ( const auto& buf : serializer.finish() ) {
+    headers += string_view { buf };
+  }
+  put16( headers, IP_LEN_OFFSET, 0 );
+
+  // Folded sums of everything the datagrams share
+  InternetChecksum ip_check;
+  ip_check.add( string_view { headers }.substr( 0, IPv4Header::LENGTH ) );
+  const auto ip_sum = static_cast<uint16_t>( ~ip_check.value() );
+  InternetChecksum tcp_check { ip_header.pseudo_checksum() };
+  tcp_check.add( string_view { headers }.substr( IPv4Header::LENGTH ) );
+  const auto tcp_sum = static_cast<uint16_t>( ~tcp_check.value() );
+
+  const string_view payload = sender.payload;
+  size_t offset = 0;
+  do {
+    const size_t len = min( payload.size() - offset, TCPConfig::MAX_PAYLOAD_SIZE );
+    const bool first = offset == 0;
+    const bool last = offset + len == payload.size();
+    const uint8_t flags = ( first and sender.SYN ? SYN_FLAG : 0 ) | ( last and sender.FIN ? FIN_FLAG : 0 )
+                          | ( first and sender.CWR ? CWR_FLAG : 0 );
+    const uint32_t seqno_offset = static_cast<uint32_t>( offset ) + ( sender.SYN and not first ? 1 : 0 );
+    const uint32_t seqno = Wrap32Serializable { sender.seqno + seqno_offset }.raw_value();
+    const auto tcp_len = static_cast<uint16_t>( TCPSegment::HEADER_LENGTH + len );
+    const auto ip_len = static_cast<uint16_t>( IPv4Header::LENGTH + tcp_len );
+
+    SegmentedDatagram& dgram = out.emplace_back( headers, payload.substr( offset, len ) );
+    string& h = dgram.headers;
+
+    put16( h, IP_LEN_OFFSET, ip_len );
+    put16( h, IP_CKSUM_OFFSET, finish_checksum( ip_sum, { ip_len } ) );
+
+    const auto seqno_hi = static_cast<uint16_t>( seqno >> 16 );
+    const auto seqno_lo = static_cast<uint16_t>( seqno );
+    put16( h, TCP_SEQNO_OFFSET, seqno_hi );
+    put16( h, TCP_SEQNO_OFFSET + 2, seqno_lo );
+    h[TCP_FLAGS_OFFSET] = static_cast<char>( h[TCP_FLAGS_OFFSET] | flags );
+    put16( h, TCP_CKSUM_OFFSET, finish_checksum( tcp_sum, { tcp_len, seqno_hi, seqno_lo, flags }, dgram.payload ) );
+
+    offset += len;
+  } while ( offset < payload.size() );
+}
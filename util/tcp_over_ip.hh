@@ -1,10 +1,14 @@
 #pragma once
 
+#include "connection_table.hh"
 #include "fd_adapter.hh"
 #include "ipv4_datagram.hh"
 #include "tcp_segment.hh"
 
 #include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
 
 //! \brief A converter from TCP segments to serialized IPv4 datagrams
 class TCPOverIPv4Adapter : public FdAdapterBase
@@ -13,4 +17,39 @@ public:
   std::optional<TCPMessage> unwrap_tcp_in_ip( InternetDatagram ip_dgram );
 
   InternetDatagram wrap_tcp_in_ip( const TCPMessage& msg );
+
+  //! Wraps a TCP message sent from `tuple`'s local address and port to its remote ones (needs no adapter state)
+  static InternetDatagram wrap_tcp_in_ip( const TCPMessage& msg, const FourTuple& tuple );
+
+  //! The fields of a TCP-in-IPv4 datagram that decide where it goes, read without verifying either checksum
+  struct Peek
+  {
+    FourTuple tuple {}; //!< From the receiving host's point of view (local is the datagram's destination)
+    uint32_t seqno {}; //!< Raw sequence number
+    uint32_t ackno {}; //!< Raw acknowledgment number (meaningful only with ACK)
+    bool SYN {};
+    bool ACK {};
+    bool RST {};
+  };
+
+  //! Reads the IPv4 header and the fixed part of the TCP header that follows it (which may be given as separate
+  //! buffers). Empty unless the datagram claims to be an unfragmented TCP segment.
+  static std::optional<Peek> peek_tcp_in_ip( std::string_view ip_header, std::string_view tcp_header );
+  static std::optional<Peek> peek_tcp_in_ip( std::string_view datagram );
+
+  //! Could a datagram with these headers belong to the current connection (or, when listening, open one)?
+  //! A cheap filter applied before unwrap_tcp_in_ip(), which still checks everything.
+  bool is_related( const Peek& peek ) const;
+
+  //! One datagram produced by segment_tcp_in_ip(): its serialized IPv4 and TCP headers, and its payload
+  //! (a slice of the segmented message's payload, which must outlive it)
+  struct SegmentedDatagram
+  {
+    std::string headers {};
+    std::string_view payload {};
+  };
+
+  //! Software segmentation offload: wraps a TCP message whose payload may exceed TCPConfig::MAX_PAYLOAD_SIZE
+  //! as a train of IPv4 datagrams, appending them to `out`
+  void segment_tcp_in_ip( const TCPMessage& msg, std::vector<SegmentedDatagram>& out );
 };
@@ -0,0 +1,132 @@
+#include "tcp_peer.hh"
+
+#include <algorithm>
+#include <utility>
+
+using namespace std;
+
+bool TCPPeer::autotune_quiet() const
+{
+  return sender_.sequence_numbers_in_flight() == 0 and sender_.reader().bytes_buffered() == 0
+         and receiver_.reader().bytes_buffered() == 0 and receiver_.reassembler().count_bytes_pending() == 0;
+}
+
+uint64_t TCPPeer::recv_shrink_floor() const
+{
+  // Shrinking the window the peer was already offered is forbidden (RFC 9293 3.8.6), so the buffer has to keep
+  // room for everything up to the advertised right edge.
+  const uint64_t advertised = advertised_window_end_ - receiver_.reader().bytes_popped();
+  return max( initial_capacity( cfg_.recv_capacity ), advertised );
+}
+
+bool TCPPeer::autotune_buffers()
+{
+  const uint64_t recv_capacity = receiver_.writer().capacity();
+  const uint64_t send_capacity = sender_.writer().capacity();
+
+  // An idle connection gives everything beyond its initial capacities (and its advertised window) back to the
+  // budget, and starts a fresh measurement.
+  if ( autotune_quiet() and cumulative_time_ - time_of_last_receipt_ >= cfg_.initial_RTO() ) {
+    autotune_epoch_start_ = cumulative_time_;
+    autotune_epoch_bytes_ = receiver_.writer().bytes_pushed();
+
+    if ( send_capacity > send_shrink_floor() ) {
+      buffer_reservation_.shrink( send_capacity - send_shrink_floor() );
+      sender_.set_capacity( send_shrink_floor() );
+    }
+    if ( recv_capacity > recv_shrink_floor() ) {
+      buffer_reservation_.shrink( recv_capacity - recv_shrink_floor() );
+      receiver_.set_capacity( recv_shrink_floor() );
+      return true;
+    }
+    return false;
+  }
+
+  // Otherwise, measure once per round trip.
+  if ( cumulative_time_ - autotune_epoch_start_ < sender_.smoothed_rtt().value_or( cfg_.initial_RTO() ) ) {
+    return false;
+  }
+  const uint64_t received = receiver_.writer().bytes_pushed() - autotune_epoch_bytes_;
+  autotune_epoch_start_ = cumulative_time_;
+  autotune_epoch_bytes_ = receiver_.writer().bytes_pushed();
+
+  // Send buffer: room for twice the peer's window, so the window never waits on the application.
+  const uint64_t send_demand = max<uint64_t>( sender_.peer_window(), sender_.sequence_numbers_in_flight() );
+  const uint64_t new_send_capacity = grow_capacity( send_capacity, 2 * send_demand, cfg_.send_capacity );
+  if ( new_send_capacity != send_capacity ) {
+    sender_.set_capacity( new_send_capacity );
+  }
+
+  // Receive buffer: room for twice what arrived during the last round trip (delivery rate x RTT).
+  const uint64_t new_recv_capacity = grow_capacity( recv_capacity, 2 * received, cfg_.recv_capacity );
+  if ( new_recv_capacity != recv_capacity ) {
+    receiver_.set_capacity( new_recv_capacity );
+    return true;
+  }
+  return false;
+}
+
+optional<chrono::microseconds> TCPPeer::autotune_deadline() const
+{
+  // A quiet connection with something to give back shrinks once it has been idle long enough.
+  if ( autotune_quiet() ) {
+    const bool shrinkable = sender_.writer().capacity() > send_shrink_floor()
+                            or receiver_.writer().capacity() > recv_shrink_floor();
+    return shrinkable ? optional { time_of_last_receipt_ + cfg_.initial_RTO() } : nullopt;
+  }
+
+  // A busy one measures at the end of each round trip in which it received or sent something.
+  if ( receiver_.writer().bytes_pushed() == autotune_epoch_bytes_ and sender_.sequence_numbers_in_flight() == 0 ) {
+    return {};
+  }
+  return autotune_epoch_start_ + sender_.smoothed_rtt().value_or( cfg_.initial_RTO() );
+}
+
+uint64_t TCPPeer::grow_capacity( const uint64_t current, const uint64_t wanted, const uint64_t limit )
+{
+  const uint64_t target = min( wanted, limit );
+  if ( target <= current ) {
+    return current;
+  }
+  return current + buffer_reservation_.grow( target - current );
+}
+
+optional<TCPMetrics> TCPPeer::metrics() const
+{
+  const auto srtt = sender_.smoothed_rtt();
+  if ( not srtt.has_value() ) {
+    return {};
+  }
+  return TCPMetrics {
+    .srtt = *srtt, .rttvar = sender_.rtt_variance(), .congestion_window = sender_.congestion_window() };
+}
+
+void TCPPeer::use_fastopen_cookie( optional<string> cookie )
+{
+  fastopen_client_ = true;
+  fastopen_cookie_ = move( cookie );
+  sender_.set_data_on_syn( cfg_.fastopen and fastopen_cookie_.has_value() );
+}
+
+void TCPPeer::receive_fastopen_syn( TCPMessage& syn )
+{
+  TCPSenderMessage sender = syn.sender.release();
+
+  if ( as_const( syn.receiver ).get().ackno.has_value() ) {
+    // A SYN-ACK: remember the cookie the server issued (the connection may not have used it yet).
+    if ( sender.fastopen_cookie.has_value() and not sender.fastopen_cookie->empty() ) {
+      fastopen_issued_ = sender.fastopen_cookie;
+    }
+  } else {
+    // A SYN: its data is accepted only with the right cookie. A client asking for a cookie, or presenting
+    // a wrong (perhaps outdated) one, is issued the right one.
+    const bool valid = fastopen_cookie_.has_value() and sender.fastopen_cookie == fastopen_cookie_;
+    fastopen_issue_ = fastopen_cookie_.has_value() and sender.fastopen_cookie.has_value() and not valid;
+    if ( not valid ) {
+      sender.payload.clear();
+      sender.FIN = false;
+    }
+  }
+
+  syn.sender = move( sender );
+}
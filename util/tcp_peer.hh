@@ -1,14 +1,23 @@
 #pragma once
 
+#include "buffer_budget.hh"
 #include "tcp_config.hh"
+#include "tcp_metrics_cache.hh"
 #include "tcp_receiver.hh"
 #include "tcp_receiver_message.hh"
 #include "tcp_segment.hh"
 #include "tcp_sender.hh"
 #include "tcp_sender_message.hh"
 
+#include <algorithm>
+#include <chrono>
+#include <concepts>
 #include <functional>
 #include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
 
 class TCPPeer
 {
@@ -17,8 +26,18 @@ class TCPPeer
     return [&]( const TCPSenderMessage& x ) { send( x, transmit ); };
   }
 
+  auto make_collect()
+  {
+    return [this]( TCPMessage x ) {
+      batch_.push_back( { .sender = x.sender.release(), .receiver = x.receiver.release() } );
+    };
+  }
+
 public:
-  explicit TCPPeer( const TCPConfig& cfg ) : cfg_( cfg ) {}
+  explicit TCPPeer( const TCPConfig& cfg ) : cfg_( cfg )
+  {
+    sender_.set_max_payload_size( cfg_.max_segment_payload );
+  }
 
   Writer& outbound_writer() { return sender_.writer(); }
   Reader& inbound_reader() { return receiver_.reader(); }
@@ -26,29 +45,159 @@ public:
   /* Type of the `transmit` function that the push and tick methods can use to send messages */
   using TransmitFunction = std::function<void( TCPMessage )>;
 
-  /* Passthrough methods */
-  void push( const TransmitFunction& transmit ) { sender_.push( make_send( transmit ) ); }
-  void tick( uint64_t t, const TransmitFunction& transmit )
+  /* Passthrough methods, specialized at compile time for any callable */
+  template<std::invocable<TCPMessage> T>
+  void push( const T& transmit )
+  {
+    sender_.push( make_send( transmit ) );
+  }
+
+  template<std::invocable<TCPMessage> T>
+  void tick( std::chrono::microseconds t, const T& transmit )
   {
     cumulative_time_ += t;
     sender_.tick( t, make_send( transmit ) );
+
+    // If the receive buffer was resized, tell the peer about the new window.
+    if ( cfg_.autotune_buffers and autotune_buffers() and has_ackno() ) {
+      send( sender_.make_empty_message(), transmit );
+    }
+  }
+
+  /* Millisecond-granular tick */
+  template<std::invocable<TCPMessage> T>
+  void tick( uint64_t ms, const T& transmit )
+  {
+    tick( std::chrono::milliseconds { ms }, transmit );
+  }
+
+  /* Type-erased versions (opt-in: pass a TransmitFunction) */
+  void push( const TransmitFunction& transmit ) { push<TransmitFunction>( transmit ); }
+  void tick( std::chrono::microseconds t, const TransmitFunction& transmit )
+  {
+    tick<TransmitFunction>( t, transmit );
+  }
+  void tick( uint64_t ms, const TransmitFunction& transmit ) { tick<TransmitFunction>( ms, transmit ); }
+  void receive( TCPMessage msg, const TransmitFunction& transmit )
+  {
+    receive<TransmitFunction>( std::move( msg ), transmit );
   }
   bool has_ackno() const { return receiver_.send().ackno.has_value(); }
 
+  /*
+   * TCP Fast Open (with TCPConfig::fastopen). A client calls use_fastopen_cookie() before connecting: with a
+   * cookie, its SYN carries the cookie and data; without one, it asks for a cookie, which the server issues
+   * in its SYN-ACK (see issued_fastopen_cookie()). A server is told, before the SYN is received, which cookie
+   * the client must present for its SYN data to be accepted (and which to issue if it asks).
+   */
+  void use_fastopen_cookie( std::optional<std::string> cookie );
+  void expect_fastopen_cookie( std::string cookie ) { fastopen_cookie_ = std::move( cookie ); }
+  const std::optional<std::string>& issued_fastopen_cookie() const { return fastopen_issued_; }
+
+  /* What this connection has measured about the path to its peer (empty until a round trip is measured) */
+  std::optional<TCPMetrics> metrics() const;
+
+  /* Warm start from what an earlier connection to the same peer measured (see TCPMetricsCache) */
+  void seed_metrics( const TCPMetrics& metrics )
+  {
+    sender_.seed( metrics.srtt, metrics.rttvar, metrics.congestion_window );
+  }
+
+  const TCPConfig& config() const { return cfg_; }
+
+  /*
+   * A listener answered this connection's SYN statelessly, with a SYN cookie as the SYN-ACK's seqno (which must
+   * be the configured ISN). Rebuild the handshake from the client's ISN and window before its ACK is received.
+   * The SYN-ACK's send time is unknown, so it gives no RTT sample.
+   */
+  void restore_syn_cookie_handshake( Wrap32 client_isn, uint16_t window_size )
+  {
+    receive( { .sender = TCPSenderMessage { .seqno = client_isn, .SYN = true },
+               .receiver = TCPReceiverMessage { .window_size = window_size } },
+             []( const TCPMessage& /*unused*/ ) {} ); // the SYN-ACK was already sent
+    sender_.skip_rtt_sample();
+  }
+
+  /* Type of the `transmit` function that the batched methods use to send every message of one call at once */
+  using BatchTransmitFunction = std::function<void( std::span<TCPMessage> )>;
+
+  /* Batched variants: collect the messages produced by one call and hand them to `transmit` together */
+  void push_batch( const BatchTransmitFunction& transmit )
+  {
+    push( make_collect() );
+    flush_batch( transmit );
+  }
+  void tick_batch( std::chrono::microseconds t, const BatchTransmitFunction& transmit )
+  {
+    tick( t, make_collect() );
+    flush_batch( transmit );
+  }
+  void receive_batch( TCPMessage msg, const BatchTransmitFunction& transmit )
+  {
+    receive( std::move( msg ), make_collect() );
+    flush_batch( transmit );
+  }
+
+  /*
+   * Is the peer active only to acknowledge a retransmission of the other side's FIN (both streams finished)?
+   * It then needs no more than the ACK it would send (sender().make_empty_message() and receiver().send()) and
+   * its next_deadline().
+   */
+  bool lingering() const { return active() and not streams_active(); }
+
   /* Is the peer still active? */
   bool active() const
   {
-    const bool any_errors = receiver_.reader().has_error() or sender_.writer().has_error();
-    const bool sender_active = sender_.sequence_numbers_in_flight() or not sender_.reader().is_finished();
-    const bool receiver_active = not receiver_.writer().is_closed();
-    const bool lingering
-      = linger_after_streams_finish_ and ( cumulative_time_ < time_of_last_receipt_ + 10UL * cfg_.rt_timeout );
+    const bool lingering = linger_after_streams_finish_ and ( cumulative_time_ < linger_deadline() );
 
-    return ( not any_errors ) and ( sender_active or receiver_active or lingering );
+    return ( not any_errors() ) and ( streams_active() or lingering );
   }
 
-  void receive( TCPMessage msg, const TransmitFunction& transmit )
+  /* Current time on the peer's clock (the sum of all ticks so far) */
+  std::chrono::microseconds current_time() const { return cumulative_time_; }
+
+  /* Time on the peer's clock at which it last received a segment (a lingering peer lingers linger_time() from
+   * then) */
+  std::chrono::microseconds time_of_last_receipt() const { return time_of_last_receipt_; }
+
+  /* Time on the peer's clock at which a tick will next have work to do (empty if only an event can wake it) */
+  std::optional<std::chrono::microseconds> next_deadline() const
+  {
+    if ( not active() ) {
+      return {};
+    }
+
+    // The sender's clock advances with the same ticks as the peer's.
+    std::optional<std::chrono::microseconds> deadline = sender_.next_deadline();
+    if ( cfg_.autotune_buffers ) {
+      deadline = earliest( deadline, autotune_deadline() );
+    }
+    if ( streams_active() or not linger_after_streams_finish_ ) {
+      return deadline;
+    }
+
+    return earliest( deadline, linger_deadline() );
+  }
+
+  template<std::invocable<TCPMessage> T>
+  void receive( TCPMessage msg, const T& transmit )
   {
+    // Header prediction: an in-order data segment on an established connection (whose inbound stream is
+    // therefore still open, so the peer is active unless a stream has errored) goes straight to the stream.
+    if ( not any_errors() and receiver_.is_in_order( std::as_const( msg.sender ).get() ) ) {
+      time_of_last_receipt_ = cumulative_time_;
+      receiver_.receive_in_order( msg.sender.release() );
+      sender_.receive( msg.receiver );
+
+      // The segment occupied sequence numbers, so it needs an acknowledgment (piggybacked if possible).
+      need_send_ = true;
+      push( transmit );
+      if ( need_send_ ) {
+        send( sender_.make_empty_message(), transmit );
+      }
+      return;
+    }
+
     if ( not active() ) {
       return;
     }
@@ -64,6 +213,14 @@ public:
     const auto our_ackno = receiver_.send().ackno;
     need_send_ |= ( our_ackno.has_value() and msg.sender->seqno + 1 == our_ackno.value() );
 
+    // ECN and Fast Open are negotiated on the handshake, before a SYN-ACK goes out.
+    if ( cfg_.ecn and msg.sender->SYN ) {
+      negotiate_ecn( msg );
+    }
+    if ( cfg_.fastopen and msg.sender->SYN and not has_ackno() ) {
+      receive_fastopen_syn( msg );
+    }
+
     // Give incoming TCPSenderMessage to receiver.
     receiver_.receive( std::move( msg.sender ) );
 
@@ -88,18 +245,118 @@ public:
 
 private:
   TCPConfig cfg_;
-  TCPSender sender_ { ByteStream { cfg_.send_capacity }, cfg_.isn, cfg_.rt_timeout };
-  TCPReceiver receiver_ { Reassembler { ByteStream { cfg_.recv_capacity } } };
+  // Autotuned buffers start small and grow (see autotune_buffers())
+  uint64_t initial_capacity( uint64_t capacity ) const
+  {
+    return cfg_.autotune_buffers ? std::min<uint64_t>( capacity, TCPConfig::MIN_AUTOTUNE_CAPACITY ) : capacity;
+  }
+
+  TCPSender sender_ { ByteStream { initial_capacity( cfg_.send_capacity ) }, cfg_.isn, cfg_.initial_RTO() };
+  TCPReceiver receiver_ { Reassembler { ByteStream { initial_capacity( cfg_.recv_capacity ) } } };
 
   bool need_send_ {};
 
-  void send( const TCPSenderMessage& sender_message, const TransmitFunction& transmit )
+  void send( const TCPSenderMessage& sender_message, const auto& transmit )
   {
-    transmit( { .sender = borrow( sender_message ), .receiver = receiver_.send() } );
+    TCPReceiverMessage receiver_message = receiver_.send();
+    receiver_message.ECE &= ecn_ok_;
+    advertised_window_end_
+      = std::max( advertised_window_end_, receiver_.writer().bytes_pushed() + receiver_message.window_size );
+
+    if ( ( cfg_.ecn or cfg_.fastopen ) and sender_message.SYN ) [[unlikely]] {
+      TCPSenderMessage syn = sender_message;
+      const bool active_open = not receiver_message.ackno.has_value();
+      if ( cfg_.ecn ) {
+        // An ECN-setup SYN carries ECE and CWR; an ECN-setup SYN-ACK (answering one) carries ECE alone.
+        syn.CWR = active_open;
+        receiver_message.ECE = active_open or ecn_ok_;
+      }
+      if ( cfg_.fastopen and active_open ) {
+        syn.fastopen_cookie = fastopen_cookie_.value_or( "" ); // an empty cookie asks for one
+      } else if ( cfg_.fastopen and fastopen_issue_ ) {
+        syn.fastopen_cookie = fastopen_cookie_;
+      }
+      transmit( { .sender = std::move( syn ), .receiver = std::move( receiver_message ) } );
+    } else {
+      transmit( { .sender = borrow( sender_message ), .receiver = std::move( receiver_message ) } );
+    }
     need_send_ = false;
   }
 
+  // Has ECN been negotiated? (Only with cfg_.ecn, and only if the peer agreed.)
+  bool ecn_ok_ {};
+
+  // TCP Fast Open state: a client's cookie to present, or the cookie a server expects (and issues)
+  bool fastopen_client_ {};
+  bool fastopen_issue_ {}; // server: put the cookie on the SYN-ACK
+  std::optional<std::string> fastopen_cookie_ {};
+  std::optional<std::string> fastopen_issued_ {}; // client: the cookie issued on the server's SYN-ACK
+
+  void receive_fastopen_syn( TCPMessage& syn );
+
+  void negotiate_ecn( TCPMessage& syn )
+  {
+    TCPReceiverMessage ack = syn.receiver.release();
+    if ( not has_ackno() ) {
+      const bool cwr = std::as_const( syn.sender ).get().CWR;
+      ecn_ok_ = ack.ackno.has_value() ? ack.ECE and not cwr : ack.ECE and cwr;
+      sender_.set_ecn( ecn_ok_ );
+    }
+
+    // The ECE flag of a SYN or SYN-ACK is part of the negotiation, not a congestion signal.
+    ack.ECE = false;
+    syn.receiver = std::move( ack );
+  }
+
+  // Messages collected by the batched methods (owned copies, since the sender's messages may be temporaries)
+  std::vector<TCPMessage> batch_ {};
+
+  void flush_batch( const BatchTransmitFunction& transmit )
+  {
+    if ( not batch_.empty() ) {
+      transmit( batch_ );
+      batch_.clear();
+    }
+  }
+
+  bool any_errors() const { return receiver_.reader().has_error() or sender_.writer().has_error(); }
+
+  bool streams_active() const
+  {
+    const bool sender_active = sender_.sequence_numbers_in_flight() or not sender_.reader().is_finished();
+    const bool receiver_active = not receiver_.writer().is_closed();
+    return sender_active or receiver_active;
+  }
+
+  std::chrono::microseconds linger_deadline() const { return time_of_last_receipt_ + cfg_.linger_time(); }
+
+  static std::optional<std::chrono::microseconds> earliest( std::optional<std::chrono::microseconds> a,
+                                                            std::optional<std::chrono::microseconds> b )
+  {
+    if ( a.has_value() and b.has_value() ) {
+      return std::min( *a, *b );
+    }
+    return a.has_value() ? a : b;
+  }
+
+  // Resize the buffers to the measured demand once per round trip; returns true if the receive buffer changed
+  bool autotune_buffers();
+  uint64_t grow_capacity( uint64_t current, uint64_t wanted, uint64_t limit );
+
+  // When autotune_buffers() next has work to do (empty if only an event can give it some)
+  std::optional<std::chrono::microseconds> autotune_deadline() const;
+  bool autotune_quiet() const; // idle, apart from how long ago the last segment arrived
+  uint64_t recv_shrink_floor() const;
+  uint64_t send_shrink_floor() const { return initial_capacity( cfg_.send_capacity ); }
+
+  BufferReservation buffer_reservation_ { BufferBudget::global() }; // growth beyond the initial capacities
+  std::chrono::microseconds autotune_epoch_start_ {};
+  uint64_t autotune_epoch_bytes_ {}; // inbound bytes pushed when the current measurement began
+
+  // Stream index just past the furthest window ever advertised: the receive buffer may not shrink below it
+  uint64_t advertised_window_end_ {};
+
   bool linger_after_streams_finish_ { true }; // one peer may need to linger to make sure all closure conditions met
-  uint64_t cumulative_time_ {};
-  uint64_t time_of_last_receipt_ {};
+  std::chrono::microseconds cumulative_time_ {};
+  std::chrono::microseconds time_of_last_receipt_ {};
 };
@@ -9,6 +9,54 @@ using namespace std;
 
 static_assert( !( TCPSegment::HEADER_LENGTH & 0x03 ) ); // header length must be divisible by 4
 
+namespace {
+// Length of the Fast Open option (kind, length and cookie), if any
+size_t fastopen_option_length( const TCPSenderMessage& sender )
+{
+  return sender.fastopen_cookie.has_value() ? 2 + sender.fastopen_cookie->size() : 0;
+}
+
+// Parse the options that follow the fixed header, keeping the ones we understand and skipping the rest
+void parse_options( Parser& parser, size_t options_length, TCPSenderMessage& sender )
+{
+  while ( options_length > 0 and not parser.has_error() ) {
+    uint8_t kind {};
+    parser.integer( kind );
+    --options_length;
+    if ( kind == TCPSegment::OPTION_END ) {
+      break;
+    }
+    if ( kind == TCPSegment::OPTION_NOP ) {
+      continue;
+    }
+
+    uint8_t length {};
+    parser.integer( length );
+    if ( length < 2 or length - 1U > options_length ) {
+      parser.set_error();
+      return;
+    }
+    options_length -= length - 1U;
+
+    if ( kind == TCPSegment::OPTION_FASTOPEN ) {
+      string cookie( length - 2U, 0 );
+      parser.string( cookie );
+      sender.fastopen_cookie = move( cookie );
+    } else {
+      parser.remove_prefix( length - 2U );
+    }
+  }
+
+  parser.remove_prefix( options_length ); // anything after an end-of-options
+}
+} // namespace
+
+size_t TCPSegment::header_length() const
+{
+  const size_t options_length = fastopen_option_length( message.sender );
+  return HEADER_LENGTH + ( ( options_length + 3 ) & ~size_t { 3 } ); // padded to a multiple of 4
+}
+
 void TCPSegment::parse( Parser& parser, uint32_t datagram_layer_pseudo_checksum )
 {
   /* verify checksum */
@@ -36,6 +84,8 @@ void TCPSegment::parse( Parser& parser, uint32_t datagram_layer_pseudo_checksum
   const uint8_t data_offset = octet >> 4;
 
   parser.integer( octet ); // flags
+  message.sender->CWR = octet & 0b1000'0000;
+  message.receiver->ECE = octet & 0b0100'0000;
   if ( not( octet & 0b0001'0000 ) ) {
     message.receiver->ackno.reset(); // no ACK
   }
@@ -53,7 +103,10 @@ void TCPSegment::parse( Parser& parser, uint32_t datagram_layer_pseudo_checksum
     parser.set_error();
     return;
   }
-  parser.remove_prefix( ( data_offset * 4 ) - HEADER_LENGTH );
+  parse_options( parser, data_offset * 4 - HEADER_LENGTH, message.sender );
+  if ( parser.has_error() ) {
+    return;
+  }
 
   parser.concatenate_all_remaining( message.sender->payload );
 }
@@ -70,14 +123,29 @@ void TCPSegment::serialize( Serializer& serializer ) const
   serializer.integer( udinfo.dst_port );
   serializer.integer( Wrap32Serializable { message.sender->seqno }.raw_value() );
   serializer.integer( Wrap32Serializable { message.receiver->ackno.value_or( Wrap32 { 0 } ) }.raw_value() );
-  serializer.integer( uint8_t { ( HEADER_LENGTH >> 2 ) << 4 } ); // data offset
+  const size_t hlen = header_length();
+  serializer.integer( static_cast<uint8_t>( ( hlen >> 2 ) << 4 ) ); // data offset
   const bool reset = message.sender->RST or message.receiver->RST;
-  const uint8_t flags = ( message.receiver->ackno.has_value() ? 0b0001'0000U : 0 ) | ( reset ? 0b0000'0100U : 0 )
+  const uint8_t flags = ( message.sender->CWR ? 0b1000'0000U : 0 ) | ( message.receiver->ECE ? 0b0100'0000U : 0 )
+                        | ( message.receiver->ackno.has_value() ? 0b0001'0000U : 0 ) | ( reset ? 0b0000'0100U : 0 )
                         | ( message.sender->SYN ? 0b0000'0010U : 0 ) | ( message.sender->FIN ? 0b0000'0001U : 0 );
   serializer.integer( flags );
   serializer.integer( message.receiver->window_size );
   serializer.integer( udinfo.cksum );
   serializer.integer( uint16_t { 0 } ); // urgent pointer
+
+  // options, padded to the header length with end-of-options
+  if ( message.sender->fastopen_cookie.has_value() ) {
+    const string& cookie = *message.sender->fastopen_cookie;
+    serializer.integer( OPTION_FASTOPEN );
+    serializer.integer( static_cast<uint8_t>( 2 + cookie.size() ) );
+    for ( const char c : cookie ) {
+      serializer.integer( static_cast<uint8_t>( c ) );
+    }
+  }
+  for ( size_t i = HEADER_LENGTH + fastopen_option_length( message.sender ); i < hlen; ++i ) {
+    serializer.integer( OPTION_END );
+  }
   serializer.buffer( message.sender->payload );
 }
 
@@ -109,6 +177,15 @@ string TCPSegment::to_string() const
   if ( message.sender->RST or message.receiver->RST ) {
     ss << " +RST";
   }
+  if ( message.sender->fastopen_cookie.has_value() ) {
+    ss << " TFO<" << message.sender->fastopen_cookie->size() << " bytes>";
+  }
+  if ( message.sender->CWR ) {
+    ss << " +CWR";
+  }
+  if ( message.receiver->ECE ) {
+    ss << " +ECE";
+  }
   auto ackno = message.receiver->ackno;
   if ( ackno.has_value() ) {
     ss << " ACK<" << Wrap32Serializable { *ackno }.raw_value() << ">";
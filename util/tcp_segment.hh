@@ -6,6 +6,8 @@
 #include "tcp_sender_message.hh"
 #include "udinfo.hh"
 
+#include <cstddef>
+
 // A TCPMessage (a concept used only in CS144) models the full
 // messages sent between TCP endpoints, omitting the multiplexing
 // information and checksum.
@@ -29,6 +31,13 @@ struct TCPSegment
 
   static constexpr uint8_t HEADER_LENGTH = 20; // TCP header length, not including options
 
+  static constexpr uint8_t OPTION_END = 0;       // end of option list
+  static constexpr uint8_t OPTION_NOP = 1;       // no-operation (padding)
+  static constexpr uint8_t OPTION_FASTOPEN = 34; // TCP Fast Open cookie (RFC 7413)
+
+  // TCP header length, including options
+  size_t header_length() const;
+
   // Return a string containing a summary in human-readable format
   std::string to_string() const;
 };
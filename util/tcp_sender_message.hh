@@ -2,12 +2,13 @@
 
 #include "wrapping_integers.hh"
 
+#include <optional>
 #include <string>
 
 /*
  * The TCPSenderMessage structure contains the information sent from a TCP sender to its receiver.
  *
- * It contains five fields:
+ * It contains five fields, plus three for Explicit Congestion Notification (RFC 3168):
  *
  * 1) The sequence number (seqno) of the beginning of the segment. If the SYN flag is set, this is the
  *    sequence number of the SYN flag. Otherwise, it's the sequence number of the beginning of the payload.
@@ -20,6 +21,17 @@
  * 4) The FIN flag. If set, the payload represents the ending of the byte stream.
  *
  * 5) The RST (reset) flag. If set, the stream has suffered an error and the connection should be aborted.
+ *
+ * 6) The CWR (congestion window reduced) flag. The sender has responded to an ECE from the receiver.
+ *    (On a SYN, together with ECE, it asks to use ECN on this connection.)
+ *
+ * 7) ECT: the datagram carrying this segment should be marked ECN-capable, so that a congested router
+ *    can mark it instead of dropping it.
+ *
+ * 8) CE: the datagram that carried this segment was marked "congestion experienced" by a router.
+ *
+ * On a SYN, it may also carry a TCP Fast Open cookie (RFC 7413): an empty cookie requests one from the
+ * server, and a client's SYN carrying a valid cookie may carry data that the server accepts at once.
  */
 
 struct TCPSenderMessage
@@ -32,6 +44,12 @@ struct TCPSenderMessage
 
   bool RST {};
 
+  bool CWR {};
+  bool ECT {};
+  bool CE {};
+
+  std::optional<std::string> fastopen_cookie {};
+
   // How many sequence numbers does this segment use?
   size_t sequence_length() const { return SYN + payload.size() + FIN; }
 };
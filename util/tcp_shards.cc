@@ -0,0 +1,189 @@
+#include "tcp_shards.hh"
+
+#include "exception.hh"
+#include "helpers.hh"
+#include "tcp_over_ip.hh"
+
+#include <array>
+#include <cerrno>
+#include <iostream>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <utility>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+microseconds timestamp_us()
+{
+  return duration_cast<microseconds>( steady_clock::now().time_since_epoch() );
+}
+
+constexpr size_t MAX_READ_BATCH = 64; // Most datagrams taken from one fd per event
+} // namespace
+
+TCPShards::TCPShards( vector<FileDescriptor> queues,
+                      const Address& local,
+                      size_t backlog,
+                      const TCPConfig& cfg,
+                      Handler handler )
+  : handler_( move( handler ) )
+{
+  if ( queues.empty() ) {
+    throw runtime_error( "TCPShards needs at least one queue" );
+  }
+
+  // Every shard must exist before any of them can forward to another.
+  for ( size_t i = 0; i < queues.size(); ++i ) {
+    array<int, 2> fds {};
+    CheckSystemCall( "socketpair",
+                     ::socketpair( AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds.data() ) );
+    shards_.push_back( make_unique<Shard>(
+      *this, i, move( queues[i] ), make_pair( FileDescriptor { fds[0] }, FileDescriptor { fds[1] } ) ) );
+  }
+  for ( const auto& shard : shards_ ) {
+    shard->start( local, backlog, cfg );
+  }
+}
+
+TCPShards::Stats TCPShards::stats() const
+{
+  Stats ret;
+  for ( const auto& shard : shards_ ) {
+    shard->add_stats( ret );
+  }
+  return ret;
+}
+
+TCPShards::~TCPShards()
+{
+  for ( const auto& shard : shards_ ) {
+    shard->stop();
+  }
+}
+
+TCPShards::Shard::Shard( TCPShards& owner,
+                         size_t index,
+                         FileDescriptor&& queue,
+                         pair<FileDescriptor, FileDescriptor> inbox )
+  : owner_( owner )
+  , index_( index )
+  , queue_( move( queue ) )
+  , inbox_( move( inbox.first ) )
+  , inbox_writer_( move( inbox.second ) )
+  , wakeup_( CheckSystemCall( "eventfd", ::eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) )
+  , demux_( [this]( const InternetDatagram& dgram ) { queue_.write( serialize( dgram ) ); } )
+{
+  queue_.set_blocking( false );
+}
+
+void TCPShards::Shard::start( const Address& local, size_t backlog, const TCPConfig& cfg )
+{
+  demux_.listen( local, backlog, cfg );
+  loop_.set_callback_budget( 3 ); // one wait can serve the queue, the inbox and the wakeup
+  loop_.add_rule( "read shard queue", queue_, Direction::In, [&] { read_queue(); } );
+  loop_.add_rule( loop_.add_category( "read shard inbox", EventLoop::Priority::High ),
+                  inbox_,
+                  Direction::In,
+                  [&] { read_inbox(); } );
+  loop_.add_rule( loop_.add_category( "wake up shard", EventLoop::Priority::High ),
+                  wakeup_,
+                  Direction::In,
+                  [&] {
+                    string counter( sizeof( uint64_t ), 0 );
+                    wakeup_.read( counter );
+                  } );
+  thread_ = thread( &Shard::main, this );
+}
+
+void TCPShards::Shard::read_queue()
+{
+  for ( size_t i = 0; i < MAX_READ_BATCH; ++i ) {
+    string datagram;
+    queue_.read( datagram );
+    if ( datagram.empty() ) {
+      return;
+    }
+
+    const auto peek = TCPOverIPv4Adapter::peek_tcp_in_ip( datagram );
+    const size_t owner = peek.has_value() ? owner_.shard_for( peek->tuple ) : index_;
+    if ( owner == index_ ) {
+      steered_.fetch_add( 1, memory_order_relaxed );
+      demux_.receive_datagram( move( datagram ) );
+    } else {
+      forwarded_.fetch_add( 1, memory_order_relaxed );
+      owner_.shards_[owner]->forward( datagram, *this );
+    }
+  }
+}
+
+void TCPShards::Shard::read_inbox()
+{
+  for ( size_t i = 0; i < MAX_READ_BATCH; ++i ) {
+    string datagram;
+    inbox_.read( datagram );
+    if ( datagram.empty() ) {
+      return;
+    }
+    demux_.receive_datagram( move( datagram ) );
+  }
+}
+
+//! \param[in] datagram is a serialized IPv4 datagram owned by this shard
+//! \param[in] from is the shard it arrived at (which counts it as dropped if the inbox is full)
+void TCPShards::Shard::forward( string_view datagram, Shard& from )
+{
+  // send(2) on a datagram socket is atomic, so any number of shards may write the inbox at once.
+  if ( ::send( inbox_writer_.fd_num(), datagram.data(), datagram.size(), MSG_DONTWAIT ) < 0 ) {
+    if ( errno != EAGAIN and errno != EWOULDBLOCK ) {
+      throw unix_error( "send" );
+    }
+    from.dropped_.fetch_add( 1, memory_order_relaxed );
+  }
+}
+
+microseconds TCPShards::Shard::wait_timeout() const
+{
+  const auto deadline = demux_.next_deadline();
+  if ( not deadline.has_value() ) {
+    return microseconds { -1 };
+  }
+  return max( *deadline - ( timestamp_us() - last_tick_time_ ), microseconds { 0 } );
+}
+
+void TCPShards::Shard::main()
+{
+  try {
+    last_tick_time_ = timestamp_us();
+    while ( not stop_ ) {
+      loop_.wait_next_event( wait_timeout() );
+
+      const auto now = timestamp_us();
+      demux_.tick( now - last_tick_time_ );
+      last_tick_time_ = now;
+
+      owner_.handler_( index_, demux_ );
+    }
+  } catch ( const exception& e ) {
+    cerr << "Exception in TCP shard " << index_ << ": " << e.what() << "\n";
+    throw;
+  }
+}
+
+void TCPShards::Shard::add_stats( Stats& stats ) const
+{
+  stats.steered += steered_.load( memory_order_relaxed );
+  stats.forwarded += forwarded_.load( memory_order_relaxed );
+  stats.dropped += dropped_.load( memory_order_relaxed );
+}
+
+void TCPShards::Shard::stop()
+{
+  stop_ = true;
+  const uint64_t one = 1;
+  CheckSystemCall( "write", ::write( wakeup_.fd_num(), &one, sizeof( one ) ) );
+  thread_.join();
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "address.hh"
+#include "connection_table.hh"
+#include "eventloop.hh"
+#include "file_descriptor.hh"
+#include "tcp_config.hh"
+#include "tcp_demux.hh"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//! \brief Shared-nothing sharding of many TCP connections across threads (one per core)
+//! \details Each shard is a thread with its own EventLoop, its own TCPDemux (and so its own ConnectionTable), and
+//! its own queue of IPv4 datagrams: a file descriptor such as one queue of a multi-queue TUN device. A connection
+//! belongs to the shard chosen by the hash of its FourTuple (see shard_for()). A datagram that arrives on another
+//! shard's queue is forwarded, still serialized, to its owner's inbox (a Unix-domain datagram socket), so the
+//! state of a connection is only ever touched by one thread and the path of a datagram takes no locks.
+//!
+//! Every shard listens on the same address. The application runs on the shards too: the Handler is called on
+//! each shard's thread, with that shard's TCPDemux, after every event, to accept connections and to read and
+//! write their streams.
+class TCPShards
+{
+public:
+  //! Called on a shard's thread with the shard's index and demux
+  using Handler = std::function<void( size_t shard, TCPDemux& demux )>;
+
+  //! Datagrams read from the shards' queues, summed over the shards
+  struct Stats
+  {
+    uint64_t steered {};   //!< arrived on the queue of the shard that owns the connection
+    uint64_t forwarded {}; //!< arrived on another shard's queue, and were forwarded to the owner
+    uint64_t dropped {};   //!< could not be forwarded because the owner's inbox was full
+  };
+
+  //! Start one shard for each of `queues` (made non-blocking), each listening on `local`
+  TCPShards( std::vector<FileDescriptor> queues,
+             const Address& local,
+             size_t backlog,
+             const TCPConfig& cfg,
+             Handler handler );
+
+  //! The shard that owns connections with this FourTuple (from the point of view of this host)
+  size_t shard_for( const FourTuple& tuple ) const { return tuple.hash() % shards_.size(); }
+
+  size_t shard_count() const { return shards_.size(); }
+
+  Stats stats() const;
+
+  //! Stops the shards
+  ~TCPShards();
+
+  TCPShards( const TCPShards& other ) = delete;
+  TCPShards( TCPShards&& other ) = delete;
+  TCPShards& operator=( const TCPShards& other ) = delete;
+  TCPShards& operator=( TCPShards&& other ) = delete;
+
+private:
+  class Shard
+  {
+    TCPShards& owner_;
+    size_t index_;
+
+    FileDescriptor queue_;
+    FileDescriptor inbox_;        //!< read by this shard
+    FileDescriptor inbox_writer_; //!< written by the other shards (with send(2), never through this object)
+    FileDescriptor wakeup_;       //!< an eventfd that interrupts the loop's wait (see stop())
+
+    TCPDemux demux_;
+    EventLoop loop_ { EventLoop::Backend::Epoll };
+    std::chrono::microseconds last_tick_time_ {};
+
+    std::atomic_bool stop_ {};
+    std::atomic_uint64_t steered_ {};
+    std::atomic_uint64_t forwarded_ {};
+    std::atomic_uint64_t dropped_ {};
+
+    std::thread thread_ {};
+
+    void main();
+    void read_queue();
+    void read_inbox();
+    std::chrono::microseconds wait_timeout() const;
+
+  public:
+    Shard( TCPShards& owner,
+           size_t index,
+           FileDescriptor&& queue,
+           std::pair<FileDescriptor, FileDescriptor> inbox );
+
+    //! Set up the listener and the rules, and start the thread
+    void start( const Address& local, size_t backlog, const TCPConfig& cfg );
+
+    //! Hand this shard a datagram that arrived on another shard's queue (called on that shard's thread)
+    void forward( std::string_view datagram, Shard& from );
+
+    void add_stats( Stats& stats ) const;
+    void stop();
+  };
+
+  Handler handler_;
+  std::vector<std::unique_ptr<Shard>> shards_ {};
+};
@@ -3,24 +3,74 @@
 
 using namespace std;
 
-optional<TCPMessage> TCPOverIPv4OverTunFdAdapter::read()
+//! \param[out] msg is the TCP segment, if the datagram was one related to the current connection
+//! \returns false if no datagram was waiting (the TUN device is non-blocking)
+bool TCPOverIPv4OverTunFdAdapter::_read_datagram( optional<TCPMessage>& msg )
 {
   vector<string> strs( 3 );
   strs[0].resize( IPv4Header::LENGTH );
   strs[1].resize( TCPSegment::HEADER_LENGTH );
   _tun.read( strs );
+  if ( strs[0].empty() ) {
+    return false;
+  }
+
+  // Drop traffic for other connections before paying for the checksums.
+  const auto peek = peek_tcp_in_ip( strs[0], strs[1] );
+  if ( peek.has_value() and not is_related( *peek ) ) {
+    return true;
+  }
 
   InternetDatagram ip_dgram;
   if ( parse( ip_dgram, move( strs ) ) ) {
-    return unwrap_tcp_in_ip( move( ip_dgram ) );
+    msg = unwrap_tcp_in_ip( move( ip_dgram ) );
+  }
+  return true;
+}
+
+optional<TCPMessage> TCPOverIPv4OverTunFdAdapter::read()
+{
+  optional<TCPMessage> msg;
+  _read_datagram( msg );
+  return msg;
+}
+
+void TCPOverIPv4OverTunFdAdapter::read_batch( vector<TCPMessage>& msgs )
+{
+  optional<TCPMessage> msg;
+  for ( size_t i = 0; i < MAX_READ_BATCH and _read_datagram( msg ); ++i ) {
+    if ( msg.has_value() ) {
+      msgs.push_back( move( msg.value() ) );
+      msg.reset();
+    }
   }
-  return {};
 }
 
 void TCPOverIPv4OverTunFdAdapter::write( const TCPMessage& seg )
 {
+  if ( seg.sender->payload.size() > TCPConfig::MAX_PAYLOAD_SIZE ) {
+    write_batch( span { const_cast<TCPMessage*>( &seg ), 1 } ); // NOLINT(*-const-cast)
+    return;
+  }
   _tun.write( serialize( wrap_tcp_in_ip( seg ) ) );
 }
 
+void TCPOverIPv4OverTunFdAdapter::write_batch( span<TCPMessage> msgs )
+{
+  // in batch order, so that e.g. a FIN can't overtake the super-segment before it
+  static thread_local vector<SegmentedDatagram> segmented;
+  for ( const auto& msg : msgs ) {
+    if ( msg.sender->payload.size() <= TCPConfig::MAX_PAYLOAD_SIZE ) {
+      _tun.write( serialize( wrap_tcp_in_ip( msg ) ) );
+      continue;
+    }
+    segmented.clear();
+    segment_tcp_in_ip( msg, segmented );
+    for ( const auto& dgram : segmented ) {
+      _tun.write( array<string_view, 2> { dgram.headers, dgram.payload } );
+    }
+  }
+}
+
 //! Specialize LossyFdAdapter to TCPOverIPv4OverTunFdAdapter
 template class LossyFdAdapter<TCPOverIPv4OverTunFdAdapter>;
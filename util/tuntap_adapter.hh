@@ -6,7 +6,9 @@
 #include "tun.hh"
 
 #include <optional>
+#include <span>
 #include <utility>
+#include <vector>
 
 template<class T>
 concept TCPDatagramAdapter = requires( T a, TCPMessage seg ) {
@@ -15,22 +17,48 @@ concept TCPDatagramAdapter = requires( T a, TCPMessage seg ) {
   { a.read() } -> std::same_as<std::optional<TCPMessage>>;
 };
 
+//! An adapter that can also take every message produced by one TCPPeer call in a single write
+template<class T>
+concept TCPBatchDatagramAdapter = TCPDatagramAdapter<T> and requires( T a, std::span<TCPMessage> msgs ) {
+  { a.write_batch( msgs ) } -> std::same_as<void>;
+};
+
+//! An adapter that can also read every datagram waiting on its fd in a single call
+template<class T>
+concept TCPBatchReadDatagramAdapter = TCPDatagramAdapter<T> and requires( T a, std::vector<TCPMessage>& msgs ) {
+  { a.read_batch( msgs ) } -> std::same_as<void>;
+};
+
 //! \brief A FD adapter for IPv4 datagrams read from and written to a TUN device
 class TCPOverIPv4OverTunFdAdapter : public TCPOverIPv4Adapter
 {
 private:
   TunFD _tun;
 
+  //! Reads one datagram, if one is waiting
+  bool _read_datagram( std::optional<TCPMessage>& msg );
+
 public:
   //! Construct from a TunFD
-  explicit TCPOverIPv4OverTunFdAdapter( TunFD&& tun ) : _tun( std::move( tun ) ) {}
+  explicit TCPOverIPv4OverTunFdAdapter( TunFD&& tun ) : _tun( std::move( tun ) ) { _tun.set_blocking( false ); }
 
   //! Attempts to read and parse an IPv4 datagram containing a TCP segment related to the current connection
   std::optional<TCPMessage> read();
 
+  static constexpr size_t MAX_READ_BATCH = 64; //!< Most datagrams that read_batch() takes in one call
+
+  //! Reads the datagrams waiting on the TUN device (up to MAX_READ_BATCH), appending the TCP segments
+  //! related to the current connection to `msgs`
+  void read_batch( std::vector<TCPMessage>& msgs );
+
   //! Creates an IPv4 datagram from a TCP segment and writes it to the TUN device
   void write( const TCPMessage& seg );
 
+  //! Creates IPv4 datagrams for a batch of TCP segments and writes them to the TUN device
+  //! \note A TUN device takes exactly one packet per write, so this still issues one write per datagram,
+  //! but every datagram is serialized before the first one is written.
+  void write_batch( std::span<TCPMessage> msgs );
+
   //! Access the underlying TUN device
   explicit operator TunFD&() { return _tun; }
 
@@ -43,3 +71,7 @@ public:
 
 static_assert( TCPDatagramAdapter<TCPOverIPv4OverTunFdAdapter> );
 static_assert( TCPDatagramAdapter<LossyFdAdapter<TCPOverIPv4OverTunFdAdapter>> );
+static_assert( TCPBatchDatagramAdapter<TCPOverIPv4OverTunFdAdapter> );
+static_assert( TCPBatchDatagramAdapter<LossyFdAdapter<TCPOverIPv4OverTunFdAdapter>> );
+static_assert( TCPBatchReadDatagramAdapter<TCPOverIPv4OverTunFdAdapter> );
+static_assert( TCPBatchReadDatagramAdapter<LossyFdAdapter<TCPOverIPv4OverTunFdAdapter>> );